@@ -4,18 +4,25 @@
  Name:          mtr.c
 
  Description:   Simple responder for MTU (MAP test utility)
-                This program responds to an incoming dialogue received
+                This program responds to incoming dialogues received
                 from the MAP module.
 
-                The program receives:
+                For each dialogue the program receives:
                         MAP-OPEN-IND
                         service indication
                         MAP-DELIMITER-IND
 
                 and it responds with:
                         MAP-OPEN-RSP
-                        service response
-                        MAP-CLOSE-IND
+                        service response, or a user error
+                        MAP-CLOSE-REQ
+
+                USSD dialogues, and MT-FORWARD-SHORT-MESSAGE with more
+                messages to send, are continued with MAP-DELIMITER-REQ
+                instead of being closed and wait for the next service
+                indication. A dialogue may also be refused under
+                overload, aborted or released without a reply by fault
+                injection, or aborted when its guard timer expires.
 
                 The following services are handled:
                         MAP-FORWARD-SHORT-MESSAGE
@@ -25,8 +32,35 @@
                         MAP-SEND-ROUTING-INFO-FOR-SMS
                         MAP-PROCESS-UNSTRUCTURED-SS
                         MAP-UNSTRUCTURED-SS-REQ
-
- Functions:     main
+                        MAP-UNSTRUCTURED-SS-NOTIFY
+                        MAP-ANY-TIME-INTERROGATION
+
+                The command line is read by mtr_main.c, which calls
+                mtr_ent() once MTR is configured.
+
+ Functions:     mtr_ent
+                MTR_cfg
+                MTR_set_default_term_mode
+                MTR_set_num_workers
+                MTR_set_dlg_range
+                MTR_set_huge_pages
+                MTR_set_map_instances
+                MTR_set_batch
+                MTR_set_capture
+                MTR_set_trace_filter
+                MTR_set_guard_timer
+                MTR_set_lat_interval
+                MTR_set_routes
+                MTR_set_subscribers
+                MTR_set_delays
+                MTR_set_faults
+                MTR_set_overload
+                MTR_process_map_msg
+                MTR_process_urgent
+                MTR_flush_msgs
+                MTR_poll_timers
+                MTR_retry_idle
+                MTR_report
 
  -----  ---------   ---------------------------------------------
  Issue    Date                       Changes
@@ -45,18 +79,183 @@
    9    11-Jan-11   - Addition of dialog termination mode.
    10   23-Aug-11   - Update return type of MTR_get_msisdn()
                     - Only check for MSISDN for ATI Req.
+   11   17-Oct-26   - Worker threads, batched receive and send, and
+                      responses built from pre-encoded templates.
+                    - Dialogue table keyed by MAP instance and dialogue
+                      id, paged in for the TCAP range served.
+                    - Guard timers, overload control and retries when
+                      messages or queue room run short.
+                    - Asynchronous trace, binary capture and trace
+                      filters; latency histograms and shared memory
+                      counters.
+                    - Answers from number ranges and a subscriber
+                      database, per-service delays and fault injection.
+                    - MT-FORWARD-SM dialogues continued while more
+                      messages follow.
 
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 
 #include "system.h"
 #include "msg.h"
 #include "sysgct.h"
 #include "map_inc.h"
 #include "mtr.h"
-#include "pack.h"
+#include "mtr_wrk.h"
+#include "mtr_tpl.h"
+#include "mtr_prs.h"
+#include "mtr_trc.h"
+#include "mtr_cap.h"
+#include "mtr_gsm.h"
+#include "mtr_tmr.h"
+#include "mtr_sub.h"
+#include "mtr_dlg.h"
+#include "mtr_lat.h"
+#include "mtr_flt.h"
+#include "mtr_stat.h"
+#include "mtr_rte.h"
+#include "mtr_dly.h"
+
+/*
+ * Number of worker threads used unless configured otherwise.
+ * Zero processes every dialogue in the receive thread.
+ */
+#ifndef MTR_DEFAULT_NUM_WORKERS
+#define MTR_DEFAULT_NUM_WORKERS (0)
+#endif
+
+/*
+ * Trace level, fixed at compile time:
+ *   0 - no trace, the trace code is left out altogether
+ *   1 - received and sent messages only
+ *   2 - messages and descriptive text (default)
+ */
+#ifndef MTR_TRACE_LEVEL
+#define MTR_TRACE_LEVEL         (2)
+#endif
+
+/*
+ * Selective trace: when a filter is configured each dialogue is
+ * selected for tracing, or not, when it opens. Selection by MSISDN
+ * has to wait for the first service primitive.
+ */
+#define MTR_DLG_TRACE_OFF       (0)     /* Dialogue not traced */
+#define MTR_DLG_TRACE_ON        (1)     /* Dialogue traced */
+#define MTR_DLG_TRACE_MSISDN    (2)     /* Waiting for the MSISDN */
+#define MTR_MAX_TRACE_PREFIX    (16)    /* Longest MSISDN prefix */
+
+#define MTR_TRACED(dlg_id)      ((mtr_trace) && \
+                                 ((mtr_trace_filter == 0) || MTR_trace_dlg(mtr_cur_inst, dlg_id)))
+#define MTR_TRACE_MSG(dlg_id)   ((MTR_TRACE_LEVEL >= 1) && MTR_TRACED(dlg_id))
+#define MTR_TRACE_TEXT(dlg_id)  ((MTR_TRACE_LEVEL >= 2) && MTR_TRACED(dlg_id))
+
+/*
+ * Batch mode: up to mtr_batch_size received messages are processed per
+ * wakeup and the resulting messages are sent together at the end of
+ * the batch, or earlier once the oldest has waited mtr_flush_us.
+ */
+#define MTR_MAX_BATCH           (256)   /* Largest batch size */
+#define MTR_MAX_TX_BATCH        (3 * MTR_MAX_BATCH) /* Queued Tx messages */
+#define MTR_DEF_FLUSH_US        (1000)  /* Default flush deadline */
+
+/*
+ * Back-pressure: a message GCT_send() refuses, and a response that
+ * cannot be built because getm() fails, are queued by the thread and
+ * retried on its next loop turn once the back-off has passed. The
+ * back-off doubles on every retry that fails.
+ */
+#define MTR_MAX_RETRY_MSGS      (1024)  /* Queued messages (power of 2) */
+#define MTR_MAX_RETRY_DLGS      (4096)  /* Queued responses (power of 2) */
+#define MTR_RETRY_MIN_US        (100)   /* First back-off */
+#define MTR_RETRY_MAX_US        (100000) /* Longest back-off */
+#define MTR_MAX_STAGE           (8)     /* Most messages in one response */
+
+/*
+ * Why the response of a dialogue is held (MTR_DLG held)
+ */
+#define MTR_HELD_DELAY          (0x01)  /* Held back by the delay emulation */
+#define MTR_HELD_RETRY          (0x02)  /* Waiting for messages to build it */
+#define MTR_HELD_OPEN           (0x04)  /* Open response still to be sent */
+#define MTR_HELD_CLOSE          (0x08)  /* Close still to be sent, after the dialogue ended */
+#define MTR_HELD_ABORT          (0x10)  /* Abort still to be sent, after the dialogue ended */
+#define MTR_HELD_REFUSE         (0x20)  /* Refusal still to be sent, after the dialogue ended */
+#define MTR_HELD_END            (MTR_HELD_CLOSE | MTR_HELD_ABORT | MTR_HELD_REFUSE)
+
+/*
+ * Overload control: above a number of dialogues in progress, or once
+ * a MAP-OPEN-IND has waited too long inside MTR, new dialogues are
+ * refused at once rather than accepted and left to time out. The
+ * dialogue limit is shared evenly by the threads running dialogue
+ * state machines, each of which counts its own dialogues.
+ */
+#define MTR_REFUSE_NO_REASON    (0)     /* MAPPN_refuse_rsn: no reason given */
+
+/*
+ * Guard timer: a dialogue that waits longer than this for its next
+ * primitive is aborted and its slot freed. Zero disables the timer.
+ */
+#define MTR_DEF_GUARD_S         (60)    /* Default guard time in seconds */
+
+/*
+ * Index of a dialogue in the dialogue table of its MAP instance
+ */
+#define MTR_DLG_REF(dlg_id)     ((u16)((dlg_id) - mtr_first_dlg_id))
+#define MTR_NUM_DLGS            ((u32)(mtr_last_dlg_id - mtr_first_dlg_id) + 1)
+
+/*
+ * Guard timer of a dialogue, among those of all MAP instances
+ */
+#define MTR_TMR_REF(inst, dlg_id) ((u32)(inst) * MTR_NUM_DLGS + MTR_DLG_REF(dlg_id))
+
+/*
+ * Index of the thread running the state machine of a dialogue
+ */
+#define MTR_THREAD(dlg_id)      (mtr_num_workers ? \
+                                 MTR_WRK_OWNER((dlg_id) & 0x7FFF, mtr_num_workers) : 0)
+
+/*
+ * Messages queued for sending by one thread
+ */
+typedef struct
+{
+  u16 num;                              /* Number of queued messages */
+  struct timespec first;                /* Time the first was queued */
+  MSG *msg[MTR_MAX_TX_BATCH];           /* Queued messages */
+  u32 flushes;                          /* Number of flushes */
+  u32 flushed;                          /* Messages sent by flushes */
+} MTR_TXQ;
+
+/*
+ * Messages of the response being built by one thread, sent together
+ * once all of them are built
+ */
+typedef struct
+{
+  u8  on;                               /* Set while a response is built */
+  u8  num;                              /* Messages built */
+  MSG *msg[MTR_MAX_STAGE];              /* Messages built */
+} MTR_STAGE;
+
+/*
+ * Messages and responses of one thread waiting to be retried
+ */
+typedef struct
+{
+  u32 msg_head;                         /* Oldest queued message */
+  u32 num_msgs;                         /* Queued messages */
+  u32 dlg_head;                         /* Oldest queued response */
+  u32 num_dlgs;                         /* Queued responses */
+  u8  exhausted;                        /* Set while anything is queued */
+  u32 backoff_us;                       /* Back-off after the next failed retry */
+  unsigned long long due_ns;            /* Time of the next retry */
+  MSG *msg[MTR_MAX_RETRY_MSGS];         /* Queued messages */
+  u32 dlg[MTR_MAX_RETRY_DLGS];          /* Queued dialogues, from MTR_TMR_REF() */
+} MTR_RTQ;
 
 /*
  * Prototypes for local functions:
@@ -64,14 +263,57 @@
 int MTR_process_map_msg(MSG *m);
 int MTR_cfg(u8 _mtr_mod_id, u8 _map_mod_id, u8 _trace_mod_id,u8 _dlg_term_mode);
 int MTR_set_default_term_mode(u8 new_term_mode);
+int MTR_set_num_workers(u8 num_workers);
+int MTR_set_dlg_range(u16 first_dlg_id, u16 last_dlg_id);
+int MTR_set_huge_pages(u8 huge_pages);
+int MTR_set_map_instances(u8 num_inst);
+int MTR_set_batch(u16 batch_size, u32 flush_us);
+int MTR_set_capture(char *base, u32 file_size, u8 compress);
+int MTR_set_trace_filter(u32 every, u16 first_dlg_id, u16 last_dlg_id,
+                         char *msisdn_prefix);
+int MTR_set_guard_timer(u32 seconds);
+int MTR_set_lat_interval(u32 seconds);
+int MTR_set_routes(char *file);
+int MTR_set_subscribers(char *file);
+int MTR_set_delays(char *file);
+int MTR_set_faults(char *file);
+int MTR_set_overload(u32 max_dlgs, u32 max_wait_us);
+int MTR_process_urgent(MSG **m, unsigned long long *rx_ns, u16 num);
+int MTR_flush_msgs(void);
+int MTR_poll_timers(u8 wheel);
+int MTR_retry_idle(void);
+int MTR_report(void);
 
 static int init_resources(void);
-static u16 MTU_def_alph_to_str(u8 *da_octs, u16 da_olen, u16 da_num,
-                                 char *ascii_str, u16 max_strlen);
-static int print_sh_msg(MSG *m);
-static dlg_info *get_dialogue_info(u16 dlg_id);
-static int MTR_trace_msg(char *prefix, MSG *m);
+static void MTR_report_handler(int sig);
+static int MTR_handle_msg(MSG *m, unsigned long long rx_ns);
+static int print_sh_msg(MTR_PRS *prs);
+static int print_ussd(MTR_PRS *prs);
+static MTR_DLG *get_dialogue_info(u16 inst, u16 dlg_id);
+static int MTR_trace_msg(u8 kind, MSG *m);
+static int MTR_trace_dlg(u16 inst, u16 dlg_id);
+static int MTR_trace_select(MTR_DLG *dlg, MSG *m, MTR_PRS *prs);
+static int MTR_guard_dlg(MTR_DLG *dlg, u16 dlg_id);
+static int MTR_guard_expiry(u32 tmr_ref);
+static int MTR_dlg_ended(MTR_DLG *dlg, u8 aborted);
+static int MTR_overloaded(void);
+static int MTR_urgent(MSG *m);
+static int MTR_respond(MTR_DLG *dlg, u16 dlg_id);
+static int MTR_answer(MTR_DLG *dlg, u16 dlg_id);
+static int MTR_release(MTR_DLG *dlg, u16 dlg_id, unsigned long long rx_ns);
+static int MTR_defer_dlg(MTR_DLG *dlg, u16 dlg_id);
+static int MTR_defer_end(MTR_DLG *dlg, u16 dlg_id, u8 held, u8 param);
+static int MTR_retry(void);
+static int MTR_retry_dlg(u32 tmr_ref);
+static int MTR_retry_wait(MTR_RTQ *rtq);
+static unsigned long long MTR_getm_fails(void);
+static int MTR_hold_dlg(MTR_DLG *dlg, u16 dlg_id, u32 hold_us);
+static int MTR_hold_stop(MTR_DLG *dlg, u16 dlg_id);
+static int MTR_hold_expiry(u32 tmr_ref);
+static u32 MTR_held(void);
 static int MTR_send_msg(u16 instance, MSG *m);
+static int MTR_queue_msg(MSG *m);
+static int MTR_gct_send(MSG *m);
 static int MTR_send_OpenResponse(u16 mtr_map_inst, u16 dlg_id, u8 result);
 static int MTR_ForwardSMResponse(u16 mtr_map_inst, u16 dlg_id, u8 invoke_id);
 static int MTR_SendImsiResponse(u16 mtr_map_inst, u16 dlg_id, u8 invoke_id);
@@ -82,23 +324,81 @@ static int MTR_Send_ProcessUnstructuredSSReqRsp (u16 mtr_map_inst, u16 dlg_id, u
 static int MTR_Send_UnstructuredSSNotifyRsp (u16 mtr_map_inst, u16 dlg_id, u8 invoke_id);
 static int MTR_send_MapClose(u16 mtr_map_inst, u16 dlg_id, u8 method);
 static int MTR_send_Abort(u16 mtr_map_inst, u16 dlg_id, u8 reason);
+static int MTR_reject_dialogue(MSG *m);
 static int MTR_send_Delimit(u16 mtr_map_inst, u16 dlg_id);
-static int MTR_get_invoke_id(u8 *pptr, u16 plen);
-static int MTR_get_applic_context(u8 *pptr, u16 plen, u8 *dst, u16 dstlen);
-static u8  MTR_get_msisdn(u8 *pptr, u16 plen, u8 *dst, u16 dstlen);
-static int MTR_get_sh_msg(u8 *pptr, u16 plen, u8 *dst, u16 dstlen);
+static int MTR_get_invoke_id(MTR_PRS *prs);
+static int MTR_get_applic_context(MTR_PRS *prs, u8 *dst, u16 dstlen);
+static u8  MTR_get_msisdn(MTR_PRS *prs, u8 *dst, u16 dstlen);
 static int MTR_MT_ForwardSMResponse(u16 mtr_map_inst, u16 dlg_id, u8 invoke_id);
 static int MTR_SendRtgInfoSmsResponse(u16 mtr_map_inst, u16 dlg_id, u8 invoke_id);
+static u8  MTR_put_tbcd(u8 *dst, u8 *digits, u8 num_digits);
 static int MTR_Send_ATIResponse(u16 mtr_map_inst, u16 dlg_id, u8 invoke_id);
+static int MTR_send_user_error(u16 mtr_map_inst, u16 dlg_id, u8 ptype, u8 invoke_id, u8 error);
+static int MTR_send_srv_rsp(u16 mtr_map_inst, u16 dlg_id, u8 ptype, u8 invoke_id,
+                            u8 *params, u16 len);
 
 /*
  * Static data:
  */
-static dlg_info dialogue_info[MAX_NUM_DLGS];    /* Dialog_info */
 static u8 mtr_mod_id;                           /* Module id of this task */
 static u8 mtr_map_id;                           /* Module id for all MAP requests */
 static u8 mtr_trace;                            /* Controls trace requirements */
 static u8 mtr_default_dlg_term_mode;            /* Controls which end terminates a dialog */
+static u8 mtr_num_workers = MTR_DEFAULT_NUM_WORKERS; /* Worker threads, 0 for none */
+static volatile sig_atomic_t mtr_report_req;    /* Set by SIGUSR1 to request a report */
+static volatile sig_atomic_t mtr_reload_req;    /* Set by SIGHUP to reload the routes */
+static u16 mtr_first_dlg_id = 0x8000;           /* First incoming dialogue id served */
+static u16 mtr_last_dlg_id = 0x8000 + MAX_NUM_DLGS - 1; /* Last incoming dialogue id served */
+static u32 mtr_dlg_rejected;                    /* Dialogues outside our range */
+static u32 mtr_dlg_outgoing;                    /* Primitives for outgoing dialogue ids */
+static u8 mtr_huge_pages;                       /* Back dialogue table with huge pages */
+static u8 mtr_num_inst = 1;                     /* MAP instances served */
+static u32 mtr_inst_rejected;                   /* Primitives from other MAP instances */
+static __thread u16 mtr_cur_inst;               /* MAP instance of the dialogue in hand */
+static u16 mtr_batch_size = 1;                  /* Messages processed per wakeup */
+static u32 mtr_flush_us = MTR_DEF_FLUSH_US;     /* Flush deadline in microseconds */
+static u32 mtr_batches;                         /* Batches received */
+static u32 mtr_batch_msgs;                      /* Messages received in batches */
+static char *mtr_capture;                       /* Capture file prefix, 0 for text trace */
+static u8 mtr_trace_filter;                     /* Set if only some dialogues are traced */
+static u32 mtr_trace_every;                     /* Trace 1 in N dialogues, 0 for none */
+static u16 mtr_trace_first_dlg_id;              /* First dialogue id traced */
+static u16 mtr_trace_last_dlg_id;               /* Last dialogue id traced */
+static char mtr_trace_prefix[MTR_MAX_TRACE_PREFIX + 1]; /* MSISDN prefix traced */
+static u8 mtr_trace_prefix_len;                 /* Digits in mtr_trace_prefix */
+static __thread u32 mtr_trace_opens;            /* Dialogues opened in this thread */
+static __thread MTR_TXQ mtr_txq;                /* This thread's Tx batch */
+static __thread MTR_STAGE mtr_stage;            /* This thread's response being built */
+static __thread MTR_RTQ mtr_rtq;                /* This thread's retry queue */
+static unsigned long long mtr_lat_interval_ns; /* Latency report interval, 0 for none */
+static unsigned long long mtr_lat_next_ns;      /* Time of the next latency report */
+static u32 mtr_guard_ticks = MTR_DEF_GUARD_S * 1000 / MTR_TMR_TICK_MS; /* Guard time, 0 for none */
+static MTR_TMR_NODE *dialogue_timer;            /* Guard timer per dialogue */
+static struct
+{
+  MTR_TMR_WHEEL w;                              /* Timers of one thread */
+} __attribute__((aligned(MTR_CACHE_LINE))) mtr_guard[MTR_MAX_WORKERS];
+static u8 mtr_hold;                             /* Set if responses may be held back */
+static u8 mtr_fault;                            /* Set if faults are injected */
+static char *mtr_fault_name[MTR_FLT_NUM_OUTCOMES] = MTR_FLT_OUTCOME_NAMES;
+static MTR_TMR_NODE *hold_timer;                /* Hold timer per dialogue */
+static struct
+{
+  MTR_TMR_WHEEL w;                              /* Held responses of one thread */
+} __attribute__((aligned(MTR_CACHE_LINE))) mtr_hold_wheel[MTR_MAX_WORKERS];
+static u32 mtr_guard_state[MTR_S_WAIT_DELIMITER + 1]; /* Guard expiries per state */
+static u32 mtr_max_dlgs;                        /* Dialogues in progress before refusing, 0 for no limit */
+static u32 mtr_thread_max_dlgs;                 /* Share of mtr_max_dlgs of each thread */
+static unsigned long long mtr_max_wait_ns;      /* Wait inside MTR before refusing, 0 for no limit */
+static u8 mtr_overload;                         /* Set if overload control is on */
+static __thread u32 mtr_active;                 /* Dialogues in progress in this thread */
+static u32 mtr_guard_srv[256];                  /* Guard expiries per service */
+static u32 mtr_guard_segment;                   /* Closed waiting for the next segment */
+static struct
+{
+  u32 opened[MTR_DLG_MAX_INST];                 /* Dialogues accepted */
+  u32 aborted[MTR_DLG_MAX_INST];                /* Dialogues aborted */
+} __attribute__((aligned(MTR_CACHE_LINE))) mtr_inst_cnt[MTR_MAX_WORKERS]; /* Per thread */
 
 #define MTR_ATI_RSP_SIZE         (8)
 #define MTR_ATI_RSP_NUM_OF_RSP   (8)
@@ -114,85 +414,64 @@ static u8 mtr_ati_rsp_data[MTR_ATI_RSP_NUM_OF_RSP][MTR_ATI_RSP_SIZE] =
     {0x14, 0x80, 0x00, 0x00, 0x10, 0x00, 0x00, 0x14}      //7
 };
 /*
- * MTU_def_alph_to_str()
- * Returns the number of ascii characters formatted into the
- * ascii string. Returns zero if this could not be done.
+ * print_sh_msg()
+ *
+ * prints a received short message
+ *
+ * Always returns zero
+ *
  */
-u16 MTU_def_alph_to_str(da_octs, da_olen, da_num, ascii_str, max_strlen)
-  u8   *da_octs;      /* u8 array from which the deft alph chars are recoverd */
-  u16   da_olen;      /* The formatted octet length of da_octs  */
-  u16   da_num;       /* The number of formatted characters in the array */
-  char *ascii_str;    /* location into which chars are written */
-  u16   max_strlen;   /* The max space available for the ascii_str */
+int print_sh_msg(prs)
+  MTR_PRS *prs;                 /* Parsed primitive */
 {
-  char *start_ascii_str;   /* The first char */
-  u16  i;                  /* The bit position along the da_octs */
-
-  start_ascii_str = ascii_str;
+  u8 *sm;                       /* Short message in the received primitive */
+  u8 sm_len;                    /* Length of short message */
+  char text[MTR_GSM_MAX_TEXT];  /* Buffer for holding the decoded SM */
+  MTR_GSM_UD info;              /* Description of the user data */
 
-  if ((da_olen * 8) > ((max_strlen + 1) * 7))
-    return(0);
+  sm = MTR_prs_find(prs, MAPPN_sm_rp_ui, &sm_len);
 
-  if (  ( (da_num * 7)  >   (da_olen      * 8) )
-     || ( (da_num * 7) <= ( (da_olen - 1) * 8) ) )
+  MTR_trc_printf("MTR Rx: Short Message User Information:\n");
+  if ((sm == 0) || (MTR_gsm_sm_text(sm, sm_len, text, sizeof(text), &info) < 0))
   {
-    /*
-     * The number of digits does not agree with the size of the string
-     */
-    return (0);
+    MTR_trc_printf("MTR Rx: (error decoding)\n");
+    return(0);
   }
-  else
-  {
-    for (i=0; i < da_num; i++)
-    {
-      *ascii_str++ = DEF2ASCII(unpackbits(da_octs, i * 7, 7));
-    }
-
-    *ascii_str++ = '\0';
 
-    return((u16)(ascii_str - start_ascii_str));
-  }
+  if (info.concat_num != 0)
+    MTR_trc_printf("MTR Rx: (part %d of %d, reference %d)\n",
+                   info.concat_seq, info.concat_num, info.concat_ref);
+  MTR_trc_printf("MTR Rx: %s%s\n",
+                 (info.charset == MTR_GSM_8BIT) ? "8-bit data " : "", text);
+  return(0);
 }
 
 /*
- * print_sh_msg()
+ * print_ussd()
  *
- * prints a received short message
+ * prints a received USSD string
  *
  * Always returns zero
  *
  */
-int print_sh_msg(m)
-  MSG *m;
+static int print_ussd(prs)
+  MTR_PRS *prs;                 /* Parsed primitive */
 {
-  u8 *pptr;                     /* Parameter pointer */
-  u16 plen;                     /* length of primitive data */
-  u16 msg_len;                  /* Number of characters in short message */
-  u8  raw_SM[MAX_SM_SIZE];      /* Buffer for holding raw SM */
-  char ascii_SM[MAX_SM_SIZE];   /* Buffer for holding ascii SM */
-  u8 num_semi_oct;              /* number of encoded useful semi-octets */
-  u8 num_dig_bytes;             /* number of bytes of digits */
-  u8 tot_header_len = SIZE_UI_HEADER_FIXED;  /* start off with the fixed part */
-
-
-  pptr = get_param(m);
-  plen = MTR_get_sh_msg(pptr, m->len, raw_SM, MAX_SM_SIZE);
-
-  /* calc size of TP-OA in bytes*/
-  num_semi_oct = raw_SM[1];
-  num_dig_bytes = (num_semi_oct/2) + (num_semi_oct % 2);
-
-  tot_header_len += num_dig_bytes; /* now total header length */
-
-  plen -= tot_header_len;
-  msg_len = raw_SM[tot_header_len - 1];
+  u8 *dcs;                      /* USSD data coding scheme */
+  u8 *str;                      /* USSD string */
+  u8 len;                       /* Length of parameter */
+  char text[MTR_GSM_MAX_TEXT];  /* Buffer for holding the decoded string */
+  MTR_GSM_UD info;              /* Description of the string */
+
+  if (((dcs = MTR_prs_find(prs, MAPPN_USSD_coding, &len)) == 0) || (len != 1) ||
+      ((str = MTR_prs_find(prs, MAPPN_USSD_string, &len)) == 0))
+    return(0);
 
-  printf("MTR Rx: Short Message User Information:\n");
-  if(MTU_def_alph_to_str(raw_SM + tot_header_len, plen, msg_len,
-                      ascii_SM, MAX_SM_SIZE) > 0)
-    printf("MTR Rx: %s\n",ascii_SM);
+  if (MTR_gsm_decode(MTR_gsm_cbs_charset(*dcs), 0, str, len, 0,
+                     text, sizeof(text), &info) < 0)
+    MTR_trc_printf("MTR Rx: USSD string: (error decoding)\n");
   else
-    printf("MTR Rx: (error decoding)\n");
+    MTR_trc_printf("MTR Rx: USSD string: %s\n", text);
   return(0);
 }
 
@@ -211,9 +490,20 @@ int mtr_ent(mtr_id, map_id, trace, dlg_term_mode)
   u8 dlg_term_mode;/* Default termination mode */
 {
   HDR *h;               /* received message */
-  MSG *m;               /* received message */
+  u16 num;              /* messages in this batch */
+  u16 i;                /* message index */
+  u16 rx_batch;         /* most messages taken per wakeup */
+  MSG *rx_msg[MTR_MAX_BATCH]; /* messages in this batch */
+  unsigned long long rx_ns[MTR_MAX_BATCH]; /* when each was received */
 
-  MTR_cfg(mtr_id, map_id, trace, dlg_term_mode);
+  if (MTR_cfg(mtr_id, map_id, trace, dlg_term_mode) != 0)
+    return(-1);
+
+  /*
+   * Counters are published for mtrstat before any thread counts.
+   */
+  if (MTR_stat_start(mtr_mod_id) != 0)
+    fprintf(stderr, "MTR: failed to start statistics thread\n");
 
   /*
    * Print banner so we know what's running.
@@ -221,8 +511,113 @@ int mtr_ent(mtr_id, map_id, trace, dlg_term_mode)
   printf("MTR MAP Test Responder (C) Dialogic Corporation 1999-2009. All Rights Reserved.\n");
   printf("===============================================================================\n\n");
   printf("MTR mod ID - 0x%02x; MAP module Id 0x%x; Termination Mode 0x%x\n", mtr_mod_id, mtr_map_id, dlg_term_mode);
-  if ( mtr_trace == 0 )
+  printf("Dialogue ids 0x%04x-0x%04x; MAP instances 0-%u\n",
+         mtr_first_dlg_id, mtr_last_dlg_id, mtr_num_inst - 1);
+  if (mtr_capture != 0)
+  {
+    printf(" Capturing trace to %s.*.mtrcap\n\n", mtr_capture);
+    mtr_trace = 1;
+  }
+  else if ( mtr_trace == 0 )
     printf(" Tracing disabled.\n\n");
+  if ((mtr_trace) && (mtr_trace_filter))
+    printf(" Tracing dialogues: every %u; ids 0x%04x-0x%04x; MSISDN prefix '%s'\n\n",
+           mtr_trace_every, mtr_trace_first_dlg_id, mtr_trace_last_dlg_id,
+           mtr_trace_prefix);
+
+  /*
+   * Every thread running dialogue state machines has its own wheel
+   * of guard timers, advanced on ticks sent to this module.
+   */
+  if (mtr_guard_ticks != 0)
+  {
+    for (num = 0; num < (mtr_num_workers ? mtr_num_workers : 1); num++)
+      MTR_tmr_init(&mtr_guard[num].w, dialogue_timer);
+    if (MTR_tmr_tick_start(mtr_mod_id) != 0)
+    {
+      fprintf(stderr, "MTR: failed to start tick thread, guard timer disabled\n");
+      mtr_guard_ticks = 0;
+    }
+    else
+      printf(" Guard timer: %ums\n\n", mtr_guard_ticks * MTR_TMR_TICK_MS);
+  }
+
+  /*
+   * Held responses are parked on a wheel of their own, with a finer
+   * tick, by each thread running dialogue state machines.
+   */
+  if (mtr_hold)
+  {
+    for (num = 0; num < (mtr_num_workers ? mtr_num_workers : 1); num++)
+    {
+      MTR_tmr_init(&mtr_hold_wheel[num].w, hold_timer);
+      mtr_hold_wheel[num].w.now = MTR_dly_ticks();
+    }
+    if (MTR_dly_start(mtr_mod_id, MTR_held) != 0)
+    {
+      fprintf(stderr, "MTR: failed to start delay clock, responses not held\n");
+      mtr_hold = 0;
+    }
+    else
+      printf(" Responses held back by service, released every %uus\n\n", MTR_DLY_TICK_US);
+  }
+
+  /*
+   * In worker mode this thread only receives, the workers run the
+   * dialogue state machines.
+   */
+  if (mtr_num_workers != 0)
+  {
+    if (MTR_wrk_start(mtr_num_workers, mtr_batch_size) != 0)
+    {
+      fprintf(stderr, "MTR: failed to start %d worker threads\n", mtr_num_workers);
+      return(-1);
+    }
+    printf(" Worker threads: %d\n\n", mtr_num_workers);
+  }
+
+  if (mtr_batch_size > 1)
+    printf(" Batch size: %d; flush deadline %uus\n\n", mtr_batch_size, mtr_flush_us);
+
+  if (mtr_overload)
+  {
+    num = mtr_num_workers ? mtr_num_workers : 1;
+    mtr_thread_max_dlgs = (mtr_max_dlgs + num - 1) / num;
+    printf(" Overload control: dialogues in progress %u; wait %uus (0 for no limit)\n\n",
+           mtr_max_dlgs, (u32)(mtr_max_wait_ns / 1000));
+  }
+
+  /*
+   * Under a wait limit all the messages waiting are taken at once, so
+   * that the time each then spends behind the others is measured even
+   * when they are processed one at a time.
+   */
+  rx_batch = ((mtr_overload) && (mtr_max_wait_ns != 0)) ? MTR_MAX_BATCH : mtr_batch_size;
+
+  if (mtr_lat_interval_ns != 0)
+  {
+    printf(" Latency report every %us\n\n", (u32)(mtr_lat_interval_ns / 1000000000));
+    mtr_lat_next_ns = MTR_lat_now() + mtr_lat_interval_ns;
+  }
+
+  /*
+   * Trace is formatted and written by its own thread, so anything
+   * printed so far must be out first.
+   */
+  fflush(stdout);
+  if ((MTR_TRACE_LEVEL >= 1) && (mtr_trace) &&
+      (MTR_trc_start(mtr_capture != 0) != 0))
+  {
+    fprintf(stderr, "MTR: failed to start trace thread, tracing disabled\n");
+    mtr_trace = 0;
+  }
+
+  /*
+   * SIGUSR1 requests a report of the internal counters, SIGHUP a
+   * reload of the route file.
+   */
+  signal(SIGUSR1, MTR_report_handler);
+  signal(SIGHUP, MTR_report_handler);
 
   /*
    * Now enter main loop, receiving messages as they
@@ -235,29 +630,200 @@ int mtr_ent(mtr_id, map_id, trace, dlg_term_mode)
      * GCT_receive will attempt to receive messages
      * from the task's message queue and block until
      * a message is ready.
+     *
+     * In batch mode any further messages already waiting are then
+     * taken with GCT_grab, and the responses to the whole batch
+     * are sent together.
+     *
+     * Each message is stamped as it is taken from the queue, the
+     * start of its response latency. Under overload control the
+     * messages that complete a dialogue go first.
+     *
+     * While messages or responses are queued for a retry the thread
+     * sleeps until the retry is due, then only polls the queue so
+     * that the retry is not held up.
      */
-    if ((h = GCT_receive(mtr_mod_id)) != 0)
+    if ((mtr_num_workers == 0) && (MTR_retry_idle() != 0))
     {
-      m = (MSG *)h;
-      MTR_trace_msg("MTR Rx:", m);
-      switch (m->hdr.type)
+      if ((h = GCT_grab(mtr_mod_id)) == 0)
       {
-        case MAP_MSG_DLG_IND:
-        case MAP_MSG_SRV_IND:
-          MTR_process_map_msg(m);
-        break;
+        MTR_poll_timers(0);
+        MTR_flush_msgs();
+      }
+    }
+    else
+      h = GCT_receive(mtr_mod_id);
+
+    if (h != 0)
+    {
+      num = 0;
+      do
+      {
+        MTR_STAT_INC(rx);
+        rx_msg[num] = (MSG *)h;
+        rx_ns[num] = MTR_lat_now();
+        num++;
+      } while ((num < rx_batch) && ((h = GCT_grab(mtr_mod_id)) != 0));
+
+      if (mtr_num_workers == 0)
+        MTR_process_urgent(rx_msg, rx_ns, num);
+      for (i = 0; i < num; i++)
+        if (rx_msg[i] != 0)
+          MTR_handle_msg(rx_msg[i], rx_ns[i]);
+
+      if (mtr_num_workers == 0)
+        MTR_poll_timers(0);
+      MTR_flush_msgs();
+      mtr_batches++;
+      mtr_batch_msgs += num;
+    }
+
+    if (mtr_report_req)
+    {
+      mtr_report_req = 0;
+      MTR_report();
+    }
+
+    if (mtr_reload_req)
+    {
+      mtr_reload_req = 0;
+      if (MTR_rte_reload() != 0)
+        fprintf(stderr, "MTR: no route file or reload in progress\n");
+    }
+
+    if ((mtr_lat_interval_ns != 0) && (MTR_lat_now() >= mtr_lat_next_ns))
+    {
+      mtr_lat_next_ns = MTR_lat_now() + mtr_lat_interval_ns;
+      printf("MTR Latency over the last %us:\n", (u32)(mtr_lat_interval_ns / 1000000000));
+      MTR_lat_report(1);
+      fflush(stdout);
+    }
+  }
+  return(0);
+}
+
+/*
+ * MTR_handle_msg
+ *
+ * Handles one message received from the GCT queue.
+ *
+ * Always returns zero.
+ */
+static int MTR_handle_msg(m, rx_ns)
+  MSG *m;               /* received message */
+  unsigned long long rx_ns; /* when it was received */
+{
+  switch (m->hdr.type)
+  {
+    case MAP_MSG_DLG_IND:
+    case MAP_MSG_SRV_IND:
+      if (mtr_num_workers != 0)
+      {
+        /*
+         * The worker owning the dialogue processes and
+         * releases the message.
+         */
+        MTR_wrk_dispatch(m, rx_ns);
+        return(0);
       }
+      MTR_lat_rx(rx_ns);
+      MTR_process_map_msg(m);
+      MTR_lat_rx(0);
+    break;
 
+    case MTR_TMR_MSG_TICK:
       /*
-       * Once we have finished processing the message
-       * it must be released to the pool of messages.
+       * Sent by the tick thread to make sure the guard timers are
+       * advanced. Workers that are asleep are woken to do so.
        */
-      relm(h);
-    }
+      MTR_tmr_tick_done();
+      if (mtr_num_workers != 0)
+        MTR_wrk_tick();
+    break;
+
+    case MTR_DLY_MSG_TICK:
+      /*
+       * Sent by the delay clock while responses are held, so that
+       * they are released on time.
+       */
+      MTR_dly_wake_done();
+      if (mtr_num_workers != 0)
+        MTR_wrk_tick();
+    break;
+
+    default:
+      MTR_trace_msg(MTR_TRC_RX, m);
+    break;
   }
+
+  /*
+   * Once we have finished processing the message
+   * it must be released to the pool of messages.
+   */
+  relm((HDR *)m);
   return(0);
 }
 
+/*
+ * MTR_process_urgent
+ *
+ * Processes and releases, ahead of the rest of a batch, the primitives
+ * for dialogues waiting for their delimiter, which complete a dialogue
+ * and free its slot, and clears their entries. Only done under
+ * overload control. The primitives of one dialogue keep their order,
+ * as its state only changes while they are processed. Must be called
+ * by the thread owning the dialogues.
+ *
+ * Returns the number of primitives processed.
+ */
+int MTR_process_urgent(m, rx_ns, num)
+  MSG **m;                      /* Batch of received messages */
+  unsigned long long *rx_ns;    /* When each was received */
+  u16 num;                      /* Messages in the batch */
+{
+  u16 i;                        /* Message index */
+  int done;                     /* Primitives processed */
+
+  if ((!mtr_overload) || (num < 2))
+    return(0);
+
+  for (i = 0, done = 0; i < num; i++)
+  {
+    if ((m[i] != 0) && (MTR_urgent(m[i]) != 0))
+    {
+      MTR_lat_rx(rx_ns[i]);
+      MTR_process_map_msg(m[i]);
+      MTR_lat_rx(0);
+      relm((HDR *)m[i]);
+      m[i] = 0;
+      done++;
+    }
+  }
+  return(done);
+}
+
+/*
+ * MTR_urgent
+ *
+ * Returns non-zero if a received message is a MAP primitive for a
+ * dialogue waiting for its delimiter.
+ */
+static int MTR_urgent(m)
+  MSG *m;                       /* Received message */
+{
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 inst;                     /* MAP instance */
+
+  if ((m->hdr.type != MAP_MSG_DLG_IND) && (m->hdr.type != MAP_MSG_SRV_IND))
+    return(0);
+  if ((m->hdr.id < mtr_first_dlg_id) || (m->hdr.id > mtr_last_dlg_id) || (!(m->hdr.id & 0x8000)))
+    return(0);
+  if ((inst = (u16)GCT_get_instance((HDR *)m)) >= mtr_num_inst)
+    return(0);
+  dlg = MTR_dlg_peek(inst, MTR_DLG_REF(m->hdr.id));
+  return((dlg != 0) && (dlg->state == MTR_S_WAIT_DELIMITER));
+}
+
 /*
  * Can be used to configure and initialise mtr
  */
@@ -272,8 +838,14 @@ int MTR_cfg(
   mtr_trace = _trace_mod_id;
   mtr_default_dlg_term_mode = _dlg_term_mode;
 
-  init_resources();
-  return (0);
+  /*
+   * Pre-encode the primitives we send
+   */
+  MTR_gsm_init();
+  if ((MTR_tpl_init(mtr_mod_id, mtr_map_id) != 0) || (MTR_tpl_verify() != 0))
+    fprintf(stderr, "MTR: failed to build primitive templates\n");
+
+  return (init_resources());
 }
 
 /*
@@ -288,68 +860,453 @@ int MTR_set_default_term_mode(
   }
 
 /*
- * Get Dialogue Info
- *
- * Returns pointer to dialogue info or 0 on error.
+ * Can be used to configure the number of worker threads.
+ * Only takes effect if called before mtr_ent().
  */
-dlg_info *get_dialogue_info(dlg_id)
-  u16 dlg_id;               /* Dlg ID of the incoming message 0x800a perhaps */
-{
-  u16 dlg_ref;              /* Internal Dlg Ref, 0x000a perhaps */
+int MTR_set_num_workers(
+  u8 num_workers
+  ){
+    if (num_workers > MTR_MAX_WORKERS)
+      return (-1);
 
-  if (!(dlg_id & 0x8000) )
-  {
-    if (mtr_trace)
-      printf("MTR Rx: Bad dialogue id: Outgoing dialogue id, dlg_id == %x\n",dlg_id);
-    return 0;
-  }
-  else
-  {
-    dlg_ref = dlg_id & 0x7FFF;
+    mtr_num_workers = num_workers;
+    return (0);
   }
 
-  if ( dlg_ref >= MAX_NUM_DLGS )
-  {
-    if (mtr_trace)
-      printf("MTR Rx: Bad dialogue id: Out of range dialogue, dlg_id == %x\n",dlg_id);
-    return 0;
+/*
+ * Can be used to set the incoming dialogue id range served, normally
+ * the TCAP incoming range, or a slice of it so that several MTR
+ * processes can share the dialogues of one MAP module. The dialogue
+ * table is sized for the range.
+ * Only takes effect if called before mtr_ent().
+ */
+int MTR_set_dlg_range(
+  u16 first_dlg_id,
+  u16 last_dlg_id
+  ){
+    if ((!(first_dlg_id & 0x8000)) || (last_dlg_id < first_dlg_id))
+      return (-1);
+
+    mtr_first_dlg_id = first_dlg_id;
+    mtr_last_dlg_id = last_dlg_id;
+    return (0);
   }
-  return &dialogue_info[dlg_ref];
-}
 
+/*
+ * Can be used to back the dialogue table with huge pages, if the
+ * system has any configured.
+ * Only takes effect if called before mtr_ent().
+ */
+int MTR_set_huge_pages(
+  u8 huge_pages
+  ){
+    mtr_huge_pages = huge_pages;
+    return (0);
+  }
 
 /*
- * MTR_process_map_msg
- *
- * Processes a received MAP primitive message.
- *
- * Always returns zero.
+ * Can be used to serve several MAP instances, numbered from zero,
+ * each with its own dialogue table covering the dialogue id range.
+ * Only takes effect if called before mtr_ent().
  */
-int MTR_process_map_msg(m)
-  MSG *m;                       /* Received message */
-{
-  u16  dlg_id;                  /* Dialogue id */
-  u8   ptype;                   /* Parameter Type */
-  u8   *pptr;                   /* Parameter Pointer */
-  dlg_info *dlg_info;           /* State info for dialogue */
-  u8   send_abort;              /* Set if abort to be generated */
-  int  invoke_id;               /* Invoke id of received srv req */
+int MTR_set_map_instances(
+  u8 num_inst
+  ){
+    if ((num_inst == 0) || (num_inst > MTR_DLG_MAX_INST))
+      return (-1);
 
-  pptr = get_param(m);
-  ptype = *pptr;
+    mtr_num_inst = num_inst;
+    return (0);
+  }
 
-  dlg_id = m->hdr.id;
-  send_abort = 0;
+/*
+ * Can be used to configure batch mode. A batch size of 1 sends every
+ * message as soon as it is built. A flush deadline of zero only sends
+ * at the end of each batch.
+ */
+int MTR_set_batch(
+  u16 batch_size,
+  u32 flush_us
+  ){
+    if ((batch_size == 0) || (batch_size > MTR_MAX_BATCH))
+      return (-1);
 
-  /*
-   * Get state information associated with this dialogue
-   */
-  dlg_info = get_dialogue_info(dlg_id);
+    mtr_batch_size = batch_size;
+    mtr_flush_us = flush_us;
+    return (0);
+  }
 
-  if (dlg_info == 0)
-    return 0;
+/*
+ * Can be used to capture the trace to binary files instead of printing
+ * it. Capture replaces the text trace and is enabled even if tracing
+ * is otherwise disabled.
+ */
+int MTR_set_capture(
+  char *base,
+  u32 file_size,
+  u8 compress
+  ){
+    if (MTR_cap_config(base, file_size, compress) != 0)
+      return (-1);
 
-  switch (dlg_info->state)
+    mtr_capture = base;
+    return (0);
+  }
+
+/*
+ * Can be used to trace only some dialogues: one in every N opened,
+ * those with ids in a range and those for an MSISDN starting with the
+ * given digits. A dialogue matching any of them is traced. Zero every,
+ * an empty range (first > last) or a null prefix leave that filter out.
+ */
+int MTR_set_trace_filter(
+  u32 every,
+  u16 first_dlg_id,
+  u16 last_dlg_id,
+  char *msisdn_prefix
+  ){
+    u8 len;
+
+    len = 0;
+    if (msisdn_prefix != 0)
+    {
+      for (len = 0; msisdn_prefix[len] != '\0'; len++)
+        if ((len >= MTR_MAX_TRACE_PREFIX) ||
+            (msisdn_prefix[len] < '0') || (msisdn_prefix[len] > '9'))
+          return (-1);
+      memcpy(mtr_trace_prefix, msisdn_prefix, len + 1);
+    }
+
+    mtr_trace_every = every;
+    mtr_trace_first_dlg_id = first_dlg_id;
+    mtr_trace_last_dlg_id = last_dlg_id;
+    mtr_trace_prefix_len = len;
+    mtr_trace_filter = ((every != 0) || (first_dlg_id <= last_dlg_id) || (len != 0));
+    return (0);
+  }
+
+/*
+ * Can be used to configure the guard timer, the longest time a
+ * dialogue waits for its next primitive. Zero disables the timer.
+ * Only takes effect if called before mtr_ent().
+ */
+int MTR_set_guard_timer(
+  u32 seconds
+  ){
+    if (seconds > MTR_TMR_MAX_TICKS / (1000 / MTR_TMR_TICK_MS))
+      return (-1);
+
+    mtr_guard_ticks = seconds * (1000 / MTR_TMR_TICK_MS);
+    return (0);
+  }
+
+/*
+ * Can be used to print the latency percentiles periodically, on top of
+ * the SIGUSR1 report. Zero disables the periodic report. Only takes
+ * effect if called before mtr_ent().
+ */
+int MTR_set_lat_interval(
+  u32 seconds
+  ){
+    mtr_lat_interval_ns = (unsigned long long)seconds * 1000000000;
+    return (0);
+  }
+
+/*
+ * Can be used to answer SEND-ROUTING-INFO-FOR-SM from the number
+ * ranges in a route file, which is read again on SIGHUP.
+ */
+int MTR_set_routes(
+  char *file
+  ){
+    return (MTR_rte_load(file));
+  }
+
+/*
+ * Can be used to answer SEND-IMSI, SEND-ROUTING-INFO-FOR-GPRS,
+ * SEND-ROUTING-INFO-FOR-SM and ATI from a subscriber database built
+ * by mtrsub. Subscribers not in it get the usual responses.
+ */
+int MTR_set_subscribers(
+  char *file
+  ){
+    return (MTR_sub_open(file));
+  }
+
+/*
+ * Can be used to hold responses back by the per-service delays in a
+ * file, to emulate a real HLR or MSC. Only takes effect if called
+ * before mtr_ent().
+ */
+int MTR_set_delays(
+  char *file
+  ){
+    if (MTR_dly_load(file) != 0)
+      return (-1);
+    mtr_hold = 1;
+    return (0);
+  }
+
+/*
+ * Can be used to inject the faults in a file into the responses.
+ */
+int MTR_set_faults(
+  char *file
+  ){
+    if (MTR_flt_load(file) != 0)
+      return (-1);
+    mtr_fault = 1;
+    return (0);
+  }
+
+/*
+ * Can be used to refuse new dialogues while more than max_dlgs are in
+ * progress, or once a MAP-OPEN-IND has waited max_wait_us since it was
+ * taken from the queue. With a wait limit every message waiting is
+ * taken from the queue at once. Zero sets no limit. Only takes effect
+ * if called before mtr_ent().
+ */
+int MTR_set_overload(
+  u32 max_dlgs,
+  u32 max_wait_us
+  ){
+    mtr_max_dlgs = max_dlgs;
+    mtr_max_wait_ns = (unsigned long long)max_wait_us * 1000;
+    mtr_overload = ((max_dlgs != 0) || (max_wait_us != 0));
+    return (0);
+  }
+
+/*
+ * MTR_report
+ *
+ * Prints the internal counters to the console.
+ *
+ * Always returns zero.
+ */
+int MTR_report()
+{
+  u32 i;                        /* Index */
+  u32 t;                        /* Thread index */
+  u32 opened;                   /* Dialogues accepted by an instance */
+  u32 aborted;                  /* Dialogues aborted by an instance */
+  MTR_STAT_THR total;           /* Counters of all threads */
+
+  printf("MTR Report:\n");
+  printf("MTR Dialogues outside range 0x%04x-0x%04x: %u\n",
+         mtr_first_dlg_id, mtr_last_dlg_id, mtr_dlg_rejected);
+  printf("MTR Primitives for outgoing dialogue ids: %u\n", mtr_dlg_outgoing);
+  printf("MTR Primitives from MAP instances above %u: %u\n", mtr_num_inst - 1, mtr_inst_rejected);
+  MTR_prs_report();
+  for (i = 0; i < mtr_num_inst; i++)
+  {
+    for (t = 0, opened = 0, aborted = 0; t < MTR_MAX_WORKERS; t++)
+    {
+      opened += mtr_inst_cnt[t].opened[i];
+      aborted += mtr_inst_cnt[t].aborted[i];
+    }
+    printf("MTR MAP instance %u: dialogues in progress %u; opened %u; aborted %u\n",
+           i, MTR_dlg_active((u16)i), opened, aborted);
+  }
+  MTR_dlg_report();
+  printf("MTR Guard timer expiries: waiting for service %u; waiting for delimiter %u\n",
+         mtr_guard_state[MTR_S_WAIT_FOR_SRV_PRIM], mtr_guard_state[MTR_S_WAIT_DELIMITER]);
+  for (i = 0; i < 256; i++)
+    if (mtr_guard_srv[i] != 0)
+      printf("MTR Guard timer expiries for service 0x%02x: %u\n", i, mtr_guard_srv[i]);
+  printf("MTR Guard timer closes waiting for the next MT-FORWARD-SM segment: %u\n",
+         mtr_guard_segment);
+  printf("MTR Rx batches: %u; messages %u; average batch %.2f\n",
+         mtr_batches, mtr_batch_msgs,
+         mtr_batches ? (double)mtr_batch_msgs / mtr_batches : 0.0);
+  if (mtr_num_workers == 0)
+    printf("MTR Tx flushes: %u; messages %u; average flush %.2f\n",
+           mtr_txq.flushes, mtr_txq.flushed,
+           mtr_txq.flushes ? (double)mtr_txq.flushed / mtr_txq.flushes : 0.0);
+  if (mtr_num_workers != 0)
+    MTR_wrk_report();
+  MTR_stat_total(&total);
+  if (mtr_overload)
+    printf("MTR Dialogues refused by overload control: %llu\n", total.refused);
+  printf("MTR Back-pressure: exhausted %llu; messages and responses deferred %llu; dropped %llu\n",
+         total.exhausted, total.deferred, total.dropped);
+  if (mtr_num_workers == 0)
+    printf("MTR Retry queue: messages %u; responses %u; back-off %uus\n",
+           mtr_rtq.num_msgs, mtr_rtq.num_dlgs, mtr_rtq.exhausted ? mtr_rtq.backoff_us : 0);
+  MTR_trc_report();
+  MTR_rte_report();
+  MTR_sub_report();
+  if (mtr_hold)
+  {
+    printf("MTR Responses held: %u\n", MTR_held());
+    MTR_dly_report();
+  }
+  if (mtr_fault)
+    MTR_flt_report(total.fault);
+  MTR_lat_report(0);
+  fflush(stdout);
+  return(0);
+}
+
+/*
+ * MTR_report_handler
+ *
+ * SIGUSR1 and SIGHUP handler, the report and the reload are done by
+ * the main loop.
+ */
+static void MTR_report_handler(sig)
+  int sig;
+{
+  if (sig == SIGHUP)
+    mtr_reload_req = 1;
+  else
+    mtr_report_req = 1;
+}
+
+/*
+ * Get Dialogue Info
+ *
+ * Returns pointer to dialogue info or 0 on error.
+ */
+MTR_DLG *get_dialogue_info(inst, dlg_id)
+  u16 inst;                 /* MAP instance the dialogue belongs to */
+  u16 dlg_id;               /* Dlg ID of the incoming message 0x800a perhaps */
+{
+  u16 dlg_ref;              /* Internal Dlg Ref, 0x000a perhaps */
+
+  if (!(dlg_id & 0x8000) )
+  {
+    if (MTR_TRACE_TEXT(dlg_id))
+      MTR_trc_printf("MTR Rx: Bad dialogue id: Outgoing dialogue id, dlg_id == %x\n",dlg_id);
+    return 0;
+  }
+
+  if ((dlg_id < mtr_first_dlg_id) || (dlg_id > mtr_last_dlg_id))
+  {
+    if (MTR_TRACE_TEXT(dlg_id))
+      MTR_trc_printf("MTR Rx: Bad dialogue id: Out of range dialogue, dlg_id == %x\n",dlg_id);
+    return 0;
+  }
+  dlg_ref = MTR_DLG_REF(dlg_id);
+  return MTR_dlg_get(inst, dlg_ref);
+}
+
+/*
+ * MTR_reject_dialogue
+ *
+ * Handles a primitive for a dialogue this MTR does not serve, or
+ * has no memory for. The dialogue is aborted without touching the
+ * dialogue table, unless the primitive already ends it.
+ *
+ * Always returns zero.
+ */
+static int MTR_reject_dialogue(m)
+  MSG *m;                       /* Received message */
+{
+  MSG  *am;                     /* Abort message */
+
+  if (!(m->hdr.id & 0x8000))
+    __sync_fetch_and_add(&mtr_dlg_outgoing, 1);
+  else if ((m->hdr.id < mtr_first_dlg_id) || (m->hdr.id > mtr_last_dlg_id))
+    __sync_fetch_and_add(&mtr_dlg_rejected, 1);
+  else if (GCT_get_instance((HDR *)m) >= mtr_num_inst)
+    __sync_fetch_and_add(&mtr_inst_rejected, 1);
+
+  if (m->hdr.type == MAP_MSG_DLG_IND)
+  {
+    switch (*get_param(m))
+    {
+      case MAPDT_CLOSE_IND :
+      case MAPDT_U_ABORT_IND :
+      case MAPDT_P_ABORT_IND :
+        return(0);
+    }
+  }
+
+  if ((am = MTR_tpl_getm(MTR_TPL_U_ABORT_REQ, m->hdr.id, 0)) != 0)
+  {
+    get_param(am)[MTR_tpl_field(MTR_TPL_U_ABORT_REQ, MAPPN_user_rsn)] = MAPUR_procedure_error;
+    MTR_send_msg((u16)GCT_get_instance((HDR *)m), am);
+  }
+  return(0);
+}
+
+
+/*
+ * MTR_process_map_msg
+ *
+ * Processes a received MAP primitive message.
+ *
+ * Always returns zero.
+ */
+int MTR_process_map_msg(m)
+  MSG *m;                       /* Received message */
+{
+  u16  dlg_id;                  /* Dialogue id */
+  u16  inst;                    /* MAP instance */
+  u8   ptype;                   /* Parameter Type */
+  MTR_DLG *dlg_info;           /* State info for dialogue */
+  MTR_DLG_COLD *cold;           /* Cold state info for dialogue */
+  u8   send_abort;              /* Set if abort to be generated */
+  u8   in_progress;             /* Set if the dialogue was open on entry */
+  int  invoke_id;               /* Invoke id of received srv req */
+  MTR_PRS prs;                  /* Parsed primitive */
+  u8   *pval;                   /* Parameter value */
+  u8   plen;                    /* Parameter length */
+  u32  hold_us;                 /* Time to hold the response back */
+
+  /*
+   * Parameters are parsed as they are looked up. A malformed primitive
+   * is still processed with whatever parameters preceded the error, so
+   * a missing invoke id or application context is handled as before.
+   */
+  MTR_prs_parse(m, &prs);
+  ptype = prs.ptype;
+
+  dlg_id = m->hdr.id;
+  inst = (u16)GCT_get_instance((HDR*)m);
+  mtr_cur_inst = inst;
+  send_abort = 0;
+
+  /*
+   * Get state information associated with this dialogue, which is
+   * identified by MAP instance and dialogue id
+   */
+  dlg_info = get_dialogue_info(inst, dlg_id);
+
+  if (dlg_info == 0)
+  {
+    MTR_trace_msg(MTR_TRC_RX, m);
+    return MTR_reject_dialogue(m);
+  }
+
+  /*
+   * A refused dialogue has been released by MAP, so a MAP-OPEN-IND
+   * reusing its id starts afresh.
+   */
+  if ((dlg_info->state == MTR_S_REFUSED) &&
+      (m->hdr.type == MAP_MSG_DLG_IND) && (ptype == MAPDT_OPEN_IND))
+    dlg_info->state = MTR_S_NULL;
+
+  /*
+   * Decide whether this dialogue is traced before tracing the message
+   */
+  if ((MTR_TRACE_LEVEL >= 1) && (mtr_trace_filter))
+    MTR_trace_select(dlg_info, m, &prs);
+  MTR_trace_msg(MTR_TRC_RX, m);
+
+  /*
+   * Any response is timed against the service of the dialogue, or of
+   * the service primitive itself.
+   */
+  in_progress = ((dlg_info->state != MTR_S_NULL) && (dlg_info->state != MTR_S_REFUSED));
+  if (!in_progress)
+    MTR_lat_class(MTR_LAT_OPEN);
+  else if (m->hdr.type == MAP_MSG_SRV_IND)
+    MTR_lat_class(MTR_lat_service(ptype));
+  else
+    MTR_lat_class(MTR_lat_service(dlg_info->ptype));
+
+  switch (dlg_info->state)
   {
     case MTR_S_NULL :
       /*
@@ -365,30 +1322,57 @@ int MTR_process_map_msg(m)
                * Open indication indicates that a request to open a new
                * dialogue has been received
                */
-              if ( mtr_trace)
-                printf("MTR Rx: Received Open Indication\n");
+              if (MTR_TRACE_TEXT(dlg_id))
+                MTR_trc_printf("MTR Rx: Received Open Indication\n");
 
               /*
                * Save application context and MAP instance
                * We don't do actually do anything further with it though.
                */
-              dlg_info->map_inst = (u16)GCT_get_instance((HDR*)m);
-              dlg_info->ac_len =(u8)MTR_get_applic_context(pptr, m->len,
-                                                           dlg_info->app_context,
-                                                           MTR_MAX_AC_LEN);
+              cold = MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id));
+              dlg_info->open_us = MTR_DLG_STAMP(MTR_lat_now());
+
+              /*
+               * MAP has released the id, so a close, abort or refusal
+               * still queued for the last dialogue on it is not sent.
+               */
+              dlg_info->held &= ~MTR_HELD_END;
+              dlg_info->map_inst = inst;
+              dlg_info->ptype = 0;
+              cold->ac_len =(u8)MTR_get_applic_context(&prs,
+                                                       cold->app_context,
+                                                       MTR_MAX_AC_LEN);
               /*
                * Set the termination mode based on the current default
                */
               dlg_info->term_mode = mtr_default_dlg_term_mode;
 
-              if (dlg_info->ac_len != 0)
+              if ((cold->ac_len != 0) && (mtr_overload) && (MTR_overloaded() != 0))
+              {
+                /*
+                 * Overloaded - refuse the dialogue now, while the
+                 * other end can still retry elsewhere.
+                 */
+                if (MTR_TRACE_TEXT(dlg_id))
+                  MTR_trc_printf("MTR Tx: Overloaded, refusing dialogue\n");
+                if (MTR_send_OpenResponse(dlg_info->map_inst, dlg_id, MAPRS_DLG_REF) != 0)
+                  MTR_defer_end(dlg_info, dlg_id, MTR_HELD_REFUSE, MAPRS_DLG_REF);
+                dlg_info->state = MTR_S_REFUSED;
+                MTR_STAT_INC(refused);
+              }
+              else if (cold->ac_len != 0)
               {
                 /*
                  * Respond to the OPEN_IND with OPEN_RSP and wait for the
-                 * service indication
+                 * service indication. An OPEN_RSP that cannot be
+                 * allocated is sent with the service response instead.
                  */
-                MTR_send_OpenResponse(dlg_info->map_inst, dlg_id, MAPRS_DLG_ACC);
+                if (MTR_send_OpenResponse(dlg_info->map_inst, dlg_id, MAPRS_DLG_ACC) != 0)
+                  dlg_info->held |= MTR_HELD_OPEN;
                 dlg_info->state = MTR_S_WAIT_FOR_SRV_PRIM;
+                mtr_inst_cnt[MTR_THREAD(dlg_id)].opened[inst]++;
+                mtr_active++;
+                MTR_STAT_INC(opened);
               }
               else
               {
@@ -440,39 +1424,39 @@ int MTR_process_map_msg(m)
             case MAPST_UNSTR_SS_REQ_IND :
             case MAPST_UNSTR_SS_NOTIFY_IND :
             case MAPST_ANYTIME_INT_IND :
-              if (mtr_trace)
+              if (MTR_TRACE_TEXT(dlg_id))
               {
                 switch (ptype)
                 {
                   case MAPST_FWD_SM_IND :
-                    printf("MTR Rx: Received Forward Short Message Indication\n");
+                    MTR_trc_printf("MTR Rx: Received Forward Short Message Indication\n");
                     break;
                   case MAPST_MT_FWD_SM_IND :
-                    printf("MTR Rx: Received MT Forward Short Message Indication\n");
+                    MTR_trc_printf("MTR Rx: Received MT Forward Short Message Indication\n");
                     break;
                   case MAPST_SEND_IMSI_IND :
-                    printf("MTR Rx: Received Send IMSI Indication\n");
+                    MTR_trc_printf("MTR Rx: Received Send IMSI Indication\n");
                     break;
                   case MAPST_SND_RTIGPRS_IND :
-                    printf("MTR Rx: Received Send Routing Info for GPRS Indication\n");
+                    MTR_trc_printf("MTR Rx: Received Send Routing Info for GPRS Indication\n");
                     break;
                   case MAPST_SND_RTISM_IND :
-                    printf("MTR Rx: Received Send Routing Info for SMS Indication\n");
+                    MTR_trc_printf("MTR Rx: Received Send Routing Info for SMS Indication\n");
                     break;
                   case MAPST_PRO_UNSTR_SS_REQ_IND :
-                    printf("MTR Rx: Received ProcessUnstructuredSS-Indication\n");
+                    MTR_trc_printf("MTR Rx: Received ProcessUnstructuredSS-Indication\n");
                     break;
                   case MAPST_UNSTR_SS_REQ_CNF :
-                    printf("MTR Rx: Received UnstructuredSS-Req-Confirmation\n");
+                    MTR_trc_printf("MTR Rx: Received UnstructuredSS-Req-Confirmation\n");
                     break;
                   case MAPST_UNSTR_SS_REQ_IND :
-                    printf("MTR Rx: Received UnstructuredSS-Indication\n");
+                    MTR_trc_printf("MTR Rx: Received UnstructuredSS-Indication\n");
                     break;
                   case MAPST_UNSTR_SS_NOTIFY_IND :
-                    printf("MTR Rx: Received UnstructuredSS-Notify Indication\n");
+                    MTR_trc_printf("MTR Rx: Received UnstructuredSS-Notify Indication\n");
                     break;
                   case MAPST_ANYTIME_INT_IND :
-                    printf("MTR Rx: Received AnyTimeInterrogation Indication\n");
+                    MTR_trc_printf("MTR Rx: Received AnyTimeInterrogation Indication\n");
                     break;
                   default :
                     send_abort = 1;
@@ -485,7 +1469,7 @@ int MTR_process_map_msg(m)
                * Recover invoke id. The invoke id is used
                * when sending the Forward short message response.
                */
-              invoke_id = MTR_get_invoke_id(get_param(m), m->len);
+              invoke_id = MTR_get_invoke_id(&prs);
 
               /*
                * If recovery of the invoke id succeeded, save invoke id and
@@ -495,21 +1479,53 @@ int MTR_process_map_msg(m)
               {
                 dlg_info->invoke_id = (u8)invoke_id;
                 dlg_info->ptype = ptype;
+                MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id))->fault = MTR_FLT_UNPICKED;
+                MTR_STAT_INC(service[MTR_lat_service(ptype)]);
 
                 /*
                  * Store MSISDN if available for use with ATI Response test data lookup
+                 * and SRI for SM routing, and find the subscriber in the database
                  */
-                if (ptype == MAPST_ANYTIME_INT_IND)
-                  dlg_info->msisdn_len = MTR_get_msisdn(pptr, m->len, dlg_info->msisdn, MTR_MAX_MSISDN_SIZE);
+                if ((ptype == MAPST_ANYTIME_INT_IND) || (ptype == MAPST_SND_RTISM_IND))
+                {
+                  cold = MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id));
+                  cold->msisdn_len = MTR_get_msisdn(&prs, cold->msisdn, MTR_MAX_MSISDN_SIZE);
+                  cold->sub = MTR_sub_msisdn(cold->msisdn, cold->msisdn_len);
+                }
+                else if ((ptype == MAPST_SEND_IMSI_IND) || (ptype == MAPST_SND_RTIGPRS_IND))
+                {
+                  cold = MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id));
+                  cold->sub = 0;
+                  if (ptype == MAPST_SEND_IMSI_IND)
+                  {
+                    if ((pval = MTR_prs_find(&prs, MAPPN_msisdn, &plen)) != 0)
+                      cold->sub = MTR_sub_msisdn(pval, plen);
+                  }
+                  else if ((pval = MTR_prs_find(&prs, MAPPN_imsi, &plen)) != 0)
+                    cold->sub = MTR_sub_imsi(pval, plen);
+                }
+                else if (ptype == MAPST_MT_FWD_SM_IND)
+                {
+                  /*
+                   * A concatenated message may come a segment at a
+                   * time, all but the last with more messages to send.
+                   */
+                  cold = MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id));
+                  cold->more_msgs = (MTR_prs_find(&prs, MAPPN_more_msgs, &plen) != 0);
+                }
 
-                if ((mtr_trace) && (ptype == MAPST_FWD_SM_IND || ptype == MAPST_MT_FWD_SM_IND))
-                  print_sh_msg(m);
+                if ((MTR_TRACE_TEXT(dlg_id)) && (ptype == MAPST_FWD_SM_IND || ptype == MAPST_MT_FWD_SM_IND))
+                  print_sh_msg(&prs);
+                if ((MTR_TRACE_TEXT(dlg_id)) &&
+                    (ptype == MAPST_PRO_UNSTR_SS_REQ_IND || ptype == MAPST_UNSTR_SS_REQ_CNF ||
+                     ptype == MAPST_UNSTR_SS_REQ_IND || ptype == MAPST_UNSTR_SS_NOTIFY_IND))
+                  print_ussd(&prs);
                 dlg_info->state = MTR_S_WAIT_DELIMITER;
                 break;
               }
               else
               {
-                printf("MTR RX: No invoke ID included in the message\n");
+                MTR_trc_printf("MTR RX: No invoke ID included in the message\n");
               }
               break;
 
@@ -530,8 +1546,8 @@ int MTR_process_map_msg(m)
                * MAP-NOTICE-IND indicates some kind of error. Close the
                * dialogue and idle the state machine.
                */
-              if (mtr_trace)
-                printf("MTR Rx: Received Notice Indication\n");
+              if (MTR_TRACE_TEXT(dlg_id))
+                MTR_trc_printf("MTR Rx: Received Notice Indication\n");
               /*
                * Now send Map Close and go to idle state.
                */
@@ -544,8 +1560,8 @@ int MTR_process_map_msg(m)
               /*
                * Close indication received.
                */
-              if (mtr_trace)
-                printf("MTR Rx: Received Close Indication\n");
+              if (MTR_TRACE_TEXT(dlg_id))
+                MTR_trc_printf("MTR Rx: Received Close Indication\n");
               dlg_info->state = MTR_S_NULL;
               send_abort = 0;
               break;
@@ -583,95 +1599,21 @@ int MTR_process_map_msg(m)
                * Delimiter indication received. Now send the appropriate
                * response depending on the service primitive that was received.
                */
-              if (mtr_trace)
-                printf("MTR Rx: Received delimiter Indication\n");
-
-              switch (dlg_info->ptype)
-              {
-                case MAPST_FWD_SM_IND :
-                  MTR_ForwardSMResponse(dlg_info->map_inst, dlg_id,
-                                        dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-                case MAPST_MT_FWD_SM_IND :
-                  MTR_MT_ForwardSMResponse(dlg_info->map_inst, dlg_id,
-                                           dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-                case MAPST_SEND_IMSI_IND :
-                  MTR_SendImsiResponse(dlg_info->map_inst, dlg_id,
-                                       dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-                case MAPST_SND_RTIGPRS_IND :
-                  MTR_SendRtgInfoGprsResponse(dlg_info->map_inst, dlg_id,
-                                              dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-                case MAPST_SND_RTISM_IND :
-                  MTR_SendRtgInfoSmsResponse(dlg_info->map_inst, dlg_id,
-                                             dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-                case MAPST_PRO_UNSTR_SS_REQ_IND :
-                  MTR_Send_UnstructuredSSRequest (dlg_info->map_inst, dlg_id,
-                                              dlg_info->invoke_id);
-                  MTR_send_Delimit(dlg_info->map_inst, dlg_id);
-                                  dlg_info->state = MTR_S_WAIT_FOR_SRV_PRIM;
-                  send_abort = 0;
-                  break;
-                case MAPST_UNSTR_SS_REQ_CNF :
-                  MTR_Send_ProcessUnstructuredSSReqRsp (dlg_info->map_inst, dlg_id,
-                                              dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-                case MAPST_UNSTR_SS_REQ_IND :
-                  MTR_Send_UnstructuredSSResponse (dlg_info->map_inst, dlg_id,
-                                              dlg_info->invoke_id);
-                  MTR_send_Delimit(dlg_info->map_inst, dlg_id);
-                  dlg_info->state = MTR_S_WAIT_FOR_SRV_PRIM;
-                  send_abort = 0;
-                  break;
-                case MAPST_UNSTR_SS_NOTIFY_IND :
-                  MTR_Send_UnstructuredSSNotifyRsp (dlg_info->map_inst, dlg_id,
-                                              dlg_info->invoke_id);
-
-                  if ((dlg_info->term_mode == DLG_TERM_MODE_AUTO) ||
-                      (dlg_info->term_mode == DLG_TERM_MODE_LOCAL_CLOSE))
-                  {
-                    MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                    dlg_info->state = MTR_S_NULL;
-                  }
-                  else
-                  {
-                    MTR_send_Delimit(dlg_info->map_inst, dlg_id);
-                    dlg_info->state = MTR_S_WAIT_FOR_SRV_PRIM;
-                  }
-                  send_abort = 0;
-
-                  break;
+              if (MTR_TRACE_TEXT(dlg_id))
+                MTR_trc_printf("MTR Rx: Received delimiter Indication\n");
 
-                case MAPST_ANYTIME_INT_IND:
-                  MTR_Send_ATIResponse(dlg_info->map_inst, dlg_id,
-                                        dlg_info->invoke_id);
-                  MTR_send_MapClose(dlg_info->map_inst, dlg_id, MAPRM_normal_release);
-                  dlg_info->state = MTR_S_NULL;
-                  send_abort = 0;
-                  break;
-              }
-                break;
+              /*
+               * The response may be held back to emulate the delay of
+               * a real HLR or MSC, and is then sent when due.
+               */
+              if (dlg_info->held & (MTR_HELD_DELAY | MTR_HELD_RETRY))
+                send_abort = 1;
+              else if ((mtr_hold) &&
+                       ((hold_us = MTR_dly_sample(MTR_lat_service(dlg_info->ptype))) != 0))
+                MTR_hold_dlg(dlg_info, dlg_id, hold_us);
+              else
+                send_abort = MTR_answer(dlg_info, dlg_id);
+              break;
 
             default :
               /*
@@ -690,6 +1632,15 @@ int MTR_process_map_msg(m)
           break;
       }
       break;
+
+    case MTR_S_REFUSED :
+      /*
+       * Refused by overload control. The rest of the dialogue is
+       * dropped up to its delimiter, or whatever else ends it.
+       */
+      if (m->hdr.type == MAP_MSG_DLG_IND)
+        dlg_info->state = MTR_S_NULL;
+      break;
   }
   /*
    * If an error or unexpected event has been encountered, send abort and
@@ -701,59 +1652,423 @@ int MTR_process_map_msg(m)
     dlg_info->state = MTR_S_NULL;
 
   }
+
+  if ((in_progress) && (dlg_info->state == MTR_S_NULL))
+    MTR_dlg_ended(dlg_info, send_abort);
+
+  if ((dlg_info->held) && (dlg_info->state == MTR_S_NULL))
+    MTR_hold_stop(dlg_info, dlg_id);
+
+  if (mtr_guard_ticks != 0)
+    MTR_guard_dlg(dlg_info, dlg_id);
   return(0);
 }
 
-/******************************************************************************
- *
- * Functions to send primitive requests to the MAP module
- *
- ******************************************************************************/
-
 /*
- * MTR_send_OpenResponse
+ * MTR_respond
  *
- * Sends an open response to MAP
+ * Sends the response to the service primitive of a dialogue once its
+ * delimiter has been received, and moves the dialogue to its next
+ * state. A fault picked for the dialogue replaces or repeats the
+ * response.
  *
- * Returns zero or -1 on error.
+ * Returns non-zero if the dialogue should be aborted.
  */
-static int MTR_send_OpenResponse(instance, dlg_id, result)
-  u16 instance;        /* Destination instance */
-  u16 dlg_id;          /* Dialogue id */
-  u8  result;          /* Result (accepted/rejected) */
+static int MTR_respond(dlg, dlg_id)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
 {
-  MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG_COLD *cold;           /* Cold state info for dialogue */
+  u8   msisdn[MTR_RTE_MAX_DIGITS]; /* MSISDN digits */
+  u8   num_digits;              /* Digits in msisdn */
+  u8   cls;                     /* Class of the dialogue */
+  u8   outcome;                 /* Fault injected, MTR_FLT_xxx */
+  u8   copies;                  /* Times the response is sent */
+
+  outcome = MTR_FLT_NONE;
+  cls = MTR_lat_service(dlg->ptype);
+  if (mtr_fault)
+  {
+    /*
+     * The outcome is picked once for each service primitive, so a
+     * response that has to be built again keeps it.
+     */
+    cold = MTR_dlg_cold(dlg->map_inst, MTR_DLG_REF(dlg_id));
+    if (cold->fault == MTR_FLT_UNPICKED)
+    {
+      num_digits = MTR_rte_digits(cold->msisdn, cold->msisdn_len, msisdn);
+      cold->fault = MTR_flt_pick(cls, msisdn, num_digits, (u8)MTR_THREAD(dlg_id));
+      if (cold->fault != MTR_FLT_NONE)
+        MTR_STAT_INC(fault[cold->fault]);
+    }
+    outcome = cold->fault;
+  }
 
-  /*
-   * Get the dialogue information associated with the dlg_id
-   */
-  dlg_info = get_dialogue_info(dlg_id);
-  if (dlg_info == 0)
-    return (-1);
+  copies = 1;
+  if (outcome != MTR_FLT_NONE)
+  {
+    if (MTR_TRACE_TEXT(dlg_id))
+      MTR_trc_printf("MTR Tx: Injecting fault: %s\n", mtr_fault_name[outcome]);
+
+    switch (outcome)
+    {
+      case MTR_FLT_ABORT :
+        return(1);
+
+      case MTR_FLT_DROP :
+        /*
+         * Released locally, the peer never hears from the dialogue
+         * again.
+         */
+        MTR_send_MapClose(dlg->map_inst, dlg_id, MAPRM_prearranged_release);
+        dlg->state = MTR_S_NULL;
+        return(0);
+
+      case MTR_FLT_DUPLICATE :
+        copies = 2;
+        break;
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Open Response\n");
+      default :
+        MTR_send_user_error(dlg->map_inst, dlg_id, dlg->ptype, dlg->invoke_id,
+                            MTR_flt_error(outcome, cls));
+        MTR_send_MapClose(dlg->map_inst, dlg_id, MAPRM_normal_release);
+        dlg->state = MTR_S_NULL;
+        return(0);
+    }
+  }
+
+  for (; copies != 0; copies--)
+  {
+    switch (dlg->ptype)
+    {
+      case MAPST_FWD_SM_IND :
+        MTR_ForwardSMResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_MT_FWD_SM_IND :
+        MTR_MT_ForwardSMResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_SEND_IMSI_IND :
+        MTR_SendImsiResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_SND_RTIGPRS_IND :
+        MTR_SendRtgInfoGprsResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_SND_RTISM_IND :
+        MTR_SendRtgInfoSmsResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_PRO_UNSTR_SS_REQ_IND :
+        MTR_Send_UnstructuredSSRequest(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_UNSTR_SS_REQ_CNF :
+        MTR_Send_ProcessUnstructuredSSReqRsp(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_UNSTR_SS_REQ_IND :
+        MTR_Send_UnstructuredSSResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_UNSTR_SS_NOTIFY_IND :
+        MTR_Send_UnstructuredSSNotifyRsp(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+      case MAPST_ANYTIME_INT_IND :
+        MTR_Send_ATIResponse(dlg->map_inst, dlg_id, dlg->invoke_id);
+        break;
+    }
+  }
 
   /*
-   * Allocate a message (MSG) to send:
+   * USSD dialogues and MT-FORWARD-SM with more messages to send may
+   * continue, all others are closed.
    */
-  if ((m = getm((u16)MAP_MSG_DLG_REQ, dlg_id,
-                     NO_RESPONSE, (u16)(7 + dlg_info->ac_len))) != 0)
+  switch (dlg->ptype)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Open response
+    case MAPST_MT_FWD_SM_IND :
+      if (MTR_dlg_cold(dlg->map_inst, MTR_DLG_REF(dlg_id))->more_msgs)
+      {
+        MTR_send_Delimit(dlg->map_inst, dlg_id);
+        dlg->state = MTR_S_WAIT_FOR_SRV_PRIM;
+      }
+      else
+      {
+        MTR_send_MapClose(dlg->map_inst, dlg_id, MAPRM_normal_release);
+        dlg->state = MTR_S_NULL;
+      }
+      break;
+
+    case MAPST_FWD_SM_IND :
+    case MAPST_SEND_IMSI_IND :
+    case MAPST_SND_RTIGPRS_IND :
+    case MAPST_SND_RTISM_IND :
+    case MAPST_UNSTR_SS_REQ_CNF :
+    case MAPST_ANYTIME_INT_IND :
+      MTR_send_MapClose(dlg->map_inst, dlg_id, MAPRM_normal_release);
+      dlg->state = MTR_S_NULL;
+      break;
+
+    case MAPST_PRO_UNSTR_SS_REQ_IND :
+    case MAPST_UNSTR_SS_REQ_IND :
+      MTR_send_Delimit(dlg->map_inst, dlg_id);
+      dlg->state = MTR_S_WAIT_FOR_SRV_PRIM;
+      break;
+
+    case MAPST_UNSTR_SS_NOTIFY_IND :
+      if ((dlg->term_mode == DLG_TERM_MODE_AUTO) ||
+          (dlg->term_mode == DLG_TERM_MODE_LOCAL_CLOSE))
+      {
+        MTR_send_MapClose(dlg->map_inst, dlg_id, MAPRM_normal_release);
+        dlg->state = MTR_S_NULL;
+      }
+      else
+      {
+        MTR_send_Delimit(dlg->map_inst, dlg_id);
+        dlg->state = MTR_S_WAIT_FOR_SRV_PRIM;
+      }
+      break;
+  }
+  return(0);
+}
+
+/*
+ * MTR_answer
+ *
+ * Sends the response of a dialogue as a whole or not at all. The
+ * messages built by MTR_respond() are staged, with the open response
+ * if that could not be sent earlier. If any of them cannot be
+ * allocated those that were are released, the dialogue is left
+ * waiting as it was and its response is queued to be built again by
+ * MTR_retry().
+ *
+ * Returns non-zero if the dialogue should be aborted.
+ */
+static int MTR_answer(dlg, dlg_id)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+{
+  MTR_STAGE *stage;             /* This thread's response being built */
+  unsigned long long fails;     /* getm failures before the response */
+  u8   state;                   /* State of the dialogue before the response */
+  u8   i;                       /* Staged message index */
+  int  send_abort;              /* Set if abort to be generated */
+
+  stage = &mtr_stage;
+  state = dlg->state;
+  fails = MTR_getm_fails();
+  stage->num = 0;
+  stage->on = 1;
+  if (dlg->held & MTR_HELD_OPEN)
+    MTR_send_OpenResponse(dlg->map_inst, dlg_id, MAPRS_DLG_ACC);
+  send_abort = MTR_respond(dlg, dlg_id);
+  stage->on = 0;
+
+  if (MTR_getm_fails() == fails)
+  {
+    dlg->held &= ~MTR_HELD_OPEN;
+    for (i = 0; i < stage->num; i++)
+      MTR_queue_msg(stage->msg[i]);
+    return(send_abort);
+  }
+
+  for (i = 0; i < stage->num; i++)
+    relm((HDR *)stage->msg[i]);
+  dlg->state = state;
+  if (MTR_defer_dlg(dlg, dlg_id) != 0)
+  {
+    dlg->state = MTR_S_NULL;
+    return(1);
+  }
+  return(0);
+}
+
+/*
+ * MTR_defer_dlg
+ *
+ * Queues the response of a dialogue to be built again once messages
+ * can be allocated.
+ *
+ * Returns zero or -1 if the retry queue is full.
+ */
+static int MTR_defer_dlg(dlg, dlg_id)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+{
+  MTR_RTQ *rtq;                 /* This thread's retry queue */
+
+  rtq = &mtr_rtq;
+  if (rtq->num_dlgs == MTR_MAX_RETRY_DLGS)
+  {
+    MTR_STAT_INC(dropped);
+    return(-1);
+  }
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Out of messages, response queued for a retry\n");
+
+  rtq->dlg[(rtq->dlg_head + rtq->num_dlgs++) & (MTR_MAX_RETRY_DLGS - 1)] =
+    MTR_TMR_REF(dlg->map_inst, dlg_id);
+  MTR_dlg_cold(dlg->map_inst, MTR_DLG_REF(dlg_id))->held_ns = MTR_lat_now();
+  dlg->held |= MTR_HELD_RETRY;
+  MTR_STAT_INC(deferred);
+  MTR_retry_wait(rtq);
+  return(0);
+}
+
+/*
+ * MTR_defer_end
+ *
+ * Queues the close, abort or refusal of a dialogue that has ended,
+ * whose message could not be allocated, to be sent once messages can
+ * be.
+ *
+ * Returns zero or -1 if the retry queue is full.
+ */
+static int MTR_defer_end(dlg, dlg_id, held, param)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+  u8  held;                     /* MTR_HELD_CLOSE, _ABORT or _REFUSE */
+  u8  param;                    /* Release method, abort reason or open result */
+{
+  MTR_RTQ *rtq;                 /* This thread's retry queue */
+
+  rtq = &mtr_rtq;
+  if (rtq->num_dlgs == MTR_MAX_RETRY_DLGS)
+  {
+    MTR_STAT_INC(dropped);
+    return(-1);
+  }
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Out of messages, %s queued for a retry\n",
+                   (held == MTR_HELD_CLOSE) ? "close" :
+                   (held == MTR_HELD_ABORT) ? "abort" : "refusal");
+
+  rtq->dlg[(rtq->dlg_head + rtq->num_dlgs++) & (MTR_MAX_RETRY_DLGS - 1)] =
+    MTR_TMR_REF(dlg->map_inst, dlg_id);
+  MTR_dlg_cold(dlg->map_inst, MTR_DLG_REF(dlg_id))->end_param = param;
+  dlg->held = (u8)((dlg->held & ~MTR_HELD_END) | held);
+  MTR_STAT_INC(deferred);
+  MTR_retry_wait(rtq);
+  return(0);
+}
+
+/*
+ * MTR_retry_dlg
+ *
+ * Builds the queued response of a dialogue again, unless the dialogue
+ * has ended since, or sends its queued close, abort or refusal.
+ *
+ * Always returns zero.
+ */
+static int MTR_retry_dlg(tmr_ref)
+  u32 tmr_ref;                  /* Dialogue, from MTR_TMR_REF() */
+{
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 inst;                     /* MAP instance */
+  u16 dlg_id;                   /* Dialogue id */
+  u8  param;                    /* Release method, abort reason or open result */
+  u8  end;                      /* Close, abort or refusal queued */
+
+  inst = (u16)(tmr_ref / MTR_NUM_DLGS);
+  dlg_id = (u16)(mtr_first_dlg_id + tmr_ref % MTR_NUM_DLGS);
+  mtr_cur_inst = inst;
+  dlg = MTR_dlg_peek(inst, MTR_DLG_REF(dlg_id));
+  if (dlg == 0)
+    return(0);
+
+  /*
+   * The dialogue has ended, a new one on the id would have dropped
+   * what was queued. A close or abort that fails again is queued again
+   * by the send.
+   */
+  if (dlg->held & MTR_HELD_END)
+  {
+    param = MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id))->end_param;
+    end = dlg->held & MTR_HELD_END;
+    dlg->held &= ~MTR_HELD_END;
+    if (end & MTR_HELD_CLOSE)
+      MTR_send_MapClose(inst, dlg_id, param);
+    else if (end & MTR_HELD_ABORT)
+      MTR_send_Abort(inst, dlg_id, param);
+    else if (MTR_send_OpenResponse(inst, dlg_id, param) != 0)
+      MTR_defer_end(dlg, dlg_id, MTR_HELD_REFUSE, param);
+    return(0);
+  }
+
+  if ((!(dlg->held & MTR_HELD_RETRY)) || (dlg->state != MTR_S_WAIT_DELIMITER))
+    return(0);
+  dlg->held &= ~MTR_HELD_RETRY;
+
+  return(MTR_release(dlg, dlg_id, MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id))->held_ns));
+}
+
+/*
+ * MTR_getm_fails
+ *
+ * Returns the number of getm failures counted by the calling thread.
+ */
+static unsigned long long MTR_getm_fails()
+{
+  MTR_STAT_THR *thr;            /* This thread's counters */
+
+  thr = mtr_stat_thr ? mtr_stat_thr : MTR_stat_thread();
+  return(thr->getm_fail);
+}
+
+/******************************************************************************
+ *
+ * Functions to send primitive requests to the MAP module
+ *
+ ******************************************************************************/
+
+/*
+ * MTR_send_OpenResponse
+ *
+ * Sends an open response to MAP
+ *
+ * Returns zero or -1 on error.
+ */
+static int MTR_send_OpenResponse(instance, dlg_id, result)
+  u16 instance;        /* Destination instance */
+  u16 dlg_id;          /* Dialogue id */
+  u8  result;          /* Result (accepted/rejected) */
+{
+  MSG  *m;                      /* Pointer to message to transmit */
+  u8   *pptr;                   /* Pointer to a parameter */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG_COLD *cold;           /* Cold dialogue state information */
+  u16  len;                     /* Length of the parameter area */
+
+  /*
+   * Get the dialogue information associated with the dlg_id
+   */
+  dlg_info = get_dialogue_info(instance, dlg_id);
+  if (dlg_info == 0)
+    return (-1);
+  cold = MTR_dlg_cold(instance, MTR_DLG_REF(dlg_id));
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Open Response\n");
+
+  /*
+   * Allocate a message (MSG) to send:
+   */
+  len = (u16)(7 + cold->ac_len);
+  if (result != MAPRS_DLG_ACC)
+    len += 3;
+  if ((m = getm((u16)MAP_MSG_DLG_REQ, dlg_id, NO_RESPONSE, len)) != 0)
+  {
+    m->hdr.src = mtr_mod_id;
+    m->hdr.dst = mtr_map_id;
+    /*
+     * Format the parameter area of the message
+     *
+     * Primitive type   = Open response
      * Parameter name   = result_tag
      * Parameter length = 1
      * Parameter value  = result
      * Parameter name   = applic_context_tag
      * parameter length = len
      * parameter data   = applic_context
+     * Parameter name   = refuse_rsn_tag (refused only)
+     * Parameter length = 1
+     * Parameter value  = refuse reason
      * EOC_tag
      */
     pptr = get_param(m);
@@ -762,15 +2077,27 @@ static int MTR_send_OpenResponse(instance, dlg_id, result)
     pptr[2] = 0x01;
     pptr[3] = result;
     pptr[4] = MAPPN_applic_context;
-    pptr[5] = (u8)dlg_info->ac_len;
-    memcpy((void*)(pptr+6), (void*)dlg_info->app_context, dlg_info->ac_len);
-    pptr[6+dlg_info->ac_len] = 0x00;
+    pptr[5] = (u8)cold->ac_len;
+    memcpy((void*)(pptr+6), (void*)cold->app_context, cold->ac_len);
+    pptr += 6 + cold->ac_len;
+    if (result != MAPRS_DLG_ACC)
+    {
+      *pptr++ = MAPPN_refuse_rsn;
+      *pptr++ = 0x01;
+      *pptr++ = MTR_REFUSE_NO_REASON;
+    }
+    *pptr = 0x00;
 
     /*
      * Now send the message
      */
     MTR_send_msg(instance, m);
   }
+  else
+  {
+    MTR_STAT_INC(getm_fail);
+    return(-1);
+  }
   return(0);
 }
 
@@ -787,43 +2114,23 @@ static int MTR_ForwardSMResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
 
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Forward SM Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Forward SM Response\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 5)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_FWD_SM_RSP, dlg_id, invoke_id)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Forward SM response
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_FWD_SM_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = 0x00;
-
     /*
      * Now send the message
      */
@@ -845,58 +2152,38 @@ static int MTR_SendRtgInfoGprsResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
+  MTR_SUB_REC *sub;             /* Subscriber, 0 if not in the database */
+  u8   params[2 + MTR_SUB_SGSN_LEN]; /* Parameters after the invoke id */
 
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Send Routing Info for GPRS Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Send Routing Info for GPRS Response\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Answer with the subscriber's SGSN address if it is known.
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 12)) != 0)
+  sub = MTR_dlg_cold(instance, MTR_DLG_REF(dlg_id))->sub;
+  if ((sub != 0) && (sub->flags & MTR_SUB_F_SGSN))
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Send Routing Info for GPRS response
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Parameter name = SGSN address
-     * Parameter length = 4
-     * Parameter value:
-     *   1st octet:  address type = IPv4; addres length = 4
-     *   remaining octets = 193.195.185.113
-     *
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_SND_RTIGPRS_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = MAPPN_sgsn_address;
-    pptr[5] = 5;
-    pptr[6] = 4;
-    pptr[7] = 193;
-    pptr[8] = 195;
-    pptr[9] = 185;
-    pptr[10] = 113;
-    pptr[11] = 0x00;
+    params[0] = MAPPN_sgsn_address;
+    params[1] = sub->sgsn_len;
+    memcpy(&params[2], sub->sgsn, sub->sgsn_len);
+    return(MTR_send_srv_rsp(instance, dlg_id, MAPST_SND_RTIGPRS_RSP, invoke_id,
+                            params, (u16)(2 + sub->sgsn_len)));
+  }
 
+  /*
+   * Allocate a message (MSG) formatted from the template:
+   */
+  if ((m = MTR_tpl_getm(MTR_TPL_SND_RTIGPRS_RSP, dlg_id, invoke_id)) != 0)
+  {
     /*
      * Now send the message
      */
@@ -918,58 +2205,38 @@ static int MTR_SendImsiResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
+  MTR_SUB_REC *sub;             /* Subscriber, 0 if not in the database */
+  u8   params[2 + MTR_SUB_IMSI_LEN]; /* Parameters after the invoke id */
 
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Send IMSI Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Send IMSI Response\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Answer with the subscriber's IMSI if it is known.
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 14)) != 0)
+  sub = MTR_dlg_cold(instance, MTR_DLG_REF(dlg_id))->sub;
+  if (sub != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = send IMSI response
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Primitive name = IMSI
-     * Parameter length = 7
-     * Parameter value = 60802678000454
-
-     * Parameter name = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_SEND_IMSI_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = MAPPN_imsi;
-    pptr[5] = 7;
-    pptr[6] = 0x06;
-    pptr[7] = 0x08;
-    pptr[8] = 0x62;
-    pptr[9] = 0x87;
-    pptr[10] = 0x00;
-    pptr[11] = 0x40;
-    pptr[12] = 0x45;
-    pptr[13] = 0x00;
+    params[0] = MAPPN_imsi;
+    params[1] = sub->imsi_len;
+    memcpy(&params[2], sub->imsi_tbcd, sub->imsi_len);
+    return(MTR_send_srv_rsp(instance, dlg_id, MAPST_SEND_IMSI_RSP, invoke_id,
+                            params, (u16)(2 + sub->imsi_len)));
+  }
 
+  /*
+   * Allocate a message (MSG) formatted from the template:
+   */
+  if ((m = MTR_tpl_getm(MTR_TPL_SEND_IMSI_RSP, dlg_id, invoke_id)) != 0)
+  {
     /*
      * Now send the message
      */
@@ -991,43 +2258,23 @@ static int MTR_MT_ForwardSMResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
 
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending MT Forward SM Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending MT Forward SM Response\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 5)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_MT_FWD_SM_RSP, dlg_id, invoke_id)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = MT Forward SM response
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_MT_FWD_SM_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = 0x00;
-
     /*
      * Now send the message
      */
@@ -1050,22 +2297,81 @@ static int MTR_SendRtgInfoSmsResponse(instance, dlg_id, invoke_id)
 {
   MSG  *m;                      /* Pointer to message to transmit */
   u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG_COLD *cold;           /* Cold dialogue state information */
+  MTR_RTE route;                /* Route of the MSISDN */
+  MTR_SUB_REC *sub;             /* Subscriber, 0 if not in the database */
+  u8   params[4 + MTR_SUB_IMSI_LEN + MTR_SUB_MSC_LEN]; /* Parameters after the invoke id */
+  u8   msisdn[MTR_RTE_MAX_DIGITS]; /* MSISDN digits */
+  u8   num_digits;              /* Digits in msisdn */
+  u8   imsi[MTR_RTE_IMSI_DIGITS]; /* IMSI digits */
+  u8   msc[MTR_RTE_MAX_DIGITS]; /* MSC number digits */
+  u8   msc_len;                 /* Digits in msc */
+  u8   error;                   /* MAP user error, 0 to answer */
+  u16  len;                     /* Length of the parameter area */
 
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Send Routing Info for SMS Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Send Routing Info for SMS Response\n\r");
+
+  /*
+   * Answer with the subscriber's IMSI and MSC if they are known.
+   */
+  cold = MTR_dlg_cold(instance, MTR_DLG_REF(dlg_id));
+  sub = cold->sub;
+  if ((sub != 0) && (sub->flags & MTR_SUB_F_MSC))
+  {
+    len = 0;
+    params[len++] = MAPPN_imsi;
+    params[len++] = sub->imsi_len;
+    memcpy(&params[len], sub->imsi_tbcd, sub->imsi_len);
+    len += sub->imsi_len;
+    params[len++] = MAPPN_msc_num;
+    params[len++] = sub->msc_len;
+    memcpy(&params[len], sub->msc, sub->msc_len);
+    len += sub->msc_len;
+    return(MTR_send_srv_rsp(instance, dlg_id, MAPST_SND_RTISM_RSP, invoke_id, params, len));
+  }
+
+  /*
+   * Otherwise look the MSISDN up in the number ranges.
+   */
+  if (((num_digits = MTR_rte_digits(cold->msisdn, cold->msisdn_len, msisdn)) == 0) ||
+      (MTR_rte_find(msisdn, num_digits, &route) != 0))
+  {
+    /*
+     * Allocate a message (MSG) formatted from the template:
+     */
+    if ((m = MTR_tpl_getm(MTR_TPL_SND_RTISM_RSP, dlg_id, invoke_id)) != 0)
+    {
+      /*
+       * Now send the message
+       */
+      MTR_send_msg(instance, m);
+    }
+    return(0);
+  }
+
+  error = route.error;
+  msc_len = route.msc_len;
+  memcpy(msc, route.msc, msc_len);
+  MTR_rte_imsi(&route, msisdn, num_digits, imsi);
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Routed with %s %u\n", error ? "user error" : "MSC digits", error ? error : msc_len);
 
   /*
    * Allocate a message (MSG) to send:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 23)) != 0)
+  len = error ? (4 + 3 + 1) :
+                (u16)(4 + 2 + (MTR_RTE_IMSI_DIGITS + 1) / 2 + 3 + (msc_len + 1) / 2 + 1);
+  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, len)) != 0)
   {
     m->hdr.src = mtr_mod_id;
     m->hdr.dst = mtr_map_id;
@@ -1073,162 +2379,188 @@ static int MTR_SendRtgInfoSmsResponse(instance, dlg_id, invoke_id)
     /*
      * Format the parameter area of the message
      *
-     * Primitive type   = Send Routing Info for SMS response
-     *
-     * Parameter name   = invoke ID
+     * Primitive type   = SRI for SM response
+     * Parameter name   = invoke_id
      * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Parameter name = IMSI
-     * Parameter length = 7
-     * Parameter value:
-     *   remaining octets = 60802678000454
-     *   TBCD digits
-     *
-     * Parameter name = MSC Number
-     * Parameter length = 7
-     * Parameter value:
-     *   remaining octets = 375290000001
-	 *   TBCD digits
+     * Parameter value  = invoke_id
      *
-     * Parameter name   = terminator (0x00)
+     * followed either by the user error, or by the IMSI and the MSC
+     * number (an address string, international ISDN)
      */
     pptr = get_param(m);
     pptr[0] = MAPST_SND_RTISM_RSP;
     pptr[1] = MAPPN_invoke_id;
     pptr[2] = 0x01;
     pptr[3] = invoke_id;
-    pptr[4] = MAPPN_imsi;
-    pptr[5] = 7;
-    pptr[6] = 0x06; // 60802678000454
-    pptr[7] = 0x08;
-    pptr[8] = 0x62;
-    pptr[9] = 0x87;
-    pptr[10] = 0x00;
-    pptr[11] = 0x40;
-    pptr[12] = 0x45;
-    pptr[13] = MAPPN_msc_num;
-    pptr[14] = 7;
-    pptr[15] = 0x91; // ton/npi = 1/1
-    pptr[16] = 0x73; // 375290000002
-    pptr[17] = 0x25;
-    pptr[18] = 0x09;
-    pptr[19] = 0x00;
-    pptr[20] = 0x00;
-    pptr[21] = 0x20;
-    pptr[22] = 0x00;
+    len = 4;
+    if (error)
+    {
+      pptr[len++] = MAPPN_user_err;
+      pptr[len++] = 0x01;
+      pptr[len++] = error;
+    }
+    else
+    {
+      pptr[len++] = MAPPN_imsi;
+      pptr[len] = MTR_put_tbcd(&pptr[len + 1], imsi, MTR_RTE_IMSI_DIGITS);
+      len += 1 + pptr[len];
+      pptr[len++] = MAPPN_msc_num;
+      pptr[len] = (u8)(1 + MTR_put_tbcd(&pptr[len + 2], msc, msc_len));
+      pptr[len + 1] = 0x91;
+      len += 1 + pptr[len];
+    }
+    pptr[len] = 0x00;
 
     /*
      * Now send the message
      */
     MTR_send_msg(instance, m);
   }
+  else
+    MTR_STAT_INC(getm_fail);
   return(0);
 }
 
-/* MTR_Send_UnstructuredSSRequest
- * Formats and sends an UnstructuredSS-Request message
- * in response to a received ProcessUnstructuredSS-Request.
+/*
+ * MTR_put_tbcd
+ *
+ * Packs digits two to an octet, low nibble first, padding an odd
+ * number of digits with a filler.
+ *
+ * Returns the number of octets written.
  */
-
- static int MTR_Send_UnstructuredSSRequest(instance, dlg_id, invoke_id)
-  u16 instance;        /* Destination instance */
-  u16 dlg_id;          /* Dialogue id */
-  u8  invoke_id;       /* Invoke_id */
+static u8 MTR_put_tbcd(dst, digits, num_digits)
+  u8 *dst;              /* Destination */
+  u8 *digits;           /* Digits, one per octet */
+  u8 num_digits;        /* Number of digits */
 {
-  MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
-  /*
-   *  Get the dialogue information associated with the dlg_id
-   */
-  dlg_info = get_dialogue_info(dlg_id);
-  if (dlg_info == 0)
-    return (-1);
+  u8 i;                 /* Digit index */
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Send_UnstructuredSS-Request\n\r");
-
-  /*
-   * Allocate a message (MSG) to send:
-   */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 47)) != 0)
-  {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
+  for (i = 0; i < num_digits; i += 2)
+    dst[i / 2] = (u8)(digits[i] | (((i + 1 < num_digits) ? digits[i + 1] : 0x0f) << 4));
+  return((u8)((num_digits + 1) / 2));
+}
 
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Send_UnstructuredSS-Request
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Parameter name = USSD Data Coding Scheme
-     * Parameter length = 1
-     * Parameter value  = 'GSM default alphabet' 00001111
-     *
-     * Parameter name = USSD String
-     *
-     * Use the MTU function 'MTU_USSD_str_to_def_alph' to verify string encoding
-     * USSD string below = 'XY Telecom <LF>'
-     *                     '1. Balance <LF>'
-     *                     '2. Texts Remaining'
-     *
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_UNSTR_SS_REQ_REQ;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = MAPPN_USSD_coding;
-    pptr[5] = 0x01;
-    pptr[6] = 0x0F;  /* USSD coding set to 'GSM default alphabet' 00001111 */
-    pptr[7] = MAPPN_USSD_string;
-    pptr[8] = 37;
-    pptr[9] = 0xD8;
-    pptr[10] = 0x2C;
-    pptr[11] = 0x88;
-    pptr[12] = 0x5A;
-    pptr[13] = 0x66;
-    pptr[14] = 0x97;
-    pptr[15] = 0xC7;
-    pptr[16] = 0xEF;
-    pptr[17] = 0xB6;
-    pptr[18] = 0x02;
-    pptr[19] = 0x14;
-    pptr[20] = 0x73;
-    pptr[21] = 0x81;
-    pptr[22] = 0x84;
-    pptr[23] = 0x61;
-    pptr[24] = 0x76;
-    pptr[25] = 0xD8;
-    pptr[26] = 0x3D;
-    pptr[27] = 0x2E;
-    pptr[28] = 0x2B;
-    pptr[29] = 0x40;
-    pptr[30] = 0x32;
-    pptr[31] = 0x17;
-    pptr[32] = 0x88;
-    pptr[33] = 0x5A;
-    pptr[34] = 0xC6;
-    pptr[35] = 0xD3;
-    pptr[36] = 0xE7;
-    pptr[37] = 0x20;
-    pptr[38] = 0x69;
-    pptr[39] = 0xB9;
-    pptr[40] = 0x1D;
-    pptr[41] = 0x4E;
-    pptr[42] = 0xBB;
-    pptr[43] = 0xD3;
-    pptr[44] = 0xEE;
-    pptr[45] = 0x73;
-    pptr[46] = 0x00;
+/*
+ * MTR_send_srv_rsp
+ *
+ * Sends a service response made of the invoke id and the given
+ * parameters, for responses whose content is not constant.
+ *
+ * Always returns zero.
+ */
+static int MTR_send_srv_rsp(instance, dlg_id, ptype, invoke_id, params, len)
+  u16 instance;         /* Destination instance */
+  u16 dlg_id;           /* Dialogue id */
+  u8  ptype;            /* Primitive type */
+  u8  invoke_id;        /* Invoke_id */
+  u8  *params;          /* Encoded parameters after the invoke id */
+  u16 len;              /* Length of params */
+{
+  MSG  *m;              /* Pointer to message to transmit */
+  u8   *pptr;           /* Pointer to the parameter area */
+
+  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, (u16)(4 + len + 1))) == 0)
+  {
+    MTR_STAT_INC(getm_fail);
+    return(0);
+  }
+  m->hdr.src = mtr_mod_id;
+  m->hdr.dst = mtr_map_id;
+
+  pptr = get_param(m);
+  pptr[0] = ptype;
+  pptr[1] = MAPPN_invoke_id;
+  pptr[2] = 0x01;
+  pptr[3] = invoke_id;
+  memcpy(&pptr[4], params, len);
+  pptr[4 + len] = 0x00;
+
+  MTR_send_msg(instance, m);
+  return(0);
+}
+
+/*
+ * MTR_send_user_error
+ *
+ * Sends the response to a service primitive as a MAP user error.
+ *
+ * Always returns zero.
+ */
+static int MTR_send_user_error(instance, dlg_id, ptype, invoke_id, error)
+  u16 instance;         /* Destination instance */
+  u16 dlg_id;           /* Dialogue id */
+  u8  ptype;            /* Service primitive answered */
+  u8  invoke_id;        /* Invoke_id */
+  u8  error;            /* MAP user error */
+{
+  u8   params[6];       /* User error parameter and its cause */
+  u8   len;             /* Length of params */
+  u8   rsp;             /* Response primitive type */
+
+  switch (ptype)
+  {
+    case MAPST_FWD_SM_IND :             rsp = MAPST_FWD_SM_RSP;           break;
+    case MAPST_MT_FWD_SM_IND :          rsp = MAPST_MT_FWD_SM_RSP;        break;
+    case MAPST_SEND_IMSI_IND :          rsp = MAPST_SEND_IMSI_RSP;        break;
+    case MAPST_SND_RTIGPRS_IND :        rsp = MAPST_SND_RTIGPRS_RSP;      break;
+    case MAPST_SND_RTISM_IND :          rsp = MAPST_SND_RTISM_RSP;        break;
+    case MAPST_PRO_UNSTR_SS_REQ_IND :
+    case MAPST_UNSTR_SS_REQ_CNF :       rsp = MAPST_PRO_UNSTR_SS_REQ_RSP; break;
+    case MAPST_UNSTR_SS_REQ_IND :
+    case MAPST_UNSTR_SS_NOTIFY_IND :    rsp = MAPST_UNSTR_SS_REQ_RSP;     break;
+    case MAPST_ANYTIME_INT_IND :        rsp = MAPST_ANYTIME_INT_RSP;      break;
+    default :
+      return(0);
+  }
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending user error %u\n", error);
+
+  params[0] = MAPPN_user_err;
+  params[1] = 0x01;
+  params[2] = error;
+  len = 3;
+
+  /*
+   * sm-DeliveryFailure must carry its cause.
+   */
+  if (error == MTR_FLT_ERR_SM_FAILURE)
+  {
+    params[len++] = MAPPN_sm_deliv_fail_cause;
+    params[len++] = 0x01;
+    params[len++] = MTR_FLT_CAUSE_MEM_FULL;
+  }
+  return(MTR_send_srv_rsp(instance, dlg_id, rsp, invoke_id, params, len));
+}
 
+/* MTR_Send_UnstructuredSSRequest
+ * Formats and sends an UnstructuredSS-Request message
+ * in response to a received ProcessUnstructuredSS-Request.
+ */
 
+ static int MTR_Send_UnstructuredSSRequest(instance, dlg_id, invoke_id)
+  u16 instance;        /* Destination instance */
+  u16 dlg_id;          /* Dialogue id */
+  u8  invoke_id;       /* Invoke_id */
+{
+  MSG  *m;                      /* Pointer to message to transmit */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
+  /*
+   *  Get the dialogue information associated with the dlg_id
+   */
+  dlg_info = get_dialogue_info(instance, dlg_id);
+  if (dlg_info == 0)
+    return (-1);
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Send_UnstructuredSS-Request\n\r");
+
+  /*
+   * Allocate a message (MSG) formatted from the template:
+   */
+  if ((m = MTR_tpl_getm(MTR_TPL_UNSTR_SS_REQ_REQ, dlg_id, invoke_id)) != 0)
+  {
     /*
      * Now send the message
      */
@@ -1248,76 +2580,22 @@ static int MTR_SendRtgInfoSmsResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Send_UnstructuredSS-Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Send_UnstructuredSS-Response\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 27)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_UNSTR_SS_REQ_RSP, dlg_id, invoke_id)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = MAPST_UNSTR_SS_IND_RSP
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Parameter name = USSD Data Coding Scheme
-     * Parameter length = 1
-     * Parameter value  = 'GSM default alphabet' 00001111
-     *
-     * Parameter name = USSD String
-     *
-     * Use the MTU function 'MTU_USSD_str_to_def_alph' to verify string encoding
-     * USSD string below = 'This is sample text'
-     *
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_UNSTR_SS_REQ_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = MAPPN_USSD_coding;
-    pptr[5] = 0x01;
-    pptr[6] = 0x0F;  /* USSD coding set to 'GSM default alphabet' 00001111 */
-    pptr[7] = MAPPN_USSD_string;
-    pptr[8] = 17;
-    pptr[9] = 0x54;
-    pptr[10] = 0x74;
-    pptr[11] = 0x7a;
-    pptr[12] = 0x0e;
-    pptr[13] = 0x4a;
-    pptr[14] = 0xcf;
-    pptr[15] = 0x41;
-    pptr[16] = 0xf3;
-    pptr[17] = 0x70;
-    pptr[18] = 0x1b;
-    pptr[19] = 0xce;
-    pptr[20] = 0x2e;
-    pptr[21] = 0x83;
-    pptr[22] = 0xe8;
-    pptr[23] = 0x65;
-    pptr[24] = 0x3c;
-    pptr[25] = 0x1d;
-
-    pptr[26] = 0x00;
-
     /*
      * Now send the message
      */
@@ -1337,74 +2615,22 @@ static int MTR_SendRtgInfoSmsResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Send_UnstructuredSS-Request\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Send_UnstructuredSS-Request\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 26)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_PRO_UNSTR_SS_REQ_RSP, dlg_id, invoke_id)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = ProcessUnstructuredSSReq-Rsp
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Parameter name = USSD Data Coding Scheme
-     * Parameter length = 1
-     * Parameter value  = 'GSM default alphabet' 00001111
-     *
-     * Parameter name = USSD String
-     *
-     * Use the MTU function 'MTU_USSD_str_to_def_alph' to verify string encoding
-     * USSD string below = 'Your balance = 350'
-     *
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_PRO_UNSTR_SS_REQ_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = MAPPN_USSD_coding;
-    pptr[5] = 0x01;
-    pptr[6] = 0x0F;  /* USSD coding set to 'GSM default alphabet' 00001111 */
-    pptr[7] = MAPPN_USSD_string;
-    pptr[8] = 16;
-    pptr[9] = 0xD9;
-    pptr[10] = 0x77;
-    pptr[11] = 0x5D;
-    pptr[12] = 0x0E;
-    pptr[13] = 0x12;
-    pptr[14] = 0x87;
-    pptr[15] = 0xD9;
-    pptr[16] = 0x61;
-    pptr[17] = 0xF7;
-    pptr[18] = 0xB8;
-    pptr[19] = 0x0C;
-    pptr[20] = 0xEA;
-    pptr[21] = 0x81;
-    pptr[22] = 0x66;
-    pptr[23] = 0x35;
-    pptr[24] = 0x58;
-    pptr[25] = 0x00;
-
     /*
      * Now send the message
      */
@@ -1424,45 +2650,22 @@ static int MTR_SendRtgInfoSmsResponse(instance, dlg_id, invoke_id)
   u8  invoke_id;       /* Invoke_id */
 {
   MSG  *m;                      /* Pointer to message to transmit */
-  u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending UnstructuredSS-Notify Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending UnstructuredSS-Notify Response\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 5)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_UNSTR_SS_NOTIFY_RSP, dlg_id, invoke_id)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     *
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPST_UNSTR_SS_REQ_RSP;
-    pptr[1] = MAPPN_invoke_id;
-    pptr[2] = 0x01;
-    pptr[3] = invoke_id;
-    pptr[4] = 0x00;
-
     /*
      * Now send the message
      */
@@ -1485,76 +2688,57 @@ static int MTR_Send_ATIResponse(instance, dlg_id, invoke_id)
 {
   MSG  *m;                      /* Pointer to message to transmit */
   u8   *pptr;                   /* Pointer to a parameter */
-  dlg_info *dlg_info;           /* Pointer to dialogue state information */
-  u8   len = 0;
+  MTR_DLG *dlg_info;           /* Pointer to dialogue state information */
+  MTR_DLG_COLD *cold;           /* Cold dialogue state information */
   u8   ati_index = 0;
 
   /*
    *  Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending ATI Response\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending ATI Response\n\r");
 
   /*
    * See if we have MSISDN to use as key into look-up.
    */
-  if (dlg_info->msisdn_len != 0)
+  cold = MTR_dlg_cold(instance, MTR_DLG_REF(dlg_id));
+  if (cold->msisdn_len != 0)
   {
     /*
      * Find the last digit and use as index into sample data.
      */
-    if ((dlg_info->msisdn[dlg_info->msisdn_len - 1] >> 4) == 0xf)
-        ati_index = ((dlg_info->msisdn[dlg_info->msisdn_len - 1]) & 0xf);
+    if ((cold->msisdn[cold->msisdn_len - 1] >> 4) == 0xf)
+        ati_index = ((cold->msisdn[cold->msisdn_len - 1]) & 0xf);
     else
-        ati_index = (dlg_info->msisdn[dlg_info->msisdn_len - 1] >> 4);
+        ati_index = (cold->msisdn[cold->msisdn_len - 1] >> 4);
 
     if (ati_index >= MTR_ATI_RSP_NUM_OF_RSP)
        ati_index = 0;
   }
 
-  if (mtr_trace)
-    printf("Using ATI sample data index %i\n", ati_index);
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("Using ATI sample data index %i\n", ati_index);
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, 15)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_ANYTIME_INT_RSP, dlg_id, invoke_id)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
     /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = send ATI response
-     *
-     * Parameter name   = invoke ID
-     * Parameter length = 1
-     * Parameter value  = invoke ID
-     *
-     * Parameter name = terminator
+     * Patch in the geographical information for this subscriber, from
+     * the database if it is there.
      */
     pptr = get_param(m);
-    pptr[len++] = MAPST_ANYTIME_INT_RSP;
-    pptr[len++] = MAPPN_invoke_id;
-    pptr[len++] = 0x01;
-    pptr[len++] = invoke_id;
-
-    pptr[len++] = MAPPN_geog_info;
-    pptr[len++] = 0x8;
-    memcpy(&pptr[len], mtr_ati_rsp_data[ati_index], 8);
-
-    /*
-     * Length is always 8
-     */
-    len += 8;
-    pptr[len++] = 0x00;
-
-
+    if ((cold->sub != 0) && (cold->sub->flags & MTR_SUB_F_GEOG))
+      memcpy(&pptr[MTR_tpl_field(MTR_TPL_ANYTIME_INT_RSP, MAPPN_geog_info)],
+             cold->sub->geog, MTR_SUB_GEOG_LEN);
+    else
+      memcpy(&pptr[MTR_tpl_field(MTR_TPL_ANYTIME_INT_RSP, MAPPN_geog_info)],
+             mtr_ati_rsp_data[ati_index], MTR_ATI_RSP_SIZE);
 
     /*
      * Now send the message
@@ -1567,9 +2751,10 @@ static int MTR_Send_ATIResponse(instance, dlg_id, invoke_id)
 /*
  * MTR_send_MapClose
  *
- * Sends a Close message to MAP.
+ * Sends a Close message to MAP. Unless it is part of a response being
+ * built, a close that cannot be allocated is queued for a retry.
  *
- * Always returns zero.
+ * Returns zero or -1 if the message could not be allocated.
  */
 static int MTR_send_MapClose(instance, dlg_id, method)
   u16 instance;        /* Destination instance */
@@ -1578,56 +2763,47 @@ static int MTR_send_MapClose(instance, dlg_id, method)
 {
   MSG  *m;                   /* Pointer to message to transmit */
   u8   *pptr;                /* Pointer to a parameter */
-  dlg_info *dlg_info;        /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;        /* Pointer to dialogue state information */
 
   /*
    * Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Close Request\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Close Request\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_DLG_REQ, dlg_id, NO_RESPONSE, 5)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_CLOSE_REQ, dlg_id, 0)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Close Request
-     * Parameter name   = release method tag
-     * Parameter length = 1
-     * Parameter value  = release method
-     * Parameter name   = terminator
-     */
     pptr = get_param(m);
-    pptr[0] = MAPDT_CLOSE_REQ;
-    pptr[1] = MAPPN_release_method;
-    pptr[2] = 0x01;
-    pptr[3] = method;
-    pptr[4] = 0x00;
+    pptr[MTR_tpl_field(MTR_TPL_CLOSE_REQ, MAPPN_release_method)] = method;
 
     /*
      * Now send the message
      */
     MTR_send_msg(dlg_info->map_inst, m);
   }
+  else
+  {
+    if (!mtr_stage.on)
+      MTR_defer_end(dlg_info, dlg_id, MTR_HELD_CLOSE, method);
+    return(-1);
+  }
   return(0);
 }
 
 /*
  * MTR_send_Abort
  *
- * Sends an abort message to MAP.
+ * Sends an abort message to MAP. Unless it is part of a response being
+ * built, an abort that cannot be allocated is queued for a retry.
  *
- * Always returns zero.
+ * Returns zero or -1 if the message could not be allocated.
  */
 static int MTR_send_Abort(instance, dlg_id, reason)
   u16 instance;         /* Destination instance */
@@ -1636,47 +2812,38 @@ static int MTR_send_Abort(instance, dlg_id, reason)
 {
   MSG  *m;              /* Pointer to message to transmit */
   u8   *pptr;           /* Pointer to a parameter */
-  dlg_info *dlg_info;   /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;   /* Pointer to dialogue state information */
 
   /*
    * Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending User Abort Request\n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending User Abort Request\n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_DLG_REQ, dlg_id, NO_RESPONSE, 5)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_U_ABORT_REQ, dlg_id, 0)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Close Request
-     * Parameter name   = user reason tag
-     * Parameter length = 1
-     * Parameter value  = reason
-     * Parameter name   = terminator
-     */
     pptr = get_param(m);
-    pptr[0] = MAPDT_U_ABORT_REQ;
-    pptr[1] = MAPPN_user_rsn;
-    pptr[2] = 0x01;
-    pptr[3] = reason;
-    pptr[4] = 0x00;
+    pptr[MTR_tpl_field(MTR_TPL_U_ABORT_REQ, MAPPN_user_rsn)] = reason;
+    mtr_inst_cnt[MTR_THREAD(dlg_id)].aborted[instance]++;
 
     /*
      * Now send the message
      */
     MTR_send_msg(dlg_info->map_inst, m);
   }
+  else
+  {
+    if (!mtr_stage.on)
+      MTR_defer_end(dlg_info, dlg_id, MTR_HELD_ABORT, reason);
+    return(-1);
+  }
   return(0);
 }
 
@@ -1692,40 +2859,23 @@ static int MTR_send_Delimit(instance, dlg_id)
   u16 dlg_id;           /* Dialogue id */
 {
   MSG  *m;              /* Pointer to message to transmit */
-  u8   *pptr;           /* Pointer to a parameter */
-  dlg_info *dlg_info;   /* Pointer to dialogue state information */
+  MTR_DLG *dlg_info;   /* Pointer to dialogue state information */
 
   /*
    * Get the dialogue information associated with the dlg_id
    */
-  dlg_info = get_dialogue_info(dlg_id);
+  dlg_info = get_dialogue_info(instance, dlg_id);
   if (dlg_info == 0)
     return (-1);
 
-  if (mtr_trace)
-    printf("MTR Tx: Sending Delimit \n\r");
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Sending Delimit \n\r");
 
   /*
-   * Allocate a message (MSG) to send:
+   * Allocate a message (MSG) formatted from the template:
    */
-  if ((m = getm((u16)MAP_MSG_DLG_REQ, dlg_id, NO_RESPONSE, 5)) != 0)
+  if ((m = MTR_tpl_getm(MTR_TPL_DELIMITER_REQ, dlg_id, 0)) != 0)
   {
-    m->hdr.src = mtr_mod_id;
-    m->hdr.dst = mtr_map_id;
-
-    /*
-     * Format the parameter area of the message
-     *
-     * Primitive type   = Delimit Request
-     * Parameter name   = user reason tag
-     * Parameter length = 1
-     * Parameter value  = reason
-     * Parameter name   = terminator
-     */
-    pptr = get_param(m);
-    pptr[0] = MAPDT_DELIMITER_REQ;
-    pptr[1] = 0x00;
-
     /*
      * Now send the message
      */
@@ -1735,8 +2885,9 @@ static int MTR_send_Delimit(instance, dlg_id)
 }
 
 /*
- * MTR_send_msg sends a MSG. On failure the
- * message is released and the user notified.
+ * MTR_send_msg sends a MSG. While a response is being built
+ * the message is only staged, and is sent by MTR_answer() once
+ * the whole response is built.
  *
  * Always returns zero.
  */
@@ -1744,20 +2895,227 @@ static int MTR_send_msg(instance, m)
   u16   instance;       /* Destination instance */
   MSG   *m;             /* MSG to send */
 {
+  MTR_STAGE *stage;     /* This thread's response being built */
+
   GCT_set_instance((unsigned int)instance, (HDR*)m);
-  MTR_trace_msg("MTR Tx:", m);
+
+  stage = &mtr_stage;
+  if ((stage->on) && (stage->num < MTR_MAX_STAGE))
+  {
+    stage->msg[stage->num++] = m;
+    return(0);
+  }
+  return(MTR_queue_msg(m));
+}
+
+/*
+ * MTR_queue_msg traces and sends a MSG.
+ *
+ * In batch mode the message is queued instead and sent by
+ * MTR_flush_msgs().
+ *
+ * Always returns zero.
+ */
+static int MTR_queue_msg(m)
+  MSG   *m;             /* MSG to send */
+{
+  struct timespec now;  /* Current time */
+  MTR_TXQ *txq;         /* This thread's Tx batch */
+
+  MTR_trace_msg(MTR_TRC_TX, m);
+  MTR_lat_sent();
+  MTR_STAT_INC(tx);
+
+  if (mtr_batch_size > 1)
+  {
+    txq = &mtr_txq;
+    if (txq->num == 0)
+      clock_gettime(CLOCK_MONOTONIC, &txq->first);
+    txq->msg[txq->num++] = m;
+
+    /*
+     * Send early if the batch is full or the oldest message
+     * has waited long enough.
+     */
+    if (txq->num == MTR_MAX_TX_BATCH)
+      return(MTR_flush_msgs());
+    if (mtr_flush_us != 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (((now.tv_sec - txq->first.tv_sec) * 1000000 +
+           (now.tv_nsec - txq->first.tv_nsec) / 1000) >= (long)mtr_flush_us)
+        return(MTR_flush_msgs());
+    }
+    return(0);
+  }
+
+  return(MTR_gct_send(m));
+}
+
+/*
+ * MTR_gct_send sends a MSG to MAP. A message that cannot be
+ * sent, or would overtake messages still waiting for a retry,
+ * is queued for MTR_retry(). If the retry queue is full the
+ * message is released and counted as dropped.
+ *
+ * Returns zero or -1 if the message was released.
+ */
+static int MTR_gct_send(m)
+  MSG   *m;             /* MSG to send */
+{
+  MTR_RTQ *rtq;         /* This thread's retry queue */
+
+  rtq = &mtr_rtq;
+  if (rtq->num_msgs == 0)
+  {
+    if (GCT_send(m->hdr.dst, (HDR *)m) == 0)
+      return(0);
+    MTR_STAT_INC(send_fail);
+  }
+
+  if (rtq->num_msgs == MTR_MAX_RETRY_MSGS)
+  {
+    MTR_STAT_INC(dropped);
+    relm((HDR *)m);
+    return(-1);
+  }
+
+  rtq->msg[(rtq->msg_head + rtq->num_msgs++) & (MTR_MAX_RETRY_MSGS - 1)] = m;
+  MTR_STAT_INC(deferred);
+  MTR_retry_wait(rtq);
+  return(0);
+}
+
+/*
+ * MTR_retry_wait marks the start of a shortage of messages,
+ * or of room on the MAP queue, when the first message or
+ * response is queued for a retry.
+ *
+ * Always returns zero.
+ */
+static int MTR_retry_wait(rtq)
+  MTR_RTQ *rtq;         /* This thread's retry queue */
+{
+  if (rtq->exhausted)
+    return(0);
+
+  MTR_STAT_INC(exhausted);
+  rtq->exhausted = 1;
+  rtq->backoff_us = MTR_RETRY_MIN_US;
+  rtq->due_ns = MTR_lat_now() + MTR_RETRY_MIN_US * 1000ULL;
+  return(0);
+}
+
+/*
+ * MTR_retry_idle sleeps until the next retry is due if the calling
+ * thread has anything queued for a retry. Threads call it instead
+ * of blocking while idle. Messages arriving meanwhile wait for the
+ * back-off, their responses could not be sent any sooner.
+ *
+ * Returns non-zero if anything is queued.
+ */
+int MTR_retry_idle()
+{
+  MTR_RTQ *rtq;         /* This thread's retry queue */
+  unsigned long long now; /* Current time */
+  struct timespec nap;  /* Time to wait */
+
+  rtq = &mtr_rtq;
+  if (!rtq->exhausted)
+    return(0);
+
+  now = MTR_lat_now();
+  if (now < rtq->due_ns)
+  {
+    nap.tv_sec = (time_t)((rtq->due_ns - now) / 1000000000ULL);
+    nap.tv_nsec = (long)((rtq->due_ns - now) % 1000000000ULL);
+    nanosleep(&nap, NULL);
+  }
+  return(1);
+}
+
+/*
+ * MTR_retry sends the messages, then builds the responses, that
+ * this thread has queued, oldest first, once the back-off has
+ * passed. It stops at the first message that still cannot be
+ * sent and doubles the back-off. The thread loop calls it on
+ * every turn, and polls rather than blocks while anything is
+ * queued.
+ *
+ * Returns the number of messages and responses retried.
+ */
+static int MTR_retry()
+{
+  MTR_RTQ *rtq;         /* This thread's retry queue */
+  MSG   *m;             /* Message to send */
+  unsigned long long now; /* Current time */
+  u32   num;            /* Responses to retry */
+  u32   ref;            /* Dialogue, from MTR_TMR_REF() */
+  int   retried;        /* Messages and responses retried */
+
+  rtq = &mtr_rtq;
+  if (!rtq->exhausted)
+    return(0);
+  now = MTR_lat_now();
+  if (now < rtq->due_ns)
+    return(0);
+
+  for (retried = 0; rtq->num_msgs != 0; retried++)
+  {
+    m = rtq->msg[rtq->msg_head];
+    if (GCT_send(m->hdr.dst, (HDR *)m) != 0)
+    {
+      MTR_STAT_INC(send_fail);
+      break;
+    }
+    rtq->msg_head = (rtq->msg_head + 1) & (MTR_MAX_RETRY_MSGS - 1);
+    rtq->num_msgs--;
+  }
 
   /*
-   * Now try to send the message, if we are successful then we do not need to
-   * release the message.  If we are unsuccessful then we do need to release it.
+   * A response that is short of messages again goes to the back of
+   * the queue, so each is tried once per turn at most.
    */
+  for (num = rtq->num_dlgs; (num != 0) && (rtq->num_msgs == 0); num--, retried++)
+  {
+    ref = rtq->dlg[rtq->dlg_head];
+    rtq->dlg_head = (rtq->dlg_head + 1) & (MTR_MAX_RETRY_DLGS - 1);
+    rtq->num_dlgs--;
+    MTR_retry_dlg(ref);
+  }
 
-  if (GCT_send(m->hdr.dst, (HDR *)m) != 0)
+  if ((rtq->num_msgs == 0) && (rtq->num_dlgs == 0))
   {
-    if (mtr_trace)
-      fprintf(stderr, "*** failed to send message ***\n");
-    relm((HDR *)m);
+    rtq->exhausted = 0;
+    return(retried);
   }
+
+  rtq->due_ns = MTR_lat_now() + rtq->backoff_us * 1000ULL;
+  if ((rtq->backoff_us *= 2) > MTR_RETRY_MAX_US)
+    rtq->backoff_us = MTR_RETRY_MAX_US;
+  return(retried);
+}
+
+/*
+ * MTR_flush_msgs sends all messages queued by this thread
+ * in batch mode.
+ *
+ * Always returns zero.
+ */
+int MTR_flush_msgs()
+{
+  MTR_TXQ *txq;         /* This thread's Tx batch */
+  u16   i;              /* Index of queued message */
+
+  txq = &mtr_txq;
+  if (txq->num == 0)
+    return(0);
+
+  for (i = 0; i < txq->num; i++)
+    MTR_gct_send(txq->msg[i]);
+  txq->flushes++;
+  txq->flushed += txq->num;
+  txq->num = 0;
   return(0);
 }
 
@@ -1771,236 +3129,458 @@ static int MTR_send_msg(instance, m)
 /*
  * MTR_get_invoke_id
  *
- * recovers the invoke id parameter from a parameter array
+ * recovers the invoke id parameter from a parsed primitive
  *
  * Returns the recovered value or -1 if not found.
  */
-static int MTR_get_invoke_id(pptr, plen)
-  u8  *pptr;        /* First byte of received primitive data (type octet) */
-  u16 plen;         /* length of primitive data */
+static int MTR_get_invoke_id(prs)
+  MTR_PRS *prs;     /* Parsed primitive */
 {
-  int  invoke_id;   /* Recovered invoke_id */
-  u8   ptype;       /* Parameter type*/
+  u8   *pval;       /* Parameter value */
+  u8   plen;        /* Parameter length */
+
+  pval = MTR_prs_find(prs, MAPPN_invoke_id, &plen);
 
   /*
-   * Skip past primitive type
+   * Verify that invoke ID length is 1 octet
    */
-  pptr++;
-  plen --;
-  invoke_id = -1;
-
-  while (plen)
-  {
-    ptype = *pptr++;
-    plen = *pptr++;
-
-    if (ptype == MAPPN_invoke_id)
-    {
-      /*
-       * Verify that invoke ID length is 1 octet
-       */
-      if (plen == 1)
-      {
-        invoke_id = (int)*pptr;
-        break;
-      }
-    }
-    /*
-     * Advance to next parameter
-     */
-    pptr += plen;
-  }
-  return(invoke_id);
+  if ((pval == 0) || (plen != 1))
+    return(-1);
+  return((int)*pval);
 }
 
 /*
  * MTR_get_applic_context
  *
- * Recovers the Application Context parameter from a parameter array
+ * Recovers the Application Context parameter from a parsed primitive
  *
- * Returns the length of parameter data recovered (-1 on failure).
+ * Returns the length of parameter data recovered (0 on failure).
  */
-static int MTR_get_applic_context(pptr, plen, dst, dstlen)
-  u8  *pptr;    /* First byte of received primitive data (type octet) */
-  u16 plen;     /* length of primitive data */
+static int MTR_get_applic_context(prs, dst, dstlen)
+  MTR_PRS *prs; /* Parsed primitive */
   u8  *dst;     /* Start of destination for recovered ac */
   u16 dstlen;   /* Space available at dst */
 {
-  u8   ptype;   /* Parameter type */
-  int  retval;  /* Return value */
+  u8   *pval;   /* Parameter value */
+  u8   plen;    /* Parameter length */
+
+  pval = MTR_prs_find(prs, MAPPN_applic_context, &plen);
 
-  retval = -1;
   /*
-   * Skip past primitive type
+   * Verify that there is sufficient space to store the parameter data
    */
-  pptr++;
-  plen --;
-
-  while (plen)
-  {
-    ptype = *pptr++;
-    plen = *pptr++;
+  if ((pval == 0) || (plen > dstlen))
+    return(0);
 
-    if (ptype == MAPPN_applic_context)
-    {
-      /*
-       * Verify that there is sufficient space to store the parameter data
-       */
-      if (plen <= dstlen)
-      {
-        memcpy((void*)dst, (void*)pptr, plen);
-        retval = plen;
-        break;
-      }
-    }
-    /*
-     * Advance to next parameter
-     */
-    pptr += plen;
-  }
-  return(retval);
+  memcpy((void*)dst, (void*)pval, plen);
+  return(plen);
 }
 
 /*
  * MTR_get_msisdn
  *
- * Recovers the MSISDN parameter from a parameter array
+ * Recovers the MSISDN parameter from a parsed primitive
  *
  * Returns the length of parameter data recovered (0 on failure).
  */
-static u8 MTR_get_msisdn(pptr, plen, dst, dstlen)
-  u8  *pptr;    /* First byte of received primitive data (type octet) */
-  u16 plen;     /* length of primitive data */
+static u8 MTR_get_msisdn(prs, dst, dstlen)
+  MTR_PRS *prs; /* Parsed primitive */
   u8  *dst;     /* Start of destination for recovered param */
   u16 dstlen;   /* Space available at dst */
 {
-  u8   ptype;   /* Parameter type */
-  u8  retval;   /* Return value */
+  u8   *pval;   /* Parameter value */
+  u8   plen;    /* Parameter length */
+
+  pval = MTR_prs_find(prs, MAPPN_msisdn, &plen);
+
+  /*
+   * Verify that there is sufficient space to store the parameter data
+   */
+  if ((pval == 0) || (plen > dstlen))
+    return(0);
+
+  memcpy((void*)dst, (void*)pval, plen);
+  return(plen);
+}
+
+/*
+ * MTR_trace_msg
+ *
+ * Traces (prints) any message as hexadecimal to the console.
+ *
+ * Always returns zero.
+ */
+static int MTR_trace_msg(kind, m)
+  u8    kind;            /* MTR_TRC_RX or MTR_TRC_TX */
+  MSG   *m;              /* received message */
+{
+  /*
+   * If tracing is disabled then return
+   */
+  if (!MTR_TRACE_MSG(m->hdr.id))
+    return(0);
 
-  retval = 0;
   /*
-   * Skip past primitive type
+   * The message is copied to the trace ring, the trace thread
+   * formats and prints it.
    */
-  pptr++;
-  plen --;
+  MTR_trc_msg(kind, m);
+  return(0);
+}
 
-  while (plen)
+/*
+ * MTR_trace_dlg
+ *
+ * Returns non-zero if a dialogue has been selected for tracing.
+ */
+static int MTR_trace_dlg(inst, dlg_id)
+  u16 inst;             /* MAP instance */
+  u16 dlg_id;           /* Dialogue id */
+{
+  MTR_DLG *dlg;         /* State info for dialogue */
+
+  if ((dlg_id < mtr_first_dlg_id) || (dlg_id > mtr_last_dlg_id) ||
+      ((dlg = MTR_dlg_peek(inst, MTR_DLG_REF(dlg_id))) == 0))
+    return(0);
+  return(dlg->trace == MTR_DLG_TRACE_ON);
+}
+
+/*
+ * MTR_trace_select
+ *
+ * Selects a dialogue for tracing, or not, when it opens, or when its
+ * first service primitive arrives if the choice depends on the MSISDN.
+ *
+ * Always returns zero.
+ */
+static int MTR_trace_select(dlg, m, prs)
+  MTR_DLG *dlg;         /* State info for dialogue */
+  MSG   *m;             /* Received message */
+  MTR_PRS *prs;         /* Parsed primitive */
+{
+  u8    *trace;         /* Selection for this dialogue */
+  u8    *msisdn;        /* MSISDN parameter */
+  u8    len;            /* Length of MSISDN */
+  u8    i;              /* Digit index */
+  u8    digit;          /* MSISDN digit */
+
+  trace = &dlg->trace;
+
+  if ((dlg->state == MTR_S_NULL) && (m->hdr.type == MAP_MSG_DLG_IND) &&
+      (prs->ptype == MAPDT_OPEN_IND))
   {
-    ptype = *pptr++;
-    plen = *pptr++;
+    *trace = MTR_DLG_TRACE_OFF;
+    if ((mtr_trace_every != 0) && ((mtr_trace_opens++ % mtr_trace_every) == 0))
+      *trace = MTR_DLG_TRACE_ON;
+    else if ((m->hdr.id >= mtr_trace_first_dlg_id) &&
+             (m->hdr.id <= mtr_trace_last_dlg_id))
+      *trace = MTR_DLG_TRACE_ON;
+    else if (mtr_trace_prefix_len != 0)
+      *trace = MTR_DLG_TRACE_MSISDN;
+    return(0);
+  }
 
-    if (ptype == MAPPN_msisdn)
-    {
-      /*
-       * Verify that there is sufficient space to store the parameter data
-       */
-      if (plen <= dstlen)
-      {
-        memcpy((void*)dst, (void*)pptr, plen);
-        if (plen <= 0xff)
-          retval = (u8) plen;
-        else
-          retval = 0;
-        break;
-      }
-    }
-    /*
-     * Advance to next parameter
-     */
-    pptr += plen;
+  if ((*trace != MTR_DLG_TRACE_MSISDN) || (m->hdr.type != MAP_MSG_SRV_IND))
+    return(0);
+
+  /*
+   * The MSISDN is an address string: one octet of nature of address
+   * followed by TBCD digits, two to an octet, low nibble first.
+   */
+  *trace = MTR_DLG_TRACE_OFF;
+  if ((msisdn = MTR_prs_find(prs, MAPPN_msisdn, &len)) == 0)
+    return(0);
+
+  for (i = 0; i < mtr_trace_prefix_len; i++)
+  {
+    if ((1 + i / 2) >= len)
+      return(0);
+    digit = (i & 1) ? (msisdn[1 + i / 2] >> 4) : (msisdn[1 + i / 2] & 0x0f);
+    if (digit != (u8)(mtr_trace_prefix[i] - '0'))
+      return(0);
   }
-  return(retval);
+  *trace = MTR_DLG_TRACE_ON;
+  return(0);
 }
 
 /*
- * MTR_get_sh_msg
+ * MTR_guard_dlg
  *
- * recovers the short message parameter from a parameter array
+ * Starts the guard timer of a dialogue that is waiting for its next
+ * primitive, or stops it once the dialogue has ended.
  *
- * Returns the length of the recovered data or -1 if error.
+ * Always returns zero.
  */
-static int MTR_get_sh_msg(pptr, plen, dst, dstlen)
-  u8  *pptr;    /* First byte of received primitive data (type octet) */
-  u16 plen;     /* length of primitive data */
-  u8  *dst;     /* Start of destination for recovered SM */
-  u16 dstlen;   /* Space available at dst */
+static int MTR_guard_dlg(dlg, dlg_id)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+{
+  MTR_TMR_WHEEL *w;             /* Wheel of the thread owning the dialogue */
+
+  w = &mtr_guard[MTR_THREAD(dlg_id)].w;
+  if (dlg->state != MTR_S_NULL)
+    MTR_tmr_start(w, MTR_TMR_REF(dlg->map_inst, dlg_id), mtr_guard_ticks);
+  else
+    MTR_tmr_stop(w, MTR_TMR_REF(dlg->map_inst, dlg_id));
+  return(0);
+}
+
+/*
+ * MTR_poll_timers
+ *
+ * Advances the guard and hold timers of the calling thread, which owns
+ * the given wheels, aborting any dialogues that have waited too long
+ * and sending any held responses that are due, then retries whatever
+ * the thread has queued while short of messages.
+ *
+ * Returns the number of dialogues aborted or answered and messages
+ * retried.
+ */
+int MTR_poll_timers(wheel)
+  u8 wheel;                     /* Wheels of the calling thread */
 {
-  u8   ptype;   /* Parameter type*/
-  int  retval;  /* return value */
+  int num;                      /* Timers expired */
+
+  num = 0;
+  if (mtr_guard_ticks != 0)
+    num = MTR_tmr_advance(&mtr_guard[wheel].w, MTR_guard_expiry);
+  if (mtr_hold)
+    num += MTR_tmr_advance_to(&mtr_hold_wheel[wheel].w, MTR_dly_ticks(), MTR_hold_expiry);
+  num += MTR_retry();
+  return(num);
+}
+
+/*
+ * MTR_guard_expiry
+ *
+ * Aborts a dialogue whose guard timer has expired, or closes one left
+ * waiting for the next segment of an MT-FORWARD-SM, and frees its slot.
+ *
+ * Always returns zero.
+ */
+static int MTR_guard_expiry(tmr_ref)
+  u32 tmr_ref;                  /* Guard timer, from MTR_TMR_REF() */
+{
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 inst;                     /* MAP instance */
+  u16 dlg_id;                   /* Dialogue id */
+
+  inst = (u16)(tmr_ref / MTR_NUM_DLGS);
+  dlg_id = (u16)(mtr_first_dlg_id + tmr_ref % MTR_NUM_DLGS);
+  mtr_cur_inst = inst;
+  dlg = MTR_dlg_peek(inst, MTR_DLG_REF(dlg_id));
+  if ((dlg == 0) || (dlg->state == MTR_S_NULL))
+    return(0);
 
   /*
-   * Skip past primitive type
+   * Nothing more is owed to a refused dialogue.
    */
-  pptr++;
-  plen --;
-  retval = -1;
-
-  while (plen)
+  if (dlg->state == MTR_S_REFUSED)
   {
-    ptype = *pptr++;
-    plen = *pptr++;
+    dlg->state = MTR_S_NULL;
+    return(0);
+  }
 
-    if (ptype == MAPPN_sm_rp_ui)
-    {
-      /*
-       * Verify that Short Message length is no greater than MAX_SM_SIZE
-       */
-      if (  (plen <= MAX_SM_SIZE)
-         && (plen <= dstlen) )
-      {
-        memcpy((void*)dst, (void*)pptr, plen);
-        retval = plen;
-        break;
-      }
-    }
-    /*
-     * Advance to next parameter
-     */
-    pptr += plen;
+  /*
+   * Every segment of a concatenated MT-FORWARD-SM received has been
+   * answered, so a dialogue left waiting for the next one is closed,
+   * and counted apart from the guard timer failures.
+   */
+  if ((dlg->state == MTR_S_WAIT_FOR_SRV_PRIM) && (dlg->ptype == MAPST_MT_FWD_SM_IND))
+  {
+    __sync_fetch_and_add(&mtr_guard_segment, 1);
+    if (MTR_TRACE_TEXT(dlg_id))
+      MTR_trc_printf("MTR Tx: Guard timer expired waiting for the next segment, closing dialogue 0x%04x\n",
+                     dlg_id);
+    MTR_send_MapClose(dlg->map_inst, dlg_id, MAPRM_normal_release);
+    dlg->state = MTR_S_NULL;
+    MTR_dlg_ended(dlg, 0);
+  }
+  else
+  {
+    __sync_fetch_and_add(&mtr_guard_state[dlg->state], 1);
+    __sync_fetch_and_add(&mtr_guard_srv[dlg->ptype], 1);
+    if (MTR_TRACE_TEXT(dlg_id))
+      MTR_trc_printf("MTR Tx: Guard timer expired in state %d, aborting dialogue 0x%04x\n",
+                     dlg->state, dlg_id);
+    MTR_send_Abort(dlg->map_inst, dlg_id, MAPUR_procedure_error);
+    dlg->state = MTR_S_NULL;
+    MTR_dlg_ended(dlg, 1);
   }
-  return(retval);
+  if (dlg->held)
+    MTR_hold_stop(dlg, dlg_id);
+  return(0);
 }
 
 /*
- * MTR_trace_msg
+ * MTR_hold_dlg
  *
- * Traces (prints) any message as hexadecimal to the console.
+ * Holds back the response of a dialogue, to be sent by
+ * MTR_hold_expiry() when due.
  *
  * Always returns zero.
  */
-static int MTR_trace_msg(prefix, m)
-  char *prefix;
-  MSG  *m;               /* received message */
+static int MTR_hold_dlg(dlg, dlg_id, hold_us)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+  u32 hold_us;                  /* Time to hold the response back */
 {
-  HDR   *h;              /* pointer to message header */
-  int   instance;        /* instance of MAP msg received from */
-  u16   mlen;            /* length of received message */
-  u8    *pptr;           /* pointer to parameter area */
+  MTR_TMR_WHEEL *w;             /* Wheel of the thread owning the dialogue */
+  u32 due;                      /* Tick the response is due */
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Holding response back for %uus\n", hold_us);
 
   /*
-   * If tracing is disabled then return
+   * The wheel may be behind the clock, so the release tick is worked
+   * out from the clock.
    */
-  if (mtr_trace == 0)
+  w = &mtr_hold_wheel[MTR_THREAD(dlg_id)].w;
+  due = MTR_dly_ticks() + (hold_us + MTR_DLY_TICK_US - 1) / MTR_DLY_TICK_US;
+  MTR_tmr_start(w, MTR_TMR_REF(dlg->map_inst, dlg_id), due - w->now);
+  MTR_dlg_cold(dlg->map_inst, MTR_DLG_REF(dlg_id))->held_ns = MTR_lat_now();
+  dlg->held |= MTR_HELD_DELAY;
+  return(0);
+}
+
+/*
+ * MTR_hold_stop
+ *
+ * Drops the held or queued response of a dialogue that has ended. A
+ * close or abort queued for a retry is kept.
+ *
+ * Always returns zero.
+ */
+static int MTR_hold_stop(dlg, dlg_id)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+{
+  if (dlg->held & MTR_HELD_DELAY)
+    MTR_tmr_stop(&mtr_hold_wheel[MTR_THREAD(dlg_id)].w, MTR_TMR_REF(dlg->map_inst, dlg_id));
+  dlg->held &= MTR_HELD_END;
+  return(0);
+}
+
+/*
+ * MTR_hold_expiry
+ *
+ * Sends the held response of a dialogue that is now due. The response
+ * latency is measured from when it was held back.
+ *
+ * Always returns zero.
+ */
+static int MTR_hold_expiry(tmr_ref)
+  u32 tmr_ref;                  /* Hold timer, from MTR_TMR_REF() */
+{
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  MTR_DLG_COLD *cold;           /* Cold state info for dialogue */
+  u16 inst;                     /* MAP instance */
+  u16 dlg_id;                   /* Dialogue id */
+
+  inst = (u16)(tmr_ref / MTR_NUM_DLGS);
+  dlg_id = (u16)(mtr_first_dlg_id + tmr_ref % MTR_NUM_DLGS);
+  mtr_cur_inst = inst;
+  dlg = MTR_dlg_peek(inst, MTR_DLG_REF(dlg_id));
+  if ((dlg == 0) || (!(dlg->held & MTR_HELD_DELAY)) || (dlg->state != MTR_S_WAIT_DELIMITER))
     return(0);
+  dlg->held &= ~MTR_HELD_DELAY;
+
+  cold = MTR_dlg_cold(inst, MTR_DLG_REF(dlg_id));
+  MTR_lat_record(MTR_LAT_HOLD, MTR_lat_service(dlg->ptype), MTR_lat_now() - cold->held_ns);
+
+  if (MTR_TRACE_TEXT(dlg_id))
+    MTR_trc_printf("MTR Tx: Releasing held response of dialogue 0x%04x\n", dlg_id);
+
+  return(MTR_release(dlg, dlg_id, cold->held_ns));
+}
+
+/*
+ * MTR_release
+ *
+ * Sends the response of a dialogue that was held back or queued for a
+ * retry, timing it from when the dialogue was held.
+ *
+ * Always returns zero.
+ */
+static int MTR_release(dlg, dlg_id, rx_ns)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+  unsigned long long rx_ns;     /* Start of the response latency */
+{
+  u8  send_abort;               /* Set if abort to be generated */
 
-  h = (HDR*)m;
-  instance = GCT_get_instance(h);
-  printf("%s I%04x M t%04x i%04x f%02x d%02x s%02x", prefix, instance, h->type,
-          h->id, h->src, h->dst, h->status);
+  MTR_lat_class(MTR_lat_service(dlg->ptype));
+  MTR_lat_rx(rx_ns);
+  send_abort = (u8)MTR_answer(dlg, dlg_id);
+  if (send_abort)
+  {
+    MTR_send_Abort(dlg->map_inst, dlg_id, MAPUR_procedure_error);
+    dlg->state = MTR_S_NULL;
+  }
+  MTR_lat_rx(0);
 
-  if ((mlen = m->len) > 0)
+  if (dlg->state == MTR_S_NULL)
   {
-    if (mlen > MAX_PARAM_LEN)
-      mlen = MAX_PARAM_LEN;
-    printf(" p");
-    pptr = get_param(m);
-    while (mlen--)
-    {
-      printf("%c%c", BIN2CH(*pptr/16), BIN2CH(*pptr%16));
-      pptr++;
-    }
+    MTR_dlg_ended(dlg, send_abort);
+    if (dlg->held)
+      MTR_hold_stop(dlg, dlg_id);
   }
-  printf("\n");
+  if (mtr_guard_ticks != 0)
+    MTR_guard_dlg(dlg, dlg_id);
+  return(0);
+}
+
+/*
+ * MTR_held
+ *
+ * Returns the number of responses held by all threads. Counts of other
+ * threads may be slightly out of date.
+ */
+static u32 MTR_held()
+{
+  u32 held;                     /* Responses held */
+  u8 i;                         /* Wheel index */
+
+  for (i = 0, held = 0; i < (mtr_num_workers ? mtr_num_workers : 1); i++)
+    held += mtr_hold_wheel[i].w.running;
+  return(held);
+}
+
+/*
+ * MTR_dlg_ended
+ *
+ * Counts a dialogue that has just ended and records its lifetime.
+ *
+ * Always returns zero.
+ */
+static int MTR_dlg_ended(dlg, aborted)
+  MTR_DLG *dlg;                 /* State info for dialogue */
+  u8 aborted;                   /* Set if ended by an abort */
+{
+  u8 cls;                       /* Class of the dialogue */
+
+  mtr_active--;
+  cls = MTR_lat_service(dlg->ptype);
+  if (aborted)
+    MTR_STAT_INC(aborted[cls]);
+  else
+    MTR_STAT_INC(closed[cls]);
+
+  return(MTR_lat_record(MTR_LAT_DLG, cls, MTR_DLG_AGE(dlg, MTR_lat_now())));
+}
+
+/*
+ * MTR_overloaded
+ *
+ * Returns non-zero if the calling thread has its share of dialogues in
+ * progress, or the primitive in hand has waited too long inside MTR.
+ */
+static int MTR_overloaded()
+{
+  if ((mtr_thread_max_dlgs != 0) && (mtr_active >= mtr_thread_max_dlgs))
+    return(1);
+  if ((mtr_max_wait_ns != 0) && (MTR_lat_waited() >= mtr_max_wait_ns))
+    return(1);
   return(0);
 }
 
@@ -2008,19 +3588,35 @@ static int MTR_trace_msg(prefix, m)
  * init_resources
  *
  * Initialises all mtr system resources
- * This includes dialogue state information.
+ * This includes dialogue state information, sized for the
+ * dialogue id range served.
  *
- * Always returns zero
+ * Returns zero or -1 on error.
  *
  */
 static int init_resources()
 {
-  int i;    /* for loop index */
+  if (MTR_dlg_init(MTR_NUM_DLGS, mtr_num_inst, mtr_huge_pages,
+                   mtr_default_dlg_term_mode) != 0)
+  {
+    fprintf(stderr, "MTR: failed to allocate dialogue table\n");
+    return (-1);
+  }
 
-  for (i=0; i<MAX_NUM_DLGS; i++)
+  /*
+   * Timer nodes are only written once a dialogue is in progress, so
+   * the kernel backs this with memory as dialogues are used.
+   */
+  if ((dialogue_timer = calloc(mtr_num_inst * MTR_NUM_DLGS, sizeof(MTR_TMR_NODE))) == 0)
+  {
+    fprintf(stderr, "MTR: failed to allocate dialogue timers, guard timer disabled\n");
+    mtr_guard_ticks = 0;
+  }
+  if ((mtr_hold) &&
+      ((hold_timer = calloc(mtr_num_inst * MTR_NUM_DLGS, sizeof(MTR_TMR_NODE))) == 0))
   {
-    dialogue_info[i].state = MTR_S_NULL;
-    dialogue_info[i].term_mode = mtr_default_dlg_term_mode;
+    fprintf(stderr, "MTR: failed to allocate hold timers, responses not held\n");
+    mtr_hold = 0;
   }
   return (0);
 }
@@ -0,0 +1,111 @@
+#
+# Makefile for the customised MTR.
+#
+# The stock DSI makefile only builds mtr_main.c, mtr.c and pack.c.
+# This one also builds the additional MTR modules and tools and links
+# the libraries they need.
+#
+# Usage: make -f mtr.mk [DSI=/opt/DSI]
+#
+# mtrsim is MTR linked with the in-process GCT stand-in (mtr_gct.c)
+# rather than gctlib, and runs without the DSI stack.
+#
+# make -f mtr.mk check builds mtrcheck, with the templates compiled
+# with MTR_TPL_VERIFY, and fails if any template differs from the
+# original encoding.
+#
+
+DSI     ?= /opt/DSI
+BINPATH ?= $(DSI)/UPD/BIN
+
+CC      ?= gcc
+CFLAGS  ?= -O2 -Wall
+CFLAGS  += -I$(DSI)/INC
+LDLIBS  += -L$(DSI)/64 -lgctlib -lpthread -lrt -lz -lm
+SIMLIBS  = -lpthread -lrt -lz -lm
+
+MTR_OBJS = mtr_main.o mtr.o pack.o mtr_wrk.o mtr_tpl.o mtr_prs.o \
+           mtr_trc.o mtr_cap.o mtr_gsm.o mtr_tmr.o mtr_dlg.o \
+           mtr_lat.o mtr_stat.o mtr_rte.o mtr_sub.o mtr_dly.o mtr_flt.o
+
+MTRSIM_OBJS = $(MTR_OBJS) mtr_gct.o
+
+MTRDEC_OBJS = mtrdec.o
+
+MTRSTAT_OBJS = mtrstat.o
+
+MTRSUB_OBJS = mtrsub.o mtr_sub.o
+
+MTRLOAD_OBJS = mtrload.o mtr_tpl.o mtr_prs.o mtr_gsm.o mtr_tmr.o mtr_dlg.o \
+               mtr_lat.o mtr_stat.o
+
+MTRPLAY_OBJS = mtrplay.o mtr_tmr.o mtr_lat.o
+
+MTRBENCH_OBJS = mtrbench.o mtr_prs.o mtr_gsm.o mtr_lat.o mtr_dlg.o mtr_stat.o
+
+MTRCHECK_OBJS = mtrcheck.o mtr_tpl_vfy.o mtr_gsm.o mtr_prs.o mtr_dlg.o \
+                mtr_lat.o mtr_stat.o mtr_gct.o
+
+all: $(BINPATH)/mtr $(BINPATH)/mtrdec $(BINPATH)/mtrstat $(BINPATH)/mtrsub \
+     $(BINPATH)/mtrload $(BINPATH)/mtrplay $(BINPATH)/mtrsim $(BINPATH)/mtrbench
+
+$(BINPATH)/mtr: $(MTR_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTR_OBJS) $(LDLIBS)
+
+$(BINPATH)/mtrsim: $(MTRSIM_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRSIM_OBJS) $(SIMLIBS)
+
+$(BINPATH)/mtrdec: $(MTRDEC_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRDEC_OBJS) -lz
+
+$(BINPATH)/mtrstat: $(MTRSTAT_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRSTAT_OBJS) -lrt
+
+$(BINPATH)/mtrsub: $(MTRSUB_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRSUB_OBJS)
+
+$(BINPATH)/mtrload: $(MTRLOAD_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRLOAD_OBJS) $(LDLIBS)
+
+$(BINPATH)/mtrplay: $(MTRPLAY_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRPLAY_OBJS) $(LDLIBS)
+
+$(BINPATH)/mtrbench: $(MTRBENCH_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRBENCH_OBJS) $(SIMLIBS)
+
+mtrcheck: $(MTRCHECK_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(MTRCHECK_OBJS) $(SIMLIBS)
+
+check: mtrcheck
+	./mtrcheck
+
+mtr_tpl_vfy.o: mtr_tpl.c
+	$(CC) $(CFLAGS) -DMTR_TPL_VERIFY -c -o $@ mtr_tpl.c
+
+$(MTR_OBJS): mtr.h mtr_wrk.h mtr_tpl.h mtr_prs.h mtr_trc.h mtr_cap.h mtr_gsm.h \
+             mtr_tmr.h mtr_dlg.h mtr_lat.h mtr_stat.h mtr_rte.h mtr_sub.h \
+             mtr_dly.h mtr_flt.h
+
+mtr_gct.o: mtr_prs.h mtr_gsm.h mtr_lat.h
+
+$(MTRDEC_OBJS): mtr_trc.h mtr_cap.h
+
+$(MTRSTAT_OBJS): mtr.h mtr_wrk.h mtr_lat.h mtr_flt.h mtr_sub.h mtr_dlg.h mtr_stat.h
+
+$(MTRSUB_OBJS): mtr_sub.h
+
+mtrload.o: mtr.h mtr_wrk.h mtr_tpl.h mtr_prs.h mtr_gsm.h mtr_tmr.h mtr_lat.h \
+           mtr_sub.h mtr_dlg.h
+
+mtrplay.o: mtr_tmr.h mtr_lat.h
+
+mtrbench.o: mtr.h mtr_prs.h mtr_gsm.h mtr_wrk.h mtr_lat.h mtr_flt.h mtr_sub.h \
+            mtr_dlg.h mtr_stat.h
+
+mtrcheck.o mtr_tpl_vfy.o: mtr_tpl.h mtr_gsm.h mtr_wrk.h mtr_lat.h mtr_flt.h mtr_stat.h
+
+clean:
+	rm -f $(MTR_OBJS) $(MTRDEC_OBJS) $(MTRSTAT_OBJS) $(MTRSUB_OBJS) mtrload.o mtrplay.o mtr_gct.o mtrbench.o \
+	      mtrcheck.o mtr_tpl_vfy.o mtrcheck
+
+.PHONY: all check clean
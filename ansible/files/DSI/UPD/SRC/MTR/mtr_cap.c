@@ -0,0 +1,205 @@
+/*
+ Name:          mtr_cap.c
+
+ Description:   Binary trace capture files for MTR.
+
+                In capture mode the trace thread encodes message records
+                in the mtr_cap.h format and hands them here in blocks.
+                Blocks are appended to the current capture file. Once the
+                file has received its configured size a new one, with the
+                next sequence number, is started, so a long load test
+                leaves a series of files that can be decoded with mtrdec.
+
+                Only the trace thread calls MTR_cap_write(), and
+                MTR_cap_close() is only called once it has stopped.
+
+ Functions:     MTR_cap_config
+                MTR_cap_write
+                MTR_cap_close
+                MTR_cap_report
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "system.h"
+#include "mtr_cap.h"
+
+/*
+ * Compression level for compressed captures, favouring speed.
+ */
+#define MTR_CAP_ZLEVEL          "wb1"
+
+static int MTR_cap_open(void);
+
+/*
+ * Static data:
+ */
+static char mtr_cap_base[MTR_CAP_MAX_NAME]; /* File name prefix */
+static u32  mtr_cap_file_size;  /* Octets per file */
+static u8   mtr_cap_compress;   /* Set to gzip the files */
+static FILE *mtr_cap_fp;        /* Current uncompressed file */
+static gzFile mtr_cap_gz;       /* Current compressed file */
+static u32  mtr_cap_seq;        /* Sequence number of current file */
+static u32  mtr_cap_len;        /* Octets written to current file */
+static u32  mtr_cap_files;      /* Files started */
+static u32  mtr_cap_errors;     /* Blocks that could not be written */
+static unsigned long long mtr_cap_total; /* Octets captured */
+
+/*
+ * MTR_cap_config
+ *
+ * Sets the capture file name prefix, size and compression. Must be
+ * called before the trace thread starts.
+ *
+ * Returns zero or -1 if the name is too long.
+ */
+int MTR_cap_config(base, file_size, compress)
+  char *base;                   /* File name prefix */
+  u32  file_size;               /* Octets per file, zero for the default */
+  u8   compress;                /* Set to gzip the files */
+{
+  if (strlen(base) + 24 > MTR_CAP_MAX_NAME)
+    return(-1);
+
+  strcpy(mtr_cap_base, base);
+  mtr_cap_file_size = file_size ? file_size : MTR_CAP_DEF_FILE_SIZE;
+  mtr_cap_compress = compress;
+  return(0);
+}
+
+/*
+ * MTR_cap_write
+ *
+ * Appends a block of whole records to the capture, starting a new
+ * file first if the current one is full.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_cap_write(buf, len)
+  char *buf;                    /* Encoded records */
+  u32  len;                     /* Length of buf */
+{
+  int err;                      /* Write failed */
+
+  if ((mtr_cap_fp == 0) && (mtr_cap_gz == 0))
+  {
+    if (MTR_cap_open() != 0)
+    {
+      mtr_cap_errors++;
+      return(-1);
+    }
+  }
+  else if (mtr_cap_len >= mtr_cap_file_size)
+  {
+    MTR_cap_close();
+    mtr_cap_seq++;
+    if (MTR_cap_open() != 0)
+    {
+      mtr_cap_errors++;
+      return(-1);
+    }
+  }
+
+  /*
+   * Compressed blocks are flushed so that a capture cut short by
+   * stopping MTR can still be decompressed up to the last block.
+   */
+  if (mtr_cap_compress)
+    err = ((gzwrite(mtr_cap_gz, buf, len) != (int)len) ||
+           (gzflush(mtr_cap_gz, Z_SYNC_FLUSH) != Z_OK));
+  else
+    err = (fwrite(buf, 1, len, mtr_cap_fp) != len);
+
+  if (err)
+  {
+    mtr_cap_errors++;
+    return(-1);
+  }
+  mtr_cap_len += len;
+  mtr_cap_total += len;
+  return(0);
+}
+
+/*
+ * MTR_cap_close
+ *
+ * Closes the current capture file, writing the gzip trailer of a
+ * compressed one.
+ *
+ * Always returns zero.
+ */
+int MTR_cap_close()
+{
+  if (mtr_cap_gz != 0)
+    gzclose(mtr_cap_gz);
+  if (mtr_cap_fp != 0)
+    fclose(mtr_cap_fp);
+  mtr_cap_gz = 0;
+  mtr_cap_fp = 0;
+  return(0);
+}
+
+/*
+ * MTR_cap_report
+ *
+ * Prints the capture counters.
+ *
+ * Always returns zero.
+ */
+int MTR_cap_report()
+{
+  if (mtr_cap_base[0] != '\0')
+    printf("MTR Capture: %s.%04u; %u files; %llu octets; %u write errors\n",
+           mtr_cap_base, mtr_cap_seq, mtr_cap_files, mtr_cap_total,
+           mtr_cap_errors);
+  return(0);
+}
+
+/*
+ * MTR_cap_open
+ *
+ * Opens the capture file for the current sequence number and writes
+ * the file header.
+ *
+ * Returns zero or -1 on error.
+ */
+static int MTR_cap_open()
+{
+  char name[MTR_CAP_MAX_NAME + 32]; /* File name */
+  MTR_CAP_FILE hdr;             /* File header */
+  struct timespec mono;         /* Monotonic time */
+  struct timespec real;         /* Wall clock time */
+
+  snprintf(name, sizeof(name), "%s.%04u.mtrcap%s", mtr_cap_base, mtr_cap_seq,
+           mtr_cap_compress ? ".gz" : "");
+
+  if (mtr_cap_compress)
+    mtr_cap_gz = gzopen(name, MTR_CAP_ZLEVEL);
+  else if ((mtr_cap_fp = fopen(name, "wb")) != 0)
+    setvbuf(mtr_cap_fp, NULL, _IONBF, 0);
+
+  if ((mtr_cap_fp == 0) && (mtr_cap_gz == 0))
+  {
+    fprintf(stderr, "MTR: failed to open capture file %s\n", name);
+    return(-1);
+  }
+  mtr_cap_files++;
+
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  memcpy(hdr.magic, MTR_CAP_MAGIC, sizeof(hdr.magic));
+  hdr.version = MTR_CAP_VERSION;
+  hdr.hdr_len = sizeof(hdr);
+  hdr.mono_ns = (unsigned long long)mono.tv_sec * 1000000000 + mono.tv_nsec;
+  hdr.real_ns = (unsigned long long)real.tv_sec * 1000000000 + real.tv_nsec;
+
+  mtr_cap_len = 0;
+  if (mtr_cap_compress)
+    gzwrite(mtr_cap_gz, &hdr, sizeof(hdr));
+  else
+    fwrite(&hdr, 1, sizeof(hdr), mtr_cap_fp);
+  return(0);
+}
@@ -0,0 +1,59 @@
+/*
+ Name:          mtr_cap.h
+
+ Description:   Binary trace capture file format.
+
+                A capture file is an MTR_CAP_FILE header followed by
+                records, each an MTR_CAP_REC header followed by the
+                parameter area of the message. Files are written in host
+                byte order and may be gzip compressed as a whole.
+ */
+
+#ifndef MTR_CAP_H
+#define MTR_CAP_H
+
+#define MTR_CAP_MAGIC           "MTRCAP01"
+#define MTR_CAP_VERSION         (1)
+
+/*
+ * Capture files are named <base>.<sequence>.mtrcap, with .gz appended
+ * when compressed, and a new file is started once this many octets
+ * have been captured unless configured otherwise.
+ */
+#define MTR_CAP_DEF_FILE_SIZE   (64 * 1024 * 1024)
+#define MTR_CAP_MAX_NAME        (256)
+
+/*
+ * File header
+ */
+typedef struct
+{
+  char magic[8];                /* MTR_CAP_MAGIC */
+  u32  version;                 /* MTR_CAP_VERSION */
+  u32  hdr_len;                 /* Length of this header */
+  unsigned long long mono_ns;   /* Monotonic time the file was opened */
+  unsigned long long real_ns;   /* Wall clock time at the same moment */
+} __attribute__((packed)) MTR_CAP_FILE;
+
+/*
+ * Record header
+ */
+typedef struct
+{
+  u16 len;                      /* Length of the record, header included */
+  u8  kind;                     /* MTR_TRC_RX or MTR_TRC_TX */
+  u8  status;                   /* Message status */
+  unsigned long long ns;        /* Monotonic time traced, in nanoseconds */
+  u16 type;                     /* Message type */
+  u16 id;                       /* Message id */
+  u8  src;                      /* Source module */
+  u8  dst;                      /* Destination module */
+  u16 instance;                 /* Message instance */
+} __attribute__((packed)) MTR_CAP_REC;
+
+int MTR_cap_config(char *base, u32 file_size, u8 compress);
+int MTR_cap_write(char *buf, u32 len);
+int MTR_cap_close(void);
+int MTR_cap_report(void);
+
+#endif
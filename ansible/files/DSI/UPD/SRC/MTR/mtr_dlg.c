@@ -0,0 +1,303 @@
+/*
+ Name:          mtr_dlg.c
+
+ Description:   Dialogue state table for MTR.
+
+                The table is sized at startup for the dialogue id range
+                served, up to the full TCAP incoming range, but only a
+                directory of page pointers is allocated then. A page of
+                MTR_DLG_PAGE_SLOTS dialogues is allocated and initialised
+                the first time one of its dialogues is used, so memory
+                grows with the number of dialogues actually in progress.
+
+                With huge pages the whole table is reserved up front as
+                one huge page mapping, which fails unless enough huge
+                pages are free. The pages of the table are still only
+                initialised as they are first used.
+
+                Each MAP instance has its own run of pages in the
+                directory, so the same dialogue id from two instances
+                is two dialogues.
+
+                Pages are never freed. Looking up a dialogue whose page
+                exists takes no lock; the lock is only taken while a
+                page is being added.
+
+ Functions:     MTR_dlg_init
+                MTR_dlg_get
+                MTR_dlg_peek
+                MTR_dlg_cold
+                MTR_dlg_active
+                MTR_dlg_states
+                MTR_dlg_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr.h"
+#include "mtr_sub.h"
+#include "mtr_dlg.h"
+
+/*
+ * Directory index of the page holding a dialogue
+ */
+#define MTR_DLG_PAGE_INDEX(inst, dlg_ref) \
+        ((inst) * mtr_dlg_pages + ((dlg_ref) >> MTR_DLG_PAGE_SHIFT))
+
+/*
+ * Size of a huge page, the huge page mapping is a multiple of it.
+ */
+#define MTR_DLG_HUGE_PAGE       (2UL * 1024 * 1024)
+
+/*
+ * One page of the table. The hot entries come first so that they
+ * stay dense.
+ */
+typedef struct
+{
+  MTR_DLG hot[MTR_DLG_PAGE_SLOTS];      /* Hot state */
+  MTR_DLG_COLD cold[MTR_DLG_PAGE_SLOTS]; /* Cold state */
+} MTR_DLG_PAGE;
+
+static MTR_DLG_PAGE *MTR_dlg_add_page(u32 page);
+
+/*
+ * Static data:
+ */
+static MTR_DLG_PAGE * volatile *mtr_dlg_dir;    /* Page directory */
+static u32 mtr_dlg_num;                         /* Dialogues per instance */
+static u8  mtr_dlg_inst;                        /* MAP instances served */
+static u32 mtr_dlg_pages;                       /* Pages per instance */
+static u32 mtr_dlg_used;                        /* Pages allocated */
+static u32 mtr_dlg_failed;                      /* Pages that could not be allocated */
+static u8  mtr_dlg_term_mode;                   /* Termination mode of a new dialogue */
+static char *mtr_dlg_huge;                      /* Huge page mapping, 0 if none */
+static pthread_mutex_t mtr_dlg_lock = PTHREAD_MUTEX_INITIALIZER; /* Held adding a page */
+
+/*
+ * MTR_dlg_init
+ *
+ * Sizes the table for the given number of dialogues in each of the
+ * given number of MAP instances. Must be called before any other
+ * function of this module.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_dlg_init(num_dlgs, num_inst, huge_pages, term_mode)
+  u32 num_dlgs;                 /* Dialogues per instance */
+  u8  num_inst;                 /* MAP instances served */
+  u8  huge_pages;               /* Set to back the table with huge pages */
+  u8  term_mode;                /* Termination mode of a new dialogue */
+{
+  size_t len;                   /* Length of the huge page mapping */
+
+  if ((num_dlgs == 0) || (num_dlgs > MTR_DLG_MAX_DLGS) ||
+      (num_inst == 0) || (num_inst > MTR_DLG_MAX_INST))
+    return(-1);
+
+  mtr_dlg_num = num_dlgs;
+  mtr_dlg_inst = num_inst;
+  mtr_dlg_pages = (num_dlgs + MTR_DLG_PAGE_SLOTS - 1) >> MTR_DLG_PAGE_SHIFT;
+  mtr_dlg_term_mode = term_mode;
+  if ((mtr_dlg_dir = calloc(num_inst * mtr_dlg_pages, sizeof(MTR_DLG_PAGE *))) == 0)
+    return(-1);
+
+  if (huge_pages)
+  {
+#ifdef MAP_HUGETLB
+    len = num_inst * mtr_dlg_pages * sizeof(MTR_DLG_PAGE);
+    len = (len + MTR_DLG_HUGE_PAGE - 1) & ~(MTR_DLG_HUGE_PAGE - 1);
+    mtr_dlg_huge = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                        -1, 0);
+    if (mtr_dlg_huge == MAP_FAILED)
+      mtr_dlg_huge = 0;
+#endif
+    if (mtr_dlg_huge == 0)
+      fprintf(stderr, "MTR: no huge pages, dialogue table uses normal pages\n");
+  }
+  return(0);
+}
+
+/*
+ * MTR_dlg_get
+ *
+ * Returns the hot state of a dialogue, adding its page if this is the
+ * first dialogue used in it, or 0 if out of range or out of memory.
+ */
+MTR_DLG *MTR_dlg_get(inst, dlg_ref)
+  u16 inst;                     /* MAP instance */
+  u16 dlg_ref;                  /* Index in the instance's table */
+{
+  MTR_DLG_PAGE *page;           /* Page holding the dialogue */
+
+  if ((inst >= mtr_dlg_inst) || (dlg_ref >= mtr_dlg_num))
+    return(0);
+
+  if (((page = mtr_dlg_dir[MTR_DLG_PAGE_INDEX(inst, dlg_ref)]) == 0) &&
+      ((page = MTR_dlg_add_page(MTR_DLG_PAGE_INDEX(inst, dlg_ref))) == 0))
+    return(0);
+  return(&page->hot[dlg_ref & (MTR_DLG_PAGE_SLOTS - 1)]);
+}
+
+/*
+ * MTR_dlg_peek
+ *
+ * Returns the hot state of a dialogue or 0 if out of range or no
+ * dialogue in its page has been used yet.
+ */
+MTR_DLG *MTR_dlg_peek(inst, dlg_ref)
+  u16 inst;                     /* MAP instance */
+  u16 dlg_ref;                  /* Index in the instance's table */
+{
+  MTR_DLG_PAGE *page;           /* Page holding the dialogue */
+
+  if ((inst >= mtr_dlg_inst) || (dlg_ref >= mtr_dlg_num) ||
+      ((page = mtr_dlg_dir[MTR_DLG_PAGE_INDEX(inst, dlg_ref)]) == 0))
+    return(0);
+  return(&page->hot[dlg_ref & (MTR_DLG_PAGE_SLOTS - 1)]);
+}
+
+/*
+ * MTR_dlg_cold
+ *
+ * Returns the cold state of a dialogue. Must only be called for a
+ * dialogue returned by MTR_dlg_get().
+ */
+MTR_DLG_COLD *MTR_dlg_cold(inst, dlg_ref)
+  u16 inst;                     /* MAP instance */
+  u16 dlg_ref;                  /* Index in the instance's table */
+{
+  return(&mtr_dlg_dir[MTR_DLG_PAGE_INDEX(inst, dlg_ref)]->cold[dlg_ref & (MTR_DLG_PAGE_SLOTS - 1)]);
+}
+
+/*
+ * MTR_dlg_active
+ *
+ * Returns the number of dialogues in progress for a MAP instance. A
+ * refused dialogue has been released and is not counted.
+ */
+u32 MTR_dlg_active(inst)
+  u16 inst;                     /* MAP instance */
+{
+  MTR_DLG_PAGE *page;           /* Page being counted */
+  u32 p;                        /* Page index */
+  u32 i;                        /* Slot index */
+  u32 num;                      /* Dialogues in progress */
+
+  num = 0;
+  if (inst >= mtr_dlg_inst)
+    return(0);
+  for (p = inst * mtr_dlg_pages; p < (inst + 1) * mtr_dlg_pages; p++)
+    if ((page = mtr_dlg_dir[p]) != 0)
+      for (i = 0; i < MTR_DLG_PAGE_SLOTS; i++)
+        if ((page->hot[i].state != MTR_S_NULL) &&
+            (page->hot[i].state != MTR_S_REFUSED))
+          num++;
+  return(num);
+}
+
+/*
+ * MTR_dlg_states
+ *
+ * Counts the dialogues of all MAP instances in each state. May be
+ * called from any thread, the count is only approximate while the
+ * table is in use.
+ *
+ * Returns the number of dialogues in progress, not counting refused
+ * ones.
+ */
+u32 MTR_dlg_states(state, num_states)
+  unsigned long long *state;    /* Incremented for each dialogue by state */
+  u32 num_states;               /* Entries in state */
+{
+  MTR_DLG_PAGE *page;           /* Page being counted */
+  u32 p;                        /* Page index */
+  u32 i;                        /* Slot index */
+  u32 num;                      /* Dialogues in progress */
+
+  num = 0;
+  for (p = 0; p < mtr_dlg_inst * mtr_dlg_pages; p++)
+  {
+    if ((page = mtr_dlg_dir[p]) == 0)
+      continue;
+    for (i = 0; i < MTR_DLG_PAGE_SLOTS; i++)
+    {
+      if (page->hot[i].state < num_states)
+        state[page->hot[i].state]++;
+      if ((page->hot[i].state != MTR_S_NULL) &&
+          (page->hot[i].state != MTR_S_REFUSED))
+        num++;
+    }
+  }
+  return(num);
+}
+
+/*
+ * MTR_dlg_report
+ *
+ * Prints the table counters.
+ *
+ * Always returns zero.
+ */
+int MTR_dlg_report()
+{
+  printf("MTR Dialogue table: %u dialogues x %u instances; %u of %u pages used (%luKB%s); %u allocation failures\n",
+         mtr_dlg_num, mtr_dlg_inst, mtr_dlg_used, mtr_dlg_inst * mtr_dlg_pages,
+         (unsigned long)(mtr_dlg_used * sizeof(MTR_DLG_PAGE) / 1024),
+         mtr_dlg_huge ? ", huge pages" : "", mtr_dlg_failed);
+  return(0);
+}
+
+/*
+ * MTR_dlg_add_page
+ *
+ * Allocates and initialises a page, unless another thread has just
+ * done so, and adds it to the directory.
+ *
+ * Returns the page or 0 if out of memory.
+ */
+static MTR_DLG_PAGE *MTR_dlg_add_page(p)
+  u32 p;                        /* Page index */
+{
+  MTR_DLG_PAGE *page;           /* New page */
+  u32 i;                        /* Slot index */
+
+  pthread_mutex_lock(&mtr_dlg_lock);
+  if ((page = mtr_dlg_dir[p]) == 0)
+  {
+    if (mtr_dlg_huge != 0)
+      page = (MTR_DLG_PAGE *)(mtr_dlg_huge + p * sizeof(MTR_DLG_PAGE));
+    else
+      page = calloc(1, sizeof(MTR_DLG_PAGE));
+
+    if (page != 0)
+    {
+      for (i = 0; i < MTR_DLG_PAGE_SLOTS; i++)
+      {
+        page->hot[i].state = MTR_S_NULL;
+        page->hot[i].term_mode = mtr_dlg_term_mode;
+        page->hot[i].map_inst = (u16)(p / mtr_dlg_pages);
+      }
+
+      /*
+       * The page must be complete before other threads can see it.
+       */
+      __sync_synchronize();
+      mtr_dlg_dir[p] = page;
+      mtr_dlg_used++;
+    }
+    else
+      mtr_dlg_failed++;
+  }
+  pthread_mutex_unlock(&mtr_dlg_lock);
+  return(page);
+}
@@ -0,0 +1,97 @@
+/*
+ Name:          mtr_dlg.h
+
+ Description:   Definitions for the MTR dialogue state table.
+
+                The state of each dialogue is split in two. The hot
+                part, used by every primitive and by the end of the
+                dialogue, is kept in a dense array of 16-byte entries,
+                four to a cache line and none straddling two. The cold
+                part holds the buffers only needed on MAP-OPEN-IND,
+                MAP-OPEN-RSP, ATI, SRI for SM and MT-FORWARD-SM and is
+                kept in a separate array at the same index.
+
+                The table covers the whole dialogue id range served and
+                is made of pages of MTR_DLG_PAGE_SLOTS dialogues, each
+                allocated the first time one of its dialogues is used.
+
+                Dialogues are keyed by MAP instance and dialogue id, so
+                each MAP instance served has its own sub-table covering
+                the range.
+ */
+
+#ifndef MTR_DLG_H
+#define MTR_DLG_H
+
+/*
+ * Dialogues per page of the table (must be a power of 2).
+ */
+#define MTR_DLG_PAGE_SHIFT      (9)
+#define MTR_DLG_PAGE_SLOTS      (1 << MTR_DLG_PAGE_SHIFT)
+
+/*
+ * Most dialogues per MAP instance, the whole incoming dialogue id range.
+ */
+#define MTR_DLG_MAX_DLGS        (0x8000)
+
+/*
+ * Most MAP instances served, numbered from zero.
+ */
+#define MTR_DLG_MAX_INST        (16)
+
+/*
+ * Dialogue open times are kept in 32 bits of microseconds, which wrap
+ * after 71 minutes, far longer than any dialogue lasts. MTR_DLG_AGE
+ * gives the nanoseconds since the open of a dialogue.
+ */
+#define MTR_DLG_STAMP(ns)       ((u32)((ns) / 1000))
+#define MTR_DLG_AGE(dlg, ns) \
+        ((unsigned long long)(u32)(MTR_DLG_STAMP(ns) - (dlg)->open_us) * 1000)
+
+/*
+ * State of a dialogue refused by overload control, on top of the
+ * MTR_S_xxx states of mtr.h. Its remaining primitives are dropped
+ * until the next dialogue primitive.
+ */
+#define MTR_S_REFUSED           (MTR_S_WAIT_DELIMITER + 1)
+
+/*
+ * Hot state of one dialogue, padded to 16 bytes
+ */
+typedef struct
+{
+  u8  state;                    /* MTR_S_xxx */
+  u8  ptype;                    /* Service primitive received */
+  u8  invoke_id;                /* Invoke id of the service primitive */
+  u8  term_mode;                /* DLG_TERM_MODE_xxx */
+  u16 map_inst;                 /* MAP instance the dialogue came from */
+  u8  trace;                    /* Trace selection (MTR_DLG_TRACE_xxx) */
+  u8  held;                     /* Set while the response is held back */
+  u32 open_us;                  /* When the MAP-OPEN-IND was received (MTR_DLG_STAMP) */
+} __attribute__((aligned(16))) MTR_DLG;
+
+/*
+ * Cold state of one dialogue
+ */
+typedef struct
+{
+  unsigned long long held_ns;   /* When the response was held back */
+  u8  ac_len;                  /* Length of app_context */
+  u8  msisdn_len;               /* Length of msisdn */
+  u8  more_msgs;                /* Set if an MT-FORWARD-SM has more messages to send */
+  u8  fault;                    /* Fault picked for the response (MTR_FLT_xxx) */
+  u8  end_param;                /* Release method, abort reason or open result queued */
+  u8  app_context[MTR_MAX_AC_LEN]; /* Application context of the open */
+  u8  msisdn[MTR_MAX_MSISDN_SIZE]; /* MSISDN of an ATI or SRI for SM */
+  MTR_SUB_REC *sub;             /* Subscriber in the database, 0 if none */
+} MTR_DLG_COLD;
+
+int MTR_dlg_init(u32 num_dlgs, u8 num_inst, u8 huge_pages, u8 term_mode);
+MTR_DLG *MTR_dlg_get(u16 inst, u16 dlg_ref);
+MTR_DLG *MTR_dlg_peek(u16 inst, u16 dlg_ref);
+MTR_DLG_COLD *MTR_dlg_cold(u16 inst, u16 dlg_ref);
+u32 MTR_dlg_active(u16 inst);
+u32 MTR_dlg_states(unsigned long long *state, u32 num_states);
+int MTR_dlg_report(void);
+
+#endif
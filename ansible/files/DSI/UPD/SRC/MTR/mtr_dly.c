@@ -0,0 +1,437 @@
+/*
+ Name:          mtr_dly.c
+
+ Description:   Response delay emulation for MTR.
+
+                Reads the delay file described in mtr_dly.h and draws
+                the time each response is held back from the
+                distribution of its service. Every thread has its own
+                random number generator, so drawing takes no lock.
+
+                Held responses are parked on a timing wheel by the
+                thread owning the dialogue, which sends them when the
+                wheel reaches their release tick; nothing ever sleeps.
+                While any response is held a clock thread sends a wake
+                up to the MTR module every tick, so that a thread
+                blocked waiting for messages still releases them on
+                time.
+
+ Functions:     MTR_dly_load
+                MTR_dly_sample
+                MTR_dly_ticks
+                MTR_dly_start
+                MTR_dly_wake_done
+                MTR_dly_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "mtr_lat.h"
+#include "mtr_dly.h"
+
+/*
+ * Delay distribution of one service
+ */
+typedef struct
+{
+  u8  type;                     /* MTR_DLY_xxx */
+  double a;                     /* Fixed, minimum or log of the median, in us */
+  double b;                     /* Maximum in us, or sigma */
+  u32 *sample;                  /* Empirical delays in us */
+  u32 num_samples;              /* Delays in sample */
+} MTR_DLY;
+
+static int MTR_dly_parse(char *str, double *us);
+static int MTR_dly_read_samples(char *file, MTR_DLY *dly);
+static double MTR_dly_random(void);
+static void *MTR_dly_main(void *arg);
+
+/*
+ * Static data:
+ */
+static MTR_DLY mtr_dly[MTR_LAT_NUM_CLASSES];    /* Distribution of each service */
+static u8 mtr_dly_any;                          /* Set if any service is delayed */
+static u8 mtr_dly_mod_id;                       /* Module the wake up is sent to */
+static u32 (*mtr_dly_held)(void);               /* Returns the responses held */
+static volatile u32 mtr_dly_pending;            /* Set while a wake up is queued */
+static __thread unsigned long long mtr_dly_state; /* This thread's generator */
+static char *mtr_dly_class_name[MTR_LAT_NUM_CLASSES] = MTR_LAT_CLASS_NAMES;
+
+/*
+ * MTR_dly_load
+ *
+ * Reads the delay file.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_dly_load(file)
+  char *file;                   /* Delay file */
+{
+  FILE *fp;                     /* Delay file */
+  char line[MTR_DLY_MAX_LINE];  /* Line of the file */
+  char field[4][MTR_DLY_MAX_LINE]; /* Parameters of a delay */
+  MTR_DLY dly;                  /* Delay being read */
+  char *p;                      /* Start of the line's text */
+  u32 line_num;                 /* Line number */
+  int num;                      /* Parameters read */
+  int c;                        /* Class */
+  int err;                      /* Set on error */
+
+  if ((fp = fopen(file, "r")) == 0)
+  {
+    fprintf(stderr, "MTR: cannot open delay file %s\n", file);
+    return(-1);
+  }
+
+  line_num = 0;
+  err = 0;
+  while ((!err) && (fgets(line, sizeof(line), fp) != 0))
+  {
+    line_num++;
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if ((*p == '\0') || (*p == '*') || (*p == '#'))
+      continue;
+
+    memset(&dly, 0, sizeof(dly));
+    num = 0;
+    if (strncmp(p, "MTR_DELAY", 9) == 0)
+      num = sscanf(p + 9, "%255s %255s %255s %255s", field[0], field[1], field[2], field[3]);
+
+    for (c = MTR_LAT_OPEN + 1; c < MTR_LAT_NUM_CLASSES; c++)
+      if ((num >= 2) && (strcmp(field[0], mtr_dly_class_name[c]) == 0))
+        break;
+    if ((num < 2) || ((c == MTR_LAT_NUM_CLASSES) && (strcmp(field[0], "*") != 0)))
+      err = 1;
+    else if ((strcmp(field[1], "FIXED") == 0) && (num == 3))
+    {
+      dly.type = MTR_DLY_FIXED;
+      err = MTR_dly_parse(field[2], &dly.a);
+    }
+    else if ((strcmp(field[1], "UNIFORM") == 0) && (num == 4))
+    {
+      dly.type = MTR_DLY_UNIFORM;
+      err = (MTR_dly_parse(field[2], &dly.a) != 0) ||
+            (MTR_dly_parse(field[3], &dly.b) != 0) || (dly.b < dly.a);
+    }
+    else if ((strcmp(field[1], "LOGNORMAL") == 0) && (num == 4))
+    {
+      dly.type = MTR_DLY_LOGNORMAL;
+      dly.b = strtod(field[3], &p);
+      err = (MTR_dly_parse(field[2], &dly.a) != 0) || (dly.a <= 0) ||
+            (*p != '\0') || (dly.b < 0) || (dly.b > 10);
+      dly.a = log(dly.a);
+    }
+    else if ((strcmp(field[1], "EMPIRICAL") == 0) && (num == 3))
+    {
+      dly.type = MTR_DLY_EMPIRICAL;
+      err = (MTR_dly_read_samples(field[2], &dly) != 0);
+    }
+    else
+      err = 1;
+
+    if (err)
+    {
+      fprintf(stderr, "MTR: %s line %u: bad delay\n", file, line_num);
+      free(dly.sample);
+      break;
+    }
+
+    /*
+     * Empirical delays may be shared by several services, they are
+     * never freed.
+     */
+    if (c < MTR_LAT_NUM_CLASSES)
+      mtr_dly[c] = dly;
+    else
+      for (c = MTR_LAT_OPEN + 1; c < MTR_LAT_NUM_CLASSES; c++)
+        mtr_dly[c] = dly;
+    mtr_dly_any = 1;
+  }
+  fclose(fp);
+  return(err ? -1 : 0);
+}
+
+/*
+ * MTR_dly_sample
+ *
+ * Draws the time to hold back a response of a service.
+ *
+ * Returns the time in microseconds, 0 to answer at once.
+ */
+u32 MTR_dly_sample(cls)
+  u8 cls;                       /* MTR_LAT_xxx class of the dialogue */
+{
+  MTR_DLY *dly;                 /* Distribution of the service */
+  double us;                    /* Delay */
+  double u1;                    /* Uniform deviate */
+  double u2;                    /* Uniform deviate */
+
+  if ((!mtr_dly_any) || (cls >= MTR_LAT_NUM_CLASSES))
+    return(0);
+
+  dly = &mtr_dly[cls];
+  switch (dly->type)
+  {
+    case MTR_DLY_FIXED:
+      us = dly->a;
+      break;
+
+    case MTR_DLY_UNIFORM:
+      us = dly->a + (dly->b - dly->a) * MTR_dly_random();
+      break;
+
+    case MTR_DLY_LOGNORMAL:
+      /*
+       * Box-Muller, using one of the pair
+       */
+      u1 = 1.0 - MTR_dly_random();
+      u2 = MTR_dly_random();
+      us = exp(dly->a + dly->b * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+      break;
+
+    case MTR_DLY_EMPIRICAL:
+      return(dly->sample[(u32)(MTR_dly_random() * dly->num_samples)]);
+
+    default:
+      return(0);
+  }
+
+  if (us > MTR_DLY_MAX_US)
+    return(MTR_DLY_MAX_US);
+  return((u32)(us + 0.5));
+}
+
+/*
+ * MTR_dly_ticks
+ *
+ * Returns the current tick of the delay clock.
+ */
+u32 MTR_dly_ticks()
+{
+  return((u32)(MTR_lat_now() / (MTR_DLY_TICK_US * 1000ULL)));
+}
+
+/*
+ * MTR_dly_start
+ *
+ * Starts the delay clock, which wakes the given module up every tick
+ * while held returns non-zero.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_dly_start(mod_id, held)
+  u8 mod_id;                    /* Module to wake up */
+  u32 (*held)(void);            /* Returns the number of responses held */
+{
+  pthread_t thread;             /* Clock thread */
+
+  mtr_dly_mod_id = mod_id;
+  mtr_dly_held = held;
+  if (pthread_create(&thread, NULL, MTR_dly_main, NULL) != 0)
+    return(-1);
+  pthread_detach(thread);
+  return(0);
+}
+
+/*
+ * MTR_dly_wake_done
+ *
+ * Called when a wake up is received, allowing the next one to be sent.
+ *
+ * Always returns zero.
+ */
+int MTR_dly_wake_done()
+{
+  mtr_dly_pending = 0;
+  return(0);
+}
+
+/*
+ * MTR_dly_report
+ *
+ * Prints the delay of each service to the console. The delays
+ * achieved are in the latency report.
+ *
+ * Always returns zero.
+ */
+int MTR_dly_report()
+{
+  MTR_DLY *dly;                 /* Distribution of a service */
+  int c;                        /* Class */
+
+  for (c = MTR_LAT_OPEN + 1; c < MTR_LAT_NUM_CLASSES; c++)
+  {
+    dly = &mtr_dly[c];
+    switch (dly->type)
+    {
+      case MTR_DLY_FIXED:
+        printf("MTR Delay %-9s: fixed %.3fms\n", mtr_dly_class_name[c], dly->a / 1000);
+        break;
+
+      case MTR_DLY_UNIFORM:
+        printf("MTR Delay %-9s: uniform %.3fms to %.3fms\n",
+               mtr_dly_class_name[c], dly->a / 1000, dly->b / 1000);
+        break;
+
+      case MTR_DLY_LOGNORMAL:
+        printf("MTR Delay %-9s: lognormal median %.3fms sigma %.2f\n",
+               mtr_dly_class_name[c], exp(dly->a) / 1000, dly->b);
+        break;
+
+      case MTR_DLY_EMPIRICAL:
+        printf("MTR Delay %-9s: empirical, %u delays\n",
+               mtr_dly_class_name[c], dly->num_samples);
+        break;
+    }
+  }
+  return(0);
+}
+
+/*
+ * MTR_dly_parse
+ *
+ * Reads a delay in ms.
+ *
+ * Returns zero or -1 if not a delay.
+ */
+static int MTR_dly_parse(str, us)
+  char *str;                    /* Delay in ms */
+  double *us;                   /* Returns the delay in us */
+{
+  char *end;                    /* End of the number */
+
+  *us = strtod(str, &end) * 1000;
+  if ((end == str) || (*end != '\0') || (!(*us >= 0)) || (*us > MTR_DLY_MAX_US))
+    return(-1);
+  return(0);
+}
+
+/*
+ * MTR_dly_read_samples
+ *
+ * Reads the delays of an empirical distribution.
+ *
+ * Returns zero or -1 on error.
+ */
+static int MTR_dly_read_samples(file, dly)
+  char *file;                   /* File of delays */
+  MTR_DLY *dly;                 /* Returns the delays */
+{
+  FILE *fp;                     /* File of delays */
+  char line[MTR_DLY_MAX_LINE];  /* Line of the file */
+  u32 *new_sample;              /* Delays, grown */
+  u32 max;                      /* Delays allocated */
+  double us;                    /* Delay read */
+  char *p;                      /* Start of the line's text */
+
+  if ((fp = fopen(file, "r")) == 0)
+    return(-1);
+
+  max = 0;
+  while (fgets(line, sizeof(line), fp) != 0)
+  {
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if ((*p == '\0') || (*p == '*') || (*p == '#'))
+      continue;
+    p[strcspn(p, " \t\r\n")] = '\0';
+
+    if ((MTR_dly_parse(p, &us) != 0) || (dly->num_samples == MTR_DLY_MAX_SAMPLES))
+      break;
+    if (dly->num_samples == max)
+    {
+      max = max ? max * 2 : 1024;
+      if ((new_sample = realloc(dly->sample, max * sizeof(u32))) == 0)
+        break;
+      dly->sample = new_sample;
+    }
+    dly->sample[dly->num_samples++] = (u32)(us + 0.5);
+  }
+
+  /*
+   * Any line not read is an error
+   */
+  if ((!feof(fp)) || (dly->num_samples == 0))
+  {
+    fclose(fp);
+    return(-1);
+  }
+  fclose(fp);
+  return(0);
+}
+
+/*
+ * MTR_dly_random
+ *
+ * Returns a uniform deviate in [0, 1) from the calling thread's
+ * xorshift64* generator, seeded on first use.
+ */
+static double MTR_dly_random()
+{
+  unsigned long long x;         /* Generator state */
+
+  if ((x = mtr_dly_state) == 0)
+    x = (MTR_lat_now() ^ (unsigned long long)(size_t)&mtr_dly_state) | 1;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  mtr_dly_state = x;
+  return((double)((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*
+ * MTR_dly_main
+ *
+ * Clock thread body. Wakes the MTR module up every tick while any
+ * response is held, unless the last wake up has not been received.
+ *
+ * Never returns.
+ */
+static void *MTR_dly_main(arg)
+  void *arg;                    /* Unused */
+{
+  struct timespec next;         /* Next tick */
+  MSG *m;                       /* Wake up message */
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1)
+  {
+    next.tv_nsec += MTR_DLY_TICK_US * 1000L;
+    if (next.tv_nsec >= 1000000000L)
+    {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+      ;
+
+    if (mtr_dly_held() == 0)
+      continue;
+    if (__sync_lock_test_and_set(&mtr_dly_pending, 1) != 0)
+      continue;
+
+    if ((m = getm(MTR_DLY_MSG_TICK, 0, 0, 0)) == 0)
+    {
+      mtr_dly_pending = 0;
+      continue;
+    }
+    m->hdr.src = mtr_dly_mod_id;
+    m->hdr.dst = mtr_dly_mod_id;
+    if (GCT_send(mtr_dly_mod_id, (HDR *)m) != 0)
+    {
+      relm((HDR *)m);
+      mtr_dly_pending = 0;
+    }
+  }
+  return(NULL);
+}
@@ -0,0 +1,63 @@
+/*
+ Name:          mtr_dly.h
+
+ Description:   Definitions for MTR response delay emulation.
+
+                The delay file holds one distribution per service, in
+                the style of config.txt, with '*' or '#' starting a
+                comment:
+
+                  MTR_DELAY <service> FIXED <ms>
+                  MTR_DELAY <service> UNIFORM <min ms> <max ms>
+                  MTR_DELAY <service> LOGNORMAL <median ms> <sigma>
+                  MTR_DELAY <service> EMPIRICAL <file>
+
+                The service is one of the latency classes other than
+                open, or * for all of them. An empirical file holds one
+                delay in ms per line, each equally likely. Delays may
+                have fractions of a ms. When a service is given twice
+                the last line wins.
+ */
+
+#ifndef MTR_DLY_H
+#define MTR_DLY_H
+
+/*
+ * Resolution of the release time of a held response
+ */
+#define MTR_DLY_TICK_US         (1000)
+
+/*
+ * Message type of the wake up sent by the delay clock to the MTR
+ * module itself while responses are held. It never leaves the module.
+ */
+#define MTR_DLY_MSG_TICK        (0x7f02)
+
+/*
+ * Longest delay, in microseconds
+ */
+#define MTR_DLY_MAX_US          (3600000000UL)
+
+/*
+ * Longest line of a delay file, and most delays in an empirical file
+ */
+#define MTR_DLY_MAX_LINE        (256)
+#define MTR_DLY_MAX_SAMPLES     (1000000)
+
+/*
+ * Distributions
+ */
+#define MTR_DLY_NONE            (0)
+#define MTR_DLY_FIXED           (1)
+#define MTR_DLY_UNIFORM         (2)
+#define MTR_DLY_LOGNORMAL       (3)
+#define MTR_DLY_EMPIRICAL       (4)
+
+int MTR_dly_load(char *file);
+u32 MTR_dly_sample(u8 cls);
+u32 MTR_dly_ticks(void);
+int MTR_dly_start(u8 mod_id, u32 (*held)(void));
+int MTR_dly_wake_done(void);
+int MTR_dly_report(void);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ Name:          mtr_flt.c
+
+ Description:   Fault injection for MTR.
+
+                Reads the fault file described in mtr_flt.h and picks
+                the outcome of each response from the profile matching
+                its service and MSISDN. Profiles are few, so they are
+                searched in turn.
+
+                The generators are seeded from the seed and the thread
+                number rather than the time, so a run can be repeated.
+                A draw is only taken for a dialogue matching a profile,
+                so services without faults do not change the outcomes
+                of the others.
+
+ Functions:     MTR_flt_load
+                MTR_flt_pick
+                MTR_flt_error
+                MTR_flt_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "system.h"
+#include "msg.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+#include "mtr_rte.h"
+#include "mtr_flt.h"
+
+/*
+ * Outcomes of one service for MSISDNs with a prefix
+ */
+typedef struct
+{
+  u8  cls;                      /* MTR_LAT_xxx class */
+  u8  prefix_len;               /* Digits in prefix, 0 for any MSISDN */
+  u8  prefix[MTR_RTE_MAX_DIGITS]; /* MSISDN prefix, one digit per octet */
+  u32 limit[MTR_FLT_NUM_OUTCOMES]; /* Draws below which each outcome is
+                                    * picked, in MTR_FLT_SCALE units */
+} MTR_FLT;
+
+static MTR_FLT *MTR_flt_profile(u8 cls, u8 *prefix, u8 prefix_len);
+static u32 MTR_flt_random(u8 thread);
+static int MTR_flt_valid(u8 outcome, u8 cls);
+
+/*
+ * Static data:
+ */
+static MTR_FLT mtr_flt[MTR_FLT_MAX_PROFILES];   /* Profiles */
+static u32 mtr_flt_num;                         /* Profiles in use */
+static unsigned long long mtr_flt_seed;         /* Seed of the generators */
+static struct
+{
+  unsigned long long x;                         /* Generator state, 0 until seeded */
+} __attribute__((aligned(MTR_CACHE_LINE))) mtr_flt_state[MTR_MAX_WORKERS];
+static char *mtr_flt_class_name[MTR_LAT_NUM_CLASSES] = MTR_LAT_CLASS_NAMES;
+static char *mtr_flt_outcome_name[MTR_FLT_NUM_OUTCOMES] = MTR_FLT_OUTCOME_NAMES;
+static char *mtr_flt_keyword[MTR_FLT_NUM_OUTCOMES] =
+  { "", "UNKNOWN", "ABSENT", "MEMORY", "SYSTEM", "ABORT", "DROP", "DUPLICATE" };
+
+/*
+ * MAP user error sent for each user error outcome of each service, 0
+ * where the operation has no such error (3GPP TS 29.002). Indexed by
+ * MTR_LAT_xxx class and MTR_FLT_xxx outcome up to MTR_FLT_SYSTEM.
+ */
+static u8 mtr_flt_err[MTR_LAT_NUM_CLASSES][MTR_FLT_SYSTEM + 1] =
+{
+  /*   unknown                  absent                   memory                   system */
+  { 0, 0,                       0,                       0,                       0                   }, /* open */
+  { 0, 0,                       MTR_FLT_ERR_ABSENT_SM,   MTR_FLT_ERR_SM_FAILURE,  MTR_FLT_ERR_SYSTEM  }, /* fwd-sm */
+  { 0, 0,                       MTR_FLT_ERR_ABSENT_SM,   MTR_FLT_ERR_SM_FAILURE,  MTR_FLT_ERR_SYSTEM  }, /* mt-fwd-sm */
+  { 0, MTR_FLT_ERR_UNKNOWN_SUB, 0,                       0,                       0                   }, /* send-imsi */
+  { 0, MTR_FLT_ERR_UNKNOWN_SUB, MTR_FLT_ERR_ABSENT_SUB,  0,                       MTR_FLT_ERR_SYSTEM  }, /* sri-gprs */
+  { 0, MTR_FLT_ERR_UNKNOWN_SUB, MTR_FLT_ERR_ABSENT_SM,   0,                       MTR_FLT_ERR_SYSTEM  }, /* sri-sm */
+  { 0, 0,                       0,                       0,                       MTR_FLT_ERR_SYSTEM  }, /* ussd */
+  { 0, MTR_FLT_ERR_UNKNOWN_SUB, 0,                       0,                       MTR_FLT_ERR_SYSTEM  }, /* ati */
+  { 0, 0,                       0,                       0,                       0                   }, /* other */
+};
+
+/*
+ * MTR_flt_load
+ *
+ * Reads the fault file.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_flt_load(file)
+  char *file;                   /* Fault file */
+{
+  FILE *fp;                     /* Fault file */
+  char line[MTR_FLT_MAX_LINE];  /* Line of the file */
+  char field[4][MTR_FLT_MAX_LINE]; /* Parameters of a fault */
+  u8  prefix[MTR_RTE_MAX_DIGITS]; /* MSISDN prefix */
+  u8  prefix_len;               /* Digits in prefix */
+  MTR_FLT *flt;                 /* Profile the fault is added to */
+  double percent;               /* Share of the outcome */
+  u32 share;                    /* Share in MTR_FLT_SCALE units */
+  char *p;                      /* Start of the line's text */
+  char *end;                    /* End of a number */
+  u32 line_num;                 /* Line number */
+  int num;                      /* Parameters read */
+  int c;                        /* Class */
+  int o;                        /* Outcome */
+  int i;                        /* Class the fault is added to */
+  int k;                        /* Outcome index */
+  int err;                      /* Set on error */
+
+  if ((fp = fopen(file, "r")) == 0)
+  {
+    fprintf(stderr, "MTR: cannot open fault file %s\n", file);
+    return(-1);
+  }
+
+  line_num = 0;
+  err = 0;
+  while ((!err) && (fgets(line, sizeof(line), fp) != 0))
+  {
+    line_num++;
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if ((*p == '\0') || (*p == '*') || (*p == '#'))
+      continue;
+
+    if (strncmp(p, "MTR_FAULT_SEED", 14) == 0)
+    {
+      num = sscanf(p + 14, "%255s", field[0]);
+      if (num == 1)
+        mtr_flt_seed = strtoull(field[0], &end, 0);
+      if ((num != 1) || (*end != '\0'))
+      {
+        fprintf(stderr, "MTR: %s line %u: bad seed\n", file, line_num);
+        err = 1;
+      }
+      continue;
+    }
+
+    num = 0;
+    if (strncmp(p, "MTR_FAULT", 9) == 0)
+      num = sscanf(p + 9, "%255s %255s %255s %255s", field[0], field[1], field[2], field[3]);
+
+    /*
+     * Service, prefix, outcome and percentage
+     */
+    for (c = MTR_LAT_OPEN + 1; c < MTR_LAT_NUM_CLASSES; c++)
+      if ((num == 4) && (strcmp(field[0], mtr_flt_class_name[c]) == 0))
+        break;
+    if ((num != 4) || ((c == MTR_LAT_NUM_CLASSES) && (strcmp(field[0], "*") != 0)))
+      err = 1;
+
+    prefix_len = 0;
+    if ((!err) && (strcmp(field[1], "+") != 0))
+    {
+      for (p = field[1]; (!err) && (*p != '\0'); p++)
+      {
+        if ((!isdigit((unsigned char)*p)) || (prefix_len == MTR_RTE_MAX_DIGITS))
+          err = 1;
+        else
+          prefix[prefix_len++] = (u8)(*p - '0');
+      }
+      if (prefix_len == 0)
+        err = 1;
+    }
+
+    for (o = MTR_FLT_NONE + 1; o < MTR_FLT_NUM_OUTCOMES; o++)
+      if ((!err) && (strcmp(field[2], mtr_flt_keyword[o]) == 0))
+        break;
+    if (o == MTR_FLT_NUM_OUTCOMES)
+      err = 1;
+
+    percent = 0;
+    if (!err)
+    {
+      percent = strtod(field[3], &end);
+      if ((*end != '\0') || (percent < 0) || (percent > 100))
+        err = 1;
+    }
+    share = (u32)(percent * (MTR_FLT_SCALE / 100) + 0.5);
+
+    /*
+     * A user error the service cannot return is refused, for * it is
+     * only added to the services that can return it.
+     */
+    if ((!err) && (c != MTR_LAT_NUM_CLASSES) && (!MTR_flt_valid((u8)o, (u8)c)))
+    {
+      fprintf(stderr, "MTR: %s line %u: %s cannot return %s\n",
+              file, line_num, mtr_flt_class_name[c], mtr_flt_keyword[o]);
+      err = 1;
+      continue;
+    }
+
+    /*
+     * Add the share to the profile of each service, keeping the
+     * limits cumulative.
+     */
+    for (i = MTR_LAT_OPEN + 1; (!err) && (i < MTR_LAT_NUM_CLASSES); i++)
+    {
+      if (((c != MTR_LAT_NUM_CLASSES) && (i != c)) || (!MTR_flt_valid((u8)o, (u8)i)))
+        continue;
+      if ((flt = MTR_flt_profile((u8)i, prefix, prefix_len)) == 0)
+        err = 1;
+      else if (flt->limit[MTR_FLT_NUM_OUTCOMES - 1] + share > MTR_FLT_SCALE)
+        err = 1;
+      else
+        for (k = o; k < MTR_FLT_NUM_OUTCOMES; k++)
+          flt->limit[k] += share;
+    }
+
+    if (err)
+      fprintf(stderr, "MTR: %s line %u: bad fault\n", file, line_num);
+  }
+  fclose(fp);
+  return(err ? -1 : 0);
+}
+
+/*
+ * MTR_flt_profile
+ *
+ * Finds the profile of a service for a prefix, adding it if new.
+ *
+ * Returns the profile, 0 if there are too many.
+ */
+static MTR_FLT *MTR_flt_profile(cls, prefix, prefix_len)
+  u8 cls;                       /* MTR_LAT_xxx class */
+  u8 *prefix;                   /* MSISDN prefix */
+  u8 prefix_len;                /* Digits in prefix */
+{
+  MTR_FLT *flt;                 /* Profile */
+  u32 i;                        /* Profile index */
+
+  for (i = 0; i < mtr_flt_num; i++)
+  {
+    flt = &mtr_flt[i];
+    if ((flt->cls == cls) && (flt->prefix_len == prefix_len) &&
+        (memcmp(flt->prefix, prefix, prefix_len) == 0))
+      return(flt);
+  }
+
+  if (mtr_flt_num == MTR_FLT_MAX_PROFILES)
+    return(0);
+  flt = &mtr_flt[mtr_flt_num++];
+  memset(flt, 0, sizeof(MTR_FLT));
+  flt->cls = cls;
+  flt->prefix_len = prefix_len;
+  memcpy(flt->prefix, prefix, prefix_len);
+  return(flt);
+}
+
+/*
+ * MTR_flt_pick
+ *
+ * Picks the outcome of a response. Only the given thread may draw from
+ * its generator.
+ *
+ * Returns the outcome, MTR_FLT_NONE to answer normally.
+ */
+u8 MTR_flt_pick(cls, digits, num_digits, thread)
+  u8 cls;                       /* MTR_LAT_xxx class of the dialogue */
+  u8 *digits;                   /* MSISDN digits, one per octet */
+  u8 num_digits;                /* Digits in the MSISDN, 0 if none */
+  u8 thread;                    /* Thread running the dialogue */
+{
+  MTR_FLT *flt;                 /* Profile */
+  MTR_FLT *best;                /* Profile with the longest prefix */
+  u32 draw;                     /* Random draw */
+  u32 i;                        /* Profile index */
+  u8  o;                        /* Outcome */
+
+  best = 0;
+  for (i = 0; i < mtr_flt_num; i++)
+  {
+    flt = &mtr_flt[i];
+    if ((flt->cls == cls) && (flt->prefix_len <= num_digits) &&
+        ((best == 0) || (flt->prefix_len > best->prefix_len)) &&
+        (memcmp(flt->prefix, digits, flt->prefix_len) == 0))
+      best = flt;
+  }
+  if ((best == 0) || (best->limit[MTR_FLT_NUM_OUTCOMES - 1] == 0))
+    return(MTR_FLT_NONE);
+
+  draw = MTR_flt_random(thread);
+  for (o = MTR_FLT_NONE + 1; o < MTR_FLT_NUM_OUTCOMES; o++)
+    if (draw < best->limit[o])
+      return(o);
+  return(MTR_FLT_NONE);
+}
+
+/*
+ * MTR_flt_error
+ *
+ * Returns the MAP user error sent for an outcome, 0 if the outcome is
+ * not a user error or the service has no such error.
+ */
+u8 MTR_flt_error(outcome, cls)
+  u8 outcome;                   /* MTR_FLT_xxx */
+  u8 cls;                       /* MTR_LAT_xxx class of the dialogue */
+{
+  if ((outcome > MTR_FLT_SYSTEM) || (cls >= MTR_LAT_NUM_CLASSES))
+    return(0);
+  return(mtr_flt_err[cls][outcome]);
+}
+
+/*
+ * MTR_flt_valid
+ *
+ * Returns non-zero if a service can be given an outcome, that is the
+ * outcome is not a user error or the operation has a matching error.
+ */
+static int MTR_flt_valid(outcome, cls)
+  u8 outcome;                   /* MTR_FLT_xxx */
+  u8 cls;                       /* MTR_LAT_xxx class */
+{
+  return((outcome > MTR_FLT_SYSTEM) || (MTR_flt_error(outcome, cls) != 0));
+}
+
+/*
+ * MTR_flt_random
+ *
+ * Returns a draw from 0 to MTR_FLT_SCALE - 1 from a thread's
+ * xorshift64* generator, seeded on first use.
+ */
+static u32 MTR_flt_random(thread)
+  u8 thread;                    /* Thread drawing */
+{
+  unsigned long long x;         /* Generator state */
+
+  if ((x = mtr_flt_state[thread].x) == 0)
+  {
+    /*
+     * splitmix64 of the seed and thread, so that the threads'
+     * sequences are unrelated
+     */
+    x = mtr_flt_seed + (thread + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = (x ^ (x >> 31)) | 1;
+  }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  mtr_flt_state[thread].x = x;
+  return((u32)((((x * 0x2545f4914f6cdd1dULL) >> 32) * MTR_FLT_SCALE) >> 32));
+}
+
+/*
+ * MTR_flt_report
+ *
+ * Prints the profiles and the outcomes injected so far to the console.
+ *
+ * Always returns zero.
+ */
+int MTR_flt_report(count)
+  unsigned long long *count;    /* Outcomes injected, by MTR_FLT_xxx */
+{
+  MTR_FLT *flt;                 /* Profile */
+  char prefix[MTR_RTE_MAX_DIGITS + 1]; /* Printable prefix */
+  u32 i;                        /* Profile index */
+  u8  o;                        /* Outcome */
+  u8  d;                        /* Digit index */
+
+  printf("MTR Fault seed: %llu\n", mtr_flt_seed);
+  for (i = 0; i < mtr_flt_num; i++)
+  {
+    flt = &mtr_flt[i];
+    if (flt->limit[MTR_FLT_NUM_OUTCOMES - 1] == 0)
+      continue;
+    for (d = 0; d < flt->prefix_len; d++)
+      prefix[d] = (char)('0' + flt->prefix[d]);
+    prefix[d] = '\0';
+    printf("MTR Faults %-9s %-*s:", mtr_flt_class_name[flt->cls],
+           MTR_RTE_MAX_DIGITS, flt->prefix_len ? prefix : "+");
+    for (o = MTR_FLT_NONE + 1; o < MTR_FLT_NUM_OUTCOMES; o++)
+      if (flt->limit[o] != flt->limit[o - 1])
+        printf(" %s %.4f%%", mtr_flt_outcome_name[o],
+               (double)(flt->limit[o] - flt->limit[o - 1]) * 100 / MTR_FLT_SCALE);
+    printf("\n");
+  }
+  printf("MTR Faults injected:");
+  for (o = MTR_FLT_NONE + 1; o < MTR_FLT_NUM_OUTCOMES; o++)
+    printf(" %s %llu;", mtr_flt_outcome_name[o], count[o]);
+  printf("\n");
+  return(0);
+}
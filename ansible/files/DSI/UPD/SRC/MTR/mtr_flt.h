@@ -0,0 +1,99 @@
+/*
+ Name:          mtr_flt.h
+
+ Description:   Definitions for MTR fault injection.
+
+                The fault file gives the outcomes injected into the
+                responses of each service, in the style of config.txt,
+                with '*' or '#' starting a comment:
+
+                  MTR_FAULT_SEED <seed>
+                  MTR_FAULT <service> <msisdn prefix> <outcome> <percent>
+
+                The service is one of the latency classes other than
+                open, or * for all of them. The prefix + matches any
+                MSISDN, as in mtr_rte.h. The outcome is one of:
+
+                  UNKNOWN       unknown subscriber user error, for
+                                send-imsi, sri-gprs, sri-sm and ati
+                  ABSENT        absent subscriber SM user error for
+                                fwd-sm, mt-fwd-sm and sri-sm, absent
+                                subscriber for sri-gprs
+                  MEMORY        SM delivery failure user error, memory
+                                capacity exceeded, for fwd-sm and
+                                mt-fwd-sm
+                  SYSTEM        system failure user error, for all but
+                                send-imsi and other
+                  ABORT         the dialogue is aborted
+                  DROP          the dialogue is released without a reply
+                  DUPLICATE     the response is sent twice
+
+                A user error is only given to the services whose
+                operation can return it. A line naming a service that
+                cannot is refused; with * the line only applies to the
+                services that can.
+
+                Lines with the same service and prefix make up one
+                profile, whose percentages may add up to at most 100.
+                The profile with the longest prefix matching the MSISDN
+                of a dialogue picks its outcome; a dialogue matching no
+                profile is answered normally.
+
+                Each thread running dialogues draws from its own random
+                number generator, seeded from the seed and the thread,
+                so the same seed replays the same outcomes for the same
+                dialogues.
+ */
+
+#ifndef MTR_FLT_H
+#define MTR_FLT_H
+
+/*
+ * Outcomes
+ */
+#define MTR_FLT_NONE            (0)     /* Answered normally */
+#define MTR_FLT_UNKNOWN         (1)
+#define MTR_FLT_ABSENT          (2)
+#define MTR_FLT_MEMORY          (3)
+#define MTR_FLT_SYSTEM          (4)
+#define MTR_FLT_ABORT           (5)
+#define MTR_FLT_DROP            (6)
+#define MTR_FLT_DUPLICATE       (7)
+#define MTR_FLT_NUM_OUTCOMES    (8)
+#define MTR_FLT_UNPICKED        (0xff)  /* Not yet picked for the response */
+
+/*
+ * Names of the outcomes, indexed by MTR_FLT_xxx
+ */
+#define MTR_FLT_OUTCOME_NAMES \
+        { "none", "unknown", "absent", "memory", "system", \
+          "abort", "drop", "duplicate" }
+
+/*
+ * MAP user error codes sent
+ */
+#define MTR_FLT_ERR_UNKNOWN_SUB (1)     /* unknownSubscriber */
+#define MTR_FLT_ERR_ABSENT_SM   (6)     /* absentSubscriberSM */
+#define MTR_FLT_ERR_ABSENT_SUB  (27)    /* absentSubscriber */
+#define MTR_FLT_ERR_SM_FAILURE  (32)    /* sm-DeliveryFailure */
+#define MTR_FLT_ERR_SYSTEM      (34)    /* systemFailure */
+
+/*
+ * SM-DeliveryFailureCause sent with sm-DeliveryFailure
+ */
+#define MTR_FLT_CAUSE_MEM_FULL  (0)     /* memoryCapacityExceeded */
+
+/*
+ * Most profiles, longest line of the fault file, and the resolution
+ * of a percentage (parts per million)
+ */
+#define MTR_FLT_MAX_PROFILES    (256)
+#define MTR_FLT_MAX_LINE        (256)
+#define MTR_FLT_SCALE           (1000000)
+
+int MTR_flt_load(char *file);
+u8  MTR_flt_pick(u8 cls, u8 *digits, u8 num_digits, u8 thread);
+u8  MTR_flt_error(u8 outcome, u8 cls);
+int MTR_flt_report(unsigned long long *count);
+
+#endif
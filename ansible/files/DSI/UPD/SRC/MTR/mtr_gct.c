@@ -0,0 +1,1077 @@
+/*
+ Name:          mtr_gct.c
+
+ Description:   In-process stand-in for the GCT library.
+
+                Linked in place of gctlib, it lets MTR build and run on
+                any Linux machine, without gctload, the DSI stack or a
+                peer, so that the state machine can be measured under
+                repeatable conditions.
+
+                getm() and relm() take messages from a fixed pool,
+                allocated on first use. GCT_send() appends a message to
+                the in-memory queue of its destination module, from
+                which GCT_receive() and GCT_grab() take it. The MAP
+                instance of a message is kept alongside it.
+
+                Messages sent to the MAP module are handled by a fake
+                MAP peer, which plays the part of MTU: it opens a window
+                of dialogues towards the first module to receive, each
+                with an open indication, a service indication and a
+                delimiter indication, answers the USSD menu sent for a
+                process USSD request, sends each further MT-FORWARD-SM
+                segment once the last is answered, and opens the next
+                dialogue when one is closed or aborted. The services are taken in turn
+                from a script. Once all the dialogues have ended the
+                peer prints the throughput and dialogue latency it saw
+                and ends the process.
+
+                The indications of each step of a dialogue are sent
+                together or not at all. A step that finds the pool empty
+                is sent again once messages have been released, when the
+                peer is next called or when MTR waits to receive.
+
+                The stand-in is configured from the environment:
+
+                  MTR_GCT_POOL      messages in the pool (default 65536)
+                  MTR_GCT_MAP_ID    module id of the fake MAP (default 0x15)
+                  MTR_GCT_DLGS      dialogues to run, 0 for no limit
+                                    (default 100000)
+                  MTR_GCT_WINDOW    dialogues in flight (default 256)
+                  MTR_GCT_FIRST_ID  first dialogue id (default 0x8000)
+                  MTR_GCT_SCRIPT    services used in turn, any of sri-sm,
+                                    mt-fwd-sm, ussd and ati, separated by
+                                    commas (default sri-sm)
+                  MTR_GCT_SEGMENTS  MT-FORWARD-SM segments per dialogue,
+                                    all but the last with more messages
+                                    to send (default 1)
+
+                The DSI headers are still needed to build, and the
+                messages follow their MSG layout, with the parameter
+                area inside the message.
+
+ Functions:     getm
+                relm
+                GCT_send
+                GCT_receive
+                GCT_grab
+                GCT_get_instance
+                GCT_set_instance
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr_prs.h"
+#include "mtr_gsm.h"
+#include "mtr_lat.h"
+
+/*
+ * Defaults of the settings
+ */
+#define MTR_GCT_DEF_POOL        (65536)
+#define MTR_GCT_DEF_MAP_ID      (0x15)
+#define MTR_GCT_DEF_DLGS        (100000)
+#define MTR_GCT_DEF_WINDOW      (256)
+#define MTR_GCT_DEF_FIRST_ID    (0x8000)
+#define MTR_GCT_DEF_SEGMENTS    (1)
+
+/*
+ * Modules with a queue, and most services in a script
+ */
+#define MTR_GCT_NUM_MODULES     (256)
+#define MTR_GCT_MAX_SCRIPT      (64)
+
+/*
+ * States of a dialogue of the peer
+ */
+#define MTR_GCT_S_IDLE          (0)     /* Not in use */
+#define MTR_GCT_S_OPEN          (1)     /* Opened, waiting for the response */
+#define MTR_GCT_S_MENU          (2)     /* USSD menu received, waiting for its delimiter */
+
+/*
+ * Steps of a dialogue of the peer, each a group of indications
+ */
+#define MTR_GCT_STEP_OPEN       (0)     /* Open, service and delimiter */
+#define MTR_GCT_STEP_MENU       (1)     /* USSD menu answer and delimiter */
+#define MTR_GCT_STEP_SEGMENT    (2)     /* Next MT-FORWARD-SM segment and delimiter */
+
+/*
+ * Most indications in a step, and how long MTR waits to receive
+ * before a step is retried
+ */
+#define MTR_GCT_MAX_STEP        (3)
+#define MTR_GCT_RETRY_NS        (1000000)
+
+/*
+ * Dialogue latency histogram: one bucket per power of two microseconds
+ */
+#define MTR_GCT_LAT_BUCKETS     (32)
+
+/*
+ * A message of the pool. The message comes first, so that a pointer
+ * to its header is a pointer to the slot.
+ */
+typedef struct mtr_gct_slot
+{
+  MSG m;                        /* Message */
+  struct mtr_gct_slot *next;    /* Next in the pool or a queue */
+  u16 instance;                 /* MAP instance */
+} MTR_GCT_SLOT;
+
+/*
+ * Queue of one module
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;         /* Signalled when a message is queued */
+  MTR_GCT_SLOT *head;           /* Next message to receive */
+  MTR_GCT_SLOT *tail;           /* Last message queued */
+  u32 count;                    /* Messages queued */
+  u32 max_count;                /* Most messages queued */
+} MTR_GCT_QUEUE;
+
+/*
+ * A service of the script
+ */
+typedef struct
+{
+  char *name;                   /* Name, as a latency class */
+  u8  ind;                      /* Service indication sent */
+  u8  ac;                       /* Application context (last but one arc) */
+  u8  ac_version;               /* Application context version */
+} MTR_GCT_SRV;
+
+/*
+ * A dialogue of the peer
+ */
+typedef struct
+{
+  u8  state;                    /* MTR_GCT_S_xxx */
+  u8  srv;                      /* Index of the service */
+  u8  invoke_id;                /* Invoke id of the USSD menu */
+  u8  step;                     /* Last step, MTR_GCT_STEP_xxx */
+  u8  retry;                    /* Set while the step waits to be sent */
+  u32 segments;                 /* MT-FORWARD-SM segments still to send */
+  unsigned long long open_ns;   /* When the dialogue was opened */
+} MTR_GCT_DLG;
+
+static void MTR_gct_init(void);
+static u32 MTR_gct_env(char *name, u32 def);
+static int MTR_gct_script(char *script);
+static int MTR_gct_queue(u8 dst, MTR_GCT_SLOT *s);
+static HDR *MTR_gct_take(u8 mod_id, int wait);
+static int MTR_gct_start(u8 mod_id);
+static int MTR_gct_open(u16 ref);
+static int MTR_gct_peer(MSG *m);
+static int MTR_gct_ended(u16 ref, u8 closed);
+static int MTR_gct_step(u16 ref, u8 step);
+static int MTR_gct_retry(void);
+static MSG *MTR_gct_ind(u16 type, u16 dlg_id, u8 *params, u16 len);
+static u16 MTR_gct_srv_params(u8 *pptr, u8 srv, u8 more);
+static u8  MTR_gct_put_addr(u8 *dst, u8 *digits, u8 num_digits);
+static u8  MTR_gct_put_tbcd(u8 *dst, u8 *digits, u8 num_digits);
+static int MTR_gct_report(void);
+
+/*
+ * Static data:
+ */
+static pthread_once_t mtr_gct_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mtr_gct_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static MTR_GCT_SLOT *mtr_gct_pool;      /* Pool of messages */
+static MTR_GCT_SLOT *mtr_gct_free;      /* Messages not in use */
+static u32 mtr_gct_pool_size;           /* Messages in the pool */
+static u32 mtr_gct_num_free;            /* Messages not in use */
+static u32 mtr_gct_min_free;            /* Fewest messages not in use */
+static u32 mtr_gct_getm_fail;           /* Times the pool was empty */
+static MTR_GCT_QUEUE mtr_gct_queue[MTR_GCT_NUM_MODULES];
+
+static MTR_GCT_SRV mtr_gct_srv[] =
+{
+  { "sri-sm",    MAPST_SND_RTISM_IND,        20, 3 },
+  { "mt-fwd-sm", MAPST_MT_FWD_SM_IND,        25, 3 },
+  { "ussd",      MAPST_PRO_UNSTR_SS_REQ_IND, 19, 2 },
+  { "ati",       MAPST_ANYTIME_INT_IND,      29, 3 },
+};
+#define MTR_GCT_NUM_SRV         (sizeof(mtr_gct_srv) / sizeof(MTR_GCT_SRV))
+
+static const u8 mtr_gct_msisdn[12] = { 4, 4, 7, 7, 0, 0, 9, 0, 0, 0, 0, 0 }; /* MSISDN, last digits counted */
+static const u8 mtr_gct_imsi[15] = { 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }; /* IMSI, last digits counted */
+static u8 mtr_gct_sc[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 0 }; /* Service centre address */
+
+static pthread_mutex_t mtr_gct_peer_lock = PTHREAD_MUTEX_INITIALIZER;
+static u8  mtr_gct_map_id;              /* Module id of the fake MAP */
+static u8  mtr_gct_user_id;             /* Module the peer opens dialogues to */
+static u8  mtr_gct_started;             /* Set once the peer has started */
+static u8  mtr_gct_script_srv[MTR_GCT_MAX_SCRIPT]; /* Services used in turn */
+static u32 mtr_gct_script_len;          /* Entries of mtr_gct_script_srv used */
+static u32 mtr_gct_window;              /* Dialogues in flight */
+static u32 mtr_gct_segments;            /* MT-FORWARD-SM segments per dialogue */
+static u16 mtr_gct_first_id;            /* First dialogue id */
+static MTR_GCT_DLG *mtr_gct_dlg;        /* Dialogues, one per window entry */
+static unsigned long long mtr_gct_total; /* Dialogues to run, 0 for no limit */
+static unsigned long long mtr_gct_opened; /* Dialogues opened */
+static unsigned long long mtr_gct_closed; /* Dialogues closed by MTR */
+static unsigned long long mtr_gct_aborted; /* Dialogues refused or aborted */
+static unsigned long long mtr_gct_in_flight; /* Dialogues open */
+static unsigned long long mtr_gct_start_ns; /* When the peer started */
+static unsigned long long mtr_gct_lat_sum; /* Sum of dialogue latencies in ns */
+static unsigned long long mtr_gct_lat_max; /* Longest dialogue in ns */
+static unsigned long long mtr_gct_lat[MTR_GCT_LAT_BUCKETS]; /* Dialogue latency histogram */
+static u32 mtr_gct_peer_fail;           /* Steps the peer found the pool empty for */
+static volatile u32 mtr_gct_num_retry;  /* Dialogues with a step to retry */
+
+/*
+ * getm
+ *
+ * Allocates a message from the pool.
+ *
+ * Returns the message or zero if the pool is empty or the parameter
+ * area too long.
+ */
+MSG *getm(type, id, rsp_req, len)
+  u16 type;                     /* Message type */
+  u16 id;                       /* Message id */
+  u16 rsp_req;                  /* Response requested */
+  u16 len;                      /* Length of the parameter area */
+{
+  MTR_GCT_SLOT *s;              /* Slot allocated */
+
+  pthread_once(&mtr_gct_once, MTR_gct_init);
+  if (len > MAX_PARAM_LEN)
+    return(0);
+
+  pthread_mutex_lock(&mtr_gct_pool_lock);
+  if ((s = mtr_gct_free) != 0)
+  {
+    mtr_gct_free = s->next;
+    if (--mtr_gct_num_free < mtr_gct_min_free)
+      mtr_gct_min_free = mtr_gct_num_free;
+  }
+  else
+    mtr_gct_getm_fail++;
+  pthread_mutex_unlock(&mtr_gct_pool_lock);
+  if (s == 0)
+    return(0);
+
+  memset(&s->m.hdr, 0, sizeof(HDR));
+  s->m.hdr.type = type;
+  s->m.hdr.id = id;
+  s->m.hdr.rsp_req = rsp_req;
+  s->m.len = len;
+  memset(get_param(&s->m), 0, len);
+  s->next = 0;
+  s->instance = 0;
+  return(&s->m);
+}
+
+/*
+ * relm
+ *
+ * Returns a message to the pool.
+ *
+ * Always returns zero.
+ */
+int relm(h)
+  HDR *h;                       /* Message to release */
+{
+  MTR_GCT_SLOT *s;              /* Slot of the message */
+
+  s = (MTR_GCT_SLOT *)h;
+  pthread_mutex_lock(&mtr_gct_pool_lock);
+  s->next = mtr_gct_free;
+  mtr_gct_free = s;
+  mtr_gct_num_free++;
+  pthread_mutex_unlock(&mtr_gct_pool_lock);
+  return(0);
+}
+
+/*
+ * GCT_send
+ *
+ * Sends a message to a module. Messages to the MAP module are handled
+ * by the fake peer and released at once.
+ *
+ * Always returns zero.
+ */
+int GCT_send(dst, h)
+  unsigned int dst;             /* Destination module */
+  HDR *h;                       /* Message to send */
+{
+  pthread_once(&mtr_gct_once, MTR_gct_init);
+  if ((u8)dst == mtr_gct_map_id)
+  {
+    MTR_gct_peer((MSG *)h);
+    relm(h);
+    return(0);
+  }
+  MTR_gct_queue((u8)dst, (MTR_GCT_SLOT *)h);
+  return(0);
+}
+
+/*
+ * GCT_receive
+ *
+ * Takes the next message for a module, waiting for one if none is
+ * queued. The first module to receive starts the peer.
+ *
+ * Returns the message.
+ */
+HDR *GCT_receive(mod_id)
+  unsigned int mod_id;          /* Receiving module */
+{
+  pthread_once(&mtr_gct_once, MTR_gct_init);
+  MTR_gct_start((u8)mod_id);
+  return(MTR_gct_take((u8)mod_id, 1));
+}
+
+/*
+ * GCT_grab
+ *
+ * Takes the next message for a module without waiting.
+ *
+ * Returns the message or zero if none is queued.
+ */
+HDR *GCT_grab(mod_id)
+  unsigned int mod_id;          /* Receiving module */
+{
+  pthread_once(&mtr_gct_once, MTR_gct_init);
+  MTR_gct_start((u8)mod_id);
+  return(MTR_gct_take((u8)mod_id, 0));
+}
+
+/*
+ * GCT_get_instance
+ *
+ * Returns the MAP instance of a message.
+ */
+int GCT_get_instance(h)
+  HDR *h;                       /* Message */
+{
+  return(((MTR_GCT_SLOT *)h)->instance);
+}
+
+/*
+ * GCT_set_instance
+ *
+ * Sets the MAP instance of a message.
+ *
+ * Always returns zero.
+ */
+int GCT_set_instance(instance, h)
+  unsigned int instance;        /* MAP instance */
+  HDR *h;                       /* Message */
+{
+  ((MTR_GCT_SLOT *)h)->instance = (u16)instance;
+  return(0);
+}
+
+/*
+ * MTR_gct_init
+ *
+ * Reads the settings and allocates the pool, the queues and the
+ * dialogues of the peer. Run once, on first use.
+ */
+static void MTR_gct_init()
+{
+  char *script;                 /* Script of services */
+  u32 i;                        /* Index */
+
+  mtr_gct_pool_size = MTR_gct_env("MTR_GCT_POOL", MTR_GCT_DEF_POOL);
+  mtr_gct_map_id = (u8)MTR_gct_env("MTR_GCT_MAP_ID", MTR_GCT_DEF_MAP_ID);
+  mtr_gct_total = MTR_gct_env("MTR_GCT_DLGS", MTR_GCT_DEF_DLGS);
+  mtr_gct_window = MTR_gct_env("MTR_GCT_WINDOW", MTR_GCT_DEF_WINDOW);
+  mtr_gct_first_id = (u16)MTR_gct_env("MTR_GCT_FIRST_ID", MTR_GCT_DEF_FIRST_ID);
+  mtr_gct_segments = MTR_gct_env("MTR_GCT_SEGMENTS", MTR_GCT_DEF_SEGMENTS);
+  if ((script = getenv("MTR_GCT_SCRIPT")) == 0)
+    script = "sri-sm";
+
+  if ((mtr_gct_window == 0) || (mtr_gct_first_id + mtr_gct_window > 0x10000) ||
+      (mtr_gct_segments == 0) || (MTR_gct_script(script) != 0))
+  {
+    fprintf(stderr, "MTR_GCT: bad MTR_GCT_WINDOW, MTR_GCT_FIRST_ID, MTR_GCT_SEGMENTS or MTR_GCT_SCRIPT\n");
+    exit(1);
+  }
+
+  if (((mtr_gct_pool = calloc(mtr_gct_pool_size, sizeof(MTR_GCT_SLOT))) == 0) ||
+      ((mtr_gct_dlg = calloc(mtr_gct_window, sizeof(MTR_GCT_DLG))) == 0))
+  {
+    fprintf(stderr, "MTR_GCT: cannot allocate %u messages\n", mtr_gct_pool_size);
+    exit(1);
+  }
+  for (i = 0; i < mtr_gct_pool_size; i++)
+    mtr_gct_pool[i].next = (i + 1 < mtr_gct_pool_size) ? &mtr_gct_pool[i + 1] : 0;
+  mtr_gct_free = mtr_gct_pool_size ? &mtr_gct_pool[0] : 0;
+  mtr_gct_num_free = mtr_gct_pool_size;
+  mtr_gct_min_free = mtr_gct_pool_size;
+
+  for (i = 0; i < MTR_GCT_NUM_MODULES; i++)
+  {
+    pthread_mutex_init(&mtr_gct_queue[i].lock, NULL);
+    pthread_cond_init(&mtr_gct_queue[i].ready, NULL);
+  }
+  MTR_gsm_init();
+}
+
+/*
+ * MTR_gct_env
+ *
+ * Returns the numeric value of an environment variable, decimal or
+ * 0x prefixed hexadecimal, or the default if it is not set.
+ */
+static u32 MTR_gct_env(name, def)
+  char *name;                   /* Variable */
+  u32 def;                      /* Default value */
+{
+  char *value;                  /* Value of the variable */
+  char *end;                    /* First character not read */
+  unsigned long n;              /* Numeric value */
+
+  if ((value = getenv(name)) == 0)
+    return(def);
+  n = strtoul(value, &end, 0);
+  if ((*value == '\0') || (*end != '\0') || (n > 0xffffffffUL))
+  {
+    fprintf(stderr, "MTR_GCT: bad %s\n", name);
+    exit(1);
+  }
+  return((u32)n);
+}
+
+/*
+ * MTR_gct_script
+ *
+ * Reads the script of services.
+ *
+ * Returns zero or -1 on error.
+ */
+static int MTR_gct_script(script)
+  char *script;                 /* Service names separated by commas */
+{
+  char *name;                   /* Start of a name */
+  size_t len;                   /* Length of the name */
+  u32 i;                        /* Service index */
+
+  for (name = script; *name != '\0'; name += len + (name[len] == ','))
+  {
+    len = strcspn(name, ",");
+    for (i = 0; i < MTR_GCT_NUM_SRV; i++)
+      if ((strlen(mtr_gct_srv[i].name) == len) && (strncmp(name, mtr_gct_srv[i].name, len) == 0))
+        break;
+    if ((i == MTR_GCT_NUM_SRV) || (mtr_gct_script_len == MTR_GCT_MAX_SCRIPT))
+      return(-1);
+    mtr_gct_script_srv[mtr_gct_script_len++] = (u8)i;
+  }
+  return(mtr_gct_script_len ? 0 : -1);
+}
+
+/*
+ * MTR_gct_queue
+ *
+ * Appends a message to the queue of a module and wakes a receiver.
+ *
+ * Always returns zero.
+ */
+static int MTR_gct_queue(dst, s)
+  u8 dst;                       /* Destination module */
+  MTR_GCT_SLOT *s;              /* Message */
+{
+  MTR_GCT_QUEUE *q;             /* Queue of the module */
+
+  q = &mtr_gct_queue[dst];
+  s->next = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->tail != 0)
+    q->tail->next = s;
+  else
+    q->head = s;
+  q->tail = s;
+  if (++q->count > q->max_count)
+    q->max_count = q->count;
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+  return(0);
+}
+
+/*
+ * MTR_gct_take
+ *
+ * Takes the first message from the queue of a module.
+ *
+ * Returns the message, or zero if none is queued and wait is not set.
+ */
+static HDR *MTR_gct_take(mod_id, wait)
+  u8 mod_id;                    /* Receiving module */
+  int wait;                     /* Set to wait for a message */
+{
+  MTR_GCT_QUEUE *q;             /* Queue of the module */
+  MTR_GCT_SLOT *s;              /* Message taken */
+  struct timespec until;        /* End of a wait to retry */
+
+  q = &mtr_gct_queue[mod_id];
+  pthread_mutex_lock(&q->lock);
+  while ((wait) && (q->head == 0))
+  {
+    if ((mtr_gct_num_retry == 0) || (mod_id != mtr_gct_user_id))
+    {
+      pthread_cond_wait(&q->ready, &q->lock);
+      continue;
+    }
+
+    /*
+     * Nothing to receive while the peer has steps to send, so retry
+     * them, and if messages are still short wait a while to try again.
+     */
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_lock(&mtr_gct_peer_lock);
+    MTR_gct_retry();
+    pthread_mutex_unlock(&mtr_gct_peer_lock);
+    pthread_mutex_lock(&q->lock);
+    if ((q->head == 0) && (mtr_gct_num_retry != 0))
+    {
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += MTR_GCT_RETRY_NS;
+      if (until.tv_nsec >= 1000000000)
+      {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&q->ready, &q->lock, &until);
+    }
+  }
+  if ((s = q->head) != 0)
+  {
+    if ((q->head = s->next) == 0)
+      q->tail = 0;
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return(s ? &s->m.hdr : 0);
+}
+
+/*
+ * MTR_gct_start
+ *
+ * Starts the peer the first time a module other than MAP receives,
+ * opening the first window of dialogues towards it.
+ *
+ * Always returns zero.
+ */
+static int MTR_gct_start(mod_id)
+  u8 mod_id;                    /* Receiving module */
+{
+  u32 ref;                      /* Index of a dialogue */
+
+  if ((mtr_gct_started) || (mod_id == mtr_gct_map_id))
+    return(0);
+
+  pthread_mutex_lock(&mtr_gct_peer_lock);
+  if (!mtr_gct_started)
+  {
+    mtr_gct_user_id = mod_id;
+    mtr_gct_start_ns = MTR_lat_now();
+    printf("MTR_GCT: %u messages; MAP 0x%02x to 0x%02x; %u dialogues in flight from 0x%04x\n",
+           mtr_gct_pool_size, mtr_gct_map_id, mod_id, mtr_gct_window, mtr_gct_first_id);
+    fflush(stdout);
+    for (ref = 0; ref < mtr_gct_window; ref++)
+      if ((mtr_gct_total == 0) || (mtr_gct_opened < mtr_gct_total))
+        MTR_gct_open((u16)ref);
+    __sync_synchronize();
+    mtr_gct_started = 1;
+  }
+  if (mtr_gct_num_retry != 0)
+    MTR_gct_retry();
+  pthread_mutex_unlock(&mtr_gct_peer_lock);
+  return(0);
+}
+
+/*
+ * MTR_gct_open
+ *
+ * Opens a dialogue for the next service of the script: an open
+ * indication, its service indication and a delimiter indication.
+ * Called with the peer locked.
+ *
+ * Returns zero or -1 if the indications are left to be retried.
+ */
+static int MTR_gct_open(ref)
+  u16 ref;                      /* Index of the dialogue */
+{
+  MTR_GCT_DLG *dlg;             /* Dialogue */
+
+  dlg = &mtr_gct_dlg[ref];
+  dlg->srv = mtr_gct_script_srv[mtr_gct_opened % mtr_gct_script_len];
+  dlg->state = MTR_GCT_S_OPEN;
+  dlg->open_ns = MTR_lat_now();
+  dlg->segments = (mtr_gct_srv[dlg->srv].ind == MAPST_MT_FWD_SM_IND) ? mtr_gct_segments - 1 : 0;
+  mtr_gct_opened++;
+  mtr_gct_in_flight++;
+  return(MTR_gct_step(ref, MTR_GCT_STEP_OPEN));
+}
+
+/*
+ * MTR_gct_step
+ *
+ * Sends the indications of a step of a dialogue, all of them or, if
+ * the pool is short, none, leaving the step to be retried by
+ * MTR_gct_retry(). Called with the peer locked.
+ *
+ * Returns zero or -1 if the step is left to be retried.
+ */
+static int MTR_gct_step(ref, step)
+  u16 ref;                      /* Index of the dialogue */
+  u8 step;                      /* MTR_GCT_STEP_xxx */
+{
+  MTR_GCT_DLG *dlg;             /* Dialogue */
+  MTR_GCT_SRV *srv;             /* Service */
+  MSG *m[MTR_GCT_MAX_STEP];     /* Indications of the step */
+  u8  params[MAX_PARAM_LEN];    /* Parameter area */
+  u16 dlg_id;                   /* Dialogue id */
+  u16 len;                      /* Length of the parameter area */
+  u8  num;                      /* Indications of the step */
+  u8  i;                        /* Indication index */
+
+  dlg = &mtr_gct_dlg[ref];
+  srv = &mtr_gct_srv[dlg->srv];
+  dlg_id = (u16)(mtr_gct_first_id + ref);
+  num = 0;
+
+  switch (step)
+  {
+    case MTR_GCT_STEP_OPEN :
+      len = 0;
+      params[len++] = MAPDT_OPEN_IND;
+      params[len++] = MAPPN_applic_context;
+      params[len++] = 9;
+      params[len++] = 0x06;
+      params[len++] = 0x07;
+      params[len++] = 0x04;
+      params[len++] = 0x00;
+      params[len++] = 0x00;
+      params[len++] = 0x01;
+      params[len++] = 0x00;
+      params[len++] = srv->ac;
+      params[len++] = srv->ac_version;
+      params[len++] = MAPPN_dest_address;
+      params[len++] = 2;
+      params[len++] = 0x42;
+      params[len++] = (srv->ind == MAPST_MT_FWD_SM_IND) ? 8 : 6;
+      params[len++] = MAPPN_orig_address;
+      params[len++] = 2;
+      params[len++] = 0x42;
+      params[len++] = 8;
+      params[len++] = 0x00;
+      m[num++] = MTR_gct_ind(MAP_MSG_DLG_IND, dlg_id, params, len);
+      len = MTR_gct_srv_params(params, dlg->srv, dlg->segments != 0);
+      m[num++] = MTR_gct_ind(MAP_MSG_SRV_IND, dlg_id, params, len);
+      break;
+
+    case MTR_GCT_STEP_MENU :
+      len = 0;
+      params[len++] = MAPST_UNSTR_SS_REQ_CNF;
+      params[len++] = MAPPN_invoke_id;
+      params[len++] = 0x01;
+      params[len++] = dlg->invoke_id;
+      params[len++] = MAPPN_USSD_coding;
+      params[len++] = 0x01;
+      params[len++] = 0x0f;
+      params[len++] = MAPPN_USSD_string;
+      params[len++] = 0x01;
+      params[len++] = 0x31;
+      params[len++] = 0x00;
+      m[num++] = MTR_gct_ind(MAP_MSG_SRV_IND, dlg_id, params, len);
+      break;
+
+    case MTR_GCT_STEP_SEGMENT :
+      len = MTR_gct_srv_params(params, dlg->srv, dlg->segments != 0);
+      m[num++] = MTR_gct_ind(MAP_MSG_SRV_IND, dlg_id, params, len);
+      break;
+  }
+  params[0] = MAPDT_DELIMITER_IND;
+  params[1] = 0x00;
+  m[num++] = MTR_gct_ind(MAP_MSG_DLG_IND, dlg_id, params, 2);
+
+  for (i = 0; (i < num) && (m[i] != 0); i++)
+    ;
+  if (i < num)
+  {
+    for (i = 0; i < num; i++)
+      if (m[i] != 0)
+        relm(&m[i]->hdr);
+    mtr_gct_peer_fail++;
+    if (!dlg->retry)
+      mtr_gct_num_retry++;
+    dlg->step = step;
+    dlg->retry = 1;
+    return(-1);
+  }
+
+  for (i = 0; i < num; i++)
+    MTR_gct_queue(mtr_gct_user_id, (MTR_GCT_SLOT *)m[i]);
+  if (dlg->retry)
+    mtr_gct_num_retry--;
+  dlg->retry = 0;
+  return(0);
+}
+
+/*
+ * MTR_gct_retry
+ *
+ * Sends again the steps that found the pool empty, stopping at the
+ * first that still does. Called with the peer locked.
+ *
+ * Always returns zero.
+ */
+static int MTR_gct_retry()
+{
+  u32 ref;                      /* Index of a dialogue */
+
+  for (ref = 0; (ref < mtr_gct_window) && (mtr_gct_num_retry != 0); ref++)
+  {
+    if ((mtr_gct_dlg[ref].retry) &&
+        (MTR_gct_step((u16)ref, mtr_gct_dlg[ref].step) != 0))
+      break;
+  }
+  return(0);
+}
+
+/*
+ * MTR_gct_srv_params
+ *
+ * Encodes the service indication of a service.
+ *
+ * Returns the length of the parameter area.
+ */
+static u16 MTR_gct_srv_params(pptr, srv, more)
+  u8 *pptr;                     /* Parameter area */
+  u8 srv;                       /* Index of the service */
+  u8 more;                      /* Set if more MT-FORWARD-SM segments follow */
+{
+  u8  msisdn[12];               /* MSISDN digits */
+  u8  imsi[15];                 /* IMSI digits */
+  u8  tpdu[64];                 /* SMS-DELIVER */
+  unsigned long long n;         /* Number of the dialogue */
+  int ud_len;                   /* Packed user data length */
+  u16 len;                      /* Length so far */
+  u16 t;                        /* TPDU length */
+  u8  i;                        /* Digit index */
+
+  /*
+   * Each dialogue has its own MSISDN in 447700900000-447700999999,
+   * and an IMSI ending in the same digits.
+   */
+  memcpy(msisdn, mtr_gct_msisdn, sizeof(msisdn));
+  memcpy(imsi, mtr_gct_imsi, sizeof(imsi));
+  for (i = 0, n = mtr_gct_opened; i < 5; i++, n /= 10)
+    msisdn[11 - i] = imsi[14 - i] = (u8)(n % 10);
+
+  len = 0;
+  pptr[len++] = mtr_gct_srv[srv].ind;
+  pptr[len++] = MAPPN_invoke_id;
+  pptr[len++] = 0x01;
+  pptr[len++] = 0x01;
+
+  switch (mtr_gct_srv[srv].ind)
+  {
+    case MAPST_SND_RTISM_IND :
+      pptr[len++] = MAPPN_msisdn;
+      len += MTR_gct_put_addr(&pptr[len], msisdn, 12);
+      pptr[len++] = MAPPN_sm_rp_pri;
+      pptr[len++] = 0x01;
+      pptr[len++] = 0x01;
+      pptr[len++] = MAPPN_sc_addr;
+      len += MTR_gct_put_addr(&pptr[len], mtr_gct_sc, 10);
+      break;
+
+    case MAPST_MT_FWD_SM_IND :
+      pptr[len++] = MAPPN_sm_rp_da;
+      pptr[len++] = 2 + 8;
+      pptr[len++] = 0x80;
+      pptr[len++] = 8;
+      len += MTR_gct_put_tbcd(&pptr[len], imsi, 15);
+      pptr[len++] = MAPPN_sm_rp_oa;
+      pptr[len++] = 2 + 1 + 5;
+      pptr[len++] = 0x84;
+      len += MTR_gct_put_addr(&pptr[len], mtr_gct_sc, 10);
+
+      t = 0;
+      tpdu[t++] = 0x04;
+      tpdu[t++] = 10;
+      tpdu[t++] = 0x91;
+      t += MTR_gct_put_tbcd(&tpdu[t], mtr_gct_sc, 10);
+      tpdu[t++] = 0x00;
+      tpdu[t++] = 0x00;
+      memset(&tpdu[t], 0, 7);
+      t += 7;
+      tpdu[t++] = 11;
+      if ((ud_len = MTR_gsm_encode7("Hello world", &tpdu[t], (u16)(sizeof(tpdu) - t))) < 0)
+        ud_len = 0;
+      t += (u16)ud_len;
+      pptr[len++] = MAPPN_sm_rp_ui;
+      pptr[len++] = (u8)t;
+      memcpy(&pptr[len], tpdu, t);
+      len += t;
+      if (more)
+      {
+        pptr[len++] = MAPPN_more_msgs;
+        pptr[len++] = 0x00;
+      }
+      break;
+
+    case MAPST_PRO_UNSTR_SS_REQ_IND :
+      pptr[len++] = MAPPN_USSD_coding;
+      pptr[len++] = 0x01;
+      pptr[len++] = 0x0f;
+      pptr[len++] = MAPPN_USSD_string;
+      if ((ud_len = MTR_gsm_encode7("*100#", &pptr[len + 1], MTR_GSM_MAX_UD)) < 0)
+        ud_len = 0;
+      pptr[len++] = (u8)ud_len;
+      len += (u16)ud_len;
+      pptr[len++] = MAPPN_msisdn;
+      len += MTR_gct_put_addr(&pptr[len], msisdn, 12);
+      break;
+
+    case MAPST_ANYTIME_INT_IND :
+      pptr[len++] = MAPPN_msisdn;
+      len += MTR_gct_put_addr(&pptr[len], msisdn, 12);
+      break;
+  }
+  pptr[len++] = 0x00;
+  return(len);
+}
+
+/*
+ * MTR_gct_peer
+ *
+ * Handles a message sent to the fake MAP module.
+ *
+ * Always returns zero.
+ */
+static int MTR_gct_peer(m)
+  MSG *m;                       /* Message sent */
+{
+  MTR_GCT_DLG *dlg;             /* Dialogue */
+  MTR_PRS prs;                  /* Parsed primitive */
+  u8  *pval;                    /* Parameter value */
+  u8  plen;                     /* Parameter length */
+  u16 ref;                      /* Index of the dialogue */
+
+  if ((m->hdr.type != MAP_MSG_DLG_REQ) && (m->hdr.type != MAP_MSG_SRV_REQ))
+    return(0);
+  ref = (u16)(m->hdr.id - mtr_gct_first_id);
+  if (ref >= mtr_gct_window)
+    return(0);
+  MTR_prs_parse(m, &prs);
+
+  pthread_mutex_lock(&mtr_gct_peer_lock);
+  dlg = &mtr_gct_dlg[ref];
+  if (dlg->state != MTR_GCT_S_IDLE)
+  {
+    if (m->hdr.type == MAP_MSG_SRV_REQ)
+    {
+      /*
+       * The USSD menu is answered once its delimiter arrives.
+       */
+      if ((prs.ptype == MAPST_UNSTR_SS_REQ_REQ) &&
+          ((pval = MTR_prs_find(&prs, MAPPN_invoke_id, &plen)) != 0))
+      {
+        dlg->invoke_id = pval[0];
+        dlg->state = MTR_GCT_S_MENU;
+      }
+    }
+    else
+    {
+      switch (prs.ptype)
+      {
+        case MAPDT_OPEN_RSP :
+          if (((pval = MTR_prs_find(&prs, MAPPN_result, &plen)) != 0) &&
+              (plen == 1) && (pval[0] != MAPRS_DLG_ACC))
+            MTR_gct_ended(ref, 0);
+          break;
+
+        case MAPDT_DELIMITER_REQ :
+          if (dlg->state == MTR_GCT_S_MENU)
+          {
+            dlg->state = MTR_GCT_S_OPEN;
+            MTR_gct_step(ref, MTR_GCT_STEP_MENU);
+          }
+          else if (dlg->segments != 0)
+          {
+            /*
+             * The next segment of the MT-FORWARD-SM goes once the
+             * last has been answered.
+             */
+            dlg->segments--;
+            MTR_gct_step(ref, MTR_GCT_STEP_SEGMENT);
+          }
+          break;
+
+        case MAPDT_CLOSE_REQ :
+          MTR_gct_ended(ref, 1);
+          break;
+
+        case MAPDT_U_ABORT_REQ :
+          MTR_gct_ended(ref, 0);
+          break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&mtr_gct_peer_lock);
+  return(0);
+}
+
+/*
+ * MTR_gct_ended
+ *
+ * Records the end of a dialogue and opens the next one in its place.
+ * Once every dialogue has ended the results are printed and the
+ * process ends. Called with the peer locked.
+ *
+ * Always returns zero.
+ */
+static int MTR_gct_ended(ref, closed)
+  u16 ref;                      /* Index of the dialogue */
+  u8 closed;                    /* Set if closed, otherwise refused or aborted */
+{
+  MTR_GCT_DLG *dlg;             /* Dialogue */
+  unsigned long long ns;        /* Dialogue latency */
+  u32 us;                       /* Dialogue latency in microseconds */
+  u32 bucket;                   /* Histogram bucket */
+
+  dlg = &mtr_gct_dlg[ref];
+  dlg->state = MTR_GCT_S_IDLE;
+  if (dlg->retry)
+    mtr_gct_num_retry--;
+  dlg->retry = 0;
+  mtr_gct_in_flight--;
+
+  if (closed)
+  {
+    ns = MTR_lat_now() - dlg->open_ns;
+    mtr_gct_closed++;
+    mtr_gct_lat_sum += ns;
+    if (ns > mtr_gct_lat_max)
+      mtr_gct_lat_max = ns;
+    for (us = (u32)(ns / 1000), bucket = 0; (us > 1) && (bucket < MTR_GCT_LAT_BUCKETS - 1); us >>= 1)
+      bucket++;
+    mtr_gct_lat[bucket]++;
+  }
+  else
+    mtr_gct_aborted++;
+
+  if ((mtr_gct_total == 0) || (mtr_gct_opened < mtr_gct_total))
+    MTR_gct_open(ref);
+  else if (mtr_gct_in_flight == 0)
+  {
+    MTR_gct_report();
+    exit(0);
+  }
+  return(0);
+}
+
+/*
+ * MTR_gct_ind
+ *
+ * Builds an indication from the fake MAP module, on MAP instance zero.
+ *
+ * Returns the indication, or zero if the pool is empty.
+ */
+static MSG *MTR_gct_ind(type, dlg_id, params, len)
+  u16 type;                     /* Message type */
+  u16 dlg_id;                   /* Dialogue id */
+  u8 *params;                   /* Parameter area */
+  u16 len;                      /* Length of the parameter area */
+{
+  MSG *m;                       /* Indication */
+
+  if ((m = getm(type, dlg_id, NO_RESPONSE, len)) == 0)
+    return(0);
+  m->hdr.src = mtr_gct_map_id;
+  m->hdr.dst = mtr_gct_user_id;
+  memcpy(get_param(m), params, len);
+  return(m);
+}
+
+/*
+ * MTR_gct_put_addr
+ *
+ * Encodes a length and an address string, international ISDN.
+ *
+ * Returns the number of octets written.
+ */
+static u8 MTR_gct_put_addr(dst, digits, num_digits)
+  u8 *dst;                      /* Destination */
+  u8 *digits;                   /* Digits, one per octet */
+  u8 num_digits;                /* Number of digits */
+{
+  dst[1] = 0x91;
+  dst[0] = (u8)(1 + MTR_gct_put_tbcd(&dst[2], digits, num_digits));
+  return((u8)(1 + dst[0]));
+}
+
+/*
+ * MTR_gct_put_tbcd
+ *
+ * Packs digits two to an octet, low nibble first, padding an odd
+ * number of digits with a filler.
+ *
+ * Returns the number of octets written.
+ */
+static u8 MTR_gct_put_tbcd(dst, digits, num_digits)
+  u8 *dst;                      /* Destination */
+  u8 *digits;                   /* Digits, one per octet */
+  u8 num_digits;                /* Number of digits */
+{
+  u8 i;                         /* Digit index */
+
+  for (i = 0; i < num_digits; i += 2)
+    dst[i / 2] = (u8)(digits[i] | (((i + 1 < num_digits) ? digits[i + 1] : 0x0f) << 4));
+  return((u8)((num_digits + 1) / 2));
+}
+
+/*
+ * MTR_gct_report
+ *
+ * Prints what the peer saw. Called with the peer locked.
+ *
+ * Always returns zero.
+ */
+static int MTR_gct_report()
+{
+  unsigned long long elapsed;   /* Run time in ns */
+  unsigned long long count;     /* Dialogues counted so far */
+  u32 p50;                      /* Bucket of the median */
+  u32 p99;                      /* Bucket of the 99th percentile */
+  u32 i;                        /* Bucket index */
+
+  elapsed = MTR_lat_now() - mtr_gct_start_ns;
+  p50 = p99 = 0;
+  for (i = 0, count = 0; i < MTR_GCT_LAT_BUCKETS; i++)
+  {
+    count += mtr_gct_lat[i];
+    if (count * 2 < mtr_gct_closed)
+      p50 = i + 1;
+    if (count * 100 < mtr_gct_closed * 99)
+      p99 = i + 1;
+  }
+
+  printf("MTR_GCT: %llu dialogues closed, %llu refused or aborted in %.3fs: %.0f dialogues/s\n",
+         mtr_gct_closed, mtr_gct_aborted, elapsed / 1e9,
+         elapsed ? (mtr_gct_closed + mtr_gct_aborted) * 1e9 / elapsed : 0.0);
+  printf("MTR_GCT: dialogue latency mean %.1fus; p50 < %uus; p99 < %uus; max %.1fus\n",
+         mtr_gct_closed ? mtr_gct_lat_sum / 1e3 / mtr_gct_closed : 0.0,
+         2U << p50, 2U << p99, mtr_gct_lat_max / 1e3);
+  printf("MTR_GCT: fewest free messages %u of %u; getm failures %u; peer retries %u; longest queue %u\n",
+         mtr_gct_min_free, mtr_gct_pool_size, mtr_gct_getm_fail, mtr_gct_peer_fail,
+         mtr_gct_queue[mtr_gct_user_id].max_count);
+  fflush(stdout);
+  return(0);
+}
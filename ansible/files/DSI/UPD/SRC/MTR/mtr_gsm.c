@@ -0,0 +1,708 @@
+/*
+ Name:          mtr_gsm.c
+
+ Description:   GSM 03.38 text codec for MTR.
+
+                Converts short message and USSD user data between the
+                GSM default alphabet (7-bit packed), 8-bit data and UCS2
+                and UTF-8 text, following the TP-DCS / CBS data coding
+                scheme and the user data header indicator.
+
+                7-bit data is packed and unpacked eight septets, seven
+                octets, at a time through a 64-bit word, falling back to
+                single septets only for the tail of the data. Characters
+                are translated through tables in both directions.
+
+ Functions:     MTR_gsm_init
+                MTR_gsm_sms_charset
+                MTR_gsm_cbs_charset
+                MTR_gsm_unpack7
+                MTR_gsm_pack7
+                MTR_gsm_decode
+                MTR_gsm_encode7
+                MTR_gsm_sm_text
+ */
+
+#include <string.h>
+#include <endian.h>
+
+#include "system.h"
+#include "mtr_gsm.h"
+
+/*
+ * Escape to the extension table
+ */
+#define MTR_GSM_ESC             (0x1b)
+
+/*
+ * Marks in the reverse table
+ */
+#define MTR_GSM_REV_NONE        (0xff)  /* No GSM character */
+#define MTR_GSM_REV_EXT         (0x80)  /* Escape then the low 7 bits */
+
+/*
+ * Character substituted for anything that cannot be converted
+ */
+#define MTR_GSM_UNKNOWN         ('?')
+
+/*
+ * Information element identifiers in a user data header
+ */
+#define MTR_GSM_IEI_CONCAT8     (0x00)  /* Concatenation, 8-bit reference */
+#define MTR_GSM_IEI_CONCAT16    (0x08)  /* Concatenation, 16-bit reference */
+
+typedef unsigned long long MTR_GSM_WORD;
+
+static char *MTR_gsm_put_utf8(char *out, u16 cp);
+static int MTR_gsm_get_utf8(u8 **in);
+static int MTR_gsm_udh(u8 *udh, u8 udh_len, MTR_GSM_UD *info);
+
+/*
+ * GSM default alphabet to Unicode
+ */
+static const u16 mtr_gsm_to_ucs[128] =
+{
+  0x0040, 0x00a3, 0x0024, 0x00a5, 0x00e8, 0x00e9, 0x00f9, 0x00ec,
+  0x00f2, 0x00c7, 0x000a, 0x00d8, 0x00f8, 0x000d, 0x00c5, 0x00e5,
+  0x0394, 0x005f, 0x03a6, 0x0393, 0x039b, 0x03a9, 0x03a0, 0x03a8,
+  0x03a3, 0x0398, 0x039e, 0x00a0, 0x00c6, 0x00e6, 0x00df, 0x00c9,
+  0x0020, 0x0021, 0x0022, 0x0023, 0x00a4, 0x0025, 0x0026, 0x0027,
+  0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+  0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+  0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+  0x00a1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+  0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+  0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+  0x0058, 0x0059, 0x005a, 0x00c4, 0x00d6, 0x00d1, 0x00dc, 0x00a7,
+  0x00bf, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+  0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+  0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+  0x0078, 0x0079, 0x007a, 0x00e4, 0x00f6, 0x00f1, 0x00fc, 0x00e0
+};
+
+/*
+ * GSM default alphabet extension table, reached by escape
+ */
+static const struct
+{
+  u8  septet;
+  u16 cp;
+} mtr_gsm_ext[] =
+{
+  { 0x0a, 0x000c }, { 0x14, 0x005e }, { 0x28, 0x007b }, { 0x29, 0x007d },
+  { 0x2f, 0x005c }, { 0x3c, 0x005b }, { 0x3d, 0x007e }, { 0x3e, 0x005d },
+  { 0x40, 0x007c }, { 0x65, 0x20ac }
+};
+#define MTR_GSM_NUM_EXT (sizeof(mtr_gsm_ext) / sizeof(mtr_gsm_ext[0]))
+
+/*
+ * Static data:
+ */
+static u16 mtr_gsm_ext_to_ucs[128];     /* Extension table, 0 if undefined */
+static u8  mtr_gsm_from_latin1[256];    /* Unicode 0-255 to GSM, or REV_xxx */
+
+/*
+ * MTR_gsm_init
+ *
+ * Builds the reverse translation tables. Must be called before any
+ * other function, before any threads that use the codec start.
+ *
+ * Always returns zero.
+ */
+int MTR_gsm_init()
+{
+  u16 i;                        /* Table index */
+
+  memset(mtr_gsm_from_latin1, MTR_GSM_REV_NONE, sizeof(mtr_gsm_from_latin1));
+  memset(mtr_gsm_ext_to_ucs, 0, sizeof(mtr_gsm_ext_to_ucs));
+
+  for (i = 0; i < MTR_GSM_NUM_EXT; i++)
+  {
+    mtr_gsm_ext_to_ucs[mtr_gsm_ext[i].septet] = mtr_gsm_ext[i].cp;
+    if (mtr_gsm_ext[i].cp < 256)
+      mtr_gsm_from_latin1[mtr_gsm_ext[i].cp] = MTR_GSM_REV_EXT | mtr_gsm_ext[i].septet;
+  }
+
+  /*
+   * Base table last so that it takes precedence
+   */
+  for (i = 128; i-- > 0; )
+    if ((i != MTR_GSM_ESC) && (mtr_gsm_to_ucs[i] < 256))
+      mtr_gsm_from_latin1[mtr_gsm_to_ucs[i]] = (u8)i;
+  return(0);
+}
+
+/*
+ * MTR_gsm_sms_charset
+ *
+ * Returns the character set selected by an SMS data coding scheme
+ * (TP-DCS, 3GPP TS 23.038 clause 4).
+ */
+u8 MTR_gsm_sms_charset(dcs)
+  u8 dcs;                       /* TP-DCS */
+{
+  switch (dcs >> 4)
+  {
+    case 0x0 :
+    case 0x1 :
+    case 0x2 :
+    case 0x3 :
+    case 0x4 :
+    case 0x5 :
+    case 0x6 :
+    case 0x7 :
+      /*
+       * General data coding, character set in bits 3 and 2
+       */
+      switch ((dcs >> 2) & 0x03)
+      {
+        case 1 :
+          return(MTR_GSM_8BIT);
+        case 2 :
+          return(MTR_GSM_UCS2);
+      }
+      return(MTR_GSM_7BIT);
+
+    case 0xe :
+      /*
+       * Message waiting indication, store message, UCS2
+       */
+      return(MTR_GSM_UCS2);
+
+    case 0xf :
+      /*
+       * Data coding / message class
+       */
+      return((dcs & 0x04) ? MTR_GSM_8BIT : MTR_GSM_7BIT);
+  }
+  return(MTR_GSM_7BIT);
+}
+
+/*
+ * MTR_gsm_cbs_charset
+ *
+ * Returns the character set selected by a CBS data coding scheme,
+ * as used for USSD strings (3GPP TS 23.038 clause 5).
+ */
+u8 MTR_gsm_cbs_charset(dcs)
+  u8 dcs;                       /* CBS data coding scheme */
+{
+  switch (dcs >> 4)
+  {
+    case 0x1 :
+      /*
+       * Language in the first characters, default alphabet or UCS2
+       */
+      return((dcs & 0x0f) == 0x01 ? MTR_GSM_UCS2 : MTR_GSM_7BIT);
+
+    case 0x4 :
+    case 0x5 :
+    case 0x6 :
+    case 0x7 :
+    case 0x9 :
+      /*
+       * General data coding or message with user data header
+       */
+      return(MTR_gsm_sms_charset((u8)(dcs & 0x0f)));
+
+    case 0xf :
+      return((dcs & 0x04) ? MTR_GSM_8BIT : MTR_GSM_7BIT);
+  }
+  return(MTR_GSM_7BIT);
+}
+
+/*
+ * MTR_gsm_unpack7
+ *
+ * Unpacks septets from packed 7-bit data, eight at a time where the
+ * data allows.
+ *
+ * Returns the number of septets unpacked, fewer than num if src is
+ * too short.
+ */
+u16 MTR_gsm_unpack7(src, src_len, num, septets)
+  u8  *src;                     /* Packed data */
+  u16 src_len;                  /* Length of packed data */
+  u16 num;                      /* Number of septets wanted */
+  u8  *septets;                 /* Unpacked septets, one per octet */
+{
+  MTR_GSM_WORD w;               /* Seven octets holding eight septets */
+  u16 n;                        /* Septets unpacked */
+  u16 bit;                      /* Bit offset of septet */
+  u16 oct;                      /* Octet holding the first bit */
+  u8  i;                        /* Septet index within a group */
+
+  if (num > (u16)((src_len * 8) / 7))
+    num = (u16)((src_len * 8) / 7);
+
+  n = 0;
+  while ((u16)(num - n) >= 8)
+  {
+    oct = (u16)((n / 8) * 7);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    if ((u16)(src_len - oct) >= 8)
+    {
+      memcpy(&w, src + oct, 8);
+    }
+    else
+#endif
+    {
+      for (w = 0, i = 7; i-- > 0; )
+        w = (w << 8) | src[oct + i];
+    }
+    septets[n + 0] = (u8)(w & 0x7f);
+    septets[n + 1] = (u8)((w >> 7) & 0x7f);
+    septets[n + 2] = (u8)((w >> 14) & 0x7f);
+    septets[n + 3] = (u8)((w >> 21) & 0x7f);
+    septets[n + 4] = (u8)((w >> 28) & 0x7f);
+    septets[n + 5] = (u8)((w >> 35) & 0x7f);
+    septets[n + 6] = (u8)((w >> 42) & 0x7f);
+    septets[n + 7] = (u8)((w >> 49) & 0x7f);
+    n += 8;
+  }
+
+  for (; n < num; n++)
+  {
+    bit = (u16)(n * 7);
+    oct = bit >> 3;
+    septets[n] = (u8)(src[oct] >> (bit & 7));
+    if ((bit & 7) > 1)
+      septets[n] |= (u8)(src[oct + 1] << (8 - (bit & 7)));
+    septets[n] &= 0x7f;
+  }
+  return(num);
+}
+
+/*
+ * MTR_gsm_pack7
+ *
+ * Packs septets into 7-bit data, eight at a time where possible.
+ *
+ * Returns the length of the packed data or zero if it does not fit.
+ */
+u16 MTR_gsm_pack7(septets, num, dst, dst_len)
+  u8  *septets;                 /* Septets to pack, one per octet */
+  u16 num;                      /* Number of septets */
+  u8  *dst;                     /* Packed data */
+  u16 dst_len;                  /* Space at dst */
+{
+  MTR_GSM_WORD w;               /* Eight septets packed into seven octets */
+  u16 len;                      /* Length of packed data */
+  u16 n;                        /* Septets packed */
+  u16 bit;                      /* Bit offset of septet */
+  u8  *out;                     /* Next octet to write */
+  u8  i;                        /* Octet index within a group */
+
+  len = (u16)((num * 7 + 7) / 8);
+  if (len > dst_len)
+    return(0);
+
+  out = dst;
+  n = 0;
+  while ((u16)(num - n) >= 8)
+  {
+    w = (MTR_GSM_WORD)(septets[n + 0] & 0x7f)
+      | ((MTR_GSM_WORD)(septets[n + 1] & 0x7f) << 7)
+      | ((MTR_GSM_WORD)(septets[n + 2] & 0x7f) << 14)
+      | ((MTR_GSM_WORD)(septets[n + 3] & 0x7f) << 21)
+      | ((MTR_GSM_WORD)(septets[n + 4] & 0x7f) << 28)
+      | ((MTR_GSM_WORD)(septets[n + 5] & 0x7f) << 35)
+      | ((MTR_GSM_WORD)(septets[n + 6] & 0x7f) << 42)
+      | ((MTR_GSM_WORD)(septets[n + 7] & 0x7f) << 49);
+    for (i = 0; i < 7; i++, w >>= 8)
+      *out++ = (u8)w;
+    n += 8;
+  }
+
+  memset(out, 0, len - (out - dst));
+  for (; n < num; n++)
+  {
+    bit = (u16)((n % 8) * 7);
+    out[bit >> 3] |= (u8)((septets[n] & 0x7f) << (bit & 7));
+    if ((bit & 7) > 1)
+      out[(bit >> 3) + 1] |= (u8)((septets[n] & 0x7f) >> (8 - (bit & 7)));
+  }
+  return(len);
+}
+
+/*
+ * MTR_gsm_decode
+ *
+ * Converts user data to UTF-8 text. For 7-bit data udl is the number
+ * of septets, header included; for 8-bit and UCS2 data it is the
+ * number of octets. Zero udl takes everything in ud. 8-bit data is
+ * converted to hexadecimal.
+ *
+ * Returns the length of the text, which is always terminated,
+ * or -1 if the user data is malformed.
+ */
+int MTR_gsm_decode(charset, udhi, ud, ud_len, udl, text, text_len, info)
+  u8  charset;                  /* MTR_GSM_xxx */
+  u8  udhi;                     /* Set if ud starts with a header */
+  u8  *ud;                      /* User data */
+  u16 ud_len;                   /* Octets available at ud */
+  u16 udl;                      /* User data length */
+  char *text;                   /* Decoded text */
+  u16 text_len;                 /* Space at text, at least 1 */
+  MTR_GSM_UD *info;             /* Description of the user data */
+{
+  u8  septets[MTR_GSM_MAX_SEPTETS * 2]; /* Unpacked septets */
+  char utf8[4];                 /* One character as UTF-8 */
+  char *out;                    /* Next character of text */
+  char *end;                    /* End of text, leaving room to terminate */
+  u16 skip;                     /* Septets or octets taken by the header */
+  u16 num;                      /* Septets or octets of text */
+  u16 cp;                       /* Unicode character */
+  u16 i;                        /* Index */
+  int n;                        /* Length of one character */
+  u8  padded;                   /* Set if 7-bit data may end in a CR pad */
+
+  memset(info, 0, sizeof(MTR_GSM_UD));
+  info->charset = charset;
+  out = text;
+  end = text + text_len - 1;
+
+  padded = (udl == 0);
+  if (charset == MTR_GSM_7BIT)
+  {
+    if ((udl == 0) || (udl > (ud_len * 8) / 7))
+      udl = (u16)((ud_len * 8) / 7);
+    if (udl > sizeof(septets))
+      udl = sizeof(septets);
+  }
+  else if ((udl == 0) || (udl > ud_len))
+    udl = ud_len;
+
+  skip = 0;
+  if (udhi)
+  {
+    if ((ud_len < 1) || (ud[0] + 1 > ud_len) ||
+        (MTR_gsm_udh(ud + 1, ud[0], info) != 0))
+      return(-1);
+    info->udh_len = ud[0];
+
+    /*
+     * 7-bit text starts on the septet boundary after the header
+     */
+    if (charset == MTR_GSM_7BIT)
+      skip = (u16)(((ud[0] + 1) * 8 + 6) / 7);
+    else
+      skip = (u16)(ud[0] + 1);
+    if (skip > udl)
+      return(-1);
+  }
+
+  switch (charset)
+  {
+    case MTR_GSM_7BIT :
+      num = MTR_gsm_unpack7(ud, ud_len, udl, septets);
+
+      /*
+       * Without a septet count, a CR filling the last seven bits
+       * of the data is padding
+       */
+      if ((padded) && (num > skip) && ((num % 8) == 0) &&
+          (septets[num - 1] == 0x0d))
+        num--;
+
+      for (i = skip; i < num; i++)
+      {
+        if ((septets[i] == MTR_GSM_ESC) && (i + 1 < num))
+        {
+          cp = mtr_gsm_ext_to_ucs[septets[++i]];
+          if (cp == 0)
+            cp = ' ';
+        }
+        else
+          cp = mtr_gsm_to_ucs[septets[i]];
+
+        n = (int)(MTR_gsm_put_utf8(utf8, cp) - utf8);
+        if (out + n > end)
+          break;
+        memcpy(out, utf8, n);
+        out += n;
+      }
+      break;
+
+    case MTR_GSM_UCS2 :
+      for (i = skip; i + 1 < udl; i += 2)
+      {
+        cp = (u16)((ud[i] << 8) | ud[i + 1]);
+        if ((cp >= 0xd800) && (cp <= 0xdfff))
+          cp = MTR_GSM_UNKNOWN;
+        n = (int)(MTR_gsm_put_utf8(utf8, cp) - utf8);
+        if (out + n > end)
+          break;
+        memcpy(out, utf8, n);
+        out += n;
+      }
+      break;
+
+    default :
+      for (i = skip; (i < udl) && (out + 2 <= end); i++)
+      {
+        *out++ = "0123456789abcdef"[ud[i] >> 4];
+        *out++ = "0123456789abcdef"[ud[i] & 0x0f];
+      }
+      break;
+  }
+  *out = '\0';
+  return((int)(out - text));
+}
+
+/*
+ * MTR_gsm_encode7
+ *
+ * Converts UTF-8 text to packed GSM default alphabet. Characters not
+ * in the alphabet or its extension are replaced by '?'. If the last
+ * octet would have seven unused bits they are filled with CR, so that
+ * the receiver does not take them for an '@'.
+ *
+ * Returns the length of the packed data or -1 if it does not fit.
+ */
+int MTR_gsm_encode7(text, dst, dst_len)
+  char *text;                   /* Terminated UTF-8 text */
+  u8  *dst;                     /* Packed data */
+  u16 dst_len;                  /* Space at dst */
+{
+  u8  septets[MTR_GSM_MAX_SEPTETS * 2]; /* Septets to pack */
+  u8  *in;                      /* Next octet of text */
+  u16 num;                      /* Number of septets */
+  u8  rev;                      /* Reverse table entry */
+  int cp;                       /* Unicode character */
+  u8  i;                        /* Table index */
+
+  in = (u8 *)text;
+  num = 0;
+  while (*in != '\0')
+  {
+    cp = MTR_gsm_get_utf8(&in);
+    rev = MTR_GSM_REV_NONE;
+    if ((cp >= 0) && (cp < 256))
+      rev = mtr_gsm_from_latin1[cp];
+    else if (cp >= 256)
+    {
+      for (i = 0; i < 128; i++)
+        if (mtr_gsm_to_ucs[i] == cp)
+          break;
+      if (i < 128)
+        rev = i;
+      else if (cp == 0x20ac)
+        rev = MTR_GSM_REV_EXT | 0x65;
+    }
+    if (rev == MTR_GSM_REV_NONE)
+      rev = MTR_GSM_UNKNOWN;
+
+    if (num + 2 > sizeof(septets))
+      return(-1);
+    if (rev & MTR_GSM_REV_EXT)
+      septets[num++] = MTR_GSM_ESC;
+    septets[num++] = (u8)(rev & 0x7f);
+  }
+
+  if ((num % 8) == 7)
+    septets[num++] = 0x0d;
+
+  if ((num != 0) && ((num = MTR_gsm_pack7(septets, num, dst, dst_len)) == 0))
+    return(-1);
+  return(num);
+}
+
+/*
+ * MTR_gsm_sm_text
+ *
+ * Recovers the text of an SMS-DELIVER or SMS-SUBMIT TPDU.
+ *
+ * Returns the length of the text or -1 if the TPDU is malformed.
+ */
+int MTR_gsm_sm_text(tpdu, tpdu_len, text, text_len, info)
+  u8  *tpdu;                    /* TPDU, first octet onwards */
+  u16 tpdu_len;                 /* Length of TPDU */
+  char *text;                   /* Decoded text */
+  u16 text_len;                 /* Space at text */
+  MTR_GSM_UD *info;             /* Description of the user data */
+{
+  u16 off;                      /* Offset of next field */
+  u8  fo;                       /* First octet */
+  u8  dcs;                      /* TP-DCS */
+  u8  charset;                  /* Character set */
+  u8  udl;                      /* TP-UDL */
+
+  if (tpdu_len < 2)
+    return(-1);
+  fo = tpdu[0];
+
+  switch (fo & 0x03)
+  {
+    case 0x00 :
+      /*
+       * SMS-DELIVER: TP-OA, TP-PID, TP-DCS, TP-SCTS
+       */
+      off = 1;
+      off += 2 + (tpdu[off] + 1) / 2;
+      off += 2;
+      if (off > tpdu_len)
+        return(-1);
+      dcs = tpdu[off - 1];
+      off += 7;
+      break;
+
+    case 0x01 :
+      /*
+       * SMS-SUBMIT: TP-MR, TP-DA, TP-PID, TP-DCS, TP-VP
+       */
+      off = 2;
+      if (off >= tpdu_len)
+        return(-1);
+      off += 2 + (tpdu[off] + 1) / 2;
+      off += 2;
+      if (off > tpdu_len)
+        return(-1);
+      dcs = tpdu[off - 1];
+      switch ((fo >> 3) & 0x03)
+      {
+        case 0x02 :
+          off += 1;
+          break;
+        case 0x01 :
+        case 0x03 :
+          off += 7;
+          break;
+      }
+      break;
+
+    default :
+      return(-1);
+  }
+
+  if (off >= tpdu_len)
+    return(-1);
+  udl = tpdu[off++];
+
+  charset = MTR_gsm_sms_charset(dcs);
+  if (udl == 0)
+  {
+    memset(info, 0, sizeof(MTR_GSM_UD));
+    info->charset = charset;
+    text[0] = '\0';
+    return(0);
+  }
+  return(MTR_gsm_decode(charset, (u8)(fo & 0x40), tpdu + off,
+                        (u16)(tpdu_len - off), udl, text, text_len, info));
+}
+
+/*
+ * MTR_gsm_udh
+ *
+ * Checks a user data header and recovers concatenation information.
+ *
+ * Returns zero or -1 if the header is malformed.
+ */
+static int MTR_gsm_udh(udh, udh_len, info)
+  u8  *udh;                     /* First information element */
+  u8  udh_len;                  /* Length of header */
+  MTR_GSM_UD *info;             /* Description of the user data */
+{
+  u8  iei;                      /* Information element identifier */
+  u8  iel;                      /* Information element length */
+
+  while (udh_len >= 2)
+  {
+    iei = udh[0];
+    iel = udh[1];
+    if (iel + 2 > udh_len)
+      return(-1);
+
+    if ((iei == MTR_GSM_IEI_CONCAT8) && (iel == 3))
+    {
+      info->concat_ref = udh[2];
+      info->concat_num = udh[3];
+      info->concat_seq = udh[4];
+    }
+    else if ((iei == MTR_GSM_IEI_CONCAT16) && (iel == 4))
+    {
+      info->concat_ref = (u16)((udh[2] << 8) | udh[3]);
+      info->concat_num = udh[4];
+      info->concat_seq = udh[5];
+    }
+    udh += iel + 2;
+    udh_len -= iel + 2;
+  }
+  return((udh_len == 0) ? 0 : -1);
+}
+
+/*
+ * MTR_gsm_put_utf8
+ *
+ * Encodes a character as UTF-8.
+ *
+ * Returns the octet following the encoding.
+ */
+static char *MTR_gsm_put_utf8(out, cp)
+  char *out;                    /* Where to encode */
+  u16 cp;                       /* Unicode character */
+{
+  if (cp < 0x80)
+    *out++ = (char)cp;
+  else if (cp < 0x800)
+  {
+    *out++ = (char)(0xc0 | (cp >> 6));
+    *out++ = (char)(0x80 | (cp & 0x3f));
+  }
+  else
+  {
+    *out++ = (char)(0xe0 | (cp >> 12));
+    *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+    *out++ = (char)(0x80 | (cp & 0x3f));
+  }
+  return(out);
+}
+
+/*
+ * MTR_gsm_get_utf8
+ *
+ * Decodes one UTF-8 character and advances past it.
+ *
+ * Returns the character or -1 if the encoding is invalid.
+ */
+static int MTR_gsm_get_utf8(in)
+  u8  **in;                     /* Text */
+{
+  u8  *p;                       /* Next octet */
+  int cp;                       /* Character */
+  int more;                     /* Continuation octets */
+
+  p = *in;
+  if (*p < 0x80)
+  {
+    *in = p + 1;
+    return(*p);
+  }
+  if ((*p & 0xe0) == 0xc0)
+  {
+    cp = *p & 0x1f;
+    more = 1;
+  }
+  else if ((*p & 0xf0) == 0xe0)
+  {
+    cp = *p & 0x0f;
+    more = 2;
+  }
+  else
+  {
+    *in = p + 1;
+    return(-1);
+  }
+
+  for (p++; more > 0; more--, p++)
+  {
+    if ((*p & 0xc0) != 0x80)
+    {
+      *in = p;
+      return(-1);
+    }
+    cp = (cp << 6) | (*p & 0x3f);
+  }
+  *in = p;
+  return(cp);
+}
@@ -0,0 +1,51 @@
+/*
+ Name:          mtr_gsm.h
+
+ Description:   Definitions for the MTR GSM 03.38 text codec.
+ */
+
+#ifndef MTR_GSM_H
+#define MTR_GSM_H
+
+/*
+ * Character sets, as selected by a data coding scheme
+ */
+#define MTR_GSM_7BIT            (0)     /* GSM default alphabet, packed */
+#define MTR_GSM_8BIT            (1)     /* 8-bit data */
+#define MTR_GSM_UCS2            (2)     /* UCS2, big endian */
+
+/*
+ * Longest user data of one short message, in octets and septets
+ */
+#define MTR_GSM_MAX_UD          (140)
+#define MTR_GSM_MAX_SEPTETS     (160)
+
+/*
+ * Space needed for the text of any one short message, as UTF-8
+ */
+#define MTR_GSM_MAX_TEXT        (3 * MTR_GSM_MAX_SEPTETS + 1)
+
+/*
+ * Description of decoded user data
+ */
+typedef struct
+{
+  u8  charset;                  /* MTR_GSM_xxx */
+  u8  udh_len;                  /* Length of user data header, 0 if none */
+  u8  concat_num;               /* Parts of a concatenated message, 0 if not */
+  u8  concat_seq;               /* Sequence number of this part */
+  u16 concat_ref;               /* Concatenated message reference */
+} MTR_GSM_UD;
+
+int MTR_gsm_init(void);
+u8  MTR_gsm_sms_charset(u8 dcs);
+u8  MTR_gsm_cbs_charset(u8 dcs);
+u16 MTR_gsm_unpack7(u8 *src, u16 src_len, u16 num, u8 *septets);
+u16 MTR_gsm_pack7(u8 *septets, u16 num, u8 *dst, u16 dst_len);
+int MTR_gsm_decode(u8 charset, u8 udhi, u8 *ud, u16 ud_len, u16 udl,
+                   char *text, u16 text_len, MTR_GSM_UD *info);
+int MTR_gsm_encode7(char *text, u8 *dst, u16 dst_len);
+int MTR_gsm_sm_text(u8 *tpdu, u16 tpdu_len, char *text, u16 text_len,
+                    MTR_GSM_UD *info);
+
+#endif
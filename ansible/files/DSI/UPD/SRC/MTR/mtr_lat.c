@@ -0,0 +1,350 @@
+/*
+ Name:          mtr_lat.c
+
+ Description:   Latency histograms for MTR.
+
+                Every received primitive is stamped with the monotonic
+                time it was taken from the GCT queue. When the first
+                message sent in response to it reaches MTR_send_msg()
+                the time between the two is recorded, and when a
+                dialogue ends the time since its MAP-OPEN-IND is
+                recorded. The time a response is held back by the delay
+                emulation is recorded too. All are kept per class of
+                service.
+
+                The histograms are log-linear (as in HdrHistogram) and
+                have a fixed size. Each thread records into its own set,
+                allocated on first use, so recording needs no locking.
+                The report merges the sets of all threads, reading them
+                while they may still be updated.
+
+ Functions:     MTR_lat_now
+                MTR_lat_rx
+                MTR_lat_waited
+                MTR_lat_class
+                MTR_lat_sent
+                MTR_lat_record
+                MTR_lat_service
+                MTR_lat_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "system.h"
+#include "msg.h"
+#include "map_inc.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+
+/*
+ * Most threads that record latencies: the workers and the receive
+ * thread.
+ */
+#define MTR_LAT_MAX_SETS        (MTR_MAX_WORKERS + 1)
+
+/*
+ * Histograms of one thread
+ */
+typedef struct
+{
+  u32 count[MTR_LAT_NUM_KINDS][MTR_LAT_NUM_CLASSES][MTR_LAT_BUCKETS];
+} MTR_LAT_SET;
+
+static MTR_LAT_SET *MTR_lat_own_set(void);
+static int MTR_lat_bucket(unsigned long long ns);
+static unsigned long long MTR_lat_value(int bucket);
+static unsigned long long MTR_lat_percentile(u32 *count, u32 total, u32 per_10000);
+
+/*
+ * Static data:
+ */
+static MTR_LAT_SET *mtr_lat_sets[MTR_LAT_MAX_SETS];     /* Sets in use */
+static u32 mtr_lat_num_sets;                            /* Entries of mtr_lat_sets used */
+static MTR_LAT_SET mtr_lat_total;                       /* Merged sets, for reports */
+static MTR_LAT_SET mtr_lat_last;                        /* Merged sets at the last interval */
+static __thread MTR_LAT_SET *mtr_lat_set;               /* This thread's set */
+static __thread unsigned long long mtr_lat_rx_ns;       /* Primitive in hand received */
+static __thread u8 mtr_lat_pending;                     /* Set until it gets a response */
+static __thread u8 mtr_lat_cls;                         /* Class of its dialogue */
+
+static const char *mtr_lat_kind_name[MTR_LAT_NUM_KINDS] =
+{
+  "response", "dialogue", "held"
+};
+
+static const char *mtr_lat_class_name[MTR_LAT_NUM_CLASSES] = MTR_LAT_CLASS_NAMES;
+
+/*
+ * MTR_lat_now
+ *
+ * Returns the monotonic time in nanoseconds.
+ */
+unsigned long long MTR_lat_now()
+{
+  struct timespec ts;           /* Current time */
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * MTR_lat_rx
+ *
+ * Notes the time the primitive about to be processed by this thread
+ * was received, or with zero that it has been processed, so that
+ * messages sent later are not taken as its response.
+ *
+ * Always returns zero.
+ */
+int MTR_lat_rx(rx_ns)
+  unsigned long long rx_ns;     /* Time received */
+{
+  mtr_lat_rx_ns = rx_ns;
+  mtr_lat_pending = (rx_ns != 0);
+  mtr_lat_cls = MTR_LAT_OTHER;
+  return(0);
+}
+
+/*
+ * MTR_lat_waited
+ *
+ * Returns how long the primitive in hand has waited since it was
+ * received, or zero if there is none.
+ */
+unsigned long long MTR_lat_waited()
+{
+  if (mtr_lat_rx_ns == 0)
+    return(0);
+  return(MTR_lat_now() - mtr_lat_rx_ns);
+}
+
+/*
+ * MTR_lat_class
+ *
+ * Sets the class the response to the primitive in hand is recorded in.
+ *
+ * Always returns zero.
+ */
+int MTR_lat_class(cls)
+  u8 cls;                       /* MTR_LAT_xxx class */
+{
+  mtr_lat_cls = cls;
+  return(0);
+}
+
+/*
+ * MTR_lat_sent
+ *
+ * Called for each message sent. The first one sent in response to a
+ * primitive records the time since the primitive was received.
+ *
+ * Always returns zero.
+ */
+int MTR_lat_sent()
+{
+  if (!mtr_lat_pending)
+    return(0);
+
+  mtr_lat_pending = 0;
+  return(MTR_lat_record(MTR_LAT_RSP, mtr_lat_cls, MTR_lat_now() - mtr_lat_rx_ns));
+}
+
+/*
+ * MTR_lat_record
+ *
+ * Records one latency in this thread's histograms.
+ *
+ * Always returns zero.
+ */
+int MTR_lat_record(kind, cls, ns)
+  u8 kind;                      /* MTR_LAT_xxx */
+  u8 cls;                       /* MTR_LAT_xxx class */
+  unsigned long long ns;        /* Latency in nanoseconds */
+{
+  MTR_LAT_SET *set;             /* This thread's histograms */
+
+  if (((set = mtr_lat_set) == 0) && ((set = MTR_lat_own_set()) == 0))
+    return(0);
+
+  set->count[kind][cls][MTR_lat_bucket(ns)]++;
+  return(0);
+}
+
+/*
+ * MTR_lat_service
+ *
+ * Returns the class of a dialogue from its service primitive type.
+ */
+u8 MTR_lat_service(ptype)
+  u8 ptype;                     /* Service primitive type, 0 for none */
+{
+  switch (ptype)
+  {
+    case 0 :
+      return(MTR_LAT_OPEN);
+    case MAPST_FWD_SM_IND :
+      return(MTR_LAT_FWD_SM);
+    case MAPST_MT_FWD_SM_IND :
+      return(MTR_LAT_MT_FWD_SM);
+    case MAPST_SEND_IMSI_IND :
+      return(MTR_LAT_SEND_IMSI);
+    case MAPST_SND_RTIGPRS_IND :
+      return(MTR_LAT_SRI_GPRS);
+    case MAPST_SND_RTISM_IND :
+      return(MTR_LAT_SRI_SM);
+    case MAPST_PRO_UNSTR_SS_REQ_IND :
+    case MAPST_UNSTR_SS_REQ_CNF :
+    case MAPST_UNSTR_SS_REQ_IND :
+    case MAPST_UNSTR_SS_NOTIFY_IND :
+      return(MTR_LAT_USSD);
+    case MAPST_ANYTIME_INT_IND :
+      return(MTR_LAT_ATI);
+  }
+  return(MTR_LAT_OTHER);
+}
+
+/*
+ * MTR_lat_report
+ *
+ * Prints the count, median, 99th and 99.9th percentiles and maximum
+ * of every histogram in use, in microseconds. An interval report
+ * covers the time since the last interval report, otherwise the
+ * report covers the time since MTR started. Must only be called from
+ * one thread.
+ *
+ * Always returns zero.
+ */
+int MTR_lat_report(interval)
+  u8 interval;                  /* Set for an interval report */
+{
+  MTR_LAT_SET *set;             /* Histograms of one thread */
+  u32 *count;                   /* Histogram being reported */
+  u32 total;                    /* Latencies in the histogram */
+  u32 s;                        /* Set index */
+  int k;                        /* Kind */
+  int c;                        /* Class */
+  int b;                        /* Bucket */
+  int max;                      /* Highest bucket used */
+  u32 now;                      /* Count merged now */
+
+  for (k = 0; k < MTR_LAT_NUM_KINDS; k++)
+  {
+    for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    {
+      count = mtr_lat_total.count[k][c];
+      for (b = 0, total = 0, max = -1; b < MTR_LAT_BUCKETS; b++)
+      {
+        for (s = 0, now = 0; (s < mtr_lat_num_sets) && (s < MTR_LAT_MAX_SETS); s++)
+          if ((set = mtr_lat_sets[s]) != 0)
+            now += set->count[k][c][b];
+
+        if (interval)
+        {
+          count[b] = now - mtr_lat_last.count[k][c][b];
+          mtr_lat_last.count[k][c][b] = now;
+        }
+        else
+          count[b] = now;
+
+        if (count[b] != 0)
+        {
+          total += count[b];
+          max = b;
+        }
+      }
+
+      if (total == 0)
+        continue;
+
+      printf("MTR Latency %s %-9s: %u; p50 %.1fus; p99 %.1fus; p99.9 %.1fus; max %.1fus\n",
+             mtr_lat_kind_name[k], mtr_lat_class_name[c], total,
+             MTR_lat_percentile(count, total, 5000) / 1000.0,
+             MTR_lat_percentile(count, total, 9900) / 1000.0,
+             MTR_lat_percentile(count, total, 9990) / 1000.0,
+             MTR_lat_value(max) / 1000.0);
+    }
+  }
+  return(0);
+}
+
+/*
+ * MTR_lat_own_set
+ *
+ * Allocates histograms for the calling thread.
+ *
+ * Returns the histograms or 0 if none are available.
+ */
+static MTR_LAT_SET *MTR_lat_own_set()
+{
+  u32 s;                        /* Set index */
+
+  s = __sync_fetch_and_add(&mtr_lat_num_sets, 1);
+  if ((s >= MTR_LAT_MAX_SETS) || ((mtr_lat_set = calloc(1, sizeof(MTR_LAT_SET))) == 0))
+    return(0);
+
+  mtr_lat_sets[s] = mtr_lat_set;
+  return(mtr_lat_set);
+}
+
+/*
+ * MTR_lat_bucket
+ *
+ * Returns the bucket a latency falls in.
+ */
+static int MTR_lat_bucket(ns)
+  unsigned long long ns;        /* Latency in nanoseconds */
+{
+  int shift;                    /* Octave of the latency */
+
+  if (ns > MTR_LAT_MAX_NS)
+    ns = MTR_LAT_MAX_NS;
+  if (ns < (1ULL << MTR_LAT_SUB_BITS))
+    return((int)ns);
+
+  shift = 63 - __builtin_clzll(ns) - (MTR_LAT_SUB_BITS - 1);
+  return((shift << (MTR_LAT_SUB_BITS - 1)) + (int)(ns >> shift));
+}
+
+/*
+ * MTR_lat_value
+ *
+ * Returns the highest latency that falls in a bucket.
+ */
+static unsigned long long MTR_lat_value(bucket)
+  int bucket;                   /* Bucket */
+{
+  int shift;                    /* Octave of the bucket */
+  unsigned long long sub;       /* Sub-bucket within the octave */
+
+  if (bucket < (1 << MTR_LAT_SUB_BITS))
+    return((unsigned long long)bucket);
+
+  shift = (bucket >> (MTR_LAT_SUB_BITS - 1)) - 1;
+  sub = (bucket & ((1 << (MTR_LAT_SUB_BITS - 1)) - 1)) + (1 << (MTR_LAT_SUB_BITS - 1));
+  return(((sub + 1) << shift) - 1);
+}
+
+/*
+ * MTR_lat_percentile
+ *
+ * Returns the latency below which the given fraction of a histogram
+ * falls.
+ */
+static unsigned long long MTR_lat_percentile(count, total, per_10000)
+  u32 *count;                   /* Histogram */
+  u32 total;                    /* Latencies in the histogram */
+  u32 per_10000;                /* Fraction in 1/10000ths */
+{
+  unsigned long long want;      /* Latencies to reach */
+  unsigned long long seen;      /* Latencies counted so far */
+  int b;                        /* Bucket */
+
+  want = ((unsigned long long)total * per_10000 + 9999) / 10000;
+  for (b = 0, seen = 0; b < MTR_LAT_BUCKETS; b++)
+    if ((seen += count[b]) >= want)
+      break;
+  return(MTR_lat_value(b < MTR_LAT_BUCKETS ? b : MTR_LAT_BUCKETS - 1));
+}
@@ -0,0 +1,59 @@
+/*
+ Name:          mtr_lat.h
+
+ Description:   Definitions for the MTR latency histograms.
+ */
+
+#ifndef MTR_LAT_H
+#define MTR_LAT_H
+
+/*
+ * What is measured
+ */
+#define MTR_LAT_RSP             (0)     /* Primitive received to first response sent */
+#define MTR_LAT_DLG             (1)     /* MAP-OPEN-IND received to dialogue end */
+#define MTR_LAT_HOLD            (2)     /* Response held back by the delay emulation */
+#define MTR_LAT_NUM_KINDS       (3)
+
+/*
+ * Classes of dialogue, by service
+ */
+#define MTR_LAT_OPEN            (0)     /* No service primitive yet */
+#define MTR_LAT_FWD_SM          (1)
+#define MTR_LAT_MT_FWD_SM       (2)
+#define MTR_LAT_SEND_IMSI       (3)
+#define MTR_LAT_SRI_GPRS        (4)
+#define MTR_LAT_SRI_SM          (5)
+#define MTR_LAT_USSD            (6)
+#define MTR_LAT_ATI             (7)
+#define MTR_LAT_OTHER           (8)
+#define MTR_LAT_NUM_CLASSES     (9)
+
+/*
+ * Names of the classes, to initialise an array of strings
+ */
+#define MTR_LAT_CLASS_NAMES \
+        { "open", "fwd-sm", "mt-fwd-sm", "send-imsi", "sri-gprs", "sri-sm", \
+          "ussd", "ati", "other" }
+
+/*
+ * Buckets are log-linear: values below 2^MTR_LAT_SUB_BITS each have
+ * their own bucket, above that every power of 2 is split into
+ * 2^(MTR_LAT_SUB_BITS - 1) buckets, so the error is under 1 in 32.
+ * Values above MTR_LAT_MAX_NS (about 18 minutes) go in the top bucket.
+ */
+#define MTR_LAT_SUB_BITS        (6)
+#define MTR_LAT_MAX_BITS        (40)
+#define MTR_LAT_MAX_NS          ((1ULL << MTR_LAT_MAX_BITS) - 1)
+#define MTR_LAT_BUCKETS         ((MTR_LAT_MAX_BITS - MTR_LAT_SUB_BITS + 2) << (MTR_LAT_SUB_BITS - 1))
+
+unsigned long long MTR_lat_now(void);
+int MTR_lat_rx(unsigned long long rx_ns);
+unsigned long long MTR_lat_waited(void);
+int MTR_lat_class(u8 cls);
+int MTR_lat_sent(void);
+int MTR_lat_record(u8 kind, u8 cls, unsigned long long ns);
+u8  MTR_lat_service(u8 ptype);
+int MTR_lat_report(u8 interval);
+
+#endif
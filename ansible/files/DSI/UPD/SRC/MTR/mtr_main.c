@@ -0,0 +1,524 @@
+/*
+ Name:          mtr_main.c
+
+ Description:   Command line interface for MTR.
+
+                Several MTR processes can share one MAP module: each one
+                runs as its own LOCAL module in system.txt, serves the
+                subsystems routed to it in config.txt and owns a disjoint
+                slice of the TCAP incoming dialogue id range, e.g.
+
+                  mtr -m0x2d -r0x8000-0x87ff
+                  mtr -m0x3d -r0x8800-0x8fff
+
+                Without -r the whole TCAP incoming dialogue id range is
+                served, as read from the TCAP_CONFIG command in
+                config.txt.
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr.h"
+#include "mtr_cap.h"
+
+/*
+ * Functions in mtr.c
+ */
+int MTR_set_num_workers(u8 num_workers);
+int MTR_set_dlg_range(u16 first_dlg_id, u16 last_dlg_id);
+int MTR_set_huge_pages(u8 huge_pages);
+int MTR_set_map_instances(u8 num_inst);
+int MTR_set_batch(u16 batch_size, u32 flush_us);
+int MTR_set_capture(char *base, u32 file_size, u8 compress);
+int MTR_set_trace_filter(u32 every, u16 first_dlg_id, u16 last_dlg_id,
+                         char *msisdn_prefix);
+int MTR_set_guard_timer(u32 seconds);
+int MTR_set_lat_interval(u32 seconds);
+int MTR_set_routes(char *file);
+int MTR_set_subscribers(char *file);
+int MTR_set_delays(char *file);
+int MTR_set_faults(char *file);
+int MTR_set_overload(u32 max_dlgs, u32 max_wait_us);
+
+/*
+ * Default module ids
+ */
+#define MTR_DEF_MOD_ID          (0x2d)
+#define MTR_DEF_MAP_ID          (0x15)
+
+/*
+ * Protocol configuration file read for the TCAP incoming dialogue
+ * id range, unless another is given.
+ */
+#define MTR_DEF_CONFIG          "config.txt"
+#define MTR_MAX_CONFIG_LINE     (256)
+
+static int read_option(char *arg);
+static int read_number(char *str, unsigned long max, unsigned long *value);
+static int read_tcap_config(char *file, u16 *first_dlg_id, u16 *last_dlg_id);
+static void show_syntax(void);
+
+static char *program;           /* Program name */
+static u8  mtr_mod_id;          /* Module id of this task */
+static u8  mtr_map_id;          /* Module id of MAP */
+static u8  mtr_trace;           /* Trace enabled */
+static u8  mtr_term_mode;       /* Default dialogue termination mode */
+static u8  mtr_num_workers;     /* Worker threads */
+static u16 mtr_first_dlg_id;    /* First incoming dialogue id served */
+static u16 mtr_last_dlg_id;     /* Last incoming dialogue id served */
+static u8  mtr_dlg_range_set;   /* Set if a dialogue id range was given */
+static char *mtr_config;        /* Protocol configuration file, 0 for default */
+static u8  mtr_huge_pages;      /* Back the dialogue table with huge pages */
+static u8  mtr_num_inst;        /* MAP instances served */
+static u16 mtr_batch_size;      /* Messages processed per wakeup */
+static u32 mtr_flush_us;        /* Batch flush deadline in microseconds */
+static char *mtr_capture;       /* Capture file prefix */
+static u32 mtr_capture_mb;      /* Capture file size in megabytes */
+static u8  mtr_capture_gz;      /* Compress capture files */
+static u32 mtr_trace_every;     /* Trace 1 in N dialogues */
+static u16 mtr_trace_first;     /* First dialogue id traced */
+static u16 mtr_trace_last;      /* Last dialogue id traced */
+static char *mtr_trace_prefix;  /* MSISDN prefix traced */
+static long mtr_guard_s;        /* Guard time in seconds, -1 for default */
+static u32 mtr_lat_s;           /* Latency report interval in seconds */
+static char *mtr_routes;        /* Number range route file, 0 for none */
+static char *mtr_subs;          /* Subscriber database, 0 for none */
+static char *mtr_delays;        /* Response delay file, 0 for none */
+static char *mtr_faults;        /* Fault file, 0 for none */
+static u32 mtr_max_dlgs;        /* Dialogues in progress before refusing */
+static u32 mtr_max_wait_us;     /* Wait inside MTR before refusing */
+
+/*
+ * main
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  int i;                        /* Argument index */
+
+  program = argv[0];
+  mtr_mod_id = MTR_DEF_MOD_ID;
+  mtr_map_id = MTR_DEF_MAP_ID;
+  mtr_trace = 1;
+  mtr_term_mode = DLG_TERM_MODE_AUTO;
+  mtr_num_workers = 0;
+  mtr_dlg_range_set = 0;
+  mtr_config = 0;
+  mtr_huge_pages = 0;
+  mtr_num_inst = 1;
+  mtr_batch_size = 1;
+  mtr_flush_us = 1000;
+  mtr_capture = 0;
+  mtr_capture_mb = 0;
+  mtr_capture_gz = 0;
+  mtr_trace_every = 0;
+  mtr_trace_first = 0xffff;
+  mtr_trace_last = 0;
+  mtr_trace_prefix = 0;
+  mtr_guard_s = -1;
+  mtr_lat_s = 0;
+  mtr_routes = 0;
+  mtr_subs = 0;
+  mtr_delays = 0;
+  mtr_faults = 0;
+  mtr_max_dlgs = 0;
+  mtr_max_wait_us = 0;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (read_option(argv[i]) != 0)
+    {
+      show_syntax();
+      return(1);
+    }
+  }
+
+  if (MTR_set_num_workers(mtr_num_workers) != 0)
+  {
+    fprintf(stderr, "%s: too many worker threads\n", program);
+    return(1);
+  }
+
+  if (MTR_set_batch(mtr_batch_size, mtr_flush_us) != 0)
+  {
+    fprintf(stderr, "%s: bad batch size\n", program);
+    return(1);
+  }
+
+  /*
+   * Without an explicit range, serve the TCAP incoming range. The
+   * default configuration file is optional.
+   */
+  if (!mtr_dlg_range_set)
+  {
+    if (read_tcap_config(mtr_config ? mtr_config : MTR_DEF_CONFIG,
+                         &mtr_first_dlg_id, &mtr_last_dlg_id) == 0)
+      mtr_dlg_range_set = 1;
+    else if (mtr_config != 0)
+    {
+      fprintf(stderr, "%s: no TCAP_CONFIG incoming dialogue range in %s\n",
+              program, mtr_config);
+      return(1);
+    }
+  }
+
+  if ((mtr_dlg_range_set) &&
+      (MTR_set_dlg_range(mtr_first_dlg_id, mtr_last_dlg_id) != 0))
+  {
+    fprintf(stderr, "%s: bad dialogue id range\n", program);
+    return(1);
+  }
+
+  MTR_set_huge_pages(mtr_huge_pages);
+
+  if (MTR_set_map_instances(mtr_num_inst) != 0)
+  {
+    fprintf(stderr, "%s: too many MAP instances\n", program);
+    return(1);
+  }
+
+  if ((mtr_capture != 0) &&
+      (MTR_set_capture(mtr_capture, mtr_capture_mb * 1024 * 1024,
+                       mtr_capture_gz) != 0))
+  {
+    fprintf(stderr, "%s: bad capture file name\n", program);
+    return(1);
+  }
+
+  if (MTR_set_trace_filter(mtr_trace_every, mtr_trace_first, mtr_trace_last,
+                           mtr_trace_prefix) != 0)
+  {
+    fprintf(stderr, "%s: bad MSISDN trace prefix\n", program);
+    return(1);
+  }
+
+  if ((mtr_guard_s >= 0) && (MTR_set_guard_timer((u32)mtr_guard_s) != 0))
+  {
+    fprintf(stderr, "%s: bad guard time\n", program);
+    return(1);
+  }
+
+  MTR_set_lat_interval(mtr_lat_s);
+
+  if ((mtr_routes != 0) && (MTR_set_routes(mtr_routes) != 0))
+  {
+    fprintf(stderr, "%s: bad route file %s\n", program, mtr_routes);
+    return(1);
+  }
+
+  if ((mtr_subs != 0) && (MTR_set_subscribers(mtr_subs) != 0))
+  {
+    fprintf(stderr, "%s: bad subscriber database %s\n", program, mtr_subs);
+    return(1);
+  }
+
+  if ((mtr_delays != 0) && (MTR_set_delays(mtr_delays) != 0))
+  {
+    fprintf(stderr, "%s: bad delay file %s\n", program, mtr_delays);
+    return(1);
+  }
+
+  if ((mtr_faults != 0) && (MTR_set_faults(mtr_faults) != 0))
+  {
+    fprintf(stderr, "%s: bad fault file %s\n", program, mtr_faults);
+    return(1);
+  }
+
+  MTR_set_overload(mtr_max_dlgs, mtr_max_wait_us);
+
+  mtr_ent(mtr_mod_id, mtr_map_id, mtr_trace, mtr_term_mode);
+  return(0);
+}
+
+/*
+ * read_option
+ *
+ * Reads one command line option.
+ *
+ * Returns zero or -1 if the option is not recognised or out of range.
+ */
+static int read_option(arg)
+  char *arg;                    /* Command line argument */
+{
+  unsigned long value;          /* Numeric value of the option */
+  unsigned long last;           /* Upper end of a range */
+  char *sep;                    /* Range separator */
+
+  if (arg[0] != '-')
+    return(-1);
+
+  switch (arg[1])
+  {
+    case 'm':
+      if (read_number(&arg[2], 0xff, &value) != 0)
+        return(-1);
+      mtr_mod_id = (u8)value;
+      break;
+
+    case 'u':
+      if (read_number(&arg[2], 0xff, &value) != 0)
+        return(-1);
+      mtr_map_id = (u8)value;
+      break;
+
+    case 't':
+      mtr_trace = 0;
+      break;
+
+    case 'o':
+      if (read_number(&arg[2], 0xff, &value) != 0)
+        return(-1);
+      mtr_term_mode = (u8)value;
+      break;
+
+    case 'w':
+      if (read_number(&arg[2], 0xff, &value) != 0)
+        return(-1);
+      mtr_num_workers = (u8)value;
+      break;
+
+    case 'b':
+      if (read_number(&arg[2], 0xffff, &value) != 0)
+        return(-1);
+      mtr_batch_size = (u16)value;
+      break;
+
+    case 'f':
+      if (read_number(&arg[2], 0xffffffff, &value) != 0)
+        return(-1);
+      mtr_flush_us = (u32)value;
+      break;
+
+    case 'r':
+      if ((sep = strchr(&arg[2], '-')) == 0)
+        return(-1);
+      *sep = '\0';
+      if ((read_number(&arg[2], 0xffff, &value) != 0) ||
+          (read_number(sep + 1, 0xffff, &last) != 0) || (value > last))
+        return(-1);
+      mtr_first_dlg_id = (u16)value;
+      mtr_last_dlg_id = (u16)last;
+      mtr_dlg_range_set = 1;
+      break;
+
+    case 'x':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_config = &arg[2];
+      break;
+
+    case 'l':
+      mtr_huge_pages = 1;
+      break;
+
+    case 'a':
+      if (read_number(&arg[2], 0xff, &value) != 0)
+        return(-1);
+      mtr_num_inst = (u8)value;
+      break;
+
+    case 'c':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_capture = &arg[2];
+      break;
+
+    case 's':
+      if ((read_number(&arg[2], 4095, &value) != 0) || (value == 0))
+        return(-1);
+      mtr_capture_mb = (u32)value;
+      break;
+
+    case 'z':
+      mtr_capture_gz = 1;
+      break;
+
+    case 'n':
+      if ((read_number(&arg[2], 0xffffffff, &value) != 0) || (value == 0))
+        return(-1);
+      mtr_trace_every = (u32)value;
+      break;
+
+    case 'i':
+      if ((sep = strchr(&arg[2], '-')) == 0)
+        return(-1);
+      *sep = '\0';
+      if ((read_number(&arg[2], 0xffff, &value) != 0) ||
+          (read_number(sep + 1, 0xffff, &last) != 0) || (value > last))
+        return(-1);
+      mtr_trace_first = (u16)value;
+      mtr_trace_last = (u16)last;
+      break;
+
+    case 'p':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_trace_prefix = &arg[2];
+      break;
+
+    case 'g':
+      if (read_number(&arg[2], 0x7fffffff, &value) != 0)
+        return(-1);
+      mtr_guard_s = (long)value;
+      break;
+
+    case 'e':
+      if (read_number(&arg[2], 86400, &value) != 0)
+        return(-1);
+      mtr_lat_s = (u32)value;
+      break;
+
+    case 'd':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_routes = &arg[2];
+      break;
+
+    case 'k':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_subs = &arg[2];
+      break;
+
+    case 'y':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_delays = &arg[2];
+      break;
+
+    case 'j':
+      if (arg[2] == '\0')
+        return(-1);
+      mtr_faults = &arg[2];
+      break;
+
+    case 'q':
+      if (read_number(&arg[2], 0xffffffff, &value) != 0)
+        return(-1);
+      mtr_max_dlgs = (u32)value;
+      break;
+
+    case 'v':
+      if (read_number(&arg[2], 0xffffffff, &value) != 0)
+        return(-1);
+      mtr_max_wait_us = (u32)value;
+      break;
+
+    default:
+      return(-1);
+  }
+  return(0);
+}
+
+/*
+ * read_number
+ *
+ * Converts a decimal or 0x prefixed hex string.
+ *
+ * Returns zero or -1 if not a number or greater than max.
+ */
+static int read_number(str, max, value)
+  char *str;                    /* String to convert */
+  unsigned long max;            /* Largest accepted value */
+  unsigned long *value;         /* Converted value */
+{
+  char *end;                    /* First character not converted */
+
+  if (*str == '\0')
+    return(-1);
+
+  *value = strtoul(str, &end, 0);
+  if ((*end != '\0') || (*value > max))
+    return(-1);
+  return(0);
+}
+
+/*
+ * read_tcap_config
+ *
+ * Reads the incoming dialogue id range from the TCAP_CONFIG command
+ * of a protocol configuration file:
+ *
+ *   TCAP_CONFIG <base_ogdlg_id> <nog_dialogues> <base_icdlg_id> <nic_dialogues> ...
+ *
+ * Returns zero or -1 if the file or command cannot be read.
+ */
+static int read_tcap_config(file, first_dlg_id, last_dlg_id)
+  char *file;                   /* Configuration file */
+  u16 *first_dlg_id;            /* First incoming dialogue id */
+  u16 *last_dlg_id;             /* Last incoming dialogue id */
+{
+  FILE *fp;                     /* Configuration file */
+  char line[MTR_MAX_CONFIG_LINE]; /* Line of the file */
+  char field[4][32];            /* First parameters of the command */
+  unsigned long base;           /* Base incoming dialogue id */
+  unsigned long num;            /* Number of incoming dialogues */
+  int found;                    /* Set once the command is read */
+
+  if ((fp = fopen(file, "r")) == 0)
+    return(-1);
+
+  found = 0;
+  while ((!found) && (fgets(line, sizeof(line), fp) != 0))
+  {
+    if ((strncmp(line, "TCAP_CONFIG", 11) != 0) ||
+        (sscanf(line + 11, "%31s %31s %31s %31s",
+                field[0], field[1], field[2], field[3]) != 4))
+      continue;
+
+    if ((read_number(field[2], 0xffff, &base) != 0) ||
+        (read_number(field[3], 0x8000, &num) != 0) ||
+        (num == 0) || (base + num - 1 > 0xffff))
+      break;
+
+    *first_dlg_id = (u16)base;
+    *last_dlg_id = (u16)(base + num - 1);
+    found = 1;
+  }
+  fclose(fp);
+  return(found ? 0 : -1);
+}
+
+/*
+ * show_syntax
+ */
+static void show_syntax()
+{
+  fprintf(stderr, "Syntax: %s [-m -u -t -o -w -b -f -r -x -l -a -c -s -z -n -i -p -g -e -d -k -y -j -q -v]\n", program);
+  fprintf(stderr, "  -m  MTR module id (default 0x%02x)\n", MTR_DEF_MOD_ID);
+  fprintf(stderr, "  -u  MAP module id (default 0x%02x)\n", MTR_DEF_MAP_ID);
+  fprintf(stderr, "  -t  disable tracing\n");
+  fprintf(stderr, "  -o  default dialogue termination mode (default 0)\n");
+  fprintf(stderr, "  -w  number of worker threads (default 0, no workers)\n");
+  fprintf(stderr, "  -b  batch size, messages processed per wakeup (default 1)\n");
+  fprintf(stderr, "  -f  batch flush deadline in microseconds (default 1000)\n");
+  fprintf(stderr, "  -r  incoming dialogue id range served, e.g. -r0x8000-0x87ff\n");
+  fprintf(stderr, "  -x  file with the TCAP_CONFIG range served without -r (default %s)\n",
+          MTR_DEF_CONFIG);
+  fprintf(stderr, "  -l  use huge pages for the dialogue table\n");
+  fprintf(stderr, "  -a  number of MAP instances served, 0 to n-1 (default 1)\n");
+  fprintf(stderr, "  -c  capture trace to binary files <prefix>.NNNN.mtrcap\n");
+  fprintf(stderr, "  -s  capture file size in megabytes (default %d)\n",
+          MTR_CAP_DEF_FILE_SIZE / (1024 * 1024));
+  fprintf(stderr, "  -z  compress capture files\n");
+  fprintf(stderr, "  -n  trace only 1 in every n dialogues\n");
+  fprintf(stderr, "  -i  trace only dialogue ids in range, e.g. -i0x8000-0x800f\n");
+  fprintf(stderr, "  -p  trace only dialogues for MSISDNs starting with digits\n");
+  fprintf(stderr, "  -g  dialogue guard time in seconds, 0 for none (default 60)\n");
+  fprintf(stderr, "  -e  print latency percentiles every n seconds (default 0, on SIGUSR1 only)\n");
+  fprintf(stderr, "  -d  answer SRI for SM from the number ranges in a file, reloaded on SIGHUP\n");
+  fprintf(stderr, "  -k  answer subscribers from a database built by mtrsub\n");
+  fprintf(stderr, "  -y  hold responses back by the per-service delays in a file\n");
+  fprintf(stderr, "  -j  inject the faults in a file into the responses\n");
+  fprintf(stderr, "  -q  refuse new dialogues above n in progress (default 0, no limit)\n");
+  fprintf(stderr, "  -v  refuse new dialogues whose open waited n us inside MTR (default 0, no limit)\n");
+}
@@ -0,0 +1,206 @@
+/*
+ Name:          mtr_prs.c
+
+ Description:   Single pass parser for received MAP primitives.
+
+                A received primitive is a type octet followed by
+                (name, length, value) parameters and a terminating zero.
+                MTR_prs_parse() only reads the type. MTR_prs_find()
+                walks on through the message from where the last look
+                up stopped, checking every parameter lies inside the
+                message and recording a view of each one it passes, and
+                stops at the parameter it wants. The handlers read
+                parameters in place, and no parameter is read twice or
+                beyond the last one wanted.
+
+ Functions:     MTR_prs_parse
+                MTR_prs_find
+                MTR_prs_report
+ */
+
+#include <stdio.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "mtr_prs.h"
+
+static u8 *MTR_prs_walk(MTR_PRS *prs, u8 pname, u8 *plen);
+static int MTR_prs_error(MTR_PRS *prs);
+
+/*
+ * Static data:
+ */
+static u32 mtr_prs_errors;              /* Malformed primitives found */
+static u32 mtr_prs_overflows;           /* Primitives with parameters not recorded */
+
+/*
+ * MTR_prs_parse
+ *
+ * Starts parsing a received primitive. Its parameters are parsed as
+ * MTR_prs_find() looks them up.
+ *
+ * Returns zero or -1 if the primitive is empty.
+ */
+int MTR_prs_parse(m, prs)
+  MSG *m;                       /* Received message */
+  MTR_PRS *prs;                 /* Parsed primitive */
+{
+  prs->pptr = get_param(m);
+  prs->plen = m->len;
+  prs->next = 1;
+  prs->num = 0;
+  prs->error = 0;
+  prs->overflow = 0;
+
+  if (prs->plen == 0)
+  {
+    prs->ptype = 0;
+    prs->more = 0;
+    return(-1);
+  }
+  prs->ptype = prs->pptr[0];
+  prs->more = 1;
+  return(0);
+}
+
+/*
+ * MTR_prs_find
+ *
+ * Looks up the first occurrence of a parameter. Parameters already
+ * recorded are searched first, then the message is walked on from the
+ * first parameter not recorded. A malformed parameter ends the walk,
+ * so the parameters before it can still be looked up.
+ *
+ * Returns a pointer to its value in the message, with its length in
+ * plen, or zero if the parameter is not present.
+ */
+u8 *MTR_prs_find(prs, pname, plen)
+  MTR_PRS *prs;                 /* Parsed primitive */
+  u8  pname;                    /* Parameter name */
+  u8  *plen;                    /* Length of the value */
+{
+  MTR_PRM *prm;                 /* Parameter view */
+  MTR_PRM *end;                 /* End of the views */
+  u8  *pptr;                    /* Parameter area */
+  u16 off;                      /* Offset of the current parameter */
+  u8  len;                      /* Length of the current value */
+
+  for (prm = prs->prm, end = prs->prm + prs->num; prm < end; prm++)
+  {
+    if (prm->name == pname)
+    {
+      *plen = prm->len;
+      return(prs->pptr + prm->off);
+    }
+  }
+
+  pptr = prs->pptr;
+  for (off = prs->next; prs->more; off += 2 + len)
+  {
+    /*
+     * Zero name terminates the parameter list, which may also end
+     * with the message.
+     */
+    if ((off >= prs->plen) || (pptr[off] == 0))
+    {
+      prs->more = 0;
+      break;
+    }
+
+    if (((prs->plen - off) < 2) || ((prs->plen - off - 2) < (len = pptr[off + 1])))
+    {
+      MTR_prs_error(prs);
+      break;
+    }
+
+    if (prs->num == MTR_PRS_MAX_PARAMS)
+      return(MTR_prs_walk(prs, pname, plen));
+
+    prm = &prs->prm[prs->num++];
+    prm->name = pptr[off];
+    prm->len = len;
+    prm->off = off + 2;
+    prs->next = off + 2 + len;
+    if (prm->name == pname)
+    {
+      *plen = len;
+      return(pptr + prm->off);
+    }
+  }
+  return(0);
+}
+
+/*
+ * MTR_prs_walk
+ *
+ * Looks a parameter up beyond the last one that could be recorded,
+ * walking the rest of the message without recording anything.
+ *
+ * Returns a pointer to its value in the message, with its length in
+ * plen, or zero if the parameter is not present.
+ */
+static u8 *MTR_prs_walk(prs, pname, plen)
+  MTR_PRS *prs;                 /* Parsed primitive */
+  u8  pname;                    /* Parameter name */
+  u8  *plen;                    /* Length of the value */
+{
+  u8  *pptr;                    /* Parameter area */
+  u16 off;                      /* Offset of the current parameter */
+  u8  len;                      /* Length of the current value */
+
+  if (prs->overflow == 0)
+  {
+    __sync_fetch_and_add(&mtr_prs_overflows, 1);
+    prs->overflow = 1;
+  }
+
+  pptr = prs->pptr;
+  for (off = prs->next; (off < prs->plen) && (pptr[off] != 0); off += 2 + len)
+  {
+    if (((prs->plen - off) < 2) || ((prs->plen - off - 2) < (len = pptr[off + 1])))
+    {
+      MTR_prs_error(prs);
+      break;
+    }
+
+    if (pptr[off] == pname)
+    {
+      *plen = len;
+      return(pptr + off + 2);
+    }
+  }
+  return(0);
+}
+
+/*
+ * MTR_prs_error
+ *
+ * Ends the walk of a primitive at a malformed parameter.
+ *
+ * Always returns zero.
+ */
+static int MTR_prs_error(prs)
+  MTR_PRS *prs;                 /* Parsed primitive */
+{
+  if (prs->error == 0)
+    __sync_fetch_and_add(&mtr_prs_errors, 1);
+  prs->error = 1;
+  prs->more = 0;
+  return(0);
+}
+
+/*
+ * MTR_prs_report
+ *
+ * Prints the parser counts to the console.
+ *
+ * Always returns zero.
+ */
+int MTR_prs_report()
+{
+  printf("MTR Malformed primitives: %u\n", mtr_prs_errors);
+  printf("MTR Primitives with more than %d parameters: %u\n",
+         MTR_PRS_MAX_PARAMS, mtr_prs_overflows);
+  return(0);
+}
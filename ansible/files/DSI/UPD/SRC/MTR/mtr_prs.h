@@ -0,0 +1,49 @@
+/*
+ Name:          mtr_prs.h
+
+ Description:   Definitions for the MTR received primitive parser.
+ */
+
+#ifndef MTR_PRS_H
+#define MTR_PRS_H
+
+/*
+ * Most parameters recorded for one primitive. Further parameters are
+ * still found, by walking the message past the recorded ones.
+ */
+#define MTR_PRS_MAX_PARAMS      (16)
+
+/*
+ * View of one parameter inside the received message
+ */
+typedef struct
+{
+  u8  name;                     /* Parameter name (MAPPN_xxx) */
+  u8  len;                      /* Length of the value */
+  u16 off;                      /* Offset of the value from the primitive type */
+} MTR_PRM;
+
+/*
+ * A parsed primitive. Parameters are recorded as they are passed by
+ * look ups, so a look up reads no further into the message than the
+ * parameter it wants. The views refer into the message, so they are
+ * only valid until the message is released.
+ */
+typedef struct
+{
+  u8  *pptr;                    /* Primitive type octet */
+  u16 plen;                     /* Length of the parameter area */
+  u16 next;                     /* Offset of the first parameter not recorded */
+  u8  ptype;                    /* Primitive type */
+  u8  num;                      /* Number of parameters recorded */
+  u8  more;                     /* Set while parameters may follow next */
+  u8  error;                    /* Set once a malformed parameter is reached */
+  u8  overflow;                 /* Set once a parameter is passed unrecorded */
+  MTR_PRM prm[MTR_PRS_MAX_PARAMS]; /* Parameter views */
+} MTR_PRS;
+
+int MTR_prs_parse(MSG *m, MTR_PRS *prs);
+u8 *MTR_prs_find(MTR_PRS *prs, u8 pname, u8 *plen);
+int MTR_prs_report(void);
+
+#endif
@@ -0,0 +1,676 @@
+/*
+ Name:          mtr_rte.c
+
+ Description:   Number range routing for MTR.
+
+                Routes are read from the route file described in
+                mtr_rte.h into a compressed radix trie over the MSISDN
+                digits. Each node holds a run of digits, a bit mask of
+                the digits having a child and the index of its first
+                child; the children of a node are contiguous and in
+                digit order, so a child is found by counting the bits
+                below its digit. The trie is built from the sorted
+                prefixes in one pass and never changed afterwards.
+
+                A reload reads the file into a new trie on its own
+                thread and then swaps the table pointer, so lookups
+                carry on throughout and take no lock. Each thread that
+                looks routes up has its own generation counter, odd
+                while a lookup is in the table. After the swap the
+                reload waits for every counter it finds odd to move on
+                before it frees the old table.
+
+ Functions:     MTR_rte_load
+                MTR_rte_reload
+                MTR_rte_find
+                MTR_rte_digits
+                MTR_rte_imsi
+                MTR_rte_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "system.h"
+#include "msg.h"
+#include "mtr_wrk.h"
+#include "mtr_rte.h"
+
+/*
+ * Node of the trie
+ */
+typedef struct
+{
+  u32 label;                    /* Offset of the node's digits in the digit pool */
+  u16 mask;                     /* Bit n set if there is a child for digit n */
+  u8  label_len;                /* Number of digits of the node */
+  u8  spare;
+  u32 child;                    /* Index of the first child */
+  u32 route;                    /* Route index + 1, 0 for none */
+} MTR_RTE_NODE;
+
+/*
+ * Prefix read from the file, before the trie is built
+ */
+typedef struct
+{
+  u32 off;                      /* Offset of the digits in the digit pool */
+  u32 line;                     /* Line of the file */
+  u32 route;                    /* Route index */
+  u8  len;                      /* Number of digits */
+} MTR_RTE_ENT;
+
+/*
+ * A complete routing table
+ */
+typedef struct
+{
+  MTR_RTE_NODE *node;           /* Nodes, the first is the root */
+  u32 num_nodes;                /* Nodes in use */
+  MTR_RTE *route;               /* Routes in file order */
+  u32 num_routes;               /* Routes read */
+  u8  *digit;                   /* Digit pool, one digit per octet */
+  u32 num_digits;               /* Digits in the pool */
+} MTR_RTE_TABLE;
+
+/*
+ * Threads that may look routes up: the workers and the receive thread
+ */
+#define MTR_RTE_MAX_READERS     (MTR_MAX_WORKERS + 1)
+
+/*
+ * Generation counter of a thread looking routes up, written only by
+ * that thread
+ */
+typedef struct
+{
+  volatile u32 gen;             /* Odd while a lookup is in the table */
+} __attribute__((aligned(MTR_CACHE_LINE))) MTR_RTE_READER;
+
+static MTR_RTE_TABLE *MTR_rte_read(char *file);
+static int MTR_rte_parse(char *str, u8 max, u8 *digits);
+static int MTR_rte_compare(const void *a, const void *b);
+static int MTR_rte_build(MTR_RTE_TABLE *tbl, MTR_RTE_ENT *ent, u32 lo, u32 hi, u8 depth, u32 n);
+static int MTR_rte_swap(MTR_RTE_TABLE *tbl);
+static int MTR_rte_free(MTR_RTE_TABLE *tbl);
+static int MTR_rte_quiesce(void);
+static void *MTR_rte_main(void *arg);
+
+/*
+ * Static data:
+ */
+static MTR_RTE_TABLE * volatile mtr_rte_table;  /* Table in use, 0 for none */
+static char *mtr_rte_file;                      /* Route file */
+static u32 mtr_rte_busy;                        /* Set while reloading */
+static u32 mtr_rte_loads;                       /* Tables loaded */
+static u32 mtr_rte_failed;                      /* Loads that failed */
+static u8 *mtr_rte_sort_digits;                 /* Digit pool being sorted */
+static MTR_RTE_READER mtr_rte_reader[MTR_RTE_MAX_READERS]; /* Generation of each thread */
+static u32 mtr_rte_num_readers;                 /* Entries of mtr_rte_reader handed out */
+static __thread MTR_RTE_READER *mtr_rte_self;   /* This thread's entry */
+
+/*
+ * MTR_rte_load
+ *
+ * Reads the route file and uses it from now on. The file is read
+ * again by MTR_rte_reload().
+ *
+ * Returns zero or -1 on error, in which case the table in use is kept.
+ */
+int MTR_rte_load(file)
+  char *file;                   /* Route file */
+{
+  MTR_RTE_TABLE *tbl;           /* New table */
+
+  mtr_rte_file = file;
+  if ((tbl = MTR_rte_read(file)) == 0)
+  {
+    mtr_rte_failed++;
+    return(-1);
+  }
+  MTR_rte_swap(tbl);
+  return(0);
+}
+
+/*
+ * MTR_rte_reload
+ *
+ * Starts reading the route file again in the background.
+ *
+ * Returns zero or -1 if there is no route file or a reload is already
+ * in progress.
+ */
+int MTR_rte_reload()
+{
+  pthread_t thread;             /* Reload thread */
+
+  if (mtr_rte_file == 0)
+    return(-1);
+  if (__sync_lock_test_and_set(&mtr_rte_busy, 1) != 0)
+    return(-1);
+
+  if (pthread_create(&thread, NULL, MTR_rte_main, NULL) != 0)
+  {
+    __sync_lock_release(&mtr_rte_busy);
+    return(-1);
+  }
+  pthread_detach(thread);
+  return(0);
+}
+
+/*
+ * MTR_rte_find
+ *
+ * Finds the route of the longest prefix matching a number and copies
+ * it, as the table may be replaced once the lookup is done.
+ *
+ * Returns zero or -1 if no prefix matches.
+ */
+int MTR_rte_find(digits, num_digits, route)
+  u8 *digits;                   /* Number, one digit per octet */
+  u8 num_digits;                /* Digits in the number */
+  MTR_RTE *route;               /* Returns the route */
+{
+  MTR_RTE_READER *self;         /* This thread's generation */
+  MTR_RTE_TABLE *tbl;           /* Table in use */
+  MTR_RTE_NODE *node;           /* Node being matched */
+  u32 best;                     /* Route of the longest match so far */
+  u32 t;                        /* Entry of mtr_rte_reader */
+  u8 pos;                       /* Digits matched */
+  u8 i;                         /* Digit of the node */
+
+  if (mtr_rte_table == 0)
+    return(-1);
+
+  if ((self = mtr_rte_self) == 0)
+  {
+    /*
+     * MTR has no more threads than there are entries, so the check
+     * only guards against misuse.
+     */
+    if ((t = __sync_fetch_and_add(&mtr_rte_num_readers, 1)) >= MTR_RTE_MAX_READERS)
+      return(-1);
+    self = mtr_rte_self = &mtr_rte_reader[t];
+  }
+
+  /*
+   * Mark this thread as in the table before reading the table pointer,
+   * so that a reload either sees the mark or is seen to have swapped.
+   */
+  self->gen++;
+  __sync_synchronize();
+  tbl = mtr_rte_table;
+
+  best = 0;
+  pos = 0;
+  node = &tbl->node[0];
+  while (1)
+  {
+    if (pos + node->label_len > num_digits)
+      break;
+    for (i = 0; i < node->label_len; i++)
+      if (tbl->digit[node->label + i] != digits[pos + i])
+        break;
+    if (i < node->label_len)
+      break;
+
+    pos += node->label_len;
+    if (node->route != 0)
+      best = node->route;
+    if ((pos == num_digits) || ((node->mask & (1 << digits[pos])) == 0))
+      break;
+
+    node = &tbl->node[node->child +
+                      __builtin_popcount(node->mask & ((1 << digits[pos]) - 1))];
+  }
+  if (best != 0)
+    *route = tbl->route[best - 1];
+
+  MTR_WRK_BARRIER();
+  self->gen++;
+  return(best ? 0 : -1);
+}
+
+/*
+ * MTR_rte_digits
+ *
+ * Unpacks the digits of an address string: one octet of nature of
+ * address followed by TBCD digits, two to an octet, low nibble first.
+ *
+ * Returns the number of digits, 0 if none or not all decimal.
+ */
+u8 MTR_rte_digits(addr, len, digits)
+  u8 *addr;                     /* Address string */
+  u8 len;                       /* Length of addr */
+  u8 *digits;                   /* Returns MTR_RTE_MAX_DIGITS digits at most */
+{
+  u8 num;                       /* Digits unpacked */
+  u8 digit;                     /* Digit */
+  u8 i;                         /* Digit index */
+
+  num = 0;
+  for (i = 0; (1 + i / 2 < len) && (num < MTR_RTE_MAX_DIGITS); i++)
+  {
+    digit = (i & 1) ? (addr[1 + i / 2] >> 4) : (addr[1 + i / 2] & 0x0f);
+    if (digit == 0x0f)
+      break;
+    if (digit > 9)
+      return(0);
+    digits[num++] = digit;
+  }
+  return(num);
+}
+
+/*
+ * MTR_rte_imsi
+ *
+ * Makes the IMSI of a subscriber from the IMSI prefix of its route and
+ * the last digits of its MSISDN.
+ *
+ * Returns the number of digits of the IMSI.
+ */
+u8 MTR_rte_imsi(route, digits, num_digits, imsi)
+  MTR_RTE *route;               /* Route of the subscriber */
+  u8 *digits;                   /* MSISDN, one digit per octet */
+  u8 num_digits;                /* Digits in the MSISDN */
+  u8 *imsi;                     /* Returns MTR_RTE_IMSI_DIGITS digits */
+{
+  u8 fill;                      /* Digits taken from the MSISDN */
+  u8 i;                         /* Digit index */
+
+  memcpy(imsi, route->imsi, route->imsi_len);
+  fill = MTR_RTE_IMSI_DIGITS - route->imsi_len;
+  for (i = 0; i < fill; i++)
+    imsi[route->imsi_len + i] = (fill - i <= num_digits) ? digits[num_digits - (fill - i)] : 0;
+  return(MTR_RTE_IMSI_DIGITS);
+}
+
+/*
+ * MTR_rte_report
+ *
+ * Prints the routing table counters.
+ *
+ * Always returns zero.
+ */
+int MTR_rte_report()
+{
+  MTR_RTE_TABLE *tbl;           /* Table in use */
+
+  if (mtr_rte_file == 0)
+    return(0);
+
+  tbl = mtr_rte_table;
+  printf("MTR Routes from %s: %u ranges; %u nodes (%luKB); %u loads; %u failed\n",
+         mtr_rte_file, tbl ? tbl->num_routes : 0, tbl ? tbl->num_nodes : 0,
+         tbl ? (unsigned long)((tbl->num_nodes * sizeof(MTR_RTE_NODE) +
+                                tbl->num_routes * sizeof(MTR_RTE) +
+                                tbl->num_digits) / 1024) : 0,
+         mtr_rte_loads, mtr_rte_failed);
+  return(0);
+}
+
+/*
+ * MTR_rte_read
+ *
+ * Reads a route file into a new table.
+ *
+ * Returns the table or 0 on error.
+ */
+static MTR_RTE_TABLE *MTR_rte_read(file)
+  char *file;                   /* Route file */
+{
+  MTR_RTE_TABLE *tbl;           /* New table */
+  MTR_RTE_ENT *ent;             /* Prefixes read */
+  MTR_RTE_ENT *new_ent;         /* Prefixes read, grown */
+  u8 *new_digit;                /* Digit pool, grown */
+  FILE *fp;                     /* Route file */
+  char line[MTR_RTE_MAX_LINE];  /* Line of the file */
+  char field[4][32];            /* Parameters of a route */
+  u8 digits[MTR_RTE_MAX_DIGITS]; /* Prefix being read */
+  MTR_RTE *route;               /* Route being read */
+  unsigned long error;          /* MAP user error */
+  char *end;                    /* End of the error code */
+  char *p;                      /* Start of the line's text */
+  u32 max;                      /* Routes and prefixes allocated */
+  u32 num;                      /* Prefixes kept after removing duplicates */
+  u32 line_num;                 /* Line number */
+  u32 i;                        /* Prefix index */
+  int len;                      /* Digits in the prefix */
+  int err;                      /* Set on error */
+
+  if ((fp = fopen(file, "r")) == 0)
+  {
+    fprintf(stderr, "MTR: cannot open route file %s\n", file);
+    return(0);
+  }
+
+  tbl = calloc(1, sizeof(MTR_RTE_TABLE));
+  ent = 0;
+  max = 0;
+  line_num = 0;
+  err = (tbl == 0);
+
+  while ((!err) && (fgets(line, sizeof(line), fp) != 0))
+  {
+    line_num++;
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if ((*p == '\0') || (*p == '*') || (*p == '#'))
+      continue;
+
+    if ((strncmp(p, "MTR_ROUTE", 9) != 0) ||
+        (sscanf(p + 9, "%31s %31s %31s", field[0], field[1], field[2]) != 3))
+    {
+      fprintf(stderr, "MTR: %s line %u: bad route\n", file, line_num);
+      err = 1;
+      break;
+    }
+
+    /*
+     * Grow the arrays, the digit pool can always hold one more prefix
+     */
+    if (tbl->num_routes == max)
+    {
+      max = max ? max * 2 : 1024;
+      if ((route = realloc(tbl->route, max * sizeof(MTR_RTE))) != 0)
+        tbl->route = route;
+      if ((new_ent = realloc(ent, max * sizeof(MTR_RTE_ENT))) != 0)
+        ent = new_ent;
+      if ((new_digit = realloc(tbl->digit, max * MTR_RTE_MAX_DIGITS)) != 0)
+        tbl->digit = new_digit;
+      if ((route == 0) || (new_ent == 0) || (new_digit == 0))
+      {
+        fprintf(stderr, "MTR: out of memory reading %s\n", file);
+        err = 1;
+        break;
+      }
+    }
+
+    route = &tbl->route[tbl->num_routes];
+    memset(route, 0, sizeof(MTR_RTE));
+    len = strcmp(field[0], "+") ? MTR_rte_parse(field[0], MTR_RTE_MAX_DIGITS, digits) : 0;
+
+    if (strcmp(field[1], "ERROR") == 0)
+    {
+      error = strtoul(field[2], &end, 0);
+      if ((*end != '\0') || (error == 0) || (error > 0xff))
+        len = -1;
+      route->error = (u8)error;
+    }
+    else
+    {
+      route->msc_len = (u8)MTR_rte_parse(field[1], MTR_RTE_MAX_DIGITS, route->msc);
+      route->imsi_len = (u8)MTR_rte_parse(field[2], MTR_RTE_IMSI_DIGITS, route->imsi);
+      if ((route->msc_len == 0) || (route->imsi_len == 0))
+        len = -1;
+    }
+
+    if (len < 0)
+    {
+      fprintf(stderr, "MTR: %s line %u: bad route\n", file, line_num);
+      err = 1;
+      break;
+    }
+
+    ent[tbl->num_routes].off = tbl->num_digits;
+    ent[tbl->num_routes].line = line_num;
+    ent[tbl->num_routes].route = tbl->num_routes;
+    ent[tbl->num_routes].len = (u8)len;
+    memcpy(&tbl->digit[tbl->num_digits], digits, len);
+    tbl->num_digits += len;
+    tbl->num_routes++;
+  }
+  fclose(fp);
+
+  /*
+   * Sort the prefixes, then drop all but the last of any duplicates
+   */
+  if (!err)
+  {
+    mtr_rte_sort_digits = tbl->digit;
+    qsort(ent, tbl->num_routes, sizeof(MTR_RTE_ENT), MTR_rte_compare);
+    for (i = 0, num = 0; i < tbl->num_routes; i++)
+    {
+      if ((i + 1 < tbl->num_routes) && (ent[i].len == ent[i + 1].len) &&
+          (memcmp(&tbl->digit[ent[i].off], &tbl->digit[ent[i + 1].off], ent[i].len) == 0))
+        continue;
+      ent[num++] = ent[i];
+    }
+
+    /*
+     * A trie over n prefixes has at most 2n nodes besides the root.
+     */
+    if ((tbl->node = calloc(2 * num + 1, sizeof(MTR_RTE_NODE))) == 0)
+    {
+      fprintf(stderr, "MTR: out of memory reading %s\n", file);
+      err = 1;
+    }
+    else
+    {
+      tbl->num_nodes = 1;
+      MTR_rte_build(tbl, ent, 0, num, 0, 0);
+    }
+  }
+
+  free(ent);
+  if (err)
+  {
+    MTR_rte_free(tbl);
+    return(0);
+  }
+  return(tbl);
+}
+
+/*
+ * MTR_rte_parse
+ *
+ * Reads a string of decimal digits.
+ *
+ * Returns the number of digits or -1 if empty, too long or not digits.
+ */
+static int MTR_rte_parse(str, max, digits)
+  char *str;                    /* String to read */
+  u8 max;                       /* Most digits allowed */
+  u8 *digits;                   /* Returns the digits */
+{
+  int len;                      /* Digits read */
+
+  for (len = 0; str[len] != '\0'; len++)
+  {
+    if ((len >= max) || (!isdigit((unsigned char)str[len])))
+      return(-1);
+    digits[len] = (u8)(str[len] - '0');
+  }
+  return(len ? len : -1);
+}
+
+/*
+ * MTR_rte_compare
+ *
+ * Orders prefixes by digits, a prefix before any longer one it starts,
+ * then by line.
+ */
+static int MTR_rte_compare(a, b)
+  const void *a;                /* First prefix */
+  const void *b;                /* Second prefix */
+{
+  const MTR_RTE_ENT *ea = a;    /* First prefix */
+  const MTR_RTE_ENT *eb = b;    /* Second prefix */
+  int cmp;                      /* Comparison of common digits */
+
+  cmp = memcmp(&mtr_rte_sort_digits[ea->off], &mtr_rte_sort_digits[eb->off],
+               (ea->len < eb->len) ? ea->len : eb->len);
+  if (cmp != 0)
+    return(cmp);
+  if (ea->len != eb->len)
+    return((ea->len < eb->len) ? -1 : 1);
+  return((ea->line < eb->line) ? -1 : (ea->line > eb->line));
+}
+
+/*
+ * MTR_rte_build
+ *
+ * Fills in a node for a run of sorted prefixes that all start with the
+ * same depth digits, and below it the nodes for the rest of them. The
+ * node's own digits are those common to the whole run.
+ *
+ * Always returns zero.
+ */
+static int MTR_rte_build(tbl, ent, lo, hi, depth, n)
+  MTR_RTE_TABLE *tbl;           /* Table being built */
+  MTR_RTE_ENT *ent;             /* Sorted prefixes without duplicates */
+  u32 lo;                       /* First prefix of the run */
+  u32 hi;                       /* End of the run */
+  u8 depth;                     /* Digits matched above the node */
+  u32 n;                        /* Node to fill in */
+{
+  MTR_RTE_NODE *node;           /* Node being filled in */
+  u8 *first;                    /* Digits of the first prefix */
+  u8 *last;                     /* Digits of the last prefix */
+  u8 common;                    /* Digits common to the run */
+  u8 digit;                     /* Digit of a child */
+  u32 child;                    /* Next child node */
+  u32 end;                      /* End of a child's run */
+
+  node = &tbl->node[n];
+  if (lo == hi)
+    return(0);
+
+  /*
+   * The run is sorted, so the digits its first and last prefixes have
+   * in common are common to all of them.
+   */
+  first = &tbl->digit[ent[lo].off];
+  last = &tbl->digit[ent[hi - 1].off];
+  for (common = depth; (common < ent[lo].len) && (common < ent[hi - 1].len) &&
+                       (first[common] == last[common]); common++)
+    ;
+  node->label = ent[lo].off + depth;
+  node->label_len = (u8)(common - depth);
+
+  /*
+   * A prefix ending here sorts first
+   */
+  if (ent[lo].len == common)
+    node->route = ent[lo++].route + 1;
+
+  for (end = lo; end < hi; end++)
+    node->mask |= (u16)(1 << tbl->digit[ent[end].off + common]);
+  node->child = tbl->num_nodes;
+  tbl->num_nodes += __builtin_popcount(node->mask);
+
+  for (child = node->child; lo < hi; child++, lo = end)
+  {
+    digit = tbl->digit[ent[lo].off + common];
+    for (end = lo + 1; (end < hi) && (tbl->digit[ent[end].off + common] == digit); end++)
+      ;
+    MTR_rte_build(tbl, ent, lo, end, common, child);
+  }
+  return(0);
+}
+
+/*
+ * MTR_rte_swap
+ *
+ * Starts using a new table and frees the old one once lookups still
+ * using it are done. Only called by one thread at a time.
+ *
+ * Always returns zero.
+ */
+static int MTR_rte_swap(tbl)
+  MTR_RTE_TABLE *tbl;           /* New table */
+{
+  MTR_RTE_TABLE *old;           /* Table replaced */
+
+  __sync_synchronize();
+  old = __sync_lock_test_and_set(&mtr_rte_table, tbl);
+  mtr_rte_loads++;
+  if (old != 0)
+  {
+    MTR_rte_quiesce();
+    MTR_rte_free(old);
+  }
+  return(0);
+}
+
+/*
+ * MTR_rte_quiesce
+ *
+ * Waits until no lookup that may have started before the table was
+ * swapped is still in progress. A thread whose generation is even is
+ * not in a table, and any lookup it starts will see the new one. A
+ * thread whose generation is odd is done with the old table once its
+ * generation changes.
+ *
+ * Always returns zero.
+ */
+static int MTR_rte_quiesce()
+{
+  u32 num;                      /* Entries of mtr_rte_reader in use */
+  u32 gen;                      /* Generation of a thread after the swap */
+  u32 t;                        /* Entry of mtr_rte_reader */
+
+  __sync_synchronize();
+  num = mtr_rte_num_readers;
+  if (num > MTR_RTE_MAX_READERS)
+    num = MTR_RTE_MAX_READERS;
+
+  for (t = 0; t < num; t++)
+  {
+    gen = mtr_rte_reader[t].gen;
+    while ((gen & 1) && (mtr_rte_reader[t].gen == gen))
+      usleep(MTR_RTE_WAIT_US);
+  }
+  __sync_synchronize();
+  return(0);
+}
+
+/*
+ * MTR_rte_free
+ *
+ * Frees a table.
+ *
+ * Always returns zero.
+ */
+static int MTR_rte_free(tbl)
+  MTR_RTE_TABLE *tbl;           /* Table */
+{
+  if (tbl == 0)
+    return(0);
+  free(tbl->node);
+  free(tbl->route);
+  free(tbl->digit);
+  free(tbl);
+  return(0);
+}
+
+/*
+ * MTR_rte_main
+ *
+ * Reload thread body. Reads the route file and swaps it in.
+ *
+ * Returns when done.
+ */
+static void *MTR_rte_main(arg)
+  void *arg;                    /* Unused */
+{
+  MTR_RTE_TABLE *tbl;           /* New table */
+
+  if ((tbl = MTR_rte_read(mtr_rte_file)) == 0)
+  {
+    fprintf(stderr, "MTR: route file %s not reloaded, old routes kept\n", mtr_rte_file);
+    mtr_rte_failed++;
+  }
+  else
+  {
+    printf("MTR Routes reloaded from %s: %u ranges\n", mtr_rte_file, tbl->num_routes);
+    fflush(stdout);
+    MTR_rte_swap(tbl);
+  }
+  __sync_lock_release(&mtr_rte_busy);
+  return(NULL);
+}
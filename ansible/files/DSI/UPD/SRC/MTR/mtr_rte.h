@@ -0,0 +1,59 @@
+/*
+ Name:          mtr_rte.h
+
+ Description:   Definitions for MTR number range routing.
+
+                The route file holds one route per line, in the style
+                of config.txt, with '*' or '#' starting a comment:
+
+                  MTR_ROUTE <msisdn prefix> <msc number> <imsi prefix>
+                  MTR_ROUTE <msisdn prefix> ERROR <map user error>
+
+                The longest prefix matching an MSISDN selects its route,
+                and the prefix + matches any MSISDN, as in the SCCP_GTT
+                patterns. The IMSI of a subscriber is the IMSI prefix
+                followed by the last digits of the MSISDN, up to 15
+                digits. When the same prefix is given twice the last
+                line wins.
+ */
+
+#ifndef MTR_RTE_H
+#define MTR_RTE_H
+
+/*
+ * Most digits of an MSISDN or MSC number, and of an IMSI
+ */
+#define MTR_RTE_MAX_DIGITS      (20)
+#define MTR_RTE_IMSI_DIGITS     (15)
+
+/*
+ * Longest line of the route file
+ */
+#define MTR_RTE_MAX_LINE        (256)
+
+/*
+ * Microseconds a reload waits between checks for lookups still using
+ * the table it replaced
+ */
+#define MTR_RTE_WAIT_US         (100)
+
+/*
+ * Outcome of a route, digits are stored one per octet
+ */
+typedef struct
+{
+  u8  error;                    /* MAP user error, 0 to answer */
+  u8  msc_len;                  /* Digits in msc */
+  u8  imsi_len;                 /* Digits in imsi */
+  u8  msc[MTR_RTE_MAX_DIGITS];  /* MSC number */
+  u8  imsi[MTR_RTE_IMSI_DIGITS]; /* IMSI prefix */
+} MTR_RTE;
+
+int MTR_rte_load(char *file);
+int MTR_rte_reload(void);
+int MTR_rte_find(u8 *digits, u8 num_digits, MTR_RTE *route);
+u8  MTR_rte_digits(u8 *addr, u8 len, u8 *digits);
+u8  MTR_rte_imsi(MTR_RTE *route, u8 *digits, u8 num_digits, u8 *imsi);
+int MTR_rte_report(void);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ Name:          mtr_stat.c
+
+ Description:   Statistics segment for MTR.
+
+                Creates the shared memory segment described in
+                mtr_stat.h and runs the statistics thread, which once a
+                second sums the counters of all threads, counts the
+                dialogues in each state and adds the totals for the
+                second to the ring in the segment.
+
+                If the segment cannot be created the counters are kept
+                in private memory, so that counting never has to check.
+
+ Functions:     MTR_stat_start
+                MTR_stat_thread
+                MTR_stat_total
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+#include "mtr_flt.h"
+#include "mtr_sub.h"
+#include "mtr_dlg.h"
+#include "mtr_stat.h"
+
+static void *MTR_stat_main(void *arg);
+
+/*
+ * Static data:
+ */
+__thread MTR_STAT_THR *mtr_stat_thr;    /* This thread's counters */
+static MTR_STAT_SEG *mtr_stat_seg;      /* The segment */
+static MTR_STAT_THR mtr_stat_spare;     /* Counters of threads beyond the last */
+
+/*
+ * MTR_stat_start
+ *
+ * Creates the statistics segment and starts the statistics thread.
+ * Must be called before any counting thread is started.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_stat_start(mod_id)
+  u8 mod_id;                    /* Module id of this MTR */
+{
+  char name[MTR_STAT_MAX_NAME]; /* Segment name */
+  pthread_t thread;             /* Statistics thread */
+  int fd;                       /* Segment file */
+  void *seg;                    /* Segment mapping */
+
+  sprintf(name, MTR_STAT_NAME, mod_id);
+  seg = MAP_FAILED;
+  if ((fd = shm_open(name, O_RDWR | O_CREAT, 0644)) != -1)
+  {
+    if (ftruncate(fd, sizeof(MTR_STAT_SEG)) == 0)
+      seg = mmap(NULL, sizeof(MTR_STAT_SEG), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+
+  if (seg == MAP_FAILED)
+  {
+    fprintf(stderr, "MTR: failed to create statistics segment %s\n", name);
+    if ((seg = malloc(sizeof(MTR_STAT_SEG))) == 0)
+      return(-1);
+  }
+
+  /*
+   * The segment may be left over from an earlier run. Readers only
+   * trust it once the magic number is set.
+   */
+  mtr_stat_seg = seg;
+  mtr_stat_seg->magic = 0;
+  __sync_synchronize();
+  memset(mtr_stat_seg, 0, sizeof(MTR_STAT_SEG));
+  mtr_stat_seg->version = MTR_STAT_VERSION;
+  mtr_stat_seg->pid = (u32)getpid();
+  mtr_stat_seg->num_states = MTR_S_REFUSED + 1;
+  mtr_stat_seg->start = (unsigned long long)time(NULL);
+  __sync_synchronize();
+  mtr_stat_seg->magic = MTR_STAT_MAGIC;
+
+  if (pthread_create(&thread, NULL, MTR_stat_main, NULL) != 0)
+    return(-1);
+  pthread_detach(thread);
+  return(0);
+}
+
+/*
+ * MTR_stat_thread
+ *
+ * Gives the calling thread its own block of counters, on its first
+ * count.
+ *
+ * Returns the block.
+ */
+MTR_STAT_THR *MTR_stat_thread()
+{
+  u32 t;                        /* Block index */
+
+  if (mtr_stat_seg == 0)
+    return(&mtr_stat_spare);
+
+  t = __sync_fetch_and_add(&mtr_stat_seg->num_threads, 1);
+  if (t >= MTR_STAT_MAX_THREADS)
+  {
+    mtr_stat_seg->num_threads = MTR_STAT_MAX_THREADS;
+    return(mtr_stat_thr = &mtr_stat_spare);
+  }
+  return(mtr_stat_thr = &mtr_stat_seg->thr[t]);
+}
+
+/*
+ * MTR_stat_total
+ *
+ * Sums the counters of all threads.
+ *
+ * Always returns zero.
+ */
+int MTR_stat_total(sum)
+  MTR_STAT_THR *sum;            /* Returns the totals */
+{
+  MTR_STAT_THR *thr;            /* Counters of one thread */
+  u32 num;                      /* Blocks in use */
+  u32 t;                        /* Block index */
+  int c;                        /* Class */
+
+  memset(sum, 0, sizeof(MTR_STAT_THR));
+  if (mtr_stat_seg == 0)
+    return(0);
+  num = mtr_stat_seg->num_threads;
+  for (t = 0; (t < num) && (t < MTR_STAT_MAX_THREADS); t++)
+  {
+    thr = &mtr_stat_seg->thr[t];
+    sum->rx += thr->rx;
+    sum->tx += thr->tx;
+    sum->opened += thr->opened;
+    sum->refused += thr->refused;
+    sum->send_fail += thr->send_fail;
+    sum->getm_fail += thr->getm_fail;
+    sum->exhausted += thr->exhausted;
+    sum->deferred += thr->deferred;
+    sum->dropped += thr->dropped;
+    for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    {
+      sum->service[c] += thr->service[c];
+      sum->closed[c] += thr->closed[c];
+      sum->aborted[c] += thr->aborted[c];
+    }
+    for (c = 0; c < MTR_FLT_NUM_OUTCOMES; c++)
+      sum->fault[c] += thr->fault[c];
+  }
+  return(0);
+}
+
+/*
+ * MTR_stat_main
+ *
+ * Statistics thread body. At the end of every second adds the totals
+ * for the second to the ring.
+ *
+ * Never returns.
+ */
+static void *MTR_stat_main(arg)
+  void *arg;                    /* Unused */
+{
+  struct timespec next;         /* End of the current second */
+  MTR_STAT_THR last;            /* Totals at the end of the last second */
+  MTR_STAT_THR now;             /* Totals now */
+  MTR_STAT_SEC *sec;            /* Ring entry being written */
+  unsigned long long state[MTR_STAT_MAX_STATES]; /* Dialogues in each state */
+  u32 closed;                   /* Dialogues ended normally */
+  u32 aborted;                  /* Dialogues ended by an abort */
+  u32 s;                        /* State */
+  int c;                        /* Class */
+
+  MTR_stat_total(&last);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (1)
+  {
+    next.tv_sec++;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+      ;
+
+    MTR_stat_total(&now);
+    for (c = 0, closed = 0, aborted = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    {
+      closed += (u32)(now.closed[c] - last.closed[c]);
+      aborted += (u32)(now.aborted[c] - last.aborted[c]);
+    }
+
+    memset(state, 0, sizeof(state));
+    sec = &mtr_stat_seg->sec[mtr_stat_seg->seconds % MTR_STAT_HISTORY];
+    sec->time = (unsigned long long)time(NULL);
+    sec->rx = (u32)(now.rx - last.rx);
+    sec->tx = (u32)(now.tx - last.tx);
+    sec->opened = (u32)(now.opened - last.opened);
+    sec->refused = (u32)(now.refused - last.refused);
+    sec->closed = closed;
+    sec->aborted = aborted;
+    sec->send_fail = (u32)(now.send_fail - last.send_fail);
+    sec->getm_fail = (u32)(now.getm_fail - last.getm_fail);
+    sec->active = MTR_dlg_states(state, mtr_stat_seg->num_states);
+    for (s = 0; s < mtr_stat_seg->num_states; s++)
+      mtr_stat_seg->state[s] = state[s];
+
+    /*
+     * The entry must be complete before readers can see it.
+     */
+    __sync_synchronize();
+    mtr_stat_seg->seconds++;
+    last = now;
+  }
+  return(NULL);
+}
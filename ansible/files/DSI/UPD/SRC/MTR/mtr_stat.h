@@ -0,0 +1,121 @@
+/*
+ Name:          mtr_stat.h
+
+ Description:   Layout of the MTR statistics segment.
+
+                Each MTR process publishes its counters in a POSIX
+                shared memory segment named after its module id, which
+                mtrstat maps read-only. Every thread counting events has
+                its own block of counters, written only by that thread,
+                so counting needs no locked instructions. A statistics
+                thread sums the blocks once a second into a ring holding
+                the last hour.
+
+                Include mtr_wrk.h, mtr_lat.h and mtr_flt.h first.
+ */
+
+#ifndef MTR_STAT_H
+#define MTR_STAT_H
+
+/*
+ * Segment identification, the version changes with the layout.
+ */
+#define MTR_STAT_MAGIC          (0x4d545253)    /* "MTRS" */
+#define MTR_STAT_VERSION        (4)
+
+/*
+ * Name of the segment of the MTR process with a given module id
+ */
+#define MTR_STAT_NAME           "/mtr_stat.%02x"
+#define MTR_STAT_MAX_NAME       (32)
+
+/*
+ * Seconds of per-second totals kept.
+ */
+#define MTR_STAT_HISTORY        (3600)
+
+/*
+ * Most threads counting events: the workers and the receive thread.
+ */
+#define MTR_STAT_MAX_THREADS    (MTR_MAX_WORKERS + 1)
+
+/*
+ * Most dialogue states counted, indexed by MTR_S_xxx.
+ */
+#define MTR_STAT_MAX_STATES     (8)
+
+/*
+ * Counters of one thread. They only ever increase.
+ */
+typedef struct
+{
+  unsigned long long rx;                /* Messages received */
+  unsigned long long tx;                /* Messages sent */
+  unsigned long long opened;            /* Dialogues accepted */
+  unsigned long long refused;           /* Dialogues refused by overload control */
+  unsigned long long send_fail;         /* Messages that could not be sent */
+  unsigned long long getm_fail;         /* Messages that could not be allocated */
+  unsigned long long exhausted;         /* Times sending was held up by getm or GCT_send */
+  unsigned long long deferred;          /* Messages and responses put off to be retried */
+  unsigned long long dropped;           /* Messages given up as the retry queue was full */
+  unsigned long long service[MTR_LAT_NUM_CLASSES]; /* Service primitives handled */
+  unsigned long long closed[MTR_LAT_NUM_CLASSES];  /* Dialogues ended normally */
+  unsigned long long aborted[MTR_LAT_NUM_CLASSES]; /* Dialogues ended by an abort */
+  unsigned long long fault[MTR_FLT_NUM_OUTCOMES];  /* Outcomes injected */
+} __attribute__((aligned(MTR_CACHE_LINE))) MTR_STAT_THR;
+
+/*
+ * Totals for one second
+ */
+typedef struct
+{
+  unsigned long long time;              /* End of the second, seconds since 1970 */
+  u32 rx;                               /* Messages received */
+  u32 tx;                               /* Messages sent */
+  u32 opened;                           /* Dialogues accepted */
+  u32 refused;                          /* Dialogues refused by overload control */
+  u32 closed;                           /* Dialogues ended normally */
+  u32 aborted;                          /* Dialogues ended by an abort */
+  u32 send_fail;                        /* Messages that could not be sent */
+  u32 getm_fail;                        /* Messages that could not be allocated */
+  u32 active;                           /* Dialogues in progress at the end */
+} MTR_STAT_SEC;
+
+/*
+ * The segment
+ */
+typedef struct
+{
+  u32 magic;                            /* MTR_STAT_MAGIC */
+  u32 version;                          /* MTR_STAT_VERSION */
+  u32 pid;                              /* Process writing the segment */
+  u32 num_threads;                      /* Entries of thr in use */
+  u32 num_states;                       /* Entries of state in use */
+  u32 spare;
+  unsigned long long start;             /* Process start, seconds since 1970 */
+  volatile unsigned long long seconds;  /* Entries written to sec, the last
+                                         * at (seconds - 1) % MTR_STAT_HISTORY */
+  unsigned long long state[MTR_STAT_MAX_STATES]; /* Dialogues in each state */
+  MTR_STAT_SEC sec[MTR_STAT_HISTORY];   /* Totals for each second */
+  MTR_STAT_THR thr[MTR_STAT_MAX_THREADS]; /* Counters of each thread */
+} MTR_STAT_SEG;
+
+/*
+ * Counts an event in the calling thread's counters. Only this thread
+ * writes them, so a relaxed store of the new value is enough and
+ * readers never see a torn value.
+ */
+#define MTR_STAT_ADD(field, n) \
+        do { \
+          MTR_STAT_THR *thr_ = mtr_stat_thr ? mtr_stat_thr : MTR_stat_thread(); \
+          __atomic_store_n(&thr_->field, thr_->field + (n), __ATOMIC_RELAXED); \
+        } while (0)
+#define MTR_STAT_INC(field)     MTR_STAT_ADD(field, 1)
+
+extern __thread MTR_STAT_THR *mtr_stat_thr;
+
+int MTR_stat_start(u8 mod_id);
+MTR_STAT_THR *MTR_stat_thread(void);
+int MTR_stat_total(MTR_STAT_THR *sum);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ Name:          mtr_sub.c
+
+ Description:   Subscriber database for MTR.
+
+                Maps the database image described in mtr_sub.h
+                read-only and shared, and looks subscribers up by
+                MSISDN or IMSI. Pages are only read in as subscribers
+                are looked up, so opening the database costs the same
+                whatever its size. The hash and number packing are also
+                used by mtrsub to build the image.
+
+ Functions:     MTR_sub_open
+                MTR_sub_msisdn
+                MTR_sub_imsi
+                MTR_sub_key
+                MTR_sub_tbcd_key
+                MTR_sub_hash
+                MTR_sub_report
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "system.h"
+#include "mtr_sub.h"
+
+static MTR_SUB_REC *MTR_sub_find(int *disp, u32 *index, unsigned long long key);
+
+/*
+ * Static data:
+ */
+static char *mtr_sub_file;              /* Database file, 0 for none */
+static MTR_SUB_HDR *mtr_sub_hdr;        /* Mapped image */
+static MTR_SUB_REC *mtr_sub_recs;       /* Records */
+static int *mtr_sub_msisdn_disp;        /* MSISDN index displacements */
+static int *mtr_sub_imsi_disp;          /* IMSI index displacements */
+static u32 *mtr_sub_imsi_recs;          /* Record of each IMSI index slot */
+
+/*
+ * MTR_sub_open
+ *
+ * Maps a database image built by mtrsub.
+ *
+ * Returns zero or -1 if the file is not a valid image.
+ */
+int MTR_sub_open(file)
+  char *file;                   /* Database file */
+{
+  struct stat st;               /* File status */
+  MTR_SUB_HDR *hdr;             /* Mapped image */
+  unsigned long long n;         /* Subscribers */
+  int fd;                       /* Database file */
+
+  if ((fd = open(file, O_RDONLY)) == -1)
+    return(-1);
+  hdr = MAP_FAILED;
+  if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(MTR_SUB_HDR)))
+    hdr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED)
+    return(-1);
+
+  /*
+   * Every part of the image must lie within the file.
+   */
+  n = hdr->num_subs;
+  if ((hdr->magic != MTR_SUB_MAGIC) || (hdr->version != MTR_SUB_VERSION) ||
+      (hdr->rec_size != sizeof(MTR_SUB_REC)) || (n == 0) ||
+      (hdr->size != (unsigned long long)st.st_size) ||
+      (hdr->msisdn_disp + n * sizeof(int) > hdr->size) ||
+      (hdr->imsi_disp + n * sizeof(int) > hdr->size) ||
+      (hdr->imsi_recs + n * sizeof(u32) > hdr->size) ||
+      (hdr->recs + n * sizeof(MTR_SUB_REC) > hdr->size) ||
+      ((hdr->msisdn_disp | hdr->imsi_disp | hdr->imsi_recs | hdr->recs) & 3))
+  {
+    munmap(hdr, (size_t)st.st_size);
+    return(-1);
+  }
+
+  mtr_sub_msisdn_disp = (int *)((u8 *)hdr + hdr->msisdn_disp);
+  mtr_sub_imsi_disp = (int *)((u8 *)hdr + hdr->imsi_disp);
+  mtr_sub_imsi_recs = (u32 *)((u8 *)hdr + hdr->imsi_recs);
+  mtr_sub_recs = (MTR_SUB_REC *)((u8 *)hdr + hdr->recs);
+  mtr_sub_hdr = hdr;
+  mtr_sub_file = file;
+  return(0);
+}
+
+/*
+ * MTR_sub_msisdn
+ *
+ * Looks a subscriber up by MSISDN, an address string.
+ *
+ * Returns the subscriber's record, 0 if not found.
+ */
+MTR_SUB_REC *MTR_sub_msisdn(addr, len)
+  u8 *addr;                     /* MSISDN address string */
+  u8 len;                       /* Length of addr */
+{
+  if ((mtr_sub_hdr == 0) || (len < 2))
+    return(0);
+  return(MTR_sub_find(mtr_sub_msisdn_disp, 0, MTR_sub_tbcd_key(&addr[1], (u8)(len - 1))));
+}
+
+/*
+ * MTR_sub_imsi
+ *
+ * Looks a subscriber up by IMSI, TBCD digits.
+ *
+ * Returns the subscriber's record, 0 if not found.
+ */
+MTR_SUB_REC *MTR_sub_imsi(tbcd, len)
+  u8 *tbcd;                     /* IMSI */
+  u8 len;                       /* Length of tbcd */
+{
+  if (mtr_sub_hdr == 0)
+    return(0);
+  return(MTR_sub_find(mtr_sub_imsi_disp, mtr_sub_imsi_recs, MTR_sub_tbcd_key(tbcd, len)));
+}
+
+/*
+ * MTR_sub_find
+ *
+ * Looks a key up in one of the indexes.
+ *
+ * Returns the record, 0 if not found.
+ */
+static MTR_SUB_REC *MTR_sub_find(disp, index, key)
+  int *disp;                    /* Index displacements */
+  u32 *index;                   /* Record of each slot, 0 if the same */
+  unsigned long long key;       /* Packed number */
+{
+  MTR_SUB_REC *rec;             /* Record found */
+  u32 num;                      /* Subscribers */
+  u32 slot;                     /* Slot of the key */
+  int d;                        /* Displacement of its bucket */
+
+  if (key == 0)
+    return(0);
+
+  /*
+   * Slots come from the image, so each is checked before it is used
+   * rather than the whole image being checked when it is opened.
+   */
+  num = mtr_sub_hdr->num_subs;
+  d = disp[MTR_sub_hash(key, 0, num)];
+  slot = (d < 0) ? ~(u32)d : MTR_sub_hash(key, (u32)d, num);
+  if ((slot < num) && (index != 0))
+    slot = index[slot];
+  if (slot >= num)
+    return(0);
+  rec = &mtr_sub_recs[slot];
+
+  if (key != ((index == 0) ? rec->msisdn : rec->imsi))
+    return(0);
+  return(rec);
+}
+
+/*
+ * MTR_sub_key
+ *
+ * Packs a number as its value, with the number of digits in the top
+ * octet so that leading zeros count.
+ *
+ * Returns the key, 0 if not a number of 1 to MTR_SUB_KEY_DIGITS digits.
+ */
+unsigned long long MTR_sub_key(digits, num_digits)
+  u8 *digits;                   /* Digits, one per octet */
+  u8 num_digits;                /* Number of digits */
+{
+  unsigned long long value;     /* Value of the digits */
+  u8 i;                         /* Digit index */
+
+  if ((num_digits == 0) || (num_digits > MTR_SUB_KEY_DIGITS))
+    return(0);
+
+  for (i = 0, value = 0; i < num_digits; i++)
+  {
+    if (digits[i] > 9)
+      return(0);
+    value = value * 10 + digits[i];
+  }
+  return(((unsigned long long)num_digits << 56) | value);
+}
+
+/*
+ * MTR_sub_tbcd_key
+ *
+ * Packs a number held as TBCD digits, two to an octet, low nibble
+ * first, ending at the first filler.
+ *
+ * Returns the key, 0 if not a valid number.
+ */
+unsigned long long MTR_sub_tbcd_key(tbcd, len)
+  u8 *tbcd;                     /* TBCD digits */
+  u8 len;                       /* Length of tbcd */
+{
+  u8 digits[MTR_SUB_KEY_DIGITS + 1]; /* Unpacked digits */
+  u8 num;                       /* Digits unpacked */
+  u8 digit;                     /* Digit */
+  u8 i;                         /* Digit index */
+
+  for (i = 0, num = 0; i / 2 < len; i++)
+  {
+    digit = (i & 1) ? (tbcd[i / 2] >> 4) : (tbcd[i / 2] & 0x0f);
+    if (digit == 0x0f)
+      break;
+    if (num > MTR_SUB_KEY_DIGITS)
+      return(0);
+    digits[num++] = digit;
+  }
+  return(MTR_sub_key(digits, num));
+}
+
+/*
+ * MTR_sub_hash
+ *
+ * Hashes a key with a seed.
+ *
+ * Returns a value from 0 to num - 1.
+ */
+u32 MTR_sub_hash(key, seed, num)
+  unsigned long long key;       /* Packed number */
+  u32 seed;                     /* Seed */
+  u32 num;                      /* Number of values */
+{
+  unsigned long long h;         /* Hash */
+
+  h = key + (seed + 1) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return((u32)(((h & 0xffffffff) * num) >> 32));
+}
+
+/*
+ * MTR_sub_report
+ *
+ * Prints the subscriber database in use to the console.
+ *
+ * Always returns zero.
+ */
+int MTR_sub_report()
+{
+  if (mtr_sub_hdr == 0)
+    return(0);
+
+  printf("MTR Subscribers from %s: %u subscribers (%luMB)\n",
+         mtr_sub_file, mtr_sub_hdr->num_subs, (unsigned long)(mtr_sub_hdr->size >> 20));
+  return(0);
+}
@@ -0,0 +1,94 @@
+/*
+ Name:          mtr_sub.h
+
+ Description:   Definitions for the MTR subscriber database.
+
+                The database is a read-only image built offline by
+                mtrsub from a CSV file and mapped by MTR, so that it is
+                ready at once and its pages are shared by every MTR
+                using it. The image is:
+
+                  MTR_SUB_HDR
+                  displacements of the MSISDN index, one int per subscriber
+                  displacements of the IMSI index, one int per subscriber
+                  record of each IMSI index slot, one u32 per subscriber
+                  MTR_SUB_REC records, in MSISDN index slot order
+
+                Each index is a minimal perfect hash of the packed
+                numbers: a key is hashed with seed zero to a bucket,
+                whose displacement d gives its slot, either -d - 1 or
+                the key hashed with seed d. Every key hashes to a slot
+                so the record found must be checked against the key.
+ */
+
+#ifndef MTR_SUB_H
+#define MTR_SUB_H
+
+#define MTR_SUB_MAGIC           (0x4d545255)    /* "MTRU" */
+#define MTR_SUB_VERSION         (1)
+
+/*
+ * Most digits of a number used as a key, and of an MSC number
+ */
+#define MTR_SUB_KEY_DIGITS      (15)
+#define MTR_SUB_MSC_DIGITS      (20)
+
+/*
+ * Largest parameter values held in a record
+ */
+#define MTR_SUB_IMSI_LEN        ((MTR_SUB_KEY_DIGITS + 1) / 2)
+#define MTR_SUB_MSC_LEN         (1 + MTR_SUB_MSC_DIGITS / 2)
+#define MTR_SUB_SGSN_LEN        (17)
+#define MTR_SUB_GEOG_LEN        (8)
+
+/*
+ * Record flags, set for each value present
+ */
+#define MTR_SUB_F_MSC           (0x01)
+#define MTR_SUB_F_SGSN          (0x02)
+#define MTR_SUB_F_GEOG          (0x04)
+
+/*
+ * Header of the image, offsets are from its start
+ */
+typedef struct
+{
+  u32 magic;                            /* MTR_SUB_MAGIC */
+  u32 version;                          /* MTR_SUB_VERSION */
+  u32 num_subs;                         /* Subscribers */
+  u32 rec_size;                         /* sizeof(MTR_SUB_REC) */
+  unsigned long long msisdn_disp;       /* MSISDN index displacements */
+  unsigned long long imsi_disp;         /* IMSI index displacements */
+  unsigned long long imsi_recs;         /* Record of each IMSI index slot */
+  unsigned long long recs;              /* Records */
+  unsigned long long size;              /* Size of the image */
+  u8  spare[8];
+} MTR_SUB_HDR;
+
+/*
+ * Subscriber record, one cache line. Values are held as they are
+ * sent in a response.
+ */
+typedef struct
+{
+  unsigned long long msisdn;            /* Packed MSISDN */
+  unsigned long long imsi;              /* Packed IMSI */
+  u8  flags;                            /* MTR_SUB_F_xxx */
+  u8  imsi_len;                         /* Octets in imsi_tbcd */
+  u8  msc_len;                          /* Octets in msc */
+  u8  sgsn_len;                         /* Octets in sgsn */
+  u8  imsi_tbcd[MTR_SUB_IMSI_LEN];      /* IMSI, TBCD */
+  u8  msc[MTR_SUB_MSC_LEN];             /* MSC number, address string */
+  u8  sgsn[MTR_SUB_SGSN_LEN];           /* SGSN address, GSN address */
+  u8  geog[MTR_SUB_GEOG_LEN];           /* Geographical information */
+} MTR_SUB_REC;
+
+int MTR_sub_open(char *file);
+MTR_SUB_REC *MTR_sub_msisdn(u8 *addr, u8 len);
+MTR_SUB_REC *MTR_sub_imsi(u8 *tbcd, u8 len);
+unsigned long long MTR_sub_key(u8 *digits, u8 num_digits);
+unsigned long long MTR_sub_tbcd_key(u8 *tbcd, u8 len);
+u32 MTR_sub_hash(unsigned long long key, u32 seed, u32 num);
+int MTR_sub_report(void);
+
+#endif
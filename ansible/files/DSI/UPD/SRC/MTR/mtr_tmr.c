@@ -0,0 +1,339 @@
+/*
+ Name:          mtr_tmr.c
+
+ Description:   Dialogue guard timers for MTR.
+
+                Timers are kept on a hierarchical timing wheel: level 0
+                has a slot for each of the next 64 ticks, and every
+                further level a slot for 64 slots of the level below.
+                Starting and stopping a timer are constant time list
+                operations. A timer is moved down a level when the wheel
+                reaches its slot, so advancing one tick costs only the
+                timers that expire or move down on that tick.
+
+                Each wheel is used by the one thread that owns its
+                timers. The timers themselves are nodes in an array kept
+                by the caller and are linked by index. A wheel normally
+                counts the ticks of the tick thread, but can be driven
+                by any other clock through MTR_tmr_advance_to().
+
+                A tick thread counts ticks and sends a tick message to
+                the MTR module, so that a thread blocked waiting for
+                messages still wakes up to advance its wheel.
+
+ Functions:     MTR_tmr_init
+                MTR_tmr_start
+                MTR_tmr_stop
+                MTR_tmr_advance
+                MTR_tmr_advance_to
+                MTR_tmr_tick_start
+                MTR_tmr_ticks
+                MTR_tmr_tick_done
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "mtr_tmr.h"
+
+/*
+ * End of a slot list
+ */
+#define MTR_TMR_NIL             (0xffffffff)
+
+/*
+ * Slot index of a tick at a level
+ */
+#define MTR_TMR_INDEX(t, level) (((t) >> ((level) * MTR_TMR_SLOT_BITS)) & (MTR_TMR_SLOTS - 1))
+
+static int MTR_tmr_link(MTR_TMR_WHEEL *w, u32 ref);
+static int MTR_tmr_unlink(MTR_TMR_WHEEL *w, u32 ref);
+static void *MTR_tmr_main(void *arg);
+
+/*
+ * Static data:
+ */
+static volatile u32 mtr_tmr_ticks;      /* Ticks since the tick thread started */
+static volatile u32 mtr_tmr_pending;    /* Set while a tick message is queued */
+static u8 mtr_tmr_mod_id;               /* Module the tick is sent to */
+
+/*
+ * MTR_tmr_init
+ *
+ * Initialises an empty wheel using the given timer nodes, which must
+ * all be zeroed.
+ *
+ * Always returns zero.
+ */
+int MTR_tmr_init(w, node)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  MTR_TMR_NODE *node;           /* Timer nodes */
+{
+  u16 i;                        /* Slot index */
+
+  w->node = node;
+  w->now = mtr_tmr_ticks;
+  w->running = 0;
+  for (i = 0; i < MTR_TMR_LEVELS * MTR_TMR_SLOTS; i++)
+    w->head[i] = MTR_TMR_NIL;
+  return(0);
+}
+
+/*
+ * MTR_tmr_start
+ *
+ * Starts, or restarts, a timer to expire after the given number of
+ * ticks, at least one.
+ *
+ * Always returns zero.
+ */
+int MTR_tmr_start(w, ref, ticks)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  u32 ref;                      /* Timer node */
+  u32 ticks;                    /* Ticks until expiry */
+{
+  if (w->node[ref].slot != 0)
+    MTR_tmr_unlink(w, ref);
+
+  if (ticks == 0)
+    ticks = 1;
+  else if (ticks > MTR_TMR_MAX_TICKS)
+    ticks = MTR_TMR_MAX_TICKS;
+
+  w->node[ref].expires = w->now + ticks;
+  return(MTR_tmr_link(w, ref));
+}
+
+/*
+ * MTR_tmr_stop
+ *
+ * Stops a timer if it is running.
+ *
+ * Always returns zero.
+ */
+int MTR_tmr_stop(w, ref)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  u32 ref;                      /* Timer node */
+{
+  if (w->node[ref].slot != 0)
+    MTR_tmr_unlink(w, ref);
+  return(0);
+}
+
+/*
+ * MTR_tmr_advance
+ *
+ * Brings the wheel up to the current tick, calling expire for every
+ * timer that expires on the way. The timer is stopped before expire
+ * is called, which may start it again.
+ *
+ * Returns the number of timers expired.
+ */
+int MTR_tmr_advance(w, expire)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  int (*expire)(u32 ref);       /* Called for each expired timer */
+{
+  return(MTR_tmr_advance_to(w, mtr_tmr_ticks, expire));
+}
+
+/*
+ * MTR_tmr_advance_to
+ *
+ * As MTR_tmr_advance(), up to the given tick of the wheel's own clock.
+ * A wheel with no timers running goes straight to the tick.
+ *
+ * Returns the number of timers expired.
+ */
+int MTR_tmr_advance_to(w, target, expire)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  u32 target;                   /* Tick to advance to */
+  int (*expire)(u32 ref);       /* Called for each expired timer */
+{
+  u32 *head;                    /* Slot being emptied */
+  u32 ref;                      /* Timer node */
+  u8  level;                    /* Wheel level */
+  int num;                      /* Timers expired */
+
+  num = 0;
+  while ((int)(target - w->now) > 0)
+  {
+    if (w->running == 0)
+    {
+      w->now = target;
+      break;
+    }
+
+    w->now++;
+
+    /*
+     * Move timers down from each level whose slot has come round,
+     * stopping at the first level that has not wrapped.
+     */
+    for (level = 1; level < MTR_TMR_LEVELS; level++)
+    {
+      if (MTR_TMR_INDEX(w->now, level - 1) != 0)
+        break;
+      head = &w->head[level * MTR_TMR_SLOTS + MTR_TMR_INDEX(w->now, level)];
+      while ((ref = *head) != MTR_TMR_NIL)
+      {
+        MTR_tmr_unlink(w, ref);
+        MTR_tmr_link(w, ref);
+      }
+    }
+
+    head = &w->head[MTR_TMR_INDEX(w->now, 0)];
+    while ((ref = *head) != MTR_TMR_NIL)
+    {
+      MTR_tmr_unlink(w, ref);
+      expire(ref);
+      num++;
+    }
+  }
+  return(num);
+}
+
+/*
+ * MTR_tmr_tick_start
+ *
+ * Starts the tick thread, which sends ticks to the given module.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_tmr_tick_start(mod_id)
+  u8 mod_id;                    /* Module to send ticks to */
+{
+  pthread_t thread;             /* Tick thread */
+
+  mtr_tmr_mod_id = mod_id;
+  if (pthread_create(&thread, NULL, MTR_tmr_main, NULL) != 0)
+    return(-1);
+  pthread_detach(thread);
+  return(0);
+}
+
+/*
+ * MTR_tmr_ticks
+ *
+ * Returns the number of ticks since the tick thread started.
+ */
+u32 MTR_tmr_ticks()
+{
+  return(mtr_tmr_ticks);
+}
+
+/*
+ * MTR_tmr_tick_done
+ *
+ * Called when a tick message is received, allowing the next one to
+ * be sent.
+ *
+ * Always returns zero.
+ */
+int MTR_tmr_tick_done()
+{
+  mtr_tmr_pending = 0;
+  return(0);
+}
+
+/*
+ * MTR_tmr_link
+ *
+ * Adds a stopped timer to the slot for its expiry tick.
+ *
+ * Always returns zero.
+ */
+static int MTR_tmr_link(w, ref)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  u32 ref;                      /* Timer node */
+{
+  MTR_TMR_NODE *n;              /* Timer */
+  u32 delta;                    /* Ticks until expiry */
+  u16 slot;                     /* Slot for the timer */
+  u8  level;                    /* Wheel level */
+
+  n = &w->node[ref];
+  delta = n->expires - w->now;
+  for (level = 0; level < MTR_TMR_LEVELS - 1; level++)
+    if (delta < (1UL << ((level + 1) * MTR_TMR_SLOT_BITS)))
+      break;
+  slot = (u16)(level * MTR_TMR_SLOTS + MTR_TMR_INDEX(n->expires, level));
+
+  n->slot = (u16)(slot + 1);
+  w->running++;
+  n->prev = MTR_TMR_NIL;
+  n->next = w->head[slot];
+  if (n->next != MTR_TMR_NIL)
+    w->node[n->next].prev = ref;
+  w->head[slot] = ref;
+  return(0);
+}
+
+/*
+ * MTR_tmr_unlink
+ *
+ * Removes a running timer from its slot.
+ *
+ * Always returns zero.
+ */
+static int MTR_tmr_unlink(w, ref)
+  MTR_TMR_WHEEL *w;             /* Wheel */
+  u32 ref;                      /* Timer node */
+{
+  MTR_TMR_NODE *n;              /* Timer */
+
+  n = &w->node[ref];
+  if (n->prev != MTR_TMR_NIL)
+    w->node[n->prev].next = n->next;
+  else
+    w->head[n->slot - 1] = n->next;
+  if (n->next != MTR_TMR_NIL)
+    w->node[n->next].prev = n->prev;
+  n->slot = 0;
+  w->running--;
+  return(0);
+}
+
+/*
+ * MTR_tmr_main
+ *
+ * Tick thread body. Counts ticks and sends a tick message to the MTR
+ * module unless the last one has not been received yet.
+ *
+ * Never returns.
+ */
+static void *MTR_tmr_main(arg)
+  void *arg;                    /* Unused */
+{
+  struct timespec tick;         /* Length of a tick */
+  MSG *m;                       /* Tick message */
+
+  tick.tv_sec = MTR_TMR_TICK_MS / 1000;
+  tick.tv_nsec = (MTR_TMR_TICK_MS % 1000) * 1000000L;
+
+  while (1)
+  {
+    nanosleep(&tick, NULL);
+    __sync_fetch_and_add(&mtr_tmr_ticks, 1);
+
+    if (__sync_lock_test_and_set(&mtr_tmr_pending, 1) != 0)
+      continue;
+
+    if ((m = getm(MTR_TMR_MSG_TICK, 0, 0, 0)) == 0)
+    {
+      mtr_tmr_pending = 0;
+      continue;
+    }
+    m->hdr.src = mtr_tmr_mod_id;
+    m->hdr.dst = mtr_tmr_mod_id;
+    if (GCT_send(mtr_tmr_mod_id, (HDR *)m) != 0)
+    {
+      relm((HDR *)m);
+      mtr_tmr_pending = 0;
+    }
+  }
+  return(NULL);
+}
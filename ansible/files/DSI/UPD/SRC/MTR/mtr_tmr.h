@@ -0,0 +1,62 @@
+/*
+ Name:          mtr_tmr.h
+
+ Description:   Definitions for the MTR dialogue timers.
+ */
+
+#ifndef MTR_TMR_H
+#define MTR_TMR_H
+
+/*
+ * Length of a timer tick in milliseconds.
+ */
+#define MTR_TMR_TICK_MS         (100)
+
+/*
+ * Message type of the tick sent by the tick thread to the MTR module
+ * itself. It never leaves the module.
+ */
+#define MTR_TMR_MSG_TICK        (0x7f01)
+
+/*
+ * The wheel has MTR_TMR_LEVELS levels of (1 << MTR_TMR_SLOT_BITS)
+ * slots, so timers can run for up to 2^24 ticks.
+ */
+#define MTR_TMR_SLOT_BITS       (6)
+#define MTR_TMR_SLOTS           (1 << MTR_TMR_SLOT_BITS)
+#define MTR_TMR_LEVELS          (4)
+#define MTR_TMR_MAX_TICKS       ((1UL << (MTR_TMR_SLOT_BITS * MTR_TMR_LEVELS)) - 1)
+
+/*
+ * One timer, found by its index in the caller's array of nodes.
+ * A zeroed node is a stopped timer.
+ */
+typedef struct
+{
+  u32 next;                     /* Next node in slot */
+  u32 prev;                     /* Previous node in slot */
+  u32 expires;                  /* Tick the timer expires */
+  u16 slot;                     /* Slot + 1, zero if stopped */
+} MTR_TMR_NODE;
+
+/*
+ * A timing wheel, used by one thread only.
+ */
+typedef struct
+{
+  MTR_TMR_NODE *node;           /* Timer nodes */
+  u32 now;                      /* Last tick processed */
+  u32 running;                  /* Timers running */
+  u32 head[MTR_TMR_LEVELS * MTR_TMR_SLOTS]; /* First node in each slot */
+} MTR_TMR_WHEEL;
+
+int MTR_tmr_init(MTR_TMR_WHEEL *w, MTR_TMR_NODE *node);
+int MTR_tmr_start(MTR_TMR_WHEEL *w, u32 ref, u32 ticks);
+int MTR_tmr_stop(MTR_TMR_WHEEL *w, u32 ref);
+int MTR_tmr_advance(MTR_TMR_WHEEL *w, int (*expire)(u32 ref));
+int MTR_tmr_advance_to(MTR_TMR_WHEEL *w, u32 target, int (*expire)(u32 ref));
+int MTR_tmr_tick_start(u8 mod_id);
+u32 MTR_tmr_ticks(void);
+int MTR_tmr_tick_done(void);
+
+#endif
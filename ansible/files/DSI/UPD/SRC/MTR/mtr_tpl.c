@@ -0,0 +1,500 @@
+/*
+ Name:          mtr_tpl.c
+
+ Description:   Pre-encoded primitive templates for MTR.
+
+                Most primitives MTR sends are the same on every dialogue
+                apart from the invoke id. Each one is encoded once, at
+                configuration time, into a template holding the complete
+                parameter area. Sending then takes a message, copies the
+                template into it and patches the invoke id and any
+                variable field.
+
+                To add a response type, give it an MTR_TPL_xxx id in
+                mtr_tpl.h and build it in MTR_tpl_init() with
+                MTR_tpl_begin(), MTR_tpl_add() and MTR_tpl_end().
+
+                Building with MTR_TPL_VERIFY defined checks every template
+                against the primitives the original hand written encoders
+                produced, byte for byte, when MTR starts. Bytes which are
+                meant to differ from the original encoding are listed, with
+                the reason, in mtr_gold_delta. make -f mtr.mk check builds
+                and runs mtrcheck, which fails on any other difference.
+
+ Functions:     MTR_tpl_init
+                MTR_tpl_getm
+                MTR_tpl_field
+                MTR_tpl_verify
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr_gsm.h"
+#include "mtr_tpl.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+#include "mtr_flt.h"
+#include "mtr_stat.h"
+
+/*
+ * A pre-encoded primitive
+ */
+typedef struct
+{
+  u16 type;                             /* Message type */
+  u16 len;                              /* Length of image */
+  u8  num_fields;                       /* Number of recorded parameters */
+  u8  field_name[MTR_TPL_MAX_FIELDS];   /* Parameter names */
+  u8  field_off[MTR_TPL_MAX_FIELDS];    /* Offsets of parameter values */
+  u8  image[MTR_TPL_MAX_LEN];           /* Parameter area */
+} MTR_TPL;
+
+static int MTR_tpl_begin(u8 tpl_id, u16 type, u8 ptype);
+static int MTR_tpl_add(u8 tpl_id, u8 pname, u8 plen, u8 *pval);
+static int MTR_tpl_end(u8 tpl_id);
+static int MTR_tpl_add_ussd(u8 tpl_id, char *text);
+
+/*
+ * Static data:
+ */
+static MTR_TPL mtr_tpl[MTR_NUM_TPL];    /* Templates */
+static u8 mtr_tpl_src;                  /* Source module id */
+static u8 mtr_tpl_dst;                  /* Destination module id */
+
+/*
+ * Constant parameter values
+ */
+static u8 mtr_tpl_imsi[] =              /* IMSI 60802678000454 */
+  { 0x06, 0x08, 0x62, 0x87, 0x00, 0x40, 0x45 };
+static u8 mtr_tpl_msc_num[] =           /* MSC 375290000002, ton/npi = 1/1 */
+  { 0x91, 0x73, 0x25, 0x09, 0x00, 0x00, 0x20 };
+static u8 mtr_tpl_sgsn_addr[] =         /* IPv4, 193.195.185.113 */
+  { 4, 193, 195, 185, 113 };
+static u8 mtr_tpl_ussd_coding[] =       /* 'GSM default alphabet' 00001111 */
+  { 0x0F };
+
+/*
+ * USSD strings, encoded in the GSM default alphabet when the
+ * templates are built.
+ */
+static char mtr_tpl_ussd_menu[] = "XY Telecom\n 1. Balance\n 2. Texts Remaining";
+static char mtr_tpl_ussd_sample[] = "This is sample text";
+static char mtr_tpl_ussd_balance[] = "Your balance = 350";
+
+/*
+ * Placeholder for values patched on every use
+ */
+static u8 mtr_tpl_zero[8];
+
+/*
+ * MTR_tpl_init
+ *
+ * Builds all the templates. MTR_gsm_init() must have been called.
+ *
+ * Returns zero or -1 if a template does not fit.
+ */
+int MTR_tpl_init(src, dst)
+  u8 src;                       /* Module id of MTR */
+  u8 dst;                       /* Module id of MAP */
+{
+  int err;                      /* Accumulated error */
+
+  mtr_tpl_src = src;
+  mtr_tpl_dst = dst;
+  err = 0;
+
+  /*
+   * Forward SM and MT Forward SM responses
+   */
+  err |= MTR_tpl_begin(MTR_TPL_FWD_SM_RSP, MAP_MSG_SRV_REQ, MAPST_FWD_SM_RSP);
+  err |= MTR_tpl_add(MTR_TPL_FWD_SM_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_end(MTR_TPL_FWD_SM_RSP);
+
+  err |= MTR_tpl_begin(MTR_TPL_MT_FWD_SM_RSP, MAP_MSG_SRV_REQ, MAPST_MT_FWD_SM_RSP);
+  err |= MTR_tpl_add(MTR_TPL_MT_FWD_SM_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_end(MTR_TPL_MT_FWD_SM_RSP);
+
+  /*
+   * Send IMSI response: IMSI 60802678000454
+   */
+  err |= MTR_tpl_begin(MTR_TPL_SEND_IMSI_RSP, MAP_MSG_SRV_REQ, MAPST_SEND_IMSI_RSP);
+  err |= MTR_tpl_add(MTR_TPL_SEND_IMSI_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_SEND_IMSI_RSP, MAPPN_imsi,
+                     sizeof(mtr_tpl_imsi), mtr_tpl_imsi);
+  err |= MTR_tpl_end(MTR_TPL_SEND_IMSI_RSP);
+
+  /*
+   * Send Routing Info for GPRS response: SGSN address 193.195.185.113
+   */
+  err |= MTR_tpl_begin(MTR_TPL_SND_RTIGPRS_RSP, MAP_MSG_SRV_REQ, MAPST_SND_RTIGPRS_RSP);
+  err |= MTR_tpl_add(MTR_TPL_SND_RTIGPRS_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_SND_RTIGPRS_RSP, MAPPN_sgsn_address,
+                     sizeof(mtr_tpl_sgsn_addr), mtr_tpl_sgsn_addr);
+  err |= MTR_tpl_end(MTR_TPL_SND_RTIGPRS_RSP);
+
+  /*
+   * Send Routing Info for SMS response: IMSI 60802678000454,
+   * MSC number 375290000002
+   */
+  err |= MTR_tpl_begin(MTR_TPL_SND_RTISM_RSP, MAP_MSG_SRV_REQ, MAPST_SND_RTISM_RSP);
+  err |= MTR_tpl_add(MTR_TPL_SND_RTISM_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_SND_RTISM_RSP, MAPPN_imsi,
+                     sizeof(mtr_tpl_imsi), mtr_tpl_imsi);
+  err |= MTR_tpl_add(MTR_TPL_SND_RTISM_RSP, MAPPN_msc_num,
+                     sizeof(mtr_tpl_msc_num), mtr_tpl_msc_num);
+  err |= MTR_tpl_end(MTR_TPL_SND_RTISM_RSP);
+
+  /*
+   * USSD primitives
+   */
+  err |= MTR_tpl_begin(MTR_TPL_UNSTR_SS_REQ_REQ, MAP_MSG_SRV_REQ, MAPST_UNSTR_SS_REQ_REQ);
+  err |= MTR_tpl_add(MTR_TPL_UNSTR_SS_REQ_REQ, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_UNSTR_SS_REQ_REQ, MAPPN_USSD_coding,
+                     sizeof(mtr_tpl_ussd_coding), mtr_tpl_ussd_coding);
+  err |= MTR_tpl_add_ussd(MTR_TPL_UNSTR_SS_REQ_REQ, mtr_tpl_ussd_menu);
+  err |= MTR_tpl_end(MTR_TPL_UNSTR_SS_REQ_REQ);
+
+  err |= MTR_tpl_begin(MTR_TPL_UNSTR_SS_REQ_RSP, MAP_MSG_SRV_REQ, MAPST_UNSTR_SS_REQ_RSP);
+  err |= MTR_tpl_add(MTR_TPL_UNSTR_SS_REQ_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_UNSTR_SS_REQ_RSP, MAPPN_USSD_coding,
+                     sizeof(mtr_tpl_ussd_coding), mtr_tpl_ussd_coding);
+  err |= MTR_tpl_add_ussd(MTR_TPL_UNSTR_SS_REQ_RSP, mtr_tpl_ussd_sample);
+  err |= MTR_tpl_end(MTR_TPL_UNSTR_SS_REQ_RSP);
+
+  err |= MTR_tpl_begin(MTR_TPL_PRO_UNSTR_SS_REQ_RSP, MAP_MSG_SRV_REQ, MAPST_PRO_UNSTR_SS_REQ_RSP);
+  err |= MTR_tpl_add(MTR_TPL_PRO_UNSTR_SS_REQ_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_PRO_UNSTR_SS_REQ_RSP, MAPPN_USSD_coding,
+                     sizeof(mtr_tpl_ussd_coding), mtr_tpl_ussd_coding);
+  err |= MTR_tpl_add_ussd(MTR_TPL_PRO_UNSTR_SS_REQ_RSP, mtr_tpl_ussd_balance);
+  err |= MTR_tpl_end(MTR_TPL_PRO_UNSTR_SS_REQ_RSP);
+
+  err |= MTR_tpl_begin(MTR_TPL_UNSTR_SS_NOTIFY_RSP, MAP_MSG_SRV_REQ, MAPST_UNSTR_SS_REQ_RSP);
+  err |= MTR_tpl_add(MTR_TPL_UNSTR_SS_NOTIFY_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_end(MTR_TPL_UNSTR_SS_NOTIFY_RSP);
+
+  /*
+   * Any Time Interrogation response, the geographical information
+   * is patched per dialogue.
+   */
+  err |= MTR_tpl_begin(MTR_TPL_ANYTIME_INT_RSP, MAP_MSG_SRV_REQ, MAPST_ANYTIME_INT_RSP);
+  err |= MTR_tpl_add(MTR_TPL_ANYTIME_INT_RSP, MAPPN_invoke_id, 1, mtr_tpl_zero);
+  err |= MTR_tpl_add(MTR_TPL_ANYTIME_INT_RSP, MAPPN_geog_info, 8, mtr_tpl_zero);
+  err |= MTR_tpl_end(MTR_TPL_ANYTIME_INT_RSP);
+
+  /*
+   * Dialogue primitives, the release method and user reason
+   * are patched per use.
+   */
+  err |= MTR_tpl_begin(MTR_TPL_CLOSE_REQ, MAP_MSG_DLG_REQ, MAPDT_CLOSE_REQ);
+  err |= MTR_tpl_add(MTR_TPL_CLOSE_REQ, MAPPN_release_method, 1, mtr_tpl_zero);
+  err |= MTR_tpl_end(MTR_TPL_CLOSE_REQ);
+
+  err |= MTR_tpl_begin(MTR_TPL_U_ABORT_REQ, MAP_MSG_DLG_REQ, MAPDT_U_ABORT_REQ);
+  err |= MTR_tpl_add(MTR_TPL_U_ABORT_REQ, MAPPN_user_rsn, 1, mtr_tpl_zero);
+  err |= MTR_tpl_end(MTR_TPL_U_ABORT_REQ);
+
+  err |= MTR_tpl_begin(MTR_TPL_DELIMITER_REQ, MAP_MSG_DLG_REQ, MAPDT_DELIMITER_REQ);
+  err |= MTR_tpl_end(MTR_TPL_DELIMITER_REQ);
+
+  return(err ? -1 : 0);
+}
+
+/*
+ * MTR_tpl_getm
+ *
+ * Allocates a message and fills it in from a template.
+ *
+ * Returns the message or zero if none could be allocated.
+ */
+MSG *MTR_tpl_getm(tpl_id, dlg_id, invoke_id)
+  u8  tpl_id;                   /* Template to use */
+  u16 dlg_id;                   /* Dialogue id */
+  u8  invoke_id;                /* Invoke id, ignored for dialogue primitives */
+{
+  MTR_TPL *tpl;                 /* Template */
+  MSG *m;                       /* Message */
+  u8 *pptr;                     /* Parameter area */
+
+  tpl = &mtr_tpl[tpl_id];
+  if ((m = getm(tpl->type, dlg_id, NO_RESPONSE, tpl->len)) != 0)
+  {
+    m->hdr.src = mtr_tpl_src;
+    m->hdr.dst = mtr_tpl_dst;
+    pptr = get_param(m);
+    memcpy(pptr, tpl->image, tpl->len);
+
+    /*
+     * The invoke id is always the first parameter of a service primitive
+     */
+    if (tpl->type == MAP_MSG_SRV_REQ)
+      pptr[3] = invoke_id;
+  }
+  else
+    MTR_STAT_INC(getm_fail);
+  return(m);
+}
+
+/*
+ * MTR_tpl_field
+ *
+ * Returns the offset in the parameter area of the value
+ * of a parameter, or -1 if the template does not contain it.
+ */
+int MTR_tpl_field(tpl_id, pname)
+  u8 tpl_id;                    /* Template */
+  u8 pname;                     /* Parameter name */
+{
+  MTR_TPL *tpl;                 /* Template */
+  u8 i;                         /* Field index */
+
+  tpl = &mtr_tpl[tpl_id];
+  for (i = 0; i < tpl->num_fields; i++)
+  {
+    if (tpl->field_name[i] == pname)
+      return(tpl->field_off[i]);
+  }
+  return(-1);
+}
+
+/*
+ * MTR_tpl_begin
+ *
+ * Starts a template with the primitive type.
+ *
+ * Always returns zero.
+ */
+static int MTR_tpl_begin(tpl_id, type, ptype)
+  u8  tpl_id;                   /* Template */
+  u16 type;                     /* Message type */
+  u8  ptype;                    /* Primitive type */
+{
+  MTR_TPL *tpl;                 /* Template */
+
+  tpl = &mtr_tpl[tpl_id];
+  memset(tpl, 0, sizeof(MTR_TPL));
+  tpl->type = type;
+  tpl->image[tpl->len++] = ptype;
+  return(0);
+}
+
+/*
+ * MTR_tpl_add
+ *
+ * Appends a parameter to a template and records where its value is.
+ *
+ * Returns zero or -1 if it does not fit.
+ */
+static int MTR_tpl_add(tpl_id, pname, plen, pval)
+  u8  tpl_id;                   /* Template */
+  u8  pname;                    /* Parameter name */
+  u8  plen;                     /* Parameter length */
+  u8  *pval;                    /* Parameter value */
+{
+  MTR_TPL *tpl;                 /* Template */
+
+  tpl = &mtr_tpl[tpl_id];
+  if ((tpl->len + 2 + plen > MTR_TPL_MAX_LEN) ||
+      (tpl->num_fields >= MTR_TPL_MAX_FIELDS))
+    return(-1);
+
+  tpl->image[tpl->len++] = pname;
+  tpl->image[tpl->len++] = plen;
+  tpl->field_name[tpl->num_fields] = pname;
+  tpl->field_off[tpl->num_fields++] = (u8)tpl->len;
+  memcpy(&tpl->image[tpl->len], pval, plen);
+  tpl->len += plen;
+  return(0);
+}
+
+/*
+ * MTR_tpl_add_ussd
+ *
+ * Appends a USSD string parameter holding text encoded in the GSM
+ * default alphabet.
+ *
+ * Returns zero or -1 if it does not fit.
+ */
+static int MTR_tpl_add_ussd(tpl_id, text)
+  u8   tpl_id;                  /* Template */
+  char *text;                   /* Text of the string */
+{
+  u8  str[MTR_TPL_MAX_LEN];     /* Encoded string */
+  int len;                      /* Length of encoded string */
+
+  if ((len = MTR_gsm_encode7(text, str, sizeof(str))) < 0)
+    return(-1);
+  return(MTR_tpl_add(tpl_id, MAPPN_USSD_string, (u8)len, str));
+}
+
+/*
+ * MTR_tpl_end
+ *
+ * Appends the terminating zero to a template.
+ *
+ * Returns zero or -1 if it does not fit.
+ */
+static int MTR_tpl_end(tpl_id)
+  u8 tpl_id;                    /* Template */
+{
+  MTR_TPL *tpl;                 /* Template */
+
+  tpl = &mtr_tpl[tpl_id];
+  if (tpl->len >= MTR_TPL_MAX_LEN)
+    return(-1);
+  tpl->image[tpl->len++] = 0x00;
+  return(0);
+}
+
+#ifdef MTR_TPL_VERIFY
+/*
+ * Primitives as built by the original encoders, with invoke id 0x01,
+ * release method and user reason 0x00 and zero geographical information.
+ */
+static u8 mtr_gold_fwd_sm_rsp[] =
+  { MAPST_FWD_SM_RSP, MAPPN_invoke_id, 0x01, 0x01, 0x00 };
+static u8 mtr_gold_mt_fwd_sm_rsp[] =
+  { MAPST_MT_FWD_SM_RSP, MAPPN_invoke_id, 0x01, 0x01, 0x00 };
+static u8 mtr_gold_send_imsi_rsp[] =
+  { MAPST_SEND_IMSI_RSP, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_imsi, 7, 0x06, 0x08, 0x62, 0x87, 0x00, 0x40, 0x45, 0x00 };
+static u8 mtr_gold_snd_rtigprs_rsp[] =
+  { MAPST_SND_RTIGPRS_RSP, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_sgsn_address, 5, 4, 193, 195, 185, 113, 0x00 };
+static u8 mtr_gold_snd_rtism_rsp[] =
+  { MAPST_SND_RTISM_RSP, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_imsi, 7, 0x06, 0x08, 0x62, 0x87, 0x00, 0x40, 0x45,
+    MAPPN_msc_num, 7, 0x91, 0x73, 0x25, 0x09, 0x00, 0x00, 0x20, 0x00 };
+static u8 mtr_gold_unstr_ss_req_req[] =
+  { MAPST_UNSTR_SS_REQ_REQ, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_USSD_coding, 0x01, 0x0F, MAPPN_USSD_string, 37,
+    0xD8, 0x2C, 0x88, 0x5A, 0x66, 0x97, 0xC7, 0xEF, 0xB6, 0x02,
+    0x14, 0x73, 0x81, 0x84, 0x61, 0x76, 0xD8, 0x3D, 0x2E, 0x2B,
+    0x40, 0x32, 0x17, 0x88, 0x5A, 0xC6, 0xD3, 0xE7, 0x20, 0x69,
+    0xB9, 0x1D, 0x4E, 0xBB, 0xD3, 0xEE, 0x73, 0x00 };
+static u8 mtr_gold_unstr_ss_req_rsp[] =
+  { MAPST_UNSTR_SS_REQ_RSP, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_USSD_coding, 0x01, 0x0F, MAPPN_USSD_string, 17,
+    0x54, 0x74, 0x7a, 0x0e, 0x4a, 0xcf, 0x41, 0xf3, 0x70, 0x1b,
+    0xce, 0x2e, 0x83, 0xe8, 0x65, 0x3c, 0x1d, 0x00 };
+static u8 mtr_gold_pro_unstr_ss_req_rsp[] =
+  { MAPST_PRO_UNSTR_SS_REQ_RSP, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_USSD_coding, 0x01, 0x0F, MAPPN_USSD_string, 16,
+    0xD9, 0x77, 0x5D, 0x0E, 0x12, 0x87, 0xD9, 0x61, 0xF7, 0xB8,
+    0x0C, 0xEA, 0x81, 0x66, 0x35, 0x58, 0x00 };
+static u8 mtr_gold_unstr_ss_notify_rsp[] =
+  { MAPST_UNSTR_SS_REQ_RSP, MAPPN_invoke_id, 0x01, 0x01, 0x00 };
+static u8 mtr_gold_anytime_int_rsp[] =
+  { MAPST_ANYTIME_INT_RSP, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_geog_info, 0x08, 0, 0, 0, 0, 0, 0, 0, 0, 0x00 };
+static u8 mtr_gold_close_req[] =
+  { MAPDT_CLOSE_REQ, MAPPN_release_method, 0x01, 0x00, 0x00 };
+static u8 mtr_gold_u_abort_req[] =
+  { MAPDT_U_ABORT_REQ, MAPPN_user_rsn, 0x01, 0x00, 0x00 };
+static u8 mtr_gold_delimiter_req[] =
+  { MAPDT_DELIMITER_REQ, 0x00 };
+
+static struct
+{
+  u8 *image;
+  u16 len;
+} mtr_gold[MTR_NUM_TPL] =
+{
+  { mtr_gold_fwd_sm_rsp,           sizeof(mtr_gold_fwd_sm_rsp) },
+  { mtr_gold_mt_fwd_sm_rsp,        sizeof(mtr_gold_mt_fwd_sm_rsp) },
+  { mtr_gold_send_imsi_rsp,        sizeof(mtr_gold_send_imsi_rsp) },
+  { mtr_gold_snd_rtigprs_rsp,      sizeof(mtr_gold_snd_rtigprs_rsp) },
+  { mtr_gold_snd_rtism_rsp,        sizeof(mtr_gold_snd_rtism_rsp) },
+  { mtr_gold_unstr_ss_req_req,     sizeof(mtr_gold_unstr_ss_req_req) },
+  { mtr_gold_unstr_ss_req_rsp,     sizeof(mtr_gold_unstr_ss_req_rsp) },
+  { mtr_gold_pro_unstr_ss_req_rsp, sizeof(mtr_gold_pro_unstr_ss_req_rsp) },
+  { mtr_gold_unstr_ss_notify_rsp,  sizeof(mtr_gold_unstr_ss_notify_rsp) },
+  { mtr_gold_anytime_int_rsp,      sizeof(mtr_gold_anytime_int_rsp) },
+  { mtr_gold_close_req,            sizeof(mtr_gold_close_req) },
+  { mtr_gold_u_abort_req,          sizeof(mtr_gold_u_abort_req) },
+  { mtr_gold_delimiter_req,        sizeof(mtr_gold_delimiter_req) }
+};
+
+/*
+ * Expected differences from the original encoding.
+ *
+ * The original USSD strings were packed by hand and set some of the
+ * unused bits at the top of their last octet. MTR_gsm_encode7() leaves
+ * them zero, as GSM 03.38 requires, so the last octet of the menu and
+ * balance strings loses bit 6.
+ */
+static struct
+{
+  u8 tpl_id;                    /* Template */
+  u8 offset;                    /* Offset in the parameter area */
+  u8 old_val;                   /* Byte the original encoder built */
+  u8 new_val;                   /* Byte the template holds */
+} mtr_gold_delta[] =
+{
+  { MTR_TPL_UNSTR_SS_REQ_REQ,     45, 0x73, 0x33 },
+  { MTR_TPL_PRO_UNSTR_SS_REQ_RSP, 24, 0x58, 0x18 }
+};
+
+#define MTR_NUM_GOLD_DELTA (sizeof(mtr_gold_delta) / sizeof(mtr_gold_delta[0]))
+#endif
+
+/*
+ * MTR_tpl_verify
+ *
+ * Compares every template, with invoke id 0x01 patched in, against
+ * the primitive the original encoder built with the expected
+ * differences applied. Only does anything when built with
+ * MTR_TPL_VERIFY defined.
+ *
+ * Returns zero or -1 if any template differs.
+ */
+int MTR_tpl_verify()
+{
+#ifdef MTR_TPL_VERIFY
+  u8 image[MTR_TPL_MAX_LEN];    /* Template with invoke id patched */
+  u8 gold[MTR_TPL_MAX_LEN];     /* Original encoding with deltas applied */
+  u8 i;                         /* Template id */
+  unsigned int d;               /* Index of expected difference */
+  int err;                      /* Set if a template differs */
+
+  err = 0;
+  for (i = 0; i < MTR_NUM_TPL; i++)
+  {
+    memcpy(image, mtr_tpl[i].image, mtr_tpl[i].len);
+    if (mtr_tpl[i].type == MAP_MSG_SRV_REQ)
+      image[3] = 0x01;
+
+    memcpy(gold, mtr_gold[i].image, mtr_gold[i].len);
+    for (d = 0; d < MTR_NUM_GOLD_DELTA; d++)
+    {
+      if (mtr_gold_delta[d].tpl_id != i)
+        continue;
+      if ((mtr_gold_delta[d].offset >= mtr_gold[i].len) ||
+          (gold[mtr_gold_delta[d].offset] != mtr_gold_delta[d].old_val))
+      {
+        fprintf(stderr, "MTR: template %d expected difference %u does not apply\n", i, d);
+        err = -1;
+        continue;
+      }
+      gold[mtr_gold_delta[d].offset] = mtr_gold_delta[d].new_val;
+    }
+
+    if ((mtr_tpl[i].len != mtr_gold[i].len) ||
+        (memcmp(image, gold, mtr_gold[i].len) != 0))
+    {
+      fprintf(stderr, "MTR: template %d does not match original encoding\n", i);
+      err = -1;
+    }
+  }
+  if (err == 0)
+    printf("MTR: %d templates verified, %d expected differences\n",
+           MTR_NUM_TPL, (int)MTR_NUM_GOLD_DELTA);
+  return(err);
+#else
+  return(0);
+#endif
+}
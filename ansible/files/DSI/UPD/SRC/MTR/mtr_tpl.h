@@ -0,0 +1,44 @@
+/*
+ Name:          mtr_tpl.h
+
+ Description:   Definitions for pre-encoded MTR primitive templates.
+ */
+
+#ifndef MTR_TPL_H
+#define MTR_TPL_H
+
+/*
+ * Template identifiers, one per primitive MTR sends with
+ * constant content.
+ */
+#define MTR_TPL_FWD_SM_RSP              (0)
+#define MTR_TPL_MT_FWD_SM_RSP           (1)
+#define MTR_TPL_SEND_IMSI_RSP           (2)
+#define MTR_TPL_SND_RTIGPRS_RSP         (3)
+#define MTR_TPL_SND_RTISM_RSP           (4)
+#define MTR_TPL_UNSTR_SS_REQ_REQ        (5)
+#define MTR_TPL_UNSTR_SS_REQ_RSP        (6)
+#define MTR_TPL_PRO_UNSTR_SS_REQ_RSP    (7)
+#define MTR_TPL_UNSTR_SS_NOTIFY_RSP     (8)
+#define MTR_TPL_ANYTIME_INT_RSP         (9)
+#define MTR_TPL_CLOSE_REQ               (10)
+#define MTR_TPL_U_ABORT_REQ             (11)
+#define MTR_TPL_DELIMITER_REQ           (12)
+#define MTR_NUM_TPL                     (13)
+
+/*
+ * Largest pre-encoded primitive
+ */
+#define MTR_TPL_MAX_LEN                 (64)
+
+/*
+ * Most parameters recorded per template for patching
+ */
+#define MTR_TPL_MAX_FIELDS              (6)
+
+int MTR_tpl_init(u8 src, u8 dst);
+MSG *MTR_tpl_getm(u8 tpl_id, u16 dlg_id, u8 invoke_id);
+int MTR_tpl_field(u8 tpl_id, u8 pname);
+int MTR_tpl_verify(void);
+
+#endif
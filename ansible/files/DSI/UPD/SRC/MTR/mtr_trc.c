@@ -0,0 +1,510 @@
+/*
+ Name:          mtr_trc.c
+
+ Description:   Asynchronous trace for MTR.
+
+                Tracing a message or a line of text only copies it into
+                a fixed size record in a lock-free ring shared by all the
+                threads that trace. A background thread takes the records
+                in order, formats them and writes the text to stdout in
+                large blocks. If the ring is full the record is dropped and
+                counted, so tracing never blocks dialogue processing.
+
+                In capture mode text lines are not traced and the thread
+                encodes message records in the binary format of mtr_cap.h
+                instead, passing the blocks to mtr_cap.c.
+
+                The ring is a bounded multi-producer queue: every record
+                carries a sequence number which tells producers whether
+                the slot is free and the trace thread whether it is full.
+
+                The ring is drained when the process exits, so that a
+                run ending with exit() still writes all it traced, and
+                the last capture file is then closed.
+
+ Functions:     MTR_trc_start
+                MTR_trc_stop
+                MTR_trc_msg
+                MTR_trc_printf
+                MTR_trc_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "mtr_wrk.h"
+#include "mtr_trc.h"
+#include "mtr_cap.h"
+
+/*
+ * Time the trace thread sleeps when the ring is empty.
+ */
+#define MTR_TRC_IDLE_NS         (1000000)
+
+/*
+ * Most idle periods MTR_trc_stop() waits for the ring to drain.
+ */
+#define MTR_TRC_STOP_WAITS      (1000)
+
+/*
+ * Longest line a record can produce: the message header fields and two
+ * hex digits for every parameter octet.
+ */
+#define MTR_TRC_MAX_LINE        (64 + 2 * MAX_PARAM_LEN)
+
+/*
+ * One trace record
+ */
+typedef struct
+{
+  volatile u32 seq;             /* Ring sequence number */
+  u8  kind;                     /* MTR_TRC_xxx */
+  u8  src;                      /* Message source module */
+  u8  dst;                      /* Message destination module */
+  u8  status;                   /* Message status */
+  u16 type;                     /* Message type */
+  u16 id;                       /* Message id */
+  u16 instance;                 /* Message instance */
+  u16 len;                      /* Length of data */
+  unsigned long long ns;        /* Monotonic time traced, in nanoseconds */
+  u8  data[MAX_PARAM_LEN];      /* Parameter area or text */
+} MTR_TRC_REC;
+
+/*
+ * Static data:
+ */
+static MTR_TRC_REC mtr_trc_ring[MTR_TRC_RING_SIZE];
+static struct
+{
+  volatile u32 pos;             /* Next record to claim */
+  u32 dropped;                  /* Records dropped with the ring full */
+} __attribute__((aligned(MTR_CACHE_LINE))) mtr_trc_prod;
+static struct
+{
+  u32 pos;                      /* Next record to format */
+  u32 written;                  /* Records formatted */
+  u32 writes;                   /* Blocks written */
+} __attribute__((aligned(MTR_CACHE_LINE))) mtr_trc_cons;
+static u8 mtr_trc_started;      /* Set once the trace thread is running */
+static volatile u8 mtr_trc_stop_req; /* Set to stop once stop_pos is reached */
+static volatile u8 mtr_trc_stopped; /* Set once the trace thread has stopped */
+static u32 mtr_trc_stop_pos;    /* Records to write before stopping */
+static u8 mtr_trc_capture;      /* Set to write binary capture files */
+static char mtr_trc_hex[256][2]; /* Two hex digits for every octet value */
+static char mtr_trc_out[MTR_TRC_OUT_SIZE]; /* Formatted text */
+
+static MTR_TRC_REC *MTR_trc_claim(void);
+static void *MTR_trc_main(void *arg);
+static char *MTR_trc_fmt_rec(char *out, MTR_TRC_REC *rec);
+static char *MTR_trc_cap_rec(char *out, MTR_TRC_REC *rec);
+static int MTR_trc_write(char *buf, size_t len);
+static void MTR_trc_exit(void);
+
+/*
+ * MTR_trc_start
+ *
+ * Initialises the trace ring and starts the trace thread, writing
+ * either text to stdout or, if capture is set, binary capture files
+ * configured with MTR_cap_config().
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_trc_start(capture)
+  u8 capture;                   /* Set for binary capture */
+{
+  static const char digits[] = "0123456789abcdef";
+  pthread_t thread;             /* Trace thread */
+  u32 i;                        /* Index */
+
+  if (mtr_trc_started)
+    return(0);
+
+  for (i = 0; i < 256; i++)
+  {
+    mtr_trc_hex[i][0] = digits[i >> 4];
+    mtr_trc_hex[i][1] = digits[i & 0xf];
+  }
+  for (i = 0; i < MTR_TRC_RING_SIZE; i++)
+    mtr_trc_ring[i].seq = i;
+
+  mtr_trc_capture = capture;
+  if (pthread_create(&thread, NULL, MTR_trc_main, NULL) != 0)
+    return(-1);
+  pthread_detach(thread);
+  mtr_trc_started = 1;
+  atexit(MTR_trc_exit);
+  return(0);
+}
+
+/*
+ * MTR_trc_stop
+ *
+ * Waits for the trace thread to write every record traced so far and
+ * stops it. Records traced afterwards are dropped. Gives up if the
+ * ring has not drained after MTR_TRC_STOP_WAITS idle periods, as a
+ * record claimed by a thread that never publishes it would hold it up.
+ *
+ * Returns zero or -1 if the ring did not drain.
+ */
+int MTR_trc_stop()
+{
+  struct timespec idle;         /* Time to wait between checks */
+  u32 waits;                    /* Idle periods waited */
+
+  if ((mtr_trc_started == 0) || (mtr_trc_stop_req))
+    return(0);
+
+  idle.tv_sec = 0;
+  idle.tv_nsec = MTR_TRC_IDLE_NS;
+  mtr_trc_stop_pos = mtr_trc_prod.pos;
+  MTR_WRK_BARRIER();
+  mtr_trc_stop_req = 1;
+  for (waits = 0; !mtr_trc_stopped; waits++)
+  {
+    if (waits == MTR_TRC_STOP_WAITS)
+      return(-1);
+    nanosleep(&idle, NULL);
+  }
+  return(0);
+}
+
+/*
+ * MTR_trc_msg
+ *
+ * Queues a received or sent message for tracing.
+ *
+ * Returns zero or -1 if the record was dropped.
+ */
+int MTR_trc_msg(kind, m)
+  u8  kind;                     /* MTR_TRC_RX or MTR_TRC_TX */
+  MSG *m;                       /* Message to trace */
+{
+  MTR_TRC_REC *rec;             /* Record to fill */
+  HDR *h;                       /* Message header */
+
+  if ((rec = MTR_trc_claim()) == 0)
+    return(-1);
+
+  h = (HDR *)m;
+  rec->kind = kind;
+  rec->type = h->type;
+  rec->id = h->id;
+  rec->src = h->src;
+  rec->dst = h->dst;
+  rec->status = (u8)h->status;
+  rec->instance = (u16)GCT_get_instance(h);
+  rec->len = (m->len > MAX_PARAM_LEN) ? MAX_PARAM_LEN : m->len;
+  memcpy(rec->data, get_param(m), rec->len);
+
+  MTR_WRK_BARRIER();
+  rec->seq++;
+  return(0);
+}
+
+/*
+ * MTR_trc_printf
+ *
+ * Queues a line of text for tracing. The text is copied as formatted,
+ * including any line terminator.
+ *
+ * Returns zero or -1 if the record was dropped.
+ */
+int MTR_trc_printf(const char *fmt, ...)
+{
+  MTR_TRC_REC *rec;             /* Record to fill */
+  va_list ap;                   /* Arguments */
+  int len;                      /* Formatted length */
+
+  if (mtr_trc_capture)
+    return(0);
+
+  if ((rec = MTR_trc_claim()) == 0)
+    return(-1);
+
+  va_start(ap, fmt);
+  len = vsnprintf((char *)rec->data, MAX_PARAM_LEN, fmt, ap);
+  va_end(ap);
+
+  rec->kind = MTR_TRC_TEXT;
+  if (len < 0)
+    len = 0;
+  rec->len = (len >= MAX_PARAM_LEN) ? (MAX_PARAM_LEN - 1) : (u16)len;
+
+  MTR_WRK_BARRIER();
+  rec->seq++;
+  return(0);
+}
+
+/*
+ * MTR_trc_report
+ *
+ * Prints the trace counters.
+ *
+ * Always returns zero.
+ */
+int MTR_trc_report()
+{
+  if (mtr_trc_started)
+    printf("MTR Trace records: %u written; %u dropped; %u writes; %u queued\n",
+           mtr_trc_cons.written, mtr_trc_prod.dropped, mtr_trc_cons.writes,
+           mtr_trc_prod.pos - mtr_trc_cons.pos);
+  if (mtr_trc_capture)
+    MTR_cap_report();
+  return(0);
+}
+
+/*
+ * MTR_trc_claim
+ *
+ * Claims the next free record and stamps it with the current time.
+ * The caller fills the record and then publishes it by incrementing
+ * its sequence number.
+ *
+ * Returns the record or zero if the ring is full.
+ */
+static MTR_TRC_REC *MTR_trc_claim()
+{
+  MTR_TRC_REC *rec;             /* Candidate record */
+  struct timespec ts;           /* Current time */
+  u32 pos;                      /* Position to claim */
+  int dif;                      /* Record sequence relative to pos */
+
+  if (mtr_trc_started == 0)
+    return(0);
+
+  pos = mtr_trc_prod.pos;
+  while (1)
+  {
+    rec = &mtr_trc_ring[pos & (MTR_TRC_RING_SIZE - 1)];
+    dif = (int)(rec->seq - pos);
+    if (dif == 0)
+    {
+      if (__sync_bool_compare_and_swap(&mtr_trc_prod.pos, pos, pos + 1))
+        break;
+    }
+    else if (dif < 0)
+    {
+      /*
+       * Still holds a record the trace thread has not formatted.
+       */
+      __sync_fetch_and_add(&mtr_trc_prod.dropped, 1);
+      return(0);
+    }
+    pos = mtr_trc_prod.pos;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  rec->ns = (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  return(rec);
+}
+
+/*
+ * MTR_trc_main
+ *
+ * Trace thread body. Formats records in ring order and writes the
+ * text whenever the buffer fills or the ring runs empty.
+ *
+ * Returns once stopped by MTR_trc_stop().
+ */
+static void *MTR_trc_main(arg)
+  void *arg;                    /* Unused */
+{
+  MTR_TRC_REC *rec;             /* Record to format */
+  struct timespec idle;         /* Time to sleep while idle */
+  char *out;                    /* Next free character in mtr_trc_out */
+
+  idle.tv_sec = 0;
+  idle.tv_nsec = MTR_TRC_IDLE_NS;
+  out = mtr_trc_out;
+
+  while (1)
+  {
+    rec = &mtr_trc_ring[mtr_trc_cons.pos & (MTR_TRC_RING_SIZE - 1)];
+    if (rec->seq != mtr_trc_cons.pos + 1)
+    {
+      if (out != mtr_trc_out)
+      {
+        MTR_trc_write(mtr_trc_out, out - mtr_trc_out);
+        out = mtr_trc_out;
+      }
+      if ((mtr_trc_stop_req) && ((int)(mtr_trc_cons.pos - mtr_trc_stop_pos) >= 0))
+      {
+        mtr_trc_stopped = 1;
+        return(NULL);
+      }
+      nanosleep(&idle, NULL);
+      continue;
+    }
+    MTR_WRK_BARRIER();
+
+    if ((mtr_trc_out + MTR_TRC_OUT_SIZE - out) < MTR_TRC_MAX_LINE)
+    {
+      MTR_trc_write(mtr_trc_out, out - mtr_trc_out);
+      out = mtr_trc_out;
+    }
+    if (mtr_trc_capture)
+      out = MTR_trc_cap_rec(out, rec);
+    else
+      out = MTR_trc_fmt_rec(out, rec);
+
+    /*
+     * Hand the record back to the producers.
+     */
+    MTR_WRK_BARRIER();
+    rec->seq = mtr_trc_cons.pos + MTR_TRC_RING_SIZE;
+    mtr_trc_cons.pos++;
+    mtr_trc_cons.written++;
+  }
+  return(NULL);
+}
+
+/*
+ * MTR_trc_fmt_rec
+ *
+ * Formats one record as text, messages in the form
+ *
+ *   MTR Rx: I0000 M t87e1 i8000 f15 d2d s00 p0e...
+ *
+ * Returns the character following the formatted text.
+ */
+static char *MTR_trc_fmt_rec(out, rec)
+  char *out;                    /* Where to format */
+  MTR_TRC_REC *rec;             /* Record to format */
+{
+  u8  *pptr;                    /* Next parameter octet */
+  u16 n;                        /* Octets left */
+
+  if (rec->kind == MTR_TRC_TEXT)
+  {
+    memcpy(out, rec->data, rec->len);
+    return(out + rec->len);
+  }
+
+  memcpy(out, (rec->kind == MTR_TRC_RX) ? "MTR Rx: I" : "MTR Tx: I", 9);
+  out += 9;
+  *out++ = mtr_trc_hex[rec->instance >> 8][0];
+  *out++ = mtr_trc_hex[rec->instance >> 8][1];
+  *out++ = mtr_trc_hex[rec->instance & 0xff][0];
+  *out++ = mtr_trc_hex[rec->instance & 0xff][1];
+  memcpy(out, " M t", 4);
+  out += 4;
+  *out++ = mtr_trc_hex[rec->type >> 8][0];
+  *out++ = mtr_trc_hex[rec->type >> 8][1];
+  *out++ = mtr_trc_hex[rec->type & 0xff][0];
+  *out++ = mtr_trc_hex[rec->type & 0xff][1];
+  memcpy(out, " i", 2);
+  out += 2;
+  *out++ = mtr_trc_hex[rec->id >> 8][0];
+  *out++ = mtr_trc_hex[rec->id >> 8][1];
+  *out++ = mtr_trc_hex[rec->id & 0xff][0];
+  *out++ = mtr_trc_hex[rec->id & 0xff][1];
+  memcpy(out, " f", 2);
+  out += 2;
+  *out++ = mtr_trc_hex[rec->src][0];
+  *out++ = mtr_trc_hex[rec->src][1];
+  memcpy(out, " d", 2);
+  out += 2;
+  *out++ = mtr_trc_hex[rec->dst][0];
+  *out++ = mtr_trc_hex[rec->dst][1];
+  memcpy(out, " s", 2);
+  out += 2;
+  *out++ = mtr_trc_hex[rec->status][0];
+  *out++ = mtr_trc_hex[rec->status][1];
+
+  if (rec->len > 0)
+  {
+    *out++ = ' ';
+    *out++ = 'p';
+    for (pptr = rec->data, n = rec->len; n > 0; n--, pptr++)
+    {
+      *out++ = mtr_trc_hex[*pptr][0];
+      *out++ = mtr_trc_hex[*pptr][1];
+    }
+  }
+  *out++ = '\n';
+  return(out);
+}
+
+/*
+ * MTR_trc_cap_rec
+ *
+ * Encodes one message record for capture.
+ *
+ * Returns the octet following the encoded record.
+ */
+static char *MTR_trc_cap_rec(out, rec)
+  char *out;                    /* Where to encode */
+  MTR_TRC_REC *rec;             /* Record to encode */
+{
+  MTR_CAP_REC *cap;             /* Encoded record header */
+
+  if (rec->kind == MTR_TRC_TEXT)
+    return(out);
+
+  cap = (MTR_CAP_REC *)out;
+  cap->len = (u16)(sizeof(MTR_CAP_REC) + rec->len);
+  cap->kind = rec->kind;
+  cap->status = rec->status;
+  cap->ns = rec->ns;
+  cap->type = rec->type;
+  cap->id = rec->id;
+  cap->src = rec->src;
+  cap->dst = rec->dst;
+  cap->instance = rec->instance;
+  memcpy(out + sizeof(MTR_CAP_REC), rec->data, rec->len);
+  return(out + cap->len);
+}
+
+/*
+ * MTR_trc_write
+ *
+ * Writes a block of formatted text to stdout, or of encoded records
+ * to the capture file.
+ *
+ * Returns zero or -1 on error.
+ */
+static int MTR_trc_write(buf, len)
+  char *buf;                    /* Text to write */
+  size_t len;                   /* Length of text */
+{
+  ssize_t n;                    /* Octets written */
+
+  mtr_trc_cons.writes++;
+  if (mtr_trc_capture)
+    return(MTR_cap_write(buf, (u32)len));
+
+  while (len > 0)
+  {
+    if ((n = write(STDOUT_FILENO, buf, len)) <= 0)
+    {
+      if ((n < 0) && (errno == EINTR))
+        continue;
+      return(-1);
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return(0);
+}
+
+/*
+ * MTR_trc_exit
+ *
+ * Exit handler, writes out the ring before the process ends and, once
+ * the trace thread has stopped, closes the capture file so that a
+ * compressed one gets its trailer.
+ */
+static void MTR_trc_exit()
+{
+  if ((MTR_trc_stop() == 0) && (mtr_trc_capture))
+    MTR_cap_close();
+}
@@ -0,0 +1,33 @@
+/*
+ Name:          mtr_trc.h
+
+ Description:   Definitions for the MTR asynchronous trace.
+ */
+
+#ifndef MTR_TRC_H
+#define MTR_TRC_H
+
+/*
+ * Number of trace records the ring can hold (must be a power of 2).
+ */
+#define MTR_TRC_RING_SIZE       (8192)
+
+/*
+ * Size of the buffer the trace thread formats into before writing.
+ */
+#define MTR_TRC_OUT_SIZE        (65536)
+
+/*
+ * Trace record kinds
+ */
+#define MTR_TRC_RX              (0)     /* Received message */
+#define MTR_TRC_TX              (1)     /* Sent message */
+#define MTR_TRC_TEXT            (2)     /* Formatted text line */
+
+int MTR_trc_start(u8 capture);
+int MTR_trc_stop(void);
+int MTR_trc_msg(u8 kind, MSG *m);
+int MTR_trc_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int MTR_trc_report(void);
+
+#endif
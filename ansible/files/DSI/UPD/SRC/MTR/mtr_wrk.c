@@ -0,0 +1,303 @@
+/*
+ Name:          mtr_wrk.c
+
+ Description:   Worker thread pool for MTR.
+
+                In worker mode the main MTR thread only receives messages
+                from the GCT queue and hands each MAP primitive to a worker
+                thread over a lock-free single-producer/single-consumer
+                ring. Every worker owns a fixed share of the dialogue table,
+                selected by the dialogue reference (dlg_id & 0x7FFF), so all
+                the primitives of one dialogue are processed by the same
+                worker, in the order they were received, without locking.
+                Each worker also advances the guard timers of its own
+                dialogues.
+
+ Functions:     MTR_wrk_start
+                MTR_wrk_dispatch
+                MTR_wrk_tick
+                MTR_wrk_report
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+
+/*
+ * Functions in mtr.c
+ */
+int MTR_process_map_msg(MSG *m);
+int MTR_process_urgent(MSG **m, unsigned long long *rx_ns, u16 num);
+int MTR_flush_msgs(void);
+int MTR_poll_timers(u8 wheel);
+int MTR_retry_idle(void);
+
+/*
+ * Number of times a worker polls an empty ring before going to sleep.
+ */
+#define MTR_WRK_SPIN_COUNT      (1000)
+
+/*
+ * Producer side of a ring, written only by the receive thread.
+ */
+typedef struct
+{
+  volatile u32 head;            /* Next ring slot to fill */
+  u32 full_waits;               /* Times the ring was found full */
+} __attribute__((aligned(MTR_CACHE_LINE))) MTR_WRK_PROD;
+
+/*
+ * Consumer side of a ring and per-worker counters, written only
+ * by the worker itself.
+ */
+typedef struct
+{
+  volatile u32 tail;            /* Next ring slot to process */
+  volatile u32 sleeping;        /* Set while the worker waits on its semaphore */
+  u32 msgs;                     /* Messages processed */
+  u32 batches;                  /* Batches of messages processed */
+  u32 sleeps;                   /* Times the worker found its ring empty */
+} __attribute__((aligned(MTR_CACHE_LINE))) MTR_WRK_CONS;
+
+typedef struct
+{
+  MTR_WRK_PROD prod;            /* Receive thread side */
+  MTR_WRK_CONS cons;            /* Worker side */
+  sem_t wake;                   /* Posted to wake a sleeping worker */
+  pthread_t thread;             /* Worker thread */
+  MSG *ring[MTR_WRK_RING_SIZE]; /* Messages waiting for the worker */
+  unsigned long long rx_ns[MTR_WRK_RING_SIZE]; /* When each was received */
+} MTR_WRK;
+
+/*
+ * Static data:
+ */
+static MTR_WRK *wrk_pool;       /* Array of wrk_num workers */
+static u8 wrk_num;              /* Number of workers */
+static u16 wrk_batch_size;      /* Messages processed per batch */
+
+static void *MTR_wrk_main(void *arg);
+
+/*
+ * MTR_wrk_start
+ *
+ * Creates the worker threads.
+ *
+ * Returns zero or -1 on error.
+ */
+int MTR_wrk_start(num_workers, batch_size)
+  u8 num_workers;               /* Number of worker threads to start */
+  u16 batch_size;               /* Messages processed per batch */
+{
+  void *pool;                   /* Cache line aligned worker array */
+  u8 i;                         /* Worker index */
+
+  if ((num_workers == 0) || (num_workers > MTR_MAX_WORKERS) ||
+      (batch_size == 0) || (batch_size > MTR_WRK_MAX_BATCH))
+    return(-1);
+
+  if (posix_memalign(&pool, MTR_CACHE_LINE, num_workers * sizeof(MTR_WRK)) != 0)
+    return(-1);
+
+  wrk_pool = (MTR_WRK *)pool;
+  wrk_batch_size = batch_size;
+  memset(wrk_pool, 0, num_workers * sizeof(MTR_WRK));
+
+  for (i = 0; i < num_workers; i++)
+  {
+    sem_init(&wrk_pool[i].wake, 0, 0);
+    if (pthread_create(&wrk_pool[i].thread, NULL, MTR_wrk_main, &wrk_pool[i]) != 0)
+    {
+      fprintf(stderr, "MTR: failed to start worker thread %d\n", i);
+      return(-1);
+    }
+    wrk_num++;
+  }
+  return(0);
+}
+
+/*
+ * MTR_wrk_dispatch
+ *
+ * Hands a received MAP primitive to the worker that owns its dialogue.
+ * The worker processes and releases the message. Must only be called
+ * from the receive thread.
+ *
+ * Always returns zero.
+ */
+int MTR_wrk_dispatch(m, rx_ns)
+  MSG *m;                       /* Received message */
+  unsigned long long rx_ns;     /* When it was received, from MTR_lat_now() */
+{
+  MTR_WRK *wrk;                 /* Worker owning the dialogue */
+  u32 head;                     /* Slot to fill */
+
+  wrk = &wrk_pool[MTR_WRK_OWNER(m->hdr.id & 0x7FFF, wrk_num)];
+  head = wrk->prod.head;
+
+  /*
+   * If the worker is behind, wait for it rather than reorder or drop.
+   * The GCT queue holds the backlog in the meantime.
+   */
+  if ((head - wrk->cons.tail) >= MTR_WRK_RING_SIZE)
+  {
+    wrk->prod.full_waits++;
+    while ((head - wrk->cons.tail) >= MTR_WRK_RING_SIZE)
+      sched_yield();
+  }
+
+  wrk->ring[head & (MTR_WRK_RING_SIZE - 1)] = m;
+  wrk->rx_ns[head & (MTR_WRK_RING_SIZE - 1)] = rx_ns;
+  MTR_WRK_BARRIER();
+  wrk->prod.head = head + 1;
+
+  /*
+   * The full barrier pairs with the one in MTR_wrk_main so that either
+   * the worker sees the new head or we see that it is sleeping.
+   */
+  __sync_synchronize();
+  if (wrk->cons.sleeping)
+    sem_post(&wrk->wake);
+
+  return(0);
+}
+
+/*
+ * MTR_wrk_tick
+ *
+ * Wakes any sleeping workers so that they advance their timers.
+ * Must only be called from the receive thread.
+ *
+ * Always returns zero.
+ */
+int MTR_wrk_tick()
+{
+  u8 i;                         /* Worker index */
+
+  __sync_synchronize();
+  for (i = 0; i < wrk_num; i++)
+    if (wrk_pool[i].cons.sleeping)
+      sem_post(&wrk_pool[i].wake);
+  return(0);
+}
+
+/*
+ * MTR_wrk_report
+ *
+ * Prints the per-worker counters.
+ *
+ * Always returns zero.
+ */
+int MTR_wrk_report()
+{
+  u8 i;                         /* Worker index */
+
+  for (i = 0; i < wrk_num; i++)
+  {
+    printf("MTR Worker %d: msgs %u batches %u sleeps %u ring full %u queued %u\n",
+           i, wrk_pool[i].cons.msgs, wrk_pool[i].cons.batches,
+           wrk_pool[i].cons.sleeps,
+           wrk_pool[i].prod.full_waits,
+           wrk_pool[i].prod.head - wrk_pool[i].cons.tail);
+  }
+  return(0);
+}
+
+/*
+ * MTR_wrk_main
+ *
+ * Worker thread body. Processes messages from its ring in order,
+ * in batches of up to wrk_batch_size, sleeping on its semaphore while
+ * the ring stays empty, and advances its guard timers. Under overload
+ * control the messages that complete a dialogue go first.
+ *
+ * Never returns.
+ */
+static void *MTR_wrk_main(arg)
+  void *arg;                    /* Worker structure */
+{
+  MTR_WRK *wrk;                 /* This worker */
+  MSG *m[MTR_WRK_MAX_BATCH];    /* Messages in this batch */
+  unsigned long long rx_ns[MTR_WRK_MAX_BATCH]; /* When each was received */
+  u32 tail;                     /* Slot to process */
+  u16 num;                      /* Messages in this batch */
+  u16 i;                        /* Message index */
+  int spin;                     /* Polls left before sleeping */
+  int expired;                  /* Dialogues aborted or answered by timers */
+
+  wrk = (MTR_WRK *)arg;
+  spin = MTR_WRK_SPIN_COUNT;
+
+  while (1)
+  {
+    num = 0;
+    while ((num < wrk_batch_size) && ((tail = wrk->cons.tail) != wrk->prod.head))
+    {
+      MTR_WRK_BARRIER();
+      m[num] = wrk->ring[tail & (MTR_WRK_RING_SIZE - 1)];
+      rx_ns[num] = wrk->rx_ns[tail & (MTR_WRK_RING_SIZE - 1)];
+      MTR_WRK_BARRIER();
+      wrk->cons.tail = tail + 1;
+      num++;
+    }
+
+    MTR_process_urgent(m, rx_ns, num);
+    for (i = 0; i < num; i++)
+    {
+      if (m[i] == 0)
+        continue;
+      MTR_lat_rx(rx_ns[i]);
+      MTR_process_map_msg(m[i]);
+      MTR_lat_rx(0);
+      relm((HDR *)m[i]);
+    }
+
+    expired = MTR_poll_timers((u8)(wrk - wrk_pool));
+    if ((num == 0) && (expired != 0))
+      MTR_flush_msgs();
+
+    if (num != 0)
+    {
+      MTR_flush_msgs();
+      wrk->cons.msgs += num;
+      wrk->cons.batches++;
+      spin = MTR_WRK_SPIN_COUNT;
+      continue;
+    }
+
+    if (spin-- > 0)
+      continue;
+
+    /*
+     * Messages or responses waiting for a retry keep the worker
+     * polling, sleeping until each retry is due.
+     */
+    if (MTR_retry_idle() != 0)
+    {
+      spin = MTR_WRK_SPIN_COUNT;
+      continue;
+    }
+
+    /*
+     * Nothing to do for a while - sleep until the receive thread
+     * queues something.
+     */
+    wrk->cons.sleeps++;
+    wrk->cons.sleeping = 1;
+    __sync_synchronize();
+    if (wrk->cons.tail == wrk->prod.head)
+      sem_wait(&wrk->wake);
+    wrk->cons.sleeping = 0;
+    spin = MTR_WRK_SPIN_COUNT;
+  }
+  return(NULL);
+}
@@ -0,0 +1,59 @@
+/*
+ Name:          mtr_wrk.h
+
+ Description:   Definitions for the MTR worker thread pool.
+ */
+
+#ifndef MTR_WRK_H
+#define MTR_WRK_H
+
+/*
+ * Size of a cache line. Data written by different threads is kept
+ * in separate lines of this size to avoid false sharing.
+ */
+#define MTR_CACHE_LINE          (64)
+
+/*
+ * Orders plain loads and stores between threads. A compiler barrier is
+ * enough on x86, elsewhere use a full memory barrier.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#define MTR_WRK_BARRIER()       __asm__ __volatile__("" ::: "memory")
+#else
+#define MTR_WRK_BARRIER()       __sync_synchronize()
+#endif
+
+/*
+ * Maximum number of worker threads.
+ */
+#define MTR_MAX_WORKERS         (32)
+
+/*
+ * Number of messages each worker ring can hold (must be a power of 2).
+ */
+#define MTR_WRK_RING_SIZE       (4096)
+
+/*
+ * Most messages a worker takes from its ring at once.
+ */
+#define MTR_WRK_MAX_BATCH       (256)
+
+/*
+ * Dialogues are handed out to workers in runs of (1 << MTR_WRK_SHARD_SHIFT)
+ * consecutive dialogue references, so that neighbouring entries of the
+ * dialogue table, which share cache lines, belong to the same worker.
+ */
+#define MTR_WRK_SHARD_SHIFT     (4)
+
+/*
+ * Worker owning a dialogue reference (dlg_id & 0x7FFF)
+ */
+#define MTR_WRK_OWNER(dlg_ref, num_workers) \
+        ((u8)(((dlg_ref) >> MTR_WRK_SHARD_SHIFT) % (num_workers)))
+
+int MTR_wrk_start(u8 num_workers, u16 batch_size);
+int MTR_wrk_dispatch(MSG *m, unsigned long long rx_ns);
+int MTR_wrk_tick(void);
+int MTR_wrk_report(void);
+
+#endif
@@ -0,0 +1,893 @@
+/*
+ Name:          mtrbench.c
+
+ Description:   Microbenchmarks for MTR.
+
+                -p  times looking up the parameters MTR reads from an
+                    SRI for SM, an MT-FORWARD-SM and a USSD indication,
+                    with the per-parameter walks MTR used before
+                    MTR_prs_parse() and with MTR_prs_parse() itself.
+
+                -g  times packing and unpacking a 160 character short
+                    message a septet at a time, as MTR did before
+                    mtr_gsm.c, and eight septets at a time with
+                    MTR_gsm_pack7() and MTR_gsm_unpack7(), and the whole
+                    text conversion both ways.
+
+                -d  updates the state of dialogues picked at random from
+                    MTR_DLG_MAX_DLGS, as every primitive does, in the
+                    stock dlg_info table with its parallel trace array
+                    and in the hot part of the split table of
+                    mtr_dlg.c. Where the kernel allows, the L1 data cache
+                    and last level cache misses per update are counted
+                    with perf_event_open.
+
+                -l  times taking a timestamp with MTR_lat_now() and
+                    recording latencies spread from 100ns to 10s with
+                    MTR_lat_record().
+
+                -s  times counting an event with MTR_STAT_INC(), against
+                    a locked increment of a counter shared by all threads.
+
+                Each benchmark prints the time per operation in
+                nanoseconds. With no benchmark selected all of them are
+                run.
+
+                Syntax: mtrbench [-p -g -d -l -s -n]
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr.h"
+#include "mtr_prs.h"
+#include "mtr_gsm.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+#include "mtr_flt.h"
+#include "mtr_sub.h"
+#include "mtr_dlg.h"
+#include "mtr_stat.h"
+
+/*
+ * Default number of operations timed by each benchmark
+ */
+#define MTRBENCH_DEF_ITERATIONS (10000000)
+
+/*
+ * Benchmarks selected
+ */
+#define MTRBENCH_PRS            (0x01)
+#define MTRBENCH_GSM            (0x02)
+#define MTRBENCH_DLG            (0x04)
+#define MTRBENCH_LAT            (0x08)
+#define MTRBENCH_STAT           (0x10)
+#define MTRBENCH_ALL            (MTRBENCH_PRS | MTRBENCH_GSM | MTRBENCH_DLG | \
+                                 MTRBENCH_LAT | MTRBENCH_STAT)
+
+/*
+ * Space for the parameters copied out of a primitive
+ */
+#define MTRBENCH_MAX_COPY       (200)
+
+/*
+ * Dialogue references visited by the dialogue table benchmark, in a
+ * random order repeated until the operations are done
+ */
+#define MTRBENCH_NUM_REFS       (1 << 20)
+
+/*
+ * Latencies recorded by the latency benchmark, spread evenly over the
+ * logarithm of 100ns to 10s
+ */
+#define MTRBENCH_NUM_LATS       (4096)
+
+/*
+ * Cache events counted by the dialogue table benchmark
+ */
+#define MTRBENCH_L1D            (0)
+#define MTRBENCH_LLC            (1)
+#define MTRBENCH_NUM_EVENTS     (2)
+
+/*
+ * A received service indication and the parameter MTR reads from it
+ * besides the invoke id
+ */
+typedef struct
+{
+  char *name;                   /* Service name */
+  u8   pname;                   /* Parameter read */
+  u8   *image;                  /* Parameter area */
+  u16  len;                     /* Length of the parameter area */
+} BENCH_PRIM;
+
+static int read_number(char *str, unsigned long max, unsigned long *value);
+static int bench_prs(u32 iterations);
+static int bench_gsm(u32 iterations);
+static int bench_dlg(u32 iterations);
+static int bench_lat(u32 iterations);
+static int bench_stat(u32 iterations);
+static int perf_open(u32 type, unsigned long long config);
+static int perf_start(int *fd);
+static int perf_stop(int *fd, unsigned long long *count);
+static int old_get_invoke_id(u8 *pptr, u16 plen);
+static u8  old_get_param(u8 *pptr, u16 plen, u8 pname, u8 *dst, u16 dstlen);
+static u16 old_unpack7(u8 *src, u16 num, u8 *septets);
+static u16 old_pack7(u8 *septets, u16 num, u8 *dst);
+static void show_syntax(char *program);
+
+/*
+ * Static data:
+ */
+static volatile u32 sink;               /* Keeps results from being optimised away */
+
+/*
+ * SRI for SM with invoke id, MSISDN, priority and service centre
+ */
+static u8 bench_sri_sm[] =
+  { MAPST_SND_RTISM_IND, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_msisdn, 7, 0x91, 0x44, 0x77, 0x00, 0x09, 0x00, 0x00,
+    MAPPN_sm_rp_pri, 0x01, 0x01,
+    MAPPN_sc_addr, 6, 0x91, 0x44, 0x77, 0x00, 0x00, 0x00,
+    0x00 };
+
+/*
+ * MT-FORWARD-SM with invoke id, IMSI, service centre and an
+ * SMS-DELIVER of 'Hello world'
+ */
+static u8 bench_mt_fwd_sm[] =
+  { MAPST_MT_FWD_SM_IND, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_sm_rp_da, 10, 0x80, 8, 0x44, 0x08, 0x70, 0x00, 0x90, 0x00, 0x00, 0xf0,
+    MAPPN_sm_rp_oa, 8, 0x84, 6, 0x91, 0x44, 0x77, 0x00, 0x00, 0x00,
+    MAPPN_sm_rp_ui, 28, 0x04, 10, 0x91, 0x44, 0x77, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 11,
+    0xC8, 0x32, 0x9B, 0xFD, 0x06, 0xDD, 0xDF, 0x72, 0x36, 0x19,
+    0x00 };
+
+/*
+ * PROCESS-UNSTRUCTURED-SS-REQUEST of '*100#' with invoke id and MSISDN
+ */
+static u8 bench_ussd[] =
+  { MAPST_PRO_UNSTR_SS_REQ_IND, MAPPN_invoke_id, 0x01, 0x01,
+    MAPPN_USSD_coding, 0x01, 0x0f,
+    MAPPN_USSD_string, 5, 0xAA, 0x18, 0x0C, 0x36, 0x02,
+    MAPPN_msisdn, 7, 0x91, 0x44, 0x77, 0x00, 0x09, 0x00, 0x00,
+    0x00 };
+
+/*
+ * Short message of MTR_GSM_MAX_SEPTETS characters
+ */
+static char bench_sm_text[] =
+  "The quick brown fox jumps over the lazy dog. 0123456789 "
+  "Pack my box with five dozen liquor jugs! The quick brown fox "
+  "jumps over the lazy dog again at 10:45 now.";
+
+static BENCH_PRIM bench_prim[] =
+{
+  { "SRI-SM",        MAPPN_msisdn,   bench_sri_sm,    sizeof(bench_sri_sm) },
+  { "MT-FORWARD-SM", MAPPN_sm_rp_ui, bench_mt_fwd_sm, sizeof(bench_mt_fwd_sm) },
+  { "USSD",          MAPPN_msisdn,   bench_ussd,      sizeof(bench_ussd) }
+};
+
+#define MTRBENCH_NUM_PRIM (sizeof(bench_prim) / sizeof(bench_prim[0]))
+
+/*
+ * main
+ *
+ * Returns zero or 1 if the options are wrong.
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  unsigned long value;          /* Numeric value of an option */
+  u32 iterations;               /* Operations timed */
+  u8  selected;                 /* Benchmarks selected */
+  int i;                        /* Argument index */
+
+  iterations = MTRBENCH_DEF_ITERATIONS;
+  selected = 0;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (argv[i][0] == '-')
+    {
+      switch (argv[i][1])
+      {
+        case 'p':
+          if (argv[i][2] != '\0')
+            break;
+          selected |= MTRBENCH_PRS;
+          continue;
+
+        case 'g':
+          if (argv[i][2] != '\0')
+            break;
+          selected |= MTRBENCH_GSM;
+          continue;
+
+        case 'd':
+          if (argv[i][2] != '\0')
+            break;
+          selected |= MTRBENCH_DLG;
+          continue;
+
+        case 'l':
+          if (argv[i][2] != '\0')
+            break;
+          selected |= MTRBENCH_LAT;
+          continue;
+
+        case 's':
+          if (argv[i][2] != '\0')
+            break;
+          selected |= MTRBENCH_STAT;
+          continue;
+
+        case 'n':
+          if ((read_number(&argv[i][2], 0xffffffff, &value) != 0) || (value == 0))
+            break;
+          iterations = (u32)value;
+          continue;
+      }
+    }
+    show_syntax(argv[0]);
+    return(1);
+  }
+  if (selected == 0)
+    selected = MTRBENCH_ALL;
+
+  if (selected & MTRBENCH_PRS)
+    bench_prs(iterations);
+  if (selected & MTRBENCH_GSM)
+    bench_gsm(iterations);
+  if (selected & MTRBENCH_DLG)
+    bench_dlg(iterations);
+  if (selected & MTRBENCH_LAT)
+    bench_lat(iterations);
+  if (selected & MTRBENCH_STAT)
+    bench_stat(iterations);
+  return(0);
+}
+
+/*
+ * read_number
+ *
+ * Reads a decimal or 0x prefixed hex number.
+ *
+ * Returns zero or -1 if the string is not a number up to max.
+ */
+static int read_number(str, max, value)
+  char *str;                    /* String to read */
+  unsigned long max;            /* Largest value allowed */
+  unsigned long *value;         /* Returns the value */
+{
+  char *end;                    /* First character not read */
+
+  if (*str == '\0')
+    return(-1);
+  *value = strtoul(str, &end, 0);
+  if ((*end != '\0') || (*value > max))
+    return(-1);
+  return(0);
+}
+
+/*
+ * bench_prs
+ *
+ * Times recovering the invoke id and one other parameter from each
+ * primitive, first with a separate walk per parameter, copying the
+ * value out as MTR did, then with one MTR_prs_parse() and look ups,
+ * copying only the MSISDN as MTR still does.
+ *
+ * Always returns zero.
+ */
+static int bench_prs(iterations)
+  u32 iterations;               /* Primitives parsed */
+{
+  static MSG m;                 /* Received message */
+  MTR_PRS prs;                  /* Parsed primitive */
+  BENCH_PRIM *p;                /* Primitive timed */
+  u8  copy[MTRBENCH_MAX_COPY];  /* Copied parameter */
+  unsigned long long start;     /* Start of a run */
+  unsigned long long old_ns;    /* Time with the old walks */
+  unsigned long long new_ns;    /* Time with the parser */
+  u8  *pval;                    /* Parameter value */
+  u8  plen;                     /* Parameter length */
+  u32 acc;                      /* Accumulated results */
+  u32 n;                        /* Iteration */
+  unsigned int i;               /* Primitive */
+
+  printf("Parameter look up, ns per primitive:\n");
+  printf("  %-14s %10s %10s %8s\n", "primitive", "walks", "parser", "speedup");
+  for (i = 0; i < MTRBENCH_NUM_PRIM; i++)
+  {
+    p = &bench_prim[i];
+    memset(&m, 0, sizeof(m));
+    memcpy(get_param(&m), p->image, p->len);
+    m.len = p->len;
+
+    acc = 0;
+    start = MTR_lat_now();
+    for (n = 0; n < iterations; n++)
+    {
+      acc += (u32)old_get_invoke_id(get_param(&m), m.len);
+      acc += old_get_param(get_param(&m), m.len, p->pname, copy, sizeof(copy));
+    }
+    old_ns = MTR_lat_now() - start;
+    sink += acc;
+
+    acc = 0;
+    start = MTR_lat_now();
+    for (n = 0; n < iterations; n++)
+    {
+      MTR_prs_parse(&m, &prs);
+      if (((pval = MTR_prs_find(&prs, MAPPN_invoke_id, &plen)) != 0) && (plen == 1))
+        acc += *pval;
+      if ((pval = MTR_prs_find(&prs, p->pname, &plen)) != 0)
+      {
+        if (p->pname == MAPPN_msisdn)
+          memcpy(copy, pval, plen);
+        acc += plen;
+      }
+    }
+    new_ns = MTR_lat_now() - start;
+    sink += acc;
+
+    printf("  %-14s %10.1f %10.1f %7.2fx\n", p->name,
+           (double)old_ns / iterations, (double)new_ns / iterations,
+           new_ns ? (double)old_ns / new_ns : 0.0);
+  }
+  return(0);
+}
+
+/*
+ * bench_gsm
+ *
+ * Times packing and unpacking a full short message, first a septet
+ * at a time and then with the mtr_gsm.c word at a time codec, then
+ * the conversion from and to UTF-8 text.
+ *
+ * Returns zero or -1 if the two codecs disagree.
+ */
+static int bench_gsm(iterations)
+  u32 iterations;               /* Messages packed and unpacked */
+{
+  u8  septets[MTR_GSM_MAX_SEPTETS];     /* Unpacked message */
+  u8  check[MTR_GSM_MAX_SEPTETS];       /* Message unpacked again */
+  u8  packed[MTR_GSM_MAX_UD];           /* Packed message */
+  u8  old_packed[MTR_GSM_MAX_UD];       /* Message packed a septet at a time */
+  char text[MTR_GSM_MAX_TEXT];          /* Decoded text */
+  MTR_GSM_UD info;              /* Description of the user data */
+  unsigned long long start;     /* Start of a run */
+  unsigned long long old_ns;    /* Time a septet at a time */
+  unsigned long long new_ns;    /* Time with mtr_gsm.c */
+  u32 acc;                      /* Accumulated results */
+  u32 n;                        /* Iteration */
+  int len;                      /* Packed length */
+
+  MTR_gsm_init();
+  if (((len = MTR_gsm_encode7(bench_sm_text, packed, sizeof(packed))) != MTR_GSM_MAX_UD) ||
+      (MTR_gsm_unpack7(packed, (u16)len, MTR_GSM_MAX_SEPTETS, septets) != MTR_GSM_MAX_SEPTETS))
+  {
+    fprintf(stderr, "mtrbench: test message is not %d characters\n", MTR_GSM_MAX_SEPTETS);
+    return(-1);
+  }
+  old_pack7(septets, MTR_GSM_MAX_SEPTETS, old_packed);
+  old_unpack7(packed, MTR_GSM_MAX_SEPTETS, check);
+  if ((memcmp(old_packed, packed, MTR_GSM_MAX_UD) != 0) ||
+      (memcmp(check, septets, MTR_GSM_MAX_SEPTETS) != 0))
+  {
+    fprintf(stderr, "mtrbench: septet at a time and word at a time codecs disagree\n");
+    return(-1);
+  }
+
+  printf("GSM 7-bit, ns per %d character message:\n", MTR_GSM_MAX_SEPTETS);
+  printf("  %-14s %10s %10s %8s\n", "operation", "septets", "words", "speedup");
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+  {
+    acc += old_unpack7(packed, MTR_GSM_MAX_SEPTETS, check);
+    acc += check[n % MTR_GSM_MAX_SEPTETS];
+  }
+  old_ns = MTR_lat_now() - start;
+  sink += acc;
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+  {
+    acc += MTR_gsm_unpack7(packed, MTR_GSM_MAX_UD, MTR_GSM_MAX_SEPTETS, check);
+    acc += check[n % MTR_GSM_MAX_SEPTETS];
+  }
+  new_ns = MTR_lat_now() - start;
+  sink += acc;
+  printf("  %-14s %10.1f %10.1f %7.2fx\n", "unpack",
+         (double)old_ns / iterations, (double)new_ns / iterations,
+         new_ns ? (double)old_ns / new_ns : 0.0);
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+  {
+    acc += old_pack7(septets, MTR_GSM_MAX_SEPTETS, old_packed);
+    acc += old_packed[n % MTR_GSM_MAX_UD];
+  }
+  old_ns = MTR_lat_now() - start;
+  sink += acc;
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+  {
+    acc += MTR_gsm_pack7(septets, MTR_GSM_MAX_SEPTETS, old_packed, sizeof(old_packed));
+    acc += old_packed[n % MTR_GSM_MAX_UD];
+  }
+  new_ns = MTR_lat_now() - start;
+  sink += acc;
+  printf("  %-14s %10.1f %10.1f %7.2fx\n", "pack",
+         (double)old_ns / iterations, (double)new_ns / iterations,
+         new_ns ? (double)old_ns / new_ns : 0.0);
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+    acc += (u32)MTR_gsm_decode(MTR_GSM_7BIT, 0, packed, MTR_GSM_MAX_UD,
+                               MTR_GSM_MAX_SEPTETS, text, sizeof(text), &info);
+  old_ns = MTR_lat_now() - start;
+  sink += acc;
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+    acc += (u32)MTR_gsm_encode7(bench_sm_text, packed, sizeof(packed));
+  new_ns = MTR_lat_now() - start;
+  sink += acc;
+  printf("  %-14s %10s %10.1f\n", "decode to text", "", (double)old_ns / iterations);
+  printf("  %-14s %10s %10.1f\n", "encode text", "", (double)new_ns / iterations);
+  return(0);
+}
+
+/*
+ * bench_dlg
+ *
+ * Times updating the state of dialogues picked at random, first in
+ * the stock dlg_info table, with the trace selection in a parallel
+ * array as MTR kept it, then in the hot part of the split table.
+ *
+ * Returns zero or -1 if the tables cannot be set up.
+ */
+static int bench_dlg(iterations)
+  u32 iterations;               /* Dialogue updates */
+{
+  static dlg_info old_dlg[MTR_DLG_MAX_DLGS];    /* Stock dialogue table */
+  static u8 old_trace[MTR_DLG_MAX_DLGS];        /* Parallel trace selection */
+  u16 *refs;                    /* Dialogues in the order visited */
+  MTR_DLG *dlg;                 /* Hot state of a dialogue */
+  dlg_info *d;                  /* Stock state of a dialogue */
+  int fd[MTRBENCH_NUM_EVENTS];  /* Cache event counters, -1 if none */
+  unsigned long long old_miss[MTRBENCH_NUM_EVENTS]; /* Misses with the stock table */
+  unsigned long long new_miss[MTRBENCH_NUM_EVENTS]; /* Misses with the split table */
+  unsigned long long start;     /* Start of a run */
+  unsigned long long old_ns;    /* Time with the stock table */
+  unsigned long long new_ns;    /* Time with the split table */
+  u32 seed;                     /* Random number state */
+  u32 acc;                      /* Accumulated results */
+  u32 n;                        /* Iteration */
+  u32 i;                        /* Index */
+
+  if ((refs = malloc(MTRBENCH_NUM_REFS * sizeof(u16))) == 0)
+    return(-1);
+  for (i = 0, seed = 1; i < MTRBENCH_NUM_REFS; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    refs[i] = (u16)((seed >> 8) % MTR_DLG_MAX_DLGS);
+  }
+
+  /*
+   * Touch both tables first so that neither run pays for page faults.
+   */
+  if (MTR_dlg_init(MTR_DLG_MAX_DLGS, 1, 0, DLG_TERM_MODE_AUTO) != 0)
+  {
+    fprintf(stderr, "mtrbench: cannot set up the dialogue table\n");
+    free(refs);
+    return(-1);
+  }
+  for (i = 0; i < MTR_DLG_MAX_DLGS; i++)
+  {
+    if (MTR_dlg_get(0, (u16)i) == 0)
+    {
+      fprintf(stderr, "mtrbench: cannot set up the dialogue table\n");
+      free(refs);
+      return(-1);
+    }
+  }
+  memset(old_dlg, 0, sizeof(old_dlg));
+  memset(old_trace, 0, sizeof(old_trace));
+
+  fd[MTRBENCH_L1D] = perf_open(PERF_TYPE_HW_CACHE,
+                               PERF_COUNT_HW_CACHE_L1D |
+                               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  fd[MTRBENCH_LLC] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+  acc = 0;
+  perf_start(fd);
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+  {
+    d = &old_dlg[refs[n & (MTRBENCH_NUM_REFS - 1)]];
+    if (d->state == MTR_S_NULL)
+      d->state = MTR_S_WAIT_FOR_SRV_PRIM;
+    else
+      d->state = MTR_S_NULL;
+    d->invoke_id = (u8)n;
+    acc += d->ptype + old_trace[refs[n & (MTRBENCH_NUM_REFS - 1)]];
+  }
+  old_ns = MTR_lat_now() - start;
+  perf_stop(fd, old_miss);
+  sink += acc;
+
+  acc = 0;
+  perf_start(fd);
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+  {
+    dlg = MTR_dlg_get(0, refs[n & (MTRBENCH_NUM_REFS - 1)]);
+    if (dlg->state == MTR_S_NULL)
+      dlg->state = MTR_S_WAIT_FOR_SRV_PRIM;
+    else
+      dlg->state = MTR_S_NULL;
+    dlg->invoke_id = (u8)n;
+    acc += dlg->ptype + dlg->trace;
+  }
+  new_ns = MTR_lat_now() - start;
+  perf_stop(fd, new_miss);
+  sink += acc;
+
+  printf("Dialogue table, %d dialogues, per update:\n", MTR_DLG_MAX_DLGS);
+  printf("  %-14s %10s %10s %10s %10s\n", "table", "bytes", "ns", "L1D miss", "LLC miss");
+  printf("  %-14s %10lu %10.1f", "dlg_info",
+         (unsigned long)(sizeof(old_dlg) + sizeof(old_trace)), (double)old_ns / iterations);
+  for (i = 0; i < MTRBENCH_NUM_EVENTS; i++)
+    if (fd[i] < 0)
+      printf(" %10s", "n/a");
+    else
+      printf(" %10.3f", (double)old_miss[i] / iterations);
+  printf("\n  %-14s %10lu %10.1f", "hot MTR_DLG",
+         (unsigned long)(MTR_DLG_MAX_DLGS * sizeof(MTR_DLG)), (double)new_ns / iterations);
+  for (i = 0; i < MTRBENCH_NUM_EVENTS; i++)
+    if (fd[i] < 0)
+      printf(" %10s", "n/a");
+    else
+      printf(" %10.3f", (double)new_miss[i] / iterations);
+  printf("\n");
+
+  for (i = 0; i < MTRBENCH_NUM_EVENTS; i++)
+    if (fd[i] >= 0)
+      close(fd[i]);
+  free(refs);
+  return(0);
+}
+
+/*
+ * bench_lat
+ *
+ * Times the two costs latency measurement adds to every primitive:
+ * taking a timestamp and recording a latency in a histogram.
+ *
+ * Always returns zero.
+ */
+static int bench_lat(iterations)
+  u32 iterations;               /* Timestamps and latencies recorded */
+{
+  static unsigned long long lat[MTRBENCH_NUM_LATS]; /* Latencies recorded */
+  unsigned long long start;     /* Start of a run */
+  unsigned long long now_ns;    /* Time taking timestamps */
+  unsigned long long rec_ns;    /* Time recording latencies */
+  unsigned long long acc;       /* Accumulated results */
+  double ns;                    /* Latency being built */
+  u32 n;                        /* Iteration */
+  u32 i;                        /* Index */
+
+  /*
+   * Each latency is the one before times the MTRBENCH_NUM_LATS'th
+   * root of 10^8, so the last is close to 10s.
+   */
+  for (i = 0, ns = 100.0; i < MTRBENCH_NUM_LATS; i++)
+  {
+    lat[i] = (unsigned long long)ns;
+    ns *= 1.0045073642544624;
+  }
+
+  acc = 0;
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+    acc += MTR_lat_now();
+  now_ns = MTR_lat_now() - start;
+  sink += (u32)acc;
+
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+    MTR_lat_record(MTR_LAT_RSP, MTR_LAT_SRI_SM, lat[n & (MTRBENCH_NUM_LATS - 1)]);
+  rec_ns = MTR_lat_now() - start;
+
+  printf("Latency measurement, ns per operation:\n");
+  printf("  %-14s %10.1f\n", "MTR_lat_now", (double)now_ns / iterations);
+  printf("  %-14s %10.1f\n", "MTR_lat_record", (double)rec_ns / iterations);
+  return(0);
+}
+
+/*
+ * bench_stat
+ *
+ * Times counting an event in this thread's block of counters with
+ * MTR_STAT_INC(), as MTR does, against the locked increment a counter
+ * shared by all threads would need.
+ * The block is given to the thread directly, so no statistics segment
+ * is created.
+ *
+ * Always returns zero.
+ */
+static int bench_stat(iterations)
+  u32 iterations;               /* Events counted */
+{
+  static MTR_STAT_THR thr;      /* This thread's counters */
+  static unsigned long long shared;             /* Counter shared by all threads */
+  unsigned long long start;     /* Start of a run */
+  unsigned long long stat_ns;   /* Time with MTR_STAT_INC */
+  unsigned long long shared_ns; /* Time with locked increments */
+  u32 n;                        /* Iteration */
+
+  mtr_stat_thr = &thr;
+
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+    MTR_STAT_INC(rx);
+  stat_ns = MTR_lat_now() - start;
+
+  start = MTR_lat_now();
+  for (n = 0; n < iterations; n++)
+    __sync_fetch_and_add(&shared, 1);
+  shared_ns = MTR_lat_now() - start;
+  sink += (u32)(thr.rx + shared);
+
+  printf("Counting an event, ns per event:\n");
+  printf("  %-14s %10.2f\n", "MTR_STAT_INC", (double)stat_ns / iterations);
+  printf("  %-14s %10.2f\n", "locked", (double)shared_ns / iterations);
+  return(0);
+}
+
+/*
+ * perf_open
+ *
+ * Opens a counter of a hardware event for this thread in user space.
+ *
+ * Returns the counter or -1 if the kernel does not allow it.
+ */
+static int perf_open(type, config)
+  u32 type;                     /* PERF_TYPE_xxx */
+  unsigned long long config;    /* Event */
+{
+  struct perf_event_attr attr;  /* Event description */
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return((int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+/*
+ * perf_start
+ *
+ * Resets and starts the cache event counters that could be opened.
+ *
+ * Always returns zero.
+ */
+static int perf_start(fd)
+  int *fd;                      /* Counters, -1 if none */
+{
+  u8 i;                         /* Event */
+
+  for (i = 0; i < MTRBENCH_NUM_EVENTS; i++)
+  {
+    if (fd[i] >= 0)
+    {
+      ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  return(0);
+}
+
+/*
+ * perf_stop
+ *
+ * Stops the cache event counters and reads them.
+ *
+ * Always returns zero.
+ */
+static int perf_stop(fd, count)
+  int *fd;                      /* Counters, -1 if none */
+  unsigned long long *count;    /* Returns the counts */
+{
+  u8 i;                         /* Event */
+
+  for (i = 0; i < MTRBENCH_NUM_EVENTS; i++)
+  {
+    count[i] = 0;
+    if (fd[i] >= 0)
+    {
+      ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd[i], &count[i], sizeof(count[i])) != sizeof(count[i]))
+        count[i] = 0;
+    }
+  }
+  return(0);
+}
+
+/*
+ * old_get_invoke_id
+ *
+ * The invoke id walk MTR used before MTR_prs_parse(), unchanged.
+ *
+ * Returns the invoke id or -1 if not found.
+ */
+static int old_get_invoke_id(pptr, plen)
+  u8  *pptr;        /* First byte of received primitive data (type octet) */
+  u16 plen;         /* length of primitive data */
+{
+  int  invoke_id;   /* Recovered invoke_id */
+  u8   ptype;       /* Parameter type*/
+
+  pptr++;
+  plen --;
+  invoke_id = -1;
+
+  while (plen)
+  {
+    ptype = *pptr++;
+    plen = *pptr++;
+
+    if (ptype == MAPPN_invoke_id)
+    {
+      if (plen == 1)
+      {
+        invoke_id = (int)*pptr;
+        break;
+      }
+    }
+    pptr += plen;
+  }
+  return(invoke_id);
+}
+
+/*
+ * old_get_param
+ *
+ * The walk MTR used before MTR_prs_parse() to copy out the MSISDN or
+ * the short message, unchanged apart from the parameter name.
+ *
+ * Returns the length copied or zero if not found.
+ */
+static u8 old_get_param(pptr, plen, pname, dst, dstlen)
+  u8  *pptr;    /* First byte of received primitive data (type octet) */
+  u16 plen;     /* length of primitive data */
+  u8  pname;    /* Parameter name */
+  u8  *dst;     /* Start of destination for recovered param */
+  u16 dstlen;   /* Space available at dst */
+{
+  u8   ptype;   /* Parameter type */
+  u8  retval;   /* Return value */
+
+  retval = 0;
+  pptr++;
+  plen --;
+
+  while (plen)
+  {
+    ptype = *pptr++;
+    plen = *pptr++;
+
+    if (ptype == pname)
+    {
+      if (plen <= dstlen)
+      {
+        memcpy((void*)dst, (void*)pptr, plen);
+        retval = (u8)plen;
+        break;
+      }
+    }
+    pptr += plen;
+  }
+  return(retval);
+}
+
+/*
+ * old_unpack7
+ *
+ * Unpacks septets one at a time, as MTR did with unpackbits() before
+ * mtr_gsm.c.
+ *
+ * Returns the number of septets unpacked.
+ */
+static u16 old_unpack7(src, num, septets)
+  u8  *src;                     /* Packed data */
+  u16 num;                      /* Number of septets */
+  u8  *septets;                 /* Unpacked septets, one per octet */
+{
+  u16 bit;                      /* Bit offset of septet */
+  u16 i;                        /* Septet index */
+
+  for (i = 0; i < num; i++)
+  {
+    bit = (u16)(i * 7);
+    septets[i] = (u8)(src[bit >> 3] >> (bit & 7));
+    if ((bit & 7) > 1)
+      septets[i] |= (u8)(src[(bit >> 3) + 1] << (8 - (bit & 7)));
+    septets[i] &= 0x7f;
+  }
+  return(num);
+}
+
+/*
+ * old_pack7
+ *
+ * Packs septets one at a time.
+ *
+ * Returns the length of the packed data.
+ */
+static u16 old_pack7(septets, num, dst)
+  u8  *septets;                 /* Septets to pack, one per octet */
+  u16 num;                      /* Number of septets */
+  u8  *dst;                     /* Packed data */
+{
+  u16 len;                      /* Length of packed data */
+  u16 bit;                      /* Bit offset of septet */
+  u16 i;                        /* Septet index */
+
+  len = (u16)((num * 7 + 7) / 8);
+  memset(dst, 0, len);
+  for (i = 0; i < num; i++)
+  {
+    bit = (u16)(i * 7);
+    dst[bit >> 3] |= (u8)((septets[i] & 0x7f) << (bit & 7));
+    if ((bit & 7) > 1)
+      dst[(bit >> 3) + 1] |= (u8)((septets[i] & 0x7f) >> (8 - (bit & 7)));
+  }
+  return(len);
+}
+
+/*
+ * show_syntax
+ */
+static void show_syntax(program)
+  char *program;                /* Program name */
+{
+  fprintf(stderr, "Syntax: %s [-p -g -d -l -s -n]\n", program);
+  fprintf(stderr, "  -p  parameter look up: per-parameter walks against MTR_prs_parse\n");
+  fprintf(stderr, "  -g  GSM 7-bit pack and unpack: septet at a time against mtr_gsm.c\n");
+  fprintf(stderr, "  -d  dialogue table: stock dlg_info against the hot MTR_DLG entries\n");
+  fprintf(stderr, "  -l  latency measurement: timestamps and histogram recording\n");
+  fprintf(stderr, "  -s  counters: MTR_STAT_INC against a locked increment\n");
+  fprintf(stderr, "  -n  operations timed by each benchmark (default %u)\n",
+          MTRBENCH_DEF_ITERATIONS);
+  fprintf(stderr, "  With no benchmark selected all of them are run\n");
+}
@@ -0,0 +1,389 @@
+/*
+ Name:          mtrdec.c
+
+ Description:   Decoder for MTR binary trace captures.
+
+                Prints the records of one or more capture files written
+                with mtr -c, either in the text format of the MTR trace
+
+                  MTR Rx: I0000 M t87e1 i8000 f15 d2d s00 p0e...
+
+                or, with -n, with each MAP parameter on its own line
+                under its MAPPN_ name. Plain files are mapped into memory,
+                compressed (.gz) files are read through zlib.
+
+                Syntax: mtrdec [-n] [-t] <file> [<file> ...]
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "system.h"
+#include "msg.h"
+#include "map_inc.h"
+#include "mtr_trc.h"
+#include "mtr_cap.h"
+
+/*
+ * Size by which the buffer for a compressed file grows.
+ */
+#define MTRDEC_GZ_CHUNK         (1024 * 1024)
+
+static int decode_file(char *name);
+static u8 *read_file(char *name, size_t *len, u8 *mapped);
+static int print_rec(MTR_CAP_FILE *fhdr, MTR_CAP_REC *rec, u8 *pptr, u16 plen);
+static int print_params(u8 *pptr, u16 plen);
+static char *param_name(u8 pname);
+static char *msg_type_name(u16 type);
+
+static u8 opt_names;            /* Print parameters by name */
+static u8 opt_time;             /* Print the wall clock time of each record */
+
+/*
+ * Names of the MAP parameters MTR handles
+ */
+static struct
+{
+  u8   pname;
+  char *name;
+} param_names[] =
+{
+  { MAPPN_dest_address,         "MAPPN_dest_address" },
+  { MAPPN_orig_address,         "MAPPN_orig_address" },
+  { MAPPN_result,               "MAPPN_result" },
+  { MAPPN_refuse_rsn,           "MAPPN_refuse_rsn" },
+  { MAPPN_release_method,       "MAPPN_release_method" },
+  { MAPPN_user_rsn,             "MAPPN_user_rsn" },
+  { MAPPN_prov_rsn,             "MAPPN_prov_rsn" },
+  { MAPPN_applic_context,       "MAPPN_applic_context" },
+  { MAPPN_invoke_id,            "MAPPN_invoke_id" },
+  { MAPPN_msisdn,               "MAPPN_msisdn" },
+  { MAPPN_sm_rp_pri,            "MAPPN_sm_rp_pri" },
+  { MAPPN_sc_addr,              "MAPPN_sc_addr" },
+  { MAPPN_imsi,                 "MAPPN_imsi" },
+  { MAPPN_msc_num,              "MAPPN_msc_num" },
+  { MAPPN_user_err,             "MAPPN_user_err" },
+  { MAPPN_sm_deliv_fail_cause,  "MAPPN_sm_deliv_fail_cause" },
+  { MAPPN_sm_rp_da,             "MAPPN_sm_rp_da" },
+  { MAPPN_sm_rp_oa,             "MAPPN_sm_rp_oa" },
+  { MAPPN_sm_rp_ui,             "MAPPN_sm_rp_ui" },
+  { MAPPN_more_msgs,            "MAPPN_more_msgs" },
+  { MAPPN_sgsn_address,         "MAPPN_sgsn_address" },
+  { MAPPN_USSD_coding,          "MAPPN_USSD_coding" },
+  { MAPPN_USSD_string,          "MAPPN_USSD_string" },
+  { MAPPN_geog_info,            "MAPPN_geog_info" },
+};
+
+/*
+ * main
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  int i;                        /* Argument index */
+  int err;                      /* Set if any file failed */
+
+  for (i = 1; (i < argc) && (argv[i][0] == '-'); i++)
+  {
+    if (strcmp(argv[i], "-n") == 0)
+      opt_names = 1;
+    else if (strcmp(argv[i], "-t") == 0)
+      opt_time = 1;
+    else
+      break;
+  }
+
+  if (i >= argc)
+  {
+    fprintf(stderr, "Syntax: %s [-n] [-t] <file> [<file> ...]\n", argv[0]);
+    fprintf(stderr, "  -n  print MAP parameters by name\n");
+    fprintf(stderr, "  -t  print the time of each record\n");
+    return(1);
+  }
+
+  err = 0;
+  for (; i < argc; i++)
+  {
+    if (decode_file(argv[i]) != 0)
+      err = 1;
+  }
+  return(err);
+}
+
+/*
+ * decode_file
+ *
+ * Prints every record in a capture file.
+ *
+ * Returns zero or -1 if the file could not be read or is damaged.
+ */
+static int decode_file(name)
+  char *name;                   /* Capture file */
+{
+  u8  *data;                    /* File contents */
+  size_t len;                   /* File length */
+  size_t off;                   /* Offset of the next record */
+  u8  mapped;                   /* Set if data is mapped */
+  MTR_CAP_FILE fhdr;            /* File header */
+  MTR_CAP_REC rec;              /* Record header */
+  int err;                      /* Return value */
+
+  if ((data = read_file(name, &len, &mapped)) == 0)
+    return(-1);
+
+  err = 0;
+  if ((len < sizeof(fhdr)) ||
+      (memcpy(&fhdr, data, sizeof(fhdr)),
+       memcmp(fhdr.magic, MTR_CAP_MAGIC, sizeof(fhdr.magic)) != 0) ||
+      (fhdr.version != MTR_CAP_VERSION) ||
+      (fhdr.hdr_len < sizeof(fhdr)) || (fhdr.hdr_len > len))
+  {
+    fprintf(stderr, "mtrdec: %s: not an MTR capture file\n", name);
+    err = -1;
+  }
+  else
+  {
+    for (off = fhdr.hdr_len; off < len; off += rec.len)
+    {
+      if (len - off < sizeof(rec))
+        break;
+      memcpy(&rec, data + off, sizeof(rec));
+      if ((rec.len < sizeof(rec)) || (rec.len > len - off))
+        break;
+      print_rec(&fhdr, &rec, data + off + sizeof(rec),
+                (u16)(rec.len - sizeof(rec)));
+    }
+    if (off < len)
+    {
+      fprintf(stderr, "mtrdec: %s: truncated or damaged at offset %lu\n",
+              name, (unsigned long)off);
+      err = -1;
+    }
+  }
+
+  if (mapped)
+    munmap(data, len);
+  else
+    free(data);
+  return(err);
+}
+
+/*
+ * read_file
+ *
+ * Maps a plain capture file into memory, or reads a compressed one
+ * into an allocated buffer.
+ *
+ * Returns the contents or zero on error.
+ */
+static u8 *read_file(name, len, mapped)
+  char   *name;                 /* File name */
+  size_t *len;                  /* Length of contents */
+  u8     *mapped;               /* Set if the contents are mapped */
+{
+  struct stat st;               /* File status */
+  gzFile gz;                    /* Compressed file */
+  u8  *data;                    /* Contents */
+  u8  *more;                    /* Grown buffer */
+  size_t size;                  /* Size of buffer */
+  int n;                        /* Octets read */
+  int fd;                       /* File descriptor */
+  size_t nlen;                  /* Length of file name */
+
+  nlen = strlen(name);
+  if ((nlen > 3) && (strcmp(name + nlen - 3, ".gz") == 0))
+  {
+    if ((gz = gzopen(name, "rb")) == 0)
+    {
+      fprintf(stderr, "mtrdec: cannot open %s\n", name);
+      return(0);
+    }
+    data = 0;
+    size = 0;
+    *len = 0;
+    do
+    {
+      if (*len == size)
+      {
+        size += MTRDEC_GZ_CHUNK;
+        if ((more = realloc(data, size)) == 0)
+        {
+          fprintf(stderr, "mtrdec: out of memory reading %s\n", name);
+          free(data);
+          gzclose(gz);
+          return(0);
+        }
+        data = more;
+      }
+      if ((n = gzread(gz, data + *len, (unsigned)(size - *len))) > 0)
+        *len += n;
+    } while (n > 0);
+    gzclose(gz);
+    *mapped = 0;
+    return(data);
+  }
+
+  if ((fd = open(name, O_RDONLY)) < 0)
+  {
+    fprintf(stderr, "mtrdec: cannot open %s\n", name);
+    return(0);
+  }
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+  {
+    fprintf(stderr, "mtrdec: %s is empty\n", name);
+    close(fd);
+    return(0);
+  }
+  *len = (size_t)st.st_size;
+  data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    fprintf(stderr, "mtrdec: cannot map %s\n", name);
+    return(0);
+  }
+  madvise(data, *len, MADV_SEQUENTIAL);
+  *mapped = 1;
+  return(data);
+}
+
+/*
+ * print_rec
+ *
+ * Prints one record.
+ *
+ * Always returns zero.
+ */
+static int print_rec(fhdr, rec, pptr, plen)
+  MTR_CAP_FILE *fhdr;           /* File header */
+  MTR_CAP_REC *rec;             /* Record header */
+  u8  *pptr;                    /* Parameter area */
+  u16 plen;                     /* Length of parameter area */
+{
+  unsigned long long ns;        /* Wall clock time of record */
+  time_t secs;                  /* Seconds part of ns */
+  struct tm tm;                 /* Broken down time */
+  u16 i;                        /* Octet index */
+
+  if (opt_time)
+  {
+    ns = fhdr->real_ns + (rec->ns - fhdr->mono_ns);
+    secs = (time_t)(ns / 1000000000);
+    localtime_r(&secs, &tm);
+    printf("%02d:%02d:%02d.%09llu ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+           ns % 1000000000);
+  }
+
+  printf("MTR %s: I%04x M t%04x i%04x f%02x d%02x s%02x",
+         (rec->kind == MTR_TRC_RX) ? "Rx" : "Tx", rec->instance,
+         rec->type, rec->id, rec->src, rec->dst, rec->status);
+
+  if (opt_names)
+  {
+    printf(" %s\n", msg_type_name(rec->type));
+    if (plen > 0)
+    {
+      printf("    primitive type 0x%02x\n", pptr[0]);
+      print_params(pptr + 1, (u16)(plen - 1));
+    }
+    return(0);
+  }
+
+  if (plen > 0)
+  {
+    printf(" p");
+    for (i = 0; i < plen; i++)
+      printf("%02x", pptr[i]);
+  }
+  printf("\n");
+  return(0);
+}
+
+/*
+ * print_params
+ *
+ * Prints the parameters following the primitive type, one per line.
+ *
+ * Returns zero or -1 if the parameter area is malformed.
+ */
+static int print_params(pptr, plen)
+  u8  *pptr;                    /* First parameter */
+  u16 plen;                     /* Length of parameters */
+{
+  u8  pname;                    /* Parameter name */
+  u8  len;                      /* Parameter length */
+  u16 i;                        /* Octet index */
+
+  while ((plen > 0) && (*pptr != 0))
+  {
+    if (plen < 2)
+      break;
+    pname = pptr[0];
+    len = pptr[1];
+    if (len > plen - 2)
+      break;
+
+    printf("    %-24s (0x%02x) %3d:", param_name(pname), pname, len);
+    for (i = 0; i < len; i++)
+      printf(" %02x", pptr[2 + i]);
+    printf("\n");
+
+    pptr += 2 + len;
+    plen -= 2 + len;
+  }
+
+  if ((plen > 0) && (*pptr != 0))
+  {
+    printf("    (malformed parameter area)\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * param_name
+ *
+ * Returns the name of a MAP parameter.
+ */
+static char *param_name(pname)
+  u8 pname;                     /* Parameter name */
+{
+  u16 i;                        /* Table index */
+
+  for (i = 0; i < sizeof(param_names) / sizeof(param_names[0]); i++)
+    if (param_names[i].pname == pname)
+      return(param_names[i].name);
+  return("MAPPN_?");
+}
+
+/*
+ * msg_type_name
+ *
+ * Returns the name of a MAP message type.
+ */
+static char *msg_type_name(type)
+  u16 type;                     /* Message type */
+{
+  switch (type)
+  {
+    case MAP_MSG_SRV_REQ :
+      return("MAP_MSG_SRV_REQ");
+    case MAP_MSG_SRV_IND :
+      return("MAP_MSG_SRV_IND");
+    case MAP_MSG_DLG_REQ :
+      return("MAP_MSG_DLG_REQ");
+    case MAP_MSG_DLG_IND :
+      return("MAP_MSG_DLG_IND");
+  }
+  return("");
+}
@@ -0,0 +1,1175 @@
+/*
+ Name:          mtrload.c
+
+ Description:   Open-loop MAP load generator.
+
+                Opens outgoing dialogues towards the MAP module at a
+                target rate, for a mix of SRI for SM, MT Forward SM,
+                USSD and ATI, and records the latency of each service
+                in the MTR histograms. It is built from the MTR code:
+                the dialogue table, the primitive parser, the templates
+                and the GSM codec.
+
+                Dialogues are started on a fixed schedule, or a Poisson
+                one with -q, whatever happened to earlier dialogues.
+                Latencies are measured from when a dialogue was due to
+                start, not when it was sent, so a stall of the system
+                under test shows up in the latencies of every dialogue
+                it held back rather than being hidden (coordinated
+                omission). Dialogues that cannot be started because no
+                dialogue id is free wait for one and count as late.
+
+                MSISDNs are made from patterns given with -p, used in
+                turn: a digit stands for itself, x for a random digit
+                and # for the next digit of a counter, so 447700####
+                walks through ten thousand numbers in order.
+
+                Syntax: mtrload [-m -u -r -t -n -q -i -g -s -p -c -I -a -b -e -z]
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr.h"
+#include "mtr_wrk.h"
+#include "mtr_prs.h"
+#include "mtr_tpl.h"
+#include "mtr_gsm.h"
+#include "mtr_tmr.h"
+#include "mtr_lat.h"
+#include "mtr_sub.h"
+#include "mtr_dlg.h"
+
+/*
+ * Default module ids of mtrload and of the MAP module
+ */
+#define MTRLOAD_DEF_MOD_ID      (0x3d)
+#define MTRLOAD_DEF_MAP_ID      (0x15)
+
+/*
+ * Default outgoing dialogue id range, which also limits the dialogues
+ * in flight, and default time a dialogue may take in seconds
+ */
+#define MTRLOAD_DEF_FIRST_ID    (0x0000)
+#define MTRLOAD_DEF_LAST_ID     (0x0fff)
+#define MTRLOAD_DEF_TIMEOUT_S   (10)
+
+/*
+ * Most MSISDN patterns, and most digits of a number
+ */
+#define MTRLOAD_MAX_PATTERNS    (16)
+#define MTRLOAD_MAX_DIGITS      (20)
+#define MTRLOAD_IMSI_DIGITS     (15)
+
+/*
+ * Longest sleep while waiting for the next dialogue, in microseconds
+ */
+#define MTRLOAD_MAX_SLEEP_US    (100)
+
+/*
+ * A dialogue sent more than this after it was due counts as late
+ */
+#define MTRLOAD_LATE_NS         (1000000ULL)
+
+/*
+ * SM-RP-DA and SM-RP-OA are sent as their ASN.1 choice: IMSI and
+ * service centre address.
+ */
+#define MTRLOAD_RP_DA_IMSI      (0x80)
+#define MTRLOAD_RP_OA_SCA       (0x84)
+
+/*
+ * A service that can be generated
+ */
+typedef struct
+{
+  char *name;                   /* Name, as a latency class */
+  u8  cls;                      /* MTR_LAT_xxx class */
+  u8  req;                      /* Service request primitive */
+  u8  cnf;                      /* Service confirmation primitive */
+  u8  ac;                       /* Application context (last but one arc) */
+  u8  ac_version;               /* Application context version */
+  u8  ssn;                      /* Default destination subsystem */
+  u32 weight;                   /* Share of the dialogues */
+  unsigned long long opened;    /* Dialogues started */
+  unsigned long long answered;  /* Confirmations received */
+  unsigned long long errors;    /* Confirmations with a user error */
+  unsigned long long failed;    /* Dialogues refused, aborted or timed out */
+} LOAD_SRV;
+
+/*
+ * An MSISDN pattern, one entry per digit
+ */
+typedef struct
+{
+  u8  len;                      /* Digits */
+  char digit[MTRLOAD_MAX_DIGITS]; /* '0' to '9', 'x' or '#' */
+  unsigned long long counter;   /* Next value of the # digits */
+} LOAD_PAT;
+
+static int read_services(char *str);
+static int read_pattern(char *str);
+static int read_digits(char *str, u8 max, u8 *digits);
+static int read_address(char *str, u8 *addr, u8 *len);
+static int read_number(char *str, unsigned long max, unsigned long *value);
+static int start_dialogue(unsigned long long due_ns);
+static int handle_msg(MSG *m);
+static int handle_dlg_ind(MTR_DLG *dlg, u16 dlg_id, MTR_PRS *prs);
+static int handle_srv_ind(MTR_DLG *dlg, MTR_PRS *prs);
+static int end_dialogue(MTR_DLG *dlg, u16 dlg_id, u8 failed);
+static int timeout(u32 ref);
+static int put_params(u8 *pptr, LOAD_SRV *srv, u8 *msisdn, u8 num_digits);
+static u8  put_addr(u8 *dst, u8 *digits, u8 num_digits);
+static u8  put_tbcd(u8 *dst, u8 *digits, u8 num_digits);
+static u8  next_msisdn(u8 *digits);
+static LOAD_SRV *find_service(u8 req);
+static double next_random(void);
+static int send_msg(MSG *m);
+static int report(u32 seconds);
+static void stop_handler(int sig);
+static void show_syntax(char *program);
+
+/*
+ * Static data:
+ */
+static LOAD_SRV srv_table[] =
+{
+  { "sri-sm",    MTR_LAT_SRI_SM,    MAPST_SND_RTISM_REQ,        MAPST_SND_RTISM_CNF,        20, 3, 6, 0, 0, 0, 0, 0 },
+  { "mt-fwd-sm", MTR_LAT_MT_FWD_SM, MAPST_MT_FWD_SM_REQ,        MAPST_MT_FWD_SM_CNF,        25, 3, 8, 0, 0, 0, 0, 0 },
+  { "ussd",      MTR_LAT_USSD,      MAPST_PRO_UNSTR_SS_REQ_REQ, MAPST_PRO_UNSTR_SS_REQ_CNF, 19, 2, 6, 0, 0, 0, 0, 0 },
+  { "ati",       MTR_LAT_ATI,       MAPST_ANYTIME_INT_REQ,      MAPST_ANYTIME_INT_CNF,      29, 3, 6, 0, 0, 0, 0, 0 },
+};
+#define MTRLOAD_NUM_SRV         (sizeof(srv_table) / sizeof(LOAD_SRV))
+
+static LOAD_PAT patterns[MTRLOAD_MAX_PATTERNS]; /* MSISDN patterns */
+static u32 num_patterns;                /* Patterns given */
+static u32 next_pattern;                /* Pattern used next */
+static u32 total_weight;                /* Sum of the service weights */
+static u8  mod_id;                      /* Module id of mtrload */
+static u8  map_id;                      /* Module id of MAP */
+static u16 first_id;                    /* First dialogue id used */
+static u32 num_dlgs;                    /* Dialogue ids used */
+static u16 *free_ref;                   /* Dialogues not in use */
+static u32 num_free;                    /* Entries of free_ref used */
+static MTR_TMR_WHEEL wheel;             /* Dialogue timeouts */
+static u32 timeout_ticks;               /* Timeout in timer ticks */
+static u8  orig_addr[MAX_PARAM_LEN];    /* Calling party address, 0 length for default */
+static u8  orig_len;
+static u8  dest_addr[MAX_PARAM_LEN];    /* Called party address, 0 length for default */
+static u8  dest_len;
+static u8  sc_digits[MTRLOAD_MAX_DIGITS]; /* Service centre address */
+static u8  sc_len;
+static u8  imsi_prefix[MTRLOAD_IMSI_DIGITS]; /* IMSI prefix for MT Forward SM */
+static u8  imsi_len;
+static unsigned long long seed;         /* State of the random number generator */
+static volatile int stop_req;           /* Set by SIGINT or SIGTERM */
+static unsigned long long started;      /* Dialogues started */
+static unsigned long long late;         /* Dialogues started late */
+static unsigned long long completed;    /* Dialogues ended */
+static unsigned long long timed_out;    /* Dialogues timed out */
+static unsigned long long send_fail;    /* Messages that could not be sent */
+static unsigned long long getm_fail;    /* Messages that could not be allocated */
+static unsigned long long unexpected;   /* Primitives for dialogues not in use */
+
+/*
+ * main
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  MSG *m;                       /* Message received */
+  unsigned long value;          /* Numeric value of an option */
+  unsigned long last;           /* Upper end of a range */
+  unsigned long long now;       /* Time now */
+  unsigned long long due;       /* When the next dialogue is due */
+  unsigned long long start_ns;  /* When the run started */
+  unsigned long long end_ns;    /* When no more dialogues are started, 0 for never */
+  unsigned long long report_ns; /* When the next progress report is due */
+  unsigned long long lat_ns;    /* When the next latency report is due, 0 for none */
+  unsigned long long count;     /* Dialogues to start, 0 for no limit */
+  struct timespec nap;          /* Time to sleep */
+  double rate;                  /* Dialogues per second */
+  double interval;              /* Mean time between dialogues in ns */
+  u32 seconds;                  /* Run time in seconds, 0 for no limit */
+  u32 lat_s;                    /* Seconds between latency reports, 0 for none */
+  u32 elapsed;                  /* Seconds run */
+  u32 i;                        /* Index */
+  u8  poisson;                  /* Set for Poisson arrivals */
+  char *sep;                    /* Range separator */
+  int busy;                     /* Set if anything was done */
+
+  mod_id = MTRLOAD_DEF_MOD_ID;
+  map_id = MTRLOAD_DEF_MAP_ID;
+  first_id = MTRLOAD_DEF_FIRST_ID;
+  num_dlgs = MTRLOAD_DEF_LAST_ID - MTRLOAD_DEF_FIRST_ID + 1;
+  timeout_ticks = MTRLOAD_DEF_TIMEOUT_S * 1000 / MTR_TMR_TICK_MS;
+  rate = 100;
+  seconds = 0;
+  count = 0;
+  lat_s = 0;
+  poisson = 0;
+  seed = 1;
+  read_digits("1234567890", MTRLOAD_MAX_DIGITS, sc_digits);
+  sc_len = 10;
+  read_digits("00101", MTRLOAD_IMSI_DIGITS, imsi_prefix);
+  imsi_len = 5;
+
+  for (i = 1; i < (u32)argc; i++)
+  {
+    if ((argv[i][0] != '-') || (argv[i][1] == '\0'))
+    {
+      show_syntax(argv[0]);
+      return(1);
+    }
+    value = 0;
+    switch (argv[i][1])
+    {
+      case 'm':
+      case 'u':
+        if (read_number(&argv[i][2], 0xff, &value) != 0)
+          break;
+        if (argv[i][1] == 'm')
+          mod_id = (u8)value;
+        else
+          map_id = (u8)value;
+        continue;
+
+      case 'r':
+        rate = strtod(&argv[i][2], &sep);
+        if ((*sep != '\0') || (rate <= 0) || (rate > 1e7))
+          break;
+        continue;
+
+      case 't':
+      case 'n':
+      case 'e':
+      case 'g':
+        if ((read_number(&argv[i][2], 0xffffffff, &value) != 0) ||
+            ((argv[i][1] == 'g') && ((value == 0) || (value > 3600))))
+          break;
+        if (argv[i][1] == 't')
+          seconds = (u32)value;
+        else if (argv[i][1] == 'n')
+          count = value;
+        else if (argv[i][1] == 'e')
+          lat_s = (u32)value;
+        else
+          timeout_ticks = (u32)(value * 1000 / MTR_TMR_TICK_MS);
+        continue;
+
+      case 'q':
+        poisson = 1;
+        continue;
+
+      case 'i':
+        if ((sep = strchr(&argv[i][2], '-')) == 0)
+          break;
+        *sep = '\0';
+        if ((read_number(&argv[i][2], 0xffff, &value) != 0) ||
+            (read_number(sep + 1, 0xffff, &last) != 0) || (last < value) ||
+            (last - value + 1 > MTR_DLG_MAX_DLGS))
+          break;
+        first_id = (u16)value;
+        num_dlgs = (u32)(last - value + 1);
+        continue;
+
+      case 's':
+        if (read_services(&argv[i][2]) != 0)
+          break;
+        continue;
+
+      case 'p':
+        if (read_pattern(&argv[i][2]) != 0)
+          break;
+        continue;
+
+      case 'c':
+        if (read_digits(&argv[i][2], MTRLOAD_MAX_DIGITS, sc_digits) <= 0)
+          break;
+        sc_len = (u8)strlen(&argv[i][2]);
+        continue;
+
+      case 'I':
+        if (read_digits(&argv[i][2], MTRLOAD_IMSI_DIGITS, imsi_prefix) <= 0)
+          break;
+        imsi_len = (u8)strlen(&argv[i][2]);
+        continue;
+
+      case 'a':
+        if (read_address(&argv[i][2], orig_addr, &orig_len) != 0)
+          break;
+        continue;
+
+      case 'b':
+        if (read_address(&argv[i][2], dest_addr, &dest_len) != 0)
+          break;
+        continue;
+
+      case 'z':
+        if (read_number(&argv[i][2], 0xffffffff, &value) != 0)
+          break;
+        seed = value;
+        continue;
+    }
+    show_syntax(argv[0]);
+    return(1);
+  }
+
+  if (total_weight == 0)
+    read_services("sri-sm");
+  if (num_patterns == 0)
+    read_pattern("44770090####");
+  seed = (seed + 1) * 0x9e3779b97f4a7c15ULL;
+
+  /*
+   * Each outgoing dialogue id is an entry of the MTR dialogue table,
+   * for MAP instance zero.
+   */
+  if ((MTR_dlg_init(num_dlgs, 1, 0, DLG_TERM_MODE_AUTO) != 0) ||
+      ((free_ref = malloc(num_dlgs * sizeof(u16))) == 0) ||
+      ((wheel.node = calloc(num_dlgs, sizeof(MTR_TMR_NODE))) == 0))
+  {
+    fprintf(stderr, "%s: cannot allocate %u dialogues\n", argv[0], num_dlgs);
+    return(1);
+  }
+  for (i = 0; i < num_dlgs; i++)
+    free_ref[i] = (u16)(num_dlgs - 1 - i);
+  num_free = num_dlgs;
+  MTR_tmr_init(&wheel, wheel.node);
+
+  MTR_gsm_init();
+  if ((MTR_tpl_init(mod_id, map_id) != 0) || (MTR_tpl_verify() != 0))
+  {
+    fprintf(stderr, "%s: cannot build primitive templates\n", argv[0]);
+    return(1);
+  }
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+
+  printf("MTRLOAD: module 0x%02x to MAP 0x%02x; %.1f dialogues/s %s; dialogue ids 0x%04x-0x%04x\n",
+         mod_id, map_id, rate, poisson ? "Poisson" : "fixed interval",
+         first_id, first_id + num_dlgs - 1);
+  for (i = 0; i < MTRLOAD_NUM_SRV; i++)
+    if (srv_table[i].weight != 0)
+      printf("MTRLOAD: %-9s weight %u\n", srv_table[i].name, srv_table[i].weight);
+  fflush(stdout);
+
+  interval = 1e9 / rate;
+  start_ns = MTR_lat_now();
+  due = start_ns;
+  end_ns = seconds ? start_ns + seconds * 1000000000ULL : 0;
+  report_ns = start_ns + 1000000000ULL;
+  lat_ns = lat_s ? start_ns + lat_s * 1000000000ULL : 0;
+  wheel.now = (u32)(start_ns / (MTR_TMR_TICK_MS * 1000000ULL));
+
+  /*
+   * Run until told to stop and every dialogue has ended.
+   */
+  while ((!stop_req) || (num_free != num_dlgs))
+  {
+    busy = 0;
+    now = MTR_lat_now();
+
+    /*
+     * Start every dialogue that is due. The schedule never waits for
+     * the system under test.
+     */
+    if ((end_ns != 0) && (now >= end_ns))
+      stop_req = 1;
+    while ((!stop_req) && (due <= now) && (num_free != 0))
+    {
+      if (now - due > MTRLOAD_LATE_NS)
+        late++;
+      start_dialogue(due);
+      due += (unsigned long long)(poisson ? -log(1.0 - next_random()) * interval : interval);
+      if ((count != 0) && (started >= count))
+        stop_req = 1;
+      busy = 1;
+    }
+
+    while ((m = (MSG *)GCT_grab(mod_id)) != 0)
+    {
+      handle_msg(m);
+      relm((HDR *)m);
+      busy = 1;
+    }
+
+    MTR_tmr_advance_to(&wheel, (u32)(now / (MTR_TMR_TICK_MS * 1000000ULL)), timeout);
+
+    if (now >= report_ns)
+    {
+      elapsed = (u32)((now - start_ns) / 1000000000ULL);
+      report(elapsed);
+      report_ns += 1000000000ULL;
+    }
+    if ((lat_ns != 0) && (now >= lat_ns))
+    {
+      MTR_lat_report(1);
+      lat_ns += lat_s * 1000000000ULL;
+    }
+
+    if (!busy)
+    {
+      nap.tv_sec = 0;
+      nap.tv_nsec = MTRLOAD_MAX_SLEEP_US * 1000L;
+      if ((!stop_req) && (num_free != 0) && (due > now) && (due - now < (unsigned long long)nap.tv_nsec))
+        nap.tv_nsec = (long)(due - now);
+      nanosleep(&nap, NULL);
+    }
+  }
+
+  report((u32)((MTR_lat_now() - start_ns) / 1000000000ULL));
+  for (i = 0; i < MTRLOAD_NUM_SRV; i++)
+    if (srv_table[i].opened != 0)
+      printf("MTRLOAD %-9s: opened %llu; answered %llu; user errors %llu; failed %llu\n",
+             srv_table[i].name, srv_table[i].opened, srv_table[i].answered,
+             srv_table[i].errors, srv_table[i].failed);
+  printf("MTRLOAD Late starts %llu; timeouts %llu; send failures %llu; getm failures %llu; unexpected %llu\n",
+         late, timed_out, send_fail, getm_fail, unexpected);
+  MTR_lat_report(0);
+  return(0);
+}
+
+/*
+ * read_services
+ *
+ * Reads a service mix, names with optional weights separated by
+ * commas, e.g. sri-sm:70,mt-fwd-sm:30.
+ *
+ * Returns zero or -1 on error.
+ */
+static int read_services(str)
+  char *str;                    /* Service mix */
+{
+  char *name;                   /* Service name */
+  char *weight;                 /* Its weight */
+  unsigned long value;          /* Weight */
+  u32 i;                        /* Service index */
+
+  for (i = 0; i < MTRLOAD_NUM_SRV; i++)
+    srv_table[i].weight = 0;
+  total_weight = 0;
+
+  for (name = strtok(str, ","); name != 0; name = strtok(NULL, ","))
+  {
+    value = 1;
+    if (((weight = strchr(name, ':')) != 0) &&
+        ((*weight++ = '\0', read_number(weight, 1000000, &value) != 0) || (value == 0)))
+      return(-1);
+    for (i = 0; i < MTRLOAD_NUM_SRV; i++)
+      if (strcmp(name, srv_table[i].name) == 0)
+        break;
+    if (i == MTRLOAD_NUM_SRV)
+      return(-1);
+    srv_table[i].weight += (u32)value;
+    total_weight += (u32)value;
+  }
+  return(total_weight ? 0 : -1);
+}
+
+/*
+ * read_pattern
+ *
+ * Adds an MSISDN pattern.
+ *
+ * Returns zero or -1 on error.
+ */
+static int read_pattern(str)
+  char *str;                    /* Pattern */
+{
+  LOAD_PAT *pat;                /* Pattern added */
+  u8 i;                         /* Digit index */
+
+  if ((num_patterns == MTRLOAD_MAX_PATTERNS) || (*str == '\0') ||
+      (strlen(str) > MTRLOAD_MAX_DIGITS))
+    return(-1);
+
+  pat = &patterns[num_patterns];
+  for (i = 0; str[i] != '\0'; i++)
+  {
+    if (((str[i] < '0') || (str[i] > '9')) && (str[i] != 'x') && (str[i] != '#'))
+      return(-1);
+    pat->digit[i] = str[i];
+  }
+  pat->len = i;
+  pat->counter = 0;
+  num_patterns++;
+  return(0);
+}
+
+/*
+ * read_digits
+ *
+ * Reads a string of decimal digits, one per octet.
+ *
+ * Returns the number of digits, -1 if not digits or too many.
+ */
+static int read_digits(str, max, digits)
+  char *str;                    /* Digits */
+  u8 max;                       /* Most digits */
+  u8 *digits;                   /* Returns the digits */
+{
+  u8 i;                         /* Digit index */
+
+  for (i = 0; str[i] != '\0'; i++)
+  {
+    if ((i == max) || (str[i] < '0') || (str[i] > '9'))
+      return(-1);
+    digits[i] = (u8)(str[i] - '0');
+  }
+  return(i);
+}
+
+/*
+ * read_address
+ *
+ * Reads an SCCP address given as hexadecimal octets, as sent in the
+ * open request.
+ *
+ * Returns zero or -1 on error.
+ */
+static int read_address(str, addr, len)
+  char *str;                    /* Hexadecimal octets */
+  u8 *addr;                     /* Returns the address */
+  u8 *len;                      /* Returns its length */
+{
+  unsigned int octet;           /* One octet */
+  u8 n;                         /* Octets read */
+
+  if ((str[0] == '0') && ((str[1] == 'x') || (str[1] == 'X')))
+    str += 2;
+  for (n = 0; (str[0] != '\0') && (str[1] != '\0'); n++, str += 2)
+  {
+    if ((n == 32) || (sscanf(str, "%2x", &octet) != 1))
+      return(-1);
+    addr[n] = (u8)octet;
+  }
+  if ((*str != '\0') || (n < 2))
+    return(-1);
+  *len = n;
+  return(0);
+}
+
+/*
+ * read_number
+ *
+ * Reads a decimal or 0x prefixed hexadecimal number.
+ *
+ * Returns zero or -1 if not a number or above max.
+ */
+static int read_number(str, max, value)
+  char *str;                    /* String to read */
+  unsigned long max;            /* Largest value allowed */
+  unsigned long *value;         /* Returns the value */
+{
+  char *end;                    /* First character not read */
+
+  if (*str == '\0')
+    return(-1);
+  *value = strtoul(str, &end, 0);
+  if ((*end != '\0') || (*value > max))
+    return(-1);
+  return(0);
+}
+
+/*
+ * start_dialogue
+ *
+ * Opens a dialogue for the next service of the mix and sends its
+ * service request.
+ *
+ * Returns zero or -1 if the dialogue could not be started.
+ */
+static int start_dialogue(due_ns)
+  unsigned long long due_ns;    /* When the dialogue was due */
+{
+  MSG *open;                    /* Open request */
+  MSG *srv_req;                 /* Service request */
+  MSG *delim;                   /* Delimiter request */
+  MTR_DLG *dlg;                 /* Dialogue */
+  LOAD_SRV *srv;                /* Service used */
+  u8  msisdn[MTRLOAD_MAX_DIGITS]; /* MSISDN digits */
+  u8  num_digits;               /* Digits in msisdn */
+  u8  params[MAX_PARAM_LEN];    /* Service request parameters */
+  u8  *pptr;                    /* Parameter area */
+  u16 len;                      /* Length of the parameters */
+  u16 ref;                      /* Index of the dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+  u32 pick;                     /* Weight picked */
+  u32 i;                        /* Service index */
+
+  ref = free_ref[num_free - 1];
+  dlg_id = (u16)(first_id + ref);
+  if ((dlg = MTR_dlg_get(0, ref)) == 0)
+    return(-1);
+
+  pick = (u32)(next_random() * total_weight);
+  for (i = 0; pick >= srv_table[i].weight; i++)
+    pick -= srv_table[i].weight;
+  srv = &srv_table[i];
+
+  num_digits = next_msisdn(msisdn);
+  len = (u16)put_params(params, srv, msisdn, num_digits);
+
+  /*
+   * Allocate the three messages before sending any, so that a
+   * dialogue is either started whole or not at all.
+   */
+  open = getm((u16)MAP_MSG_DLG_REQ, dlg_id, NO_RESPONSE,
+              (u16)(1 + 2 + 9 + 2 + (dest_len ? dest_len : 2) + 2 + (orig_len ? orig_len : 2) + 1));
+  srv_req = getm((u16)MAP_MSG_SRV_REQ, dlg_id, NO_RESPONSE, (u16)(1 + len + 1));
+  delim = MTR_tpl_getm(MTR_TPL_DELIMITER_REQ, dlg_id, 0);
+  if ((open == 0) || (srv_req == 0) || (delim == 0))
+  {
+    if (open != 0)
+      relm((HDR *)open);
+    if (srv_req != 0)
+      relm((HDR *)srv_req);
+    if (delim != 0)
+      relm((HDR *)delim);
+    getm_fail++;
+    return(-1);
+  }
+
+  /*
+   * Open request: application context, then the called and calling
+   * party addresses, routed on the subsystem unless given.
+   */
+  open->hdr.src = mod_id;
+  open->hdr.dst = map_id;
+  pptr = get_param(open);
+  len = 0;
+  pptr[len++] = MAPDT_OPEN_REQ;
+  pptr[len++] = MAPPN_applic_context;
+  pptr[len++] = 9;
+  pptr[len++] = 0x06;
+  pptr[len++] = 0x07;
+  pptr[len++] = 0x04;
+  pptr[len++] = 0x00;
+  pptr[len++] = 0x00;
+  pptr[len++] = 0x01;
+  pptr[len++] = 0x00;
+  pptr[len++] = srv->ac;
+  pptr[len++] = srv->ac_version;
+  pptr[len++] = MAPPN_dest_address;
+  if (dest_len != 0)
+  {
+    pptr[len++] = dest_len;
+    memcpy(&pptr[len], dest_addr, dest_len);
+    len += dest_len;
+  }
+  else
+  {
+    pptr[len++] = 2;
+    pptr[len++] = 0x42;
+    pptr[len++] = srv->ssn;
+  }
+  pptr[len++] = MAPPN_orig_address;
+  if (orig_len != 0)
+  {
+    pptr[len++] = orig_len;
+    memcpy(&pptr[len], orig_addr, orig_len);
+    len += orig_len;
+  }
+  else
+  {
+    pptr[len++] = 2;
+    pptr[len++] = 0x42;
+    pptr[len++] = 8;
+  }
+  pptr[len] = 0x00;
+
+  srv_req->hdr.src = mod_id;
+  srv_req->hdr.dst = map_id;
+  pptr = get_param(srv_req);
+  pptr[0] = srv->req;
+  memcpy(&pptr[1], params, srv_req->len - 2);
+  pptr[srv_req->len - 1] = 0x00;
+
+  num_free--;
+  dlg->state = MTR_S_WAIT_FOR_SRV_PRIM;
+  dlg->ptype = srv->req;
+  dlg->invoke_id = 1;
+  dlg->open_us = MTR_DLG_STAMP(due_ns);
+  MTR_tmr_start(&wheel, ref, timeout_ticks);
+  started++;
+  srv->opened++;
+
+  send_msg(open);
+  send_msg(srv_req);
+  send_msg(delim);
+  return(0);
+}
+
+/*
+ * put_params
+ *
+ * Encodes the parameters of a service request, from the invoke id on.
+ *
+ * Returns the length of the parameters.
+ */
+static int put_params(pptr, srv, msisdn, num_digits)
+  u8 *pptr;                     /* Parameter area */
+  LOAD_SRV *srv;                /* Service */
+  u8 *msisdn;                   /* MSISDN digits */
+  u8 num_digits;                /* Digits in msisdn */
+{
+  u8  imsi[MTRLOAD_IMSI_DIGITS]; /* IMSI digits */
+  u8  tpdu[MTR_GSM_MAX_UD + 32]; /* SMS-DELIVER */
+  char text[32];                /* Text of the short message */
+  int ud_len;                   /* Packed user data length */
+  u16 len;                      /* Length so far */
+  u16 t;                        /* TPDU length */
+  u8  n;                        /* Digits taken from the MSISDN */
+
+  len = 0;
+  pptr[len++] = MAPPN_invoke_id;
+  pptr[len++] = 0x01;
+  pptr[len++] = 0x01;
+
+  switch (srv->req)
+  {
+    case MAPST_SND_RTISM_REQ :
+      pptr[len++] = MAPPN_msisdn;
+      len += put_addr(&pptr[len], msisdn, num_digits);
+      pptr[len++] = MAPPN_sm_rp_pri;
+      pptr[len++] = 0x01;
+      pptr[len++] = 0x01;
+      pptr[len++] = MAPPN_sc_addr;
+      len += put_addr(&pptr[len], sc_digits, sc_len);
+      break;
+
+    case MAPST_MT_FWD_SM_REQ :
+      /*
+       * The IMSI is the IMSI prefix followed by the last digits of
+       * the MSISDN.
+       */
+      memcpy(imsi, imsi_prefix, imsi_len);
+      n = (u8)(MTRLOAD_IMSI_DIGITS - imsi_len);
+      if (n > num_digits)
+        n = num_digits;
+      memcpy(&imsi[imsi_len], &msisdn[num_digits - n], n);
+      pptr[len++] = MAPPN_sm_rp_da;
+      pptr[len++] = (u8)(2 + (imsi_len + n + 1) / 2);
+      pptr[len++] = MTRLOAD_RP_DA_IMSI;
+      pptr[len++] = (u8)((imsi_len + n + 1) / 2);
+      len += put_tbcd(&pptr[len], imsi, (u8)(imsi_len + n));
+
+      pptr[len++] = MAPPN_sm_rp_oa;
+      pptr[len++] = (u8)(2 + 1 + (sc_len + 1) / 2);
+      pptr[len++] = MTRLOAD_RP_OA_SCA;
+      len += put_addr(&pptr[len], sc_digits, sc_len);
+
+      /*
+       * SMS-DELIVER from the service centre, GSM default alphabet
+       */
+      t = 0;
+      tpdu[t++] = 0x04;
+      tpdu[t++] = sc_len;
+      tpdu[t++] = 0x91;
+      t += put_tbcd(&tpdu[t], sc_digits, sc_len);
+      tpdu[t++] = 0x00;
+      tpdu[t++] = 0x00;
+      memset(&tpdu[t], 0, 7);
+      t += 7;
+      sprintf(text, "mtrload %llu", started);
+      tpdu[t++] = (u8)strlen(text);
+      if ((ud_len = MTR_gsm_encode7(text, &tpdu[t], MTR_GSM_MAX_UD)) < 0)
+        ud_len = 0;
+      t += (u16)ud_len;
+      pptr[len++] = MAPPN_sm_rp_ui;
+      pptr[len++] = (u8)t;
+      memcpy(&pptr[len], tpdu, t);
+      len += t;
+      break;
+
+    case MAPST_PRO_UNSTR_SS_REQ_REQ :
+      pptr[len++] = MAPPN_USSD_coding;
+      pptr[len++] = 0x01;
+      pptr[len++] = 0x0f;
+      pptr[len++] = MAPPN_USSD_string;
+      if ((ud_len = MTR_gsm_encode7("*100#", &pptr[len + 1], MTR_GSM_MAX_UD)) < 0)
+        ud_len = 0;
+      pptr[len++] = (u8)ud_len;
+      len += (u16)ud_len;
+      pptr[len++] = MAPPN_msisdn;
+      len += put_addr(&pptr[len], msisdn, num_digits);
+      break;
+
+    case MAPST_ANYTIME_INT_REQ :
+      pptr[len++] = MAPPN_msisdn;
+      len += put_addr(&pptr[len], msisdn, num_digits);
+      break;
+  }
+  return(len);
+}
+
+/*
+ * put_addr
+ *
+ * Encodes a length and an address string, international ISDN.
+ *
+ * Returns the number of octets written.
+ */
+static u8 put_addr(dst, digits, num_digits)
+  u8 *dst;                      /* Destination */
+  u8 *digits;                   /* Digits, one per octet */
+  u8 num_digits;                /* Number of digits */
+{
+  dst[1] = 0x91;
+  dst[0] = (u8)(1 + put_tbcd(&dst[2], digits, num_digits));
+  return((u8)(1 + dst[0]));
+}
+
+/*
+ * put_tbcd
+ *
+ * Packs digits two to an octet, low nibble first, padding an odd
+ * number of digits with a filler.
+ *
+ * Returns the number of octets written.
+ */
+static u8 put_tbcd(dst, digits, num_digits)
+  u8 *dst;                      /* Destination */
+  u8 *digits;                   /* Digits, one per octet */
+  u8 num_digits;                /* Number of digits */
+{
+  u8 i;                         /* Digit index */
+
+  for (i = 0; i < num_digits; i += 2)
+    dst[i / 2] = (u8)(digits[i] | (((i + 1 < num_digits) ? digits[i + 1] : 0x0f) << 4));
+  return((u8)((num_digits + 1) / 2));
+}
+
+/*
+ * next_msisdn
+ *
+ * Makes the next MSISDN from the patterns, used in turn.
+ *
+ * Returns the number of digits.
+ */
+static u8 next_msisdn(digits)
+  u8 *digits;                   /* Returns the digits */
+{
+  LOAD_PAT *pat;                /* Pattern used */
+  unsigned long long counter;   /* Counter, least significant digit first */
+  int i;                        /* Digit index */
+
+  pat = &patterns[next_pattern];
+  next_pattern = (next_pattern + 1) % num_patterns;
+
+  counter = pat->counter++;
+  for (i = pat->len - 1; i >= 0; i--)
+  {
+    if (pat->digit[i] == '#')
+    {
+      digits[i] = (u8)(counter % 10);
+      counter /= 10;
+    }
+    else if (pat->digit[i] == 'x')
+      digits[i] = (u8)(next_random() * 10);
+    else
+      digits[i] = (u8)(pat->digit[i] - '0');
+  }
+  return(pat->len);
+}
+
+/*
+ * handle_msg
+ *
+ * Handles a message received from MAP.
+ *
+ * Always returns zero.
+ */
+static int handle_msg(m)
+  MSG *m;                       /* Message received */
+{
+  MTR_PRS prs;                  /* Parsed primitive */
+  MTR_DLG *dlg;                 /* Dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+
+  dlg_id = m->hdr.id;
+  if ((m->hdr.type != MAP_MSG_DLG_IND) && (m->hdr.type != MAP_MSG_SRV_IND))
+    return(0);
+  if (((u16)(dlg_id - first_id) >= num_dlgs) ||
+      ((dlg = MTR_dlg_peek(0, (u16)(dlg_id - first_id))) == 0) ||
+      (dlg->state == MTR_S_NULL))
+  {
+    unexpected++;
+    return(0);
+  }
+
+  MTR_prs_parse(m, &prs);
+  if (m->hdr.type == MAP_MSG_DLG_IND)
+    handle_dlg_ind(dlg, dlg_id, &prs);
+  else
+    handle_srv_ind(dlg, &prs);
+  return(0);
+}
+
+/*
+ * handle_dlg_ind
+ *
+ * Handles a dialogue primitive for a dialogue in flight.
+ *
+ * Always returns zero.
+ */
+static int handle_dlg_ind(dlg, dlg_id, prs)
+  MTR_DLG *dlg;                 /* Dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+  MTR_PRS *prs;                 /* Parsed primitive */
+{
+  MSG *m;                       /* Message to send */
+  u8  *pval;                    /* Parameter value */
+  u8  plen;                     /* Parameter length */
+
+  switch (prs->ptype)
+  {
+    case MAPDT_OPEN_CNF :
+      if (((pval = MTR_prs_find(prs, MAPPN_result, &plen)) != 0) &&
+          (plen == 1) && (pval[0] != MAPRS_DLG_ACC))
+        end_dialogue(dlg, dlg_id, 1);
+      break;
+
+    case MAPDT_DELIMITER_IND :
+      /*
+       * The USSD menu sent by MTR is answered with a choice, which it
+       * answers in turn with its final response.
+       */
+      if (dlg->state == MTR_S_WAIT_DELIMITER)
+      {
+        if ((m = MTR_tpl_getm(MTR_TPL_UNSTR_SS_REQ_RSP, dlg_id, dlg->invoke_id)) != 0)
+          send_msg(m);
+        else
+          getm_fail++;
+        if ((m = MTR_tpl_getm(MTR_TPL_DELIMITER_REQ, dlg_id, 0)) != 0)
+          send_msg(m);
+        else
+          getm_fail++;
+        dlg->state = MTR_S_WAIT_FOR_SRV_PRIM;
+      }
+      break;
+
+    case MAPDT_CLOSE_IND :
+      end_dialogue(dlg, dlg_id, 0);
+      break;
+
+    case MAPDT_NOTICE_IND :
+      if ((m = MTR_tpl_getm(MTR_TPL_U_ABORT_REQ, dlg_id, 0)) != 0)
+        send_msg(m);
+      end_dialogue(dlg, dlg_id, 1);
+      break;
+
+    case MAPDT_U_ABORT_IND :
+    case MAPDT_P_ABORT_IND :
+      end_dialogue(dlg, dlg_id, 1);
+      break;
+  }
+  return(0);
+}
+
+/*
+ * handle_srv_ind
+ *
+ * Handles a service primitive for a dialogue in flight.
+ *
+ * Always returns zero.
+ */
+static int handle_srv_ind(dlg, prs)
+  MTR_DLG *dlg;                 /* Dialogue */
+  MTR_PRS *prs;                 /* Parsed primitive */
+{
+  LOAD_SRV *srv;                /* Service of the dialogue */
+  u8  *pval;                    /* Parameter value */
+  u8  plen;                     /* Parameter length */
+
+  srv = find_service(dlg->ptype);
+  if (prs->ptype == MAPST_UNSTR_SS_REQ_IND)
+  {
+    if ((pval = MTR_prs_find(prs, MAPPN_invoke_id, &plen)) != 0)
+      dlg->invoke_id = pval[0];
+    dlg->state = MTR_S_WAIT_DELIMITER;
+  }
+  else if (prs->ptype == srv->cnf)
+  {
+    MTR_lat_record(MTR_LAT_RSP, srv->cls, MTR_DLG_AGE(dlg, MTR_lat_now()));
+    srv->answered++;
+    if (MTR_prs_find(prs, MAPPN_user_err, &plen) != 0)
+      srv->errors++;
+  }
+  return(0);
+}
+
+/*
+ * end_dialogue
+ *
+ * Records the end of a dialogue and frees its id.
+ *
+ * Always returns zero.
+ */
+static int end_dialogue(dlg, dlg_id, failed)
+  MTR_DLG *dlg;                 /* Dialogue */
+  u16 dlg_id;                   /* Dialogue id */
+  u8 failed;                    /* Set if refused, aborted or timed out */
+{
+  LOAD_SRV *srv;                /* Service of the dialogue */
+  u16 ref;                      /* Index of the dialogue */
+
+  ref = (u16)(dlg_id - first_id);
+  srv = find_service(dlg->ptype);
+  if (failed)
+    srv->failed++;
+  else
+    MTR_lat_record(MTR_LAT_DLG, srv->cls, MTR_DLG_AGE(dlg, MTR_lat_now()));
+
+  MTR_tmr_stop(&wheel, ref);
+  dlg->state = MTR_S_NULL;
+  free_ref[num_free++] = ref;
+  completed++;
+  return(0);
+}
+
+/*
+ * timeout
+ *
+ * Aborts a dialogue that has taken too long.
+ *
+ * Always returns zero.
+ */
+static int timeout(ref)
+  u32 ref;                      /* Index of the dialogue */
+{
+  MTR_DLG *dlg;                 /* Dialogue */
+  MSG *m;                       /* Abort request */
+  u16 dlg_id;                   /* Dialogue id */
+
+  dlg_id = (u16)(first_id + ref);
+  if (((dlg = MTR_dlg_peek(0, (u16)ref)) == 0) || (dlg->state == MTR_S_NULL))
+    return(0);
+  if ((m = MTR_tpl_getm(MTR_TPL_U_ABORT_REQ, dlg_id, 0)) != 0)
+    send_msg(m);
+  timed_out++;
+  end_dialogue(dlg, dlg_id, 1);
+  return(0);
+}
+
+/*
+ * find_service
+ *
+ * Returns the service with a request primitive type.
+ */
+static LOAD_SRV *find_service(req)
+  u8 req;                       /* Service request primitive */
+{
+  u32 i;                        /* Service index */
+
+  for (i = 0; i < MTRLOAD_NUM_SRV - 1; i++)
+    if (srv_table[i].req == req)
+      break;
+  return(&srv_table[i]);
+}
+
+/*
+ * next_random
+ *
+ * Returns a uniform deviate in [0, 1) from an xorshift64* generator,
+ * so that a run with the same -z seed makes the same dialogues.
+ */
+static double next_random()
+{
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return((double)((seed * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*
+ * send_msg
+ *
+ * Sends a message to MAP, releasing it if it cannot be sent.
+ *
+ * Returns zero or -1 on error.
+ */
+static int send_msg(m)
+  MSG *m;                       /* Message to send */
+{
+  if (GCT_send(m->hdr.dst, (HDR *)m) != 0)
+  {
+    relm((HDR *)m);
+    send_fail++;
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * report
+ *
+ * Prints progress to the console.
+ *
+ * Always returns zero.
+ */
+static int report(seconds)
+  u32 seconds;                  /* Seconds run */
+{
+  static unsigned long long last_started; /* Dialogues started at the last report */
+  static unsigned long long last_completed; /* Dialogues ended at the last report */
+
+  printf("MTRLOAD %us: started %llu (+%llu); ended %llu (+%llu); in flight %u; late %llu; timeouts %llu\n",
+         seconds, started, started - last_started, completed, completed - last_completed,
+         num_dlgs - num_free, late, timed_out);
+  fflush(stdout);
+  last_started = started;
+  last_completed = completed;
+  return(0);
+}
+
+/*
+ * stop_handler
+ *
+ * SIGINT and SIGTERM handler: no more dialogues are started and
+ * mtrload ends once those in flight have ended.
+ */
+static void stop_handler(sig)
+  int sig;
+{
+  stop_req = 1;
+}
+
+/*
+ * show_syntax
+ */
+static void show_syntax(program)
+  char *program;                /* Program name */
+{
+  fprintf(stderr, "Syntax: %s [-m -u -r -t -n -q -i -g -s -p -c -I -a -b -e -z]\n", program);
+  fprintf(stderr, "  -m  module id of mtrload (default 0x%02x)\n", MTRLOAD_DEF_MOD_ID);
+  fprintf(stderr, "  -u  module id of MAP (default 0x%02x)\n", MTRLOAD_DEF_MAP_ID);
+  fprintf(stderr, "  -r  dialogues started per second (default 100)\n");
+  fprintf(stderr, "  -t  seconds to start dialogues for (default 0, until interrupted)\n");
+  fprintf(stderr, "  -n  dialogues to start (default 0, no limit)\n");
+  fprintf(stderr, "  -q  start dialogues at Poisson rather than fixed intervals\n");
+  fprintf(stderr, "  -i  outgoing dialogue id range, limits dialogues in flight (default 0x%04x-0x%04x)\n",
+          MTRLOAD_DEF_FIRST_ID, MTRLOAD_DEF_LAST_ID);
+  fprintf(stderr, "  -g  seconds before a dialogue is aborted (default %u)\n", MTRLOAD_DEF_TIMEOUT_S);
+  fprintf(stderr, "  -s  service mix, e.g. -ssri-sm:70,mt-fwd-sm:20,ussd:5,ati:5 (default sri-sm)\n");
+  fprintf(stderr, "  -p  MSISDN pattern, x for a random and # for a counting digit, may be repeated\n");
+  fprintf(stderr, "  -c  service centre address digits\n");
+  fprintf(stderr, "  -I  IMSI prefix for MT Forward SM, completed from the MSISDN\n");
+  fprintf(stderr, "  -a  calling party SCCP address in hex (default route on SSN 8)\n");
+  fprintf(stderr, "  -b  called party SCCP address in hex (default route on the service's SSN)\n");
+  fprintf(stderr, "  -e  seconds between latency reports (default 0, at the end only)\n");
+  fprintf(stderr, "  -z  seed of the service and digit choices (default 1)\n");
+}
@@ -0,0 +1,1271 @@
+/*
+ Name:          mtrplay.c
+
+ Description:   Replays recorded MAP traffic into MTR.
+
+                mtrplay takes the place of the MAP module: MTR is run
+                with -u set to the module id of mtrplay. The records
+                replayed are read from MTR text traces
+
+                  MTR Rx: I0000 M t87e1 i8000 f15 d2d s00 p0e...
+
+                as printed by MTR, or by mtrdec with or without -t,
+                and from s7_play scripts (M- and W- records). The
+                indications received by MTR (Rx) are sent to it again,
+                and the messages it sent (Tx) are what it is expected
+                to send back.
+
+                The records are grouped into dialogues by MAP instance
+                and dialogue id, each starting with an open indication;
+                records of dialogues whose start was not recorded are
+                skipped. Every dialogue is played with a dialogue id of
+                its own from the range given with -r, on MAP instances
+                0 to n-1 with -a, so the recording may be played many
+                times over at once with -c: each copy starts -o
+                milliseconds after the one before. An indication that
+                followed a message from MTR in the recording is only
+                sent once MTR has sent the message again. When no
+                dialogue id is free the replay waits for one, and the
+                dialogues started late are counted.
+
+                The recording is played with its original timing, if
+                the trace has times (mtrdec -t), or faster with -s, e.g.
+                -s10 or -sx10 for ten times as fast, or as fast as
+                possible with -s0.
+
+                Every message received from MTR is compared with the
+                one recorded at the same point of the dialogue, and the
+                throughput and the dialogues that diverged from the
+                recording are reported.
+
+                Syntax: mtrplay [-m -u -s -c -o -r -a -g -v] <file> [<file> ...]
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "system.h"
+#include "msg.h"
+#include "sysgct.h"
+#include "map_inc.h"
+#include "mtr_tmr.h"
+#include "mtr_lat.h"
+
+/*
+ * Default module ids of mtrplay and of MTR
+ */
+#define MTRPLAY_DEF_MOD_ID      (0x3e)
+#define MTRPLAY_DEF_MTR_ID      (0x2d)
+
+/*
+ * Default dialogue id range, and time a dialogue may wait for MTR in
+ * seconds
+ */
+#define MTRPLAY_DEF_FIRST_ID    (0x8000)
+#define MTRPLAY_DEF_LAST_ID     (0xffff)
+#define MTRPLAY_DEF_TIMEOUT_S   (10)
+
+/*
+ * Most MAP instances, longest line read, and divergences printed by
+ * default
+ */
+#define MTRPLAY_MAX_INST        (16)
+#define MTRPLAY_MAX_LINE        (64 + 4 * MAX_PARAM_LEN)
+#define MTRPLAY_DEF_VERBOSE     (10)
+
+/*
+ * Most dialogues started, and heap entries handled, before checking
+ * for messages from MTR again
+ */
+#define MTRPLAY_MAX_BURST       (256)
+
+/*
+ * Longest sleep while idle in microseconds, and lateness counted
+ */
+#define MTRPLAY_MAX_SLEEP_US    (100)
+#define MTRPLAY_LATE_NS         (1000000ULL)
+
+#define MTRPLAY_NIL             (0xffffffff)
+#define MTRPLAY_NS_PER_DAY      (86400ULL * 1000000000ULL)
+
+/*
+ * Direction of a record, as seen by MTR
+ */
+#define MTRPLAY_RX              (0)
+#define MTRPLAY_TX              (1)
+
+/*
+ * A recorded message
+ */
+typedef struct
+{
+  unsigned long long ns;        /* Time recorded, zero if none */
+  u32 off;                      /* Offset of the parameter area */
+  u32 next;                     /* Next record of the dialogue */
+  u16 type;                     /* Message type */
+  u16 id;                       /* Dialogue id */
+  u16 instance;                 /* MAP instance */
+  u16 len;                      /* Length of the parameter area */
+  u8  kind;                     /* MTRPLAY_RX or MTRPLAY_TX */
+} PLAY_REC;
+
+/*
+ * An indication of a recorded dialogue
+ */
+typedef struct
+{
+  u32 rec;                      /* Record */
+  u32 tx_before;                /* Messages from MTR recorded before it */
+  unsigned long long rel_ns;    /* Time after the start of the dialogue */
+} PLAY_RX;
+
+/*
+ * A recorded dialogue
+ */
+typedef struct
+{
+  unsigned long long start_ns;  /* Time of its first record */
+  u32 first;                    /* First record, then first indication */
+  u32 last;                     /* Last record while reading */
+  u32 num_rx;                   /* Indications */
+  u32 first_tx;                 /* First expected message in tx_list */
+  u32 num_tx;                   /* Expected messages */
+} PLAY_DLG;
+
+/*
+ * A dialogue being played, one per dialogue id
+ */
+typedef struct
+{
+  u32 dlg;                      /* Recorded dialogue, MTRPLAY_NIL if free */
+  u32 copy;                     /* Copy of the recording */
+  u32 rx_pos;                   /* Indications sent */
+  u32 tx_pos;                   /* Messages received from MTR */
+  u32 gen;                      /* Times the dialogue id was used */
+  unsigned long long start_ns;  /* When the dialogue was due to start */
+  u8  in_heap;                  /* Set while waiting for an indication to be due */
+  u8  diverged;                 /* Set once it has diverged */
+} PLAY_LIVE;
+
+/*
+ * An entry of a heap ordered by time
+ */
+typedef struct
+{
+  unsigned long long due;       /* When due */
+  u32 idx;                      /* Copy or dialogue id index */
+  u32 gen;                      /* Generation of the dialogue id */
+} PLAY_EVT;
+
+static int read_file(char *name);
+static int read_line(char *line, PLAY_REC *rec, u8 *params);
+static int read_hex(char *str, u8 *dst, u16 max, u16 *len);
+static int add_record(PLAY_REC *rec, u8 *params);
+static int build_dialogues(void);
+static int compare_dlgs(const void *a, const void *b);
+static int read_number(char *str, unsigned long max, unsigned long *value);
+static int start_dialogue(u32 copy, u32 dlg, unsigned long long due);
+static int play(u32 slot, unsigned long long now);
+static int send_rx(u32 slot, u16 type, u8 *pptr, u16 len);
+static int handle_msg(MSG *m);
+static int diverged(u32 slot, PLAY_REC *rec, MSG *m, char *what);
+static int end_dialogue(u32 slot);
+static int timeout(u32 slot);
+static int ends_dialogue(u16 type, u8 ptype);
+static unsigned long long scaled(unsigned long long ns);
+static int heap_push(PLAY_EVT *heap, u32 *num, unsigned long long due, u32 idx, u32 gen);
+static int heap_pop(PLAY_EVT *heap, u32 *num, PLAY_EVT *evt);
+static int print_msg(char *prefix, u16 type, u16 instance, u16 id, u8 *pptr, u16 len);
+static int report(u32 seconds);
+static void stop_handler(int sig);
+static void show_syntax(char *program);
+
+/*
+ * Static data:
+ */
+static PLAY_REC *recs;                  /* Records read */
+static u32 num_recs;                    /* Entries of recs used */
+static u32 max_recs;                    /* Entries of recs allocated */
+static u8  *arena;                      /* Parameter areas of the records */
+static u32 arena_len;                   /* Octets of arena used */
+static u32 arena_size;                  /* Octets of arena allocated */
+static PLAY_DLG *dlgs;                  /* Dialogues recorded */
+static u32 num_dlgs;                    /* Entries of dlgs used */
+static u32 max_dlgs;                    /* Entries of dlgs allocated */
+static PLAY_RX *rx_list;                /* Indications of all dialogues */
+static u32 *tx_list;                    /* Expected messages of all dialogues */
+static u32 *cur_dlg;                    /* Open dialogue + 1 by instance and id, while reading */
+static unsigned long long day_ns;       /* Days passed in the trace, while reading */
+static unsigned long long last_ns;      /* Last time read */
+static u8  have_time;                   /* Set if the trace has times */
+static u8  have_tx;                     /* Set if messages from MTR were recorded */
+static u32 skipped;                     /* Records of dialogues not recorded from the start */
+
+static u8  mod_id;                      /* Module id of mtrplay */
+static u8  mtr_id;                      /* Module id of MTR */
+static double speed;                    /* Playing speed, 0 for as fast as possible */
+static unsigned long long offset_ns;    /* Start of each copy after the one before */
+static u32 copies;                      /* Copies of the recording played */
+static u16 first_id;                    /* First dialogue id used */
+static u32 range_len;                   /* Dialogue ids used on each instance */
+static u32 num_inst;                    /* MAP instances used */
+static u32 num_slots;                   /* Dialogues that can be played at once */
+static u32 verbose;                     /* Divergences printed */
+static PLAY_LIVE *live;                 /* Dialogues being played, by dialogue id */
+static u32 *free_slot;                  /* Dialogue ids free, oldest first */
+static u32 free_head;                   /* Next entry of free_slot taken */
+static u32 num_free;                    /* Entries of free_slot used */
+static u32 *cursor;                     /* Next dialogue of each copy to start */
+static PLAY_EVT *start_heap;            /* Copies by when their next dialogue is due */
+static u32 num_start;                   /* Entries of start_heap used */
+static PLAY_EVT *rx_heap;               /* Dialogues by when their next indication is due */
+static u32 num_rx_heap;                 /* Entries of rx_heap used */
+static MTR_TMR_WHEEL wheel;             /* Dialogue timeouts */
+static u32 timeout_ticks;               /* Timeout in timer ticks */
+static unsigned long long play_start_ns; /* When the replay started */
+static volatile int stop_req;           /* Set by SIGINT or SIGTERM */
+
+static unsigned long long started;      /* Dialogues started */
+static unsigned long long completed;    /* Dialogues ended */
+static unsigned long long late;         /* Dialogues started late */
+static unsigned long long timed_out;    /* Dialogues timed out */
+static unsigned long long rx_sent;      /* Indications sent */
+static unsigned long long tx_rcvd;      /* Messages received from MTR */
+static unsigned long long tx_differ;    /* Messages unlike the recording */
+static unsigned long long tx_extra;     /* Messages not recorded */
+static unsigned long long tx_missing;   /* Messages recorded but not received */
+static unsigned long long tx_unknown;   /* Messages for dialogue ids not in use */
+static unsigned long long rx_unsent;    /* Indications not sent as MTR ended the dialogue */
+static unsigned long long dlg_diverged; /* Dialogues that diverged */
+static unsigned long long send_fail;    /* Messages that could not be sent */
+static unsigned long long getm_fail;    /* Messages that could not be allocated */
+static unsigned long long printed;      /* Divergences printed */
+
+/*
+ * main
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  MSG *m;                       /* Message received */
+  PLAY_EVT evt;                 /* Heap entry */
+  PLAY_LIVE *l;                 /* Dialogue being played */
+  unsigned long value;          /* Numeric value of an option */
+  unsigned long last;           /* Upper end of a range */
+  unsigned long long now;       /* Time now */
+  unsigned long long report_ns; /* When the next report is due */
+  unsigned long long elapsed;   /* Time played */
+  struct timespec nap;          /* Time to sleep */
+  char *sep;                    /* Range separator */
+  u32 burst;                    /* Entries handled this time round */
+  u32 i;                        /* Index */
+  int busy;                     /* Set if anything was done */
+
+  mod_id = MTRPLAY_DEF_MOD_ID;
+  mtr_id = MTRPLAY_DEF_MTR_ID;
+  speed = 1;
+  copies = 1;
+  offset_ns = 0;
+  first_id = MTRPLAY_DEF_FIRST_ID;
+  range_len = MTRPLAY_DEF_LAST_ID - MTRPLAY_DEF_FIRST_ID + 1;
+  num_inst = 1;
+  timeout_ticks = MTRPLAY_DEF_TIMEOUT_S * 1000 / MTR_TMR_TICK_MS;
+  verbose = MTRPLAY_DEF_VERBOSE;
+
+  for (i = 1; (i < (u32)argc) && (argv[i][0] == '-') && (argv[i][1] != '\0'); i++)
+  {
+    value = 0;
+    switch (argv[i][1])
+    {
+      case 'm':
+      case 'u':
+        if (read_number(&argv[i][2], 0xff, &value) != 0)
+          break;
+        if (argv[i][1] == 'm')
+          mod_id = (u8)value;
+        else
+          mtr_id = (u8)value;
+        continue;
+
+      case 's':
+        speed = strtod(&argv[i][(argv[i][2] == 'x') ? 3 : 2], &sep);
+        if ((*sep != '\0') || (speed < 0) || (sep == &argv[i][2]))
+          break;
+        continue;
+
+      case 'c':
+      case 'o':
+      case 'a':
+      case 'g':
+      case 'v':
+        if ((read_number(&argv[i][2], 0xffffffff, &value) != 0) ||
+            ((argv[i][1] == 'c') && (value == 0)) ||
+            ((argv[i][1] == 'a') && ((value == 0) || (value > MTRPLAY_MAX_INST))) ||
+            ((argv[i][1] == 'g') && ((value == 0) || (value > 3600))))
+          break;
+        if (argv[i][1] == 'c')
+          copies = (u32)value;
+        else if (argv[i][1] == 'o')
+          offset_ns = value * 1000000ULL;
+        else if (argv[i][1] == 'a')
+          num_inst = (u32)value;
+        else if (argv[i][1] == 'g')
+          timeout_ticks = (u32)(value * 1000 / MTR_TMR_TICK_MS);
+        else
+          verbose = (u32)value;
+        continue;
+
+      case 'r':
+        if ((sep = strchr(&argv[i][2], '-')) == 0)
+          break;
+        *sep = '\0';
+        if ((read_number(&argv[i][2], 0xffff, &value) != 0) ||
+            (read_number(sep + 1, 0xffff, &last) != 0) || (last < value))
+          break;
+        first_id = (u16)value;
+        range_len = (u32)(last - value + 1);
+        continue;
+    }
+    show_syntax(argv[0]);
+    return(1);
+  }
+  if (i >= (u32)argc)
+  {
+    show_syntax(argv[0]);
+    return(1);
+  }
+
+  /*
+   * Read the recording and group it into dialogues.
+   */
+  if ((cur_dlg = calloc(MTRPLAY_MAX_INST * 0x10000, sizeof(u32))) == 0)
+  {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return(1);
+  }
+  for (; i < (u32)argc; i++)
+    if (read_file(argv[i]) != 0)
+      return(1);
+  free(cur_dlg);
+  if (build_dialogues() != 0)
+  {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return(1);
+  }
+  if (num_dlgs == 0)
+  {
+    fprintf(stderr, "%s: no dialogues recorded\n", argv[0]);
+    return(1);
+  }
+  if ((speed != 0) && (!have_time))
+  {
+    printf("MTRPLAY: no times recorded, playing as fast as possible\n");
+    speed = 0;
+  }
+
+  num_slots = range_len * num_inst;
+  if (((live = malloc(num_slots * sizeof(PLAY_LIVE))) == 0) ||
+      ((free_slot = malloc(num_slots * sizeof(u32))) == 0) ||
+      ((rx_heap = malloc(num_slots * sizeof(PLAY_EVT))) == 0) ||
+      ((wheel.node = calloc(num_slots, sizeof(MTR_TMR_NODE))) == 0) ||
+      ((cursor = calloc(copies, sizeof(u32))) == 0) ||
+      ((start_heap = malloc(copies * sizeof(PLAY_EVT))) == 0))
+  {
+    fprintf(stderr, "%s: cannot allocate %u dialogues and %u copies\n",
+            argv[0], num_slots, copies);
+    return(1);
+  }
+  for (i = 0; i < num_slots; i++)
+  {
+    live[i].dlg = MTRPLAY_NIL;
+    live[i].gen = 0;
+    free_slot[i] = i;
+  }
+  num_free = num_slots;
+  MTR_tmr_init(&wheel, wheel.node);
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+
+  printf("MTRPLAY: %u dialogues, %u records (%u skipped) from the recording%s\n",
+         num_dlgs, num_recs, skipped, have_tx ? "" : "; no messages from MTR recorded");
+  printf("MTRPLAY: module 0x%02x to MTR 0x%02x; %u copies %llums apart; speed %s%g; dialogue ids 0x%04x-0x%04x on %u instances\n",
+         mod_id, mtr_id, copies, offset_ns / 1000000ULL, speed ? "x" : "", speed,
+         first_id, first_id + range_len - 1, num_inst);
+  fflush(stdout);
+
+  play_start_ns = MTR_lat_now();
+  for (i = 0; i < copies; i++)
+    heap_push(start_heap, &num_start, play_start_ns + scaled(0) + i * offset_ns, i, 0);
+  report_ns = play_start_ns + 1000000000ULL;
+  wheel.now = (u32)(play_start_ns / (MTR_TMR_TICK_MS * 1000000ULL));
+
+  /*
+   * Run until every dialogue of every copy has ended.
+   */
+  while ((num_start != 0) || (num_free != num_slots))
+  {
+    busy = 0;
+    now = MTR_lat_now();
+    if (stop_req)
+      num_start = 0;
+
+    /*
+     * Start the dialogues that are due while there are dialogue ids
+     * to play them with.
+     */
+    for (burst = 0; (burst < MTRPLAY_MAX_BURST) && (num_start != 0) &&
+                    (start_heap[0].due <= now) && (num_free != 0); burst++)
+    {
+      heap_pop(start_heap, &num_start, &evt);
+      if (now - evt.due > MTRPLAY_LATE_NS)
+        late++;
+      start_dialogue(evt.idx, cursor[evt.idx], evt.due);
+      if (++cursor[evt.idx] < num_dlgs)
+        heap_push(start_heap, &num_start,
+                  play_start_ns + scaled(dlgs[cursor[evt.idx]].start_ns - dlgs[0].start_ns) +
+                  evt.idx * offset_ns, evt.idx, 0);
+      busy = 1;
+    }
+
+    /*
+     * Send the indications that have come due.
+     */
+    for (burst = 0; (burst < MTRPLAY_MAX_BURST) && (num_rx_heap != 0) &&
+                    (rx_heap[0].due <= now); burst++)
+    {
+      heap_pop(rx_heap, &num_rx_heap, &evt);
+      l = &live[evt.idx];
+      if ((l->dlg == MTRPLAY_NIL) || (l->gen != evt.gen))
+        continue;
+      l->in_heap = 0;
+      play(evt.idx, now);
+      busy = 1;
+    }
+
+    while ((m = (MSG *)GCT_grab(mod_id)) != 0)
+    {
+      handle_msg(m);
+      relm((HDR *)m);
+      busy = 1;
+    }
+
+    MTR_tmr_advance_to(&wheel, (u32)(now / (MTR_TMR_TICK_MS * 1000000ULL)), timeout);
+
+    if (now >= report_ns)
+    {
+      report((u32)((now - play_start_ns) / 1000000000ULL));
+      report_ns += 1000000000ULL;
+    }
+
+    if (!busy)
+    {
+      nap.tv_sec = 0;
+      nap.tv_nsec = MTRPLAY_MAX_SLEEP_US * 1000L;
+      nanosleep(&nap, NULL);
+    }
+  }
+
+  elapsed = MTR_lat_now() - play_start_ns;
+  report((u32)(elapsed / 1000000000ULL));
+  printf("MTRPLAY Throughput: %.0f dialogues/s; %.0f messages/s sent; %.0f messages/s received\n",
+         elapsed ? completed * 1e9 / elapsed : 0.0, elapsed ? rx_sent * 1e9 / elapsed : 0.0,
+         elapsed ? tx_rcvd * 1e9 / elapsed : 0.0);
+  if (have_tx)
+    printf("MTRPLAY Divergence: %llu of %llu dialogues; %llu messages different; %llu not recorded; %llu missing; %llu indications not sent\n",
+           dlg_diverged, completed, tx_differ, tx_extra, tx_missing, rx_unsent);
+  printf("MTRPLAY Late starts %llu; timeouts %llu; unknown dialogues %llu; send failures %llu; getm failures %llu\n",
+         late, timed_out, tx_unknown, send_fail, getm_fail);
+  return((have_tx && dlg_diverged) ? 2 : 0);
+}
+
+/*
+ * read_file
+ *
+ * Reads the records of a trace or s7_play script.
+ *
+ * Returns zero or -1 on error.
+ */
+static int read_file(name)
+  char *name;                   /* File name, - for stdin */
+{
+  FILE *f;                      /* File */
+  static char line[MTRPLAY_MAX_LINE]; /* Line read */
+  u8  params[MAX_PARAM_LEN];    /* Parameter area of a record */
+  PLAY_REC rec;                 /* Record read */
+  u32 num;                      /* Line number */
+
+  if (strcmp(name, "-") == 0)
+    f = stdin;
+  else if ((f = fopen(name, "r")) == 0)
+  {
+    fprintf(stderr, "mtrplay: cannot open %s\n", name);
+    return(-1);
+  }
+
+  for (num = 1; fgets(line, sizeof(line), f) != 0; num++)
+  {
+    memset(&rec, 0, sizeof(rec));
+    if (read_line(line, &rec, params) != 0)
+      continue;
+    if (add_record(&rec, params) != 0)
+    {
+      fprintf(stderr, "mtrplay: %s:%u: out of memory\n", name, num);
+      if (f != stdin)
+        fclose(f);
+      return(-1);
+    }
+  }
+
+  if (f != stdin)
+    fclose(f);
+  return(0);
+}
+
+/*
+ * read_line
+ *
+ * Reads a message from a line of trace, with or without the time
+ * printed by mtrdec -t, or an s7_play M- or W- record, which is taken
+ * as received by MTR.
+ *
+ * Returns zero or -1 if the line is not a message.
+ */
+static int read_line(line, rec, params)
+  char *line;                   /* Line */
+  PLAY_REC *rec;                /* Returns the record */
+  u8 *params;                   /* Returns the parameter area */
+{
+  unsigned int hh, mm, ss;      /* Time of day */
+  unsigned long long frac;      /* Nanoseconds */
+  unsigned int inst, type, id, src, dst, status; /* Header fields */
+  unsigned long value;          /* Field of an s7_play record */
+  char *p;                      /* Position in the line */
+  char *end;                    /* End of a field */
+  int n;                        /* Characters read */
+
+  line[strcspn(line, "\r\n")] = '\0';
+
+  if (((line[0] == 'M') || (line[0] == 'W')) && (line[1] == '-'))
+  {
+    rec->kind = MTRPLAY_RX;
+    for (p = line + 1; *p == '-'; p = end)
+    {
+      p++;
+      if (*p == 'p')
+      {
+        if (read_hex(p + 1, params, MAX_PARAM_LEN, &rec->len) != 0)
+          return(-1);
+        end = p + 1 + 2 * rec->len;
+        continue;
+      }
+      value = strtoul(p + 1, &end, 16);
+      if (*p == 't')
+        rec->type = (u16)value;
+      else if (*p == 'i')
+        rec->id = (u16)value;
+    }
+    return(((rec->type == MAP_MSG_DLG_IND) || (rec->type == MAP_MSG_SRV_IND)) ? 0 : -1);
+  }
+
+  if ((p = strstr(line, "MTR Rx: I")) != 0)
+    rec->kind = MTRPLAY_RX;
+  else if ((p = strstr(line, "MTR Tx: I")) != 0)
+    rec->kind = MTRPLAY_TX;
+  else
+    return(-1);
+
+  if (sscanf(p + 9, "%4x M t%4x i%4x f%2x d%2x s%2x%n",
+             &inst, &type, &id, &src, &dst, &status, &n) != 6)
+    return(-1);
+  rec->instance = (u16)inst;
+  rec->type = (u16)type;
+  rec->id = (u16)id;
+  p += 9 + n;
+  if ((p[0] == ' ') && (p[1] == 'p') &&
+      (read_hex(p + 2, params, MAX_PARAM_LEN, &rec->len) != 0))
+    return(-1);
+
+  /*
+   * Times printed by mtrdec -t are times of day, which may pass
+   * midnight during the trace.
+   */
+  if (sscanf(line, "%2u:%2u:%2u.%9llu ", &hh, &mm, &ss, &frac) == 4)
+  {
+    rec->ns = ((hh * 60ULL + mm) * 60ULL + ss) * 1000000000ULL + frac;
+    if ((have_time) && (rec->ns + day_ns + MTRPLAY_NS_PER_DAY / 2 < last_ns))
+      day_ns += MTRPLAY_NS_PER_DAY;
+    rec->ns += day_ns;
+    last_ns = rec->ns;
+    have_time = 1;
+  }
+  else
+    rec->ns = last_ns;
+
+  if (rec->kind == MTRPLAY_RX)
+    return(((rec->type == MAP_MSG_DLG_IND) || (rec->type == MAP_MSG_SRV_IND)) ? 0 : -1);
+  return(((rec->type == MAP_MSG_DLG_REQ) || (rec->type == MAP_MSG_SRV_REQ)) ? 0 : -1);
+}
+
+/*
+ * read_hex
+ *
+ * Reads hexadecimal octets, up to the first character that is not a
+ * hexadecimal digit.
+ *
+ * Returns zero or -1 if there are too many or an odd number of digits.
+ */
+static int read_hex(str, dst, max, len)
+  char *str;                    /* Hexadecimal digits */
+  u8 *dst;                      /* Returns the octets */
+  u16 max;                      /* Most octets */
+  u16 *len;                     /* Returns the number of octets */
+{
+  unsigned int octet;           /* One octet */
+  u16 n;                        /* Octets read */
+
+  for (n = 0; (str[0] != '\0') && (strchr("0123456789abcdefABCDEF", str[0]) != 0); n++, str += 2)
+  {
+    if ((n == max) || (str[1] == '\0') || (strchr("0123456789abcdefABCDEF", str[1]) == 0) ||
+        (sscanf(str, "%2x", &octet) != 1))
+      return(-1);
+    dst[n] = (u8)octet;
+  }
+  *len = n;
+  return(0);
+}
+
+/*
+ * add_record
+ *
+ * Adds a record to the dialogue it belongs to. An open indication
+ * starts a new dialogue, and a message that ends the dialogue, either
+ * way, closes it.
+ *
+ * Returns zero or -1 if out of memory.
+ */
+static int add_record(rec, params)
+  PLAY_REC *rec;                /* Record */
+  u8 *params;                   /* Parameter area */
+{
+  PLAY_DLG *dlg;                /* Dialogue of the record */
+  u32 *cur;                     /* Open dialogue + 1 of the instance and id */
+  void *more;                   /* Grown table */
+  u8  ptype;                    /* Primitive type */
+
+  if (rec->instance >= MTRPLAY_MAX_INST)
+  {
+    skipped++;
+    return(0);
+  }
+  cur = &cur_dlg[rec->instance * 0x10000 + rec->id];
+  ptype = rec->len ? params[0] : 0;
+
+  if ((rec->kind == MTRPLAY_RX) && (rec->type == MAP_MSG_DLG_IND) && (ptype == MAPDT_OPEN_IND))
+  {
+    if (num_dlgs == max_dlgs)
+    {
+      max_dlgs = max_dlgs ? 2 * max_dlgs : 1024;
+      if ((more = realloc(dlgs, max_dlgs * sizeof(PLAY_DLG))) == 0)
+        return(-1);
+      dlgs = more;
+    }
+    dlg = &dlgs[num_dlgs];
+    memset(dlg, 0, sizeof(PLAY_DLG));
+    dlg->start_ns = rec->ns;
+    dlg->first = MTRPLAY_NIL;
+    *cur = ++num_dlgs;
+  }
+  else if (*cur == 0)
+  {
+    skipped++;
+    return(0);
+  }
+  dlg = &dlgs[*cur - 1];
+
+  if (num_recs == max_recs)
+  {
+    max_recs = max_recs ? 2 * max_recs : 4096;
+    if ((more = realloc(recs, max_recs * sizeof(PLAY_REC))) == 0)
+      return(-1);
+    recs = more;
+  }
+  if (arena_len + rec->len > arena_size)
+  {
+    arena_size = arena_size ? 2 * arena_size : 65536;
+    if ((more = realloc(arena, arena_size)) == 0)
+      return(-1);
+    arena = more;
+  }
+  rec->off = arena_len;
+  memcpy(&arena[arena_len], params, rec->len);
+  arena_len += rec->len;
+  rec->next = MTRPLAY_NIL;
+  recs[num_recs] = *rec;
+
+  if (dlg->first == MTRPLAY_NIL)
+    dlg->first = num_recs;
+  else
+    recs[dlg->last].next = num_recs;
+  dlg->last = num_recs;
+  if (rec->kind == MTRPLAY_RX)
+    dlg->num_rx++;
+  else
+  {
+    dlg->num_tx++;
+    have_tx = 1;
+  }
+  num_recs++;
+
+  if (ends_dialogue(rec->type, ptype))
+    *cur = 0;
+  return(0);
+}
+
+/*
+ * build_dialogues
+ *
+ * Puts the dialogues in the order they started, as the files read may
+ * overlap, and lays out the indications and expected messages of each
+ * in order, noting how many messages from MTR precede each indication.
+ *
+ * Returns zero or -1 if out of memory.
+ */
+static int build_dialogues()
+{
+  PLAY_DLG *dlg;                /* Dialogue */
+  PLAY_RX *rx;                  /* Next indication */
+  u32 *tx;                      /* Next expected message */
+  u32 num_rx;                   /* Indications of all dialogues */
+  u32 num_tx;                   /* Expected messages of all dialogues */
+  u32 k;                        /* Dialogue index */
+  u32 r;                        /* Record index */
+
+  qsort(dlgs, num_dlgs, sizeof(PLAY_DLG), compare_dlgs);
+  for (num_rx = num_tx = 0, k = 0; k < num_dlgs; k++)
+  {
+    num_rx += dlgs[k].num_rx;
+    num_tx += dlgs[k].num_tx;
+  }
+  if (((rx_list = malloc((num_rx + 1) * sizeof(PLAY_RX))) == 0) ||
+      ((tx_list = malloc((num_tx + 1) * sizeof(u32))) == 0))
+    return(-1);
+
+  rx = rx_list;
+  tx = tx_list;
+  for (k = 0; k < num_dlgs; k++)
+  {
+    dlg = &dlgs[k];
+    r = dlg->first;
+    dlg->first = (u32)(rx - rx_list);
+    dlg->first_tx = (u32)(tx - tx_list);
+    for (; r != MTRPLAY_NIL; r = recs[r].next)
+    {
+      if (recs[r].kind == MTRPLAY_TX)
+      {
+        *tx++ = r;
+        continue;
+      }
+      rx->rec = r;
+      rx->tx_before = (u32)(tx - tx_list) - dlg->first_tx;
+      rx->rel_ns = recs[r].ns - dlg->start_ns;
+      rx++;
+    }
+  }
+  return(0);
+}
+
+/*
+ * compare_dlgs
+ *
+ * qsort comparison of dialogues by start time, then by first record.
+ */
+static int compare_dlgs(a, b)
+  const void *a;                /* First dialogue */
+  const void *b;                /* Second dialogue */
+{
+  const PLAY_DLG *da = a;       /* First dialogue */
+  const PLAY_DLG *db = b;       /* Second dialogue */
+
+  if (da->start_ns != db->start_ns)
+    return((da->start_ns < db->start_ns) ? -1 : 1);
+  return((da->first < db->first) ? -1 : (da->first > db->first));
+}
+
+/*
+ * read_number
+ *
+ * Reads a decimal or 0x prefixed hexadecimal number.
+ *
+ * Returns zero or -1 if not a number or above max.
+ */
+static int read_number(str, max, value)
+  char *str;                    /* String to read */
+  unsigned long max;            /* Largest value allowed */
+  unsigned long *value;         /* Returns the value */
+{
+  char *end;                    /* First character not read */
+
+  if (*str == '\0')
+    return(-1);
+  *value = strtoul(str, &end, 0);
+  if ((*end != '\0') || (*value > max))
+    return(-1);
+  return(0);
+}
+
+/*
+ * start_dialogue
+ *
+ * Starts a copy of a recorded dialogue on the dialogue id free for
+ * longest.
+ *
+ * Always returns zero.
+ */
+static int start_dialogue(copy, dlg, due)
+  u32 copy;                     /* Copy of the recording */
+  u32 dlg;                      /* Recorded dialogue */
+  unsigned long long due;       /* When it was due to start */
+{
+  PLAY_LIVE *l;                 /* Dialogue played */
+  u32 slot;                     /* Its dialogue id index */
+
+  slot = free_slot[free_head];
+  free_head = (free_head + 1) % num_slots;
+  num_free--;
+
+  l = &live[slot];
+  l->dlg = dlg;
+  l->copy = copy;
+  l->rx_pos = 0;
+  l->tx_pos = 0;
+  l->gen++;
+  l->start_ns = due;
+  l->in_heap = 0;
+  l->diverged = 0;
+  started++;
+  MTR_tmr_start(&wheel, slot, timeout_ticks);
+  play(slot, MTR_lat_now());
+  return(0);
+}
+
+/*
+ * play
+ *
+ * Sends the indications of a dialogue that are due, up to the first
+ * that must wait for a message from MTR. A dialogue with nothing left
+ * to send and nothing more to wait for has ended.
+ *
+ * Always returns zero.
+ */
+static int play(slot, now)
+  u32 slot;                     /* Dialogue id index */
+  unsigned long long now;       /* Time now */
+{
+  PLAY_LIVE *l;                 /* Dialogue played */
+  PLAY_DLG *dlg;                /* Its recording */
+  PLAY_RX *rx;                  /* Next indication */
+  PLAY_REC *rec;                /* Last indication sent */
+  unsigned long long due;       /* When the next indication is due */
+
+  l = &live[slot];
+  dlg = &dlgs[l->dlg];
+  rec = 0;
+  while (l->rx_pos < dlg->num_rx)
+  {
+    rx = &rx_list[dlg->first + l->rx_pos];
+    if (l->tx_pos < rx->tx_before)
+      return(0);
+    due = l->start_ns + scaled(rx->rel_ns);
+    if (due > now)
+    {
+      heap_push(rx_heap, &num_rx_heap, due, slot, l->gen);
+      l->in_heap = 1;
+      return(0);
+    }
+    rec = &recs[rx->rec];
+    send_rx(slot, rec->type, &arena[rec->off], rec->len);
+    l->rx_pos++;
+  }
+
+  /*
+   * Everything is sent: the dialogue has ended once all the messages
+   * recorded from MTR are back, or, with none recorded, if the last
+   * indication ended it.
+   */
+  if (have_tx ? (l->tx_pos >= dlg->num_tx)
+              : ((rec != 0) && ends_dialogue(rec->type, rec->len ? arena[rec->off] : 0)))
+    end_dialogue(slot);
+  return(0);
+}
+
+/*
+ * send_rx
+ *
+ * Sends an indication to MTR, on the dialogue id of the dialogue
+ * played.
+ *
+ * Returns zero or -1 on error.
+ */
+static int send_rx(slot, type, pptr, len)
+  u32 slot;                     /* Dialogue id index */
+  u16 type;                     /* Message type */
+  u8 *pptr;                     /* Parameter area */
+  u16 len;                      /* Its length */
+{
+  MSG *m;                       /* Message sent */
+
+  if ((m = getm(type, (u16)(first_id + slot % range_len), NO_RESPONSE, len)) == 0)
+  {
+    getm_fail++;
+    return(-1);
+  }
+  m->hdr.src = mod_id;
+  m->hdr.dst = mtr_id;
+  memcpy(get_param(m), pptr, len);
+  GCT_set_instance(slot / range_len, (HDR *)m);
+  if (GCT_send(mtr_id, (HDR *)m) != 0)
+  {
+    relm((HDR *)m);
+    send_fail++;
+    return(-1);
+  }
+  rx_sent++;
+  return(0);
+}
+
+/*
+ * handle_msg
+ *
+ * Compares a message from MTR with the one recorded at the same point
+ * of its dialogue, and sends any indications that were waiting for it.
+ *
+ * Always returns zero.
+ */
+static int handle_msg(m)
+  MSG *m;                       /* Message received */
+{
+  PLAY_LIVE *l;                 /* Dialogue played */
+  PLAY_DLG *dlg;                /* Its recording */
+  PLAY_REC *rec;                /* Message expected */
+  u32 inst;                     /* MAP instance */
+  u32 slot;                     /* Dialogue id index */
+  u8  ptype;                    /* Primitive type */
+
+  if ((m->hdr.type != MAP_MSG_DLG_REQ) && (m->hdr.type != MAP_MSG_SRV_REQ))
+    return(0);
+  tx_rcvd++;
+
+  inst = (u32)GCT_get_instance((HDR *)m);
+  if (((u16)(m->hdr.id - first_id) >= range_len) || (inst >= num_inst) ||
+      (live[slot = inst * range_len + (u16)(m->hdr.id - first_id)].dlg == MTRPLAY_NIL))
+  {
+    tx_unknown++;
+    return(0);
+  }
+  l = &live[slot];
+  dlg = &dlgs[l->dlg];
+  ptype = m->len ? get_param(m)[0] : 0;
+  MTR_tmr_start(&wheel, slot, timeout_ticks);
+
+  if (have_tx)
+  {
+    if (l->tx_pos < dlg->num_tx)
+    {
+      rec = &recs[tx_list[dlg->first_tx + l->tx_pos]];
+      l->tx_pos++;
+      if ((rec->type != m->hdr.type) || (rec->len != m->len) ||
+          (memcmp(&arena[rec->off], get_param(m), m->len) != 0))
+      {
+        tx_differ++;
+        diverged(slot, rec, m, "differs from");
+      }
+    }
+    else
+    {
+      tx_extra++;
+      diverged(slot, 0, m, "was not");
+    }
+  }
+
+  /*
+   * MTR ending the dialogue ends the replay of it, whatever is left.
+   */
+  if (ends_dialogue(m->hdr.type, ptype))
+  {
+    if (have_tx && ((l->tx_pos < dlg->num_tx) || (l->rx_pos < dlg->num_rx)))
+    {
+      tx_missing += dlg->num_tx - l->tx_pos;
+      rx_unsent += dlg->num_rx - l->rx_pos;
+      diverged(slot, 0, 0, "ended before");
+    }
+    end_dialogue(slot);
+  }
+  else if (!l->in_heap)
+    play(slot, MTR_lat_now());
+  return(0);
+}
+
+/*
+ * diverged
+ *
+ * Counts a dialogue that has diverged from the recording, and prints
+ * the divergence while fewer than -v have been printed.
+ *
+ * Always returns zero.
+ */
+static int diverged(slot, rec, m, what)
+  u32 slot;                     /* Dialogue id index */
+  PLAY_REC *rec;                /* Message expected, zero for none */
+  MSG *m;                       /* Message received, zero for none */
+  char *what;                   /* How it diverged */
+{
+  PLAY_LIVE *l;                 /* Dialogue played */
+  PLAY_REC *first;              /* First record of the dialogue */
+
+  l = &live[slot];
+  if (!l->diverged)
+  {
+    l->diverged = 1;
+    dlg_diverged++;
+  }
+  if (printed >= verbose)
+    return(0);
+  printed++;
+
+  first = &recs[rx_list[dlgs[l->dlg].first].rec];
+  printf("MTRPLAY Copy %u of dialogue I%04x i%04x played as I%04x i%04x: message %u %s the recording\n",
+         l->copy, first->instance, first->id, slot / range_len, first_id + slot % range_len,
+         l->tx_pos, what);
+  if (rec != 0)
+    print_msg("  recorded", rec->type, rec->instance, rec->id, &arena[rec->off], rec->len);
+  if (m != 0)
+    print_msg("  received", m->hdr.type, (u16)GCT_get_instance((HDR *)m), m->hdr.id,
+              get_param(m), m->len);
+  return(0);
+}
+
+/*
+ * end_dialogue
+ *
+ * Frees the dialogue id of a dialogue that has ended, to be used
+ * again after all the others that are free.
+ *
+ * Always returns zero.
+ */
+static int end_dialogue(slot)
+  u32 slot;                     /* Dialogue id index */
+{
+  MTR_tmr_stop(&wheel, slot);
+  live[slot].dlg = MTRPLAY_NIL;
+  free_slot[(free_head + num_free) % num_slots] = slot;
+  num_free++;
+  completed++;
+  return(0);
+}
+
+/*
+ * timeout
+ *
+ * Gives up on a dialogue MTR has not answered, aborting it so that
+ * MTR frees it too.
+ *
+ * Always returns zero.
+ */
+static int timeout(slot)
+  u32 slot;                     /* Dialogue id index */
+{
+  PLAY_LIVE *l;                 /* Dialogue played */
+  PLAY_DLG *dlg;                /* Its recording */
+  static u8 abort_ind[2] = { MAPDT_U_ABORT_IND, 0x00 }; /* User abort indication */
+
+  l = &live[slot];
+  if (l->dlg == MTRPLAY_NIL)
+    return(0);
+  dlg = &dlgs[l->dlg];
+  timed_out++;
+  if (have_tx)
+  {
+    tx_missing += dlg->num_tx - l->tx_pos;
+    rx_unsent += dlg->num_rx - l->rx_pos;
+    diverged(slot, 0, 0, "timed out before");
+  }
+  send_rx(slot, MAP_MSG_DLG_IND, abort_ind, sizeof(abort_ind));
+  end_dialogue(slot);
+  return(0);
+}
+
+/*
+ * ends_dialogue
+ *
+ * Returns non-zero if a message ends its dialogue.
+ */
+static int ends_dialogue(type, ptype)
+  u16 type;                     /* Message type */
+  u8 ptype;                     /* Primitive type */
+{
+  if (type == MAP_MSG_DLG_REQ)
+    return((ptype == MAPDT_CLOSE_REQ) || (ptype == MAPDT_U_ABORT_REQ));
+  if (type == MAP_MSG_DLG_IND)
+    return((ptype == MAPDT_CLOSE_IND) || (ptype == MAPDT_U_ABORT_IND) ||
+           (ptype == MAPDT_P_ABORT_IND));
+  return(0);
+}
+
+/*
+ * scaled
+ *
+ * Returns a recorded interval at the playing speed.
+ */
+static unsigned long long scaled(ns)
+  unsigned long long ns;        /* Recorded interval */
+{
+  if (speed == 0)
+    return(0);
+  return((unsigned long long)(ns / speed));
+}
+
+/*
+ * heap_push
+ *
+ * Adds an entry to a heap ordered by time.
+ *
+ * Always returns zero.
+ */
+static int heap_push(heap, num, due, idx, gen)
+  PLAY_EVT *heap;               /* Heap */
+  u32 *num;                     /* Entries used */
+  unsigned long long due;       /* When due */
+  u32 idx;                      /* Index */
+  u32 gen;                      /* Generation */
+{
+  u32 i;                        /* Hole moving up */
+  u32 parent;                   /* Parent of the hole */
+
+  for (i = (*num)++; i > 0; i = parent)
+  {
+    parent = (i - 1) / 2;
+    if (heap[parent].due <= due)
+      break;
+    heap[i] = heap[parent];
+  }
+  heap[i].due = due;
+  heap[i].idx = idx;
+  heap[i].gen = gen;
+  return(0);
+}
+
+/*
+ * heap_pop
+ *
+ * Removes the earliest entry of a heap.
+ *
+ * Always returns zero.
+ */
+static int heap_pop(heap, num, evt)
+  PLAY_EVT *heap;               /* Heap */
+  u32 *num;                     /* Entries used */
+  PLAY_EVT *evt;                /* Returns the entry */
+{
+  PLAY_EVT last;                /* Entry moved into the hole */
+  u32 i;                        /* Hole moving down */
+  u32 child;                    /* Earlier child of the hole */
+
+  *evt = heap[0];
+  last = heap[--(*num)];
+  for (i = 0; (child = 2 * i + 1) < *num; i = child)
+  {
+    if ((child + 1 < *num) && (heap[child + 1].due < heap[child].due))
+      child++;
+    if (last.due <= heap[child].due)
+      break;
+    heap[i] = heap[child];
+  }
+  heap[i] = last;
+  return(0);
+}
+
+/*
+ * print_msg
+ *
+ * Prints a message in the form of the MTR trace.
+ *
+ * Always returns zero.
+ */
+static int print_msg(prefix, type, instance, id, pptr, len)
+  char *prefix;                 /* Printed first */
+  u16 type;                     /* Message type */
+  u16 instance;                 /* MAP instance */
+  u16 id;                       /* Dialogue id */
+  u8 *pptr;                     /* Parameter area */
+  u16 len;                      /* Its length */
+{
+  u16 i;                        /* Octet index */
+
+  printf("%s MTR Tx: I%04x M t%04x i%04x p", prefix, instance, type, id);
+  for (i = 0; i < len; i++)
+    printf("%02x", pptr[i]);
+  printf("\n");
+  return(0);
+}
+
+/*
+ * report
+ *
+ * Prints progress to the console.
+ *
+ * Always returns zero.
+ */
+static int report(seconds)
+  u32 seconds;                  /* Seconds played */
+{
+  static unsigned long long last_started; /* Dialogues started at the last report */
+  static unsigned long long last_sent;    /* Indications sent at the last report */
+
+  printf("MTRPLAY %us: started %llu (+%llu); ended %llu; in flight %u; sent %llu (+%llu); received %llu; diverged %llu; late %llu; timeouts %llu\n",
+         seconds, started, started - last_started, completed, num_slots - num_free,
+         rx_sent, rx_sent - last_sent, tx_rcvd, dlg_diverged, late, timed_out);
+  fflush(stdout);
+  last_started = started;
+  last_sent = rx_sent;
+  return(0);
+}
+
+/*
+ * stop_handler
+ *
+ * SIGINT and SIGTERM handler: no more dialogues are started and
+ * mtrplay ends once those being played have ended.
+ */
+static void stop_handler(sig)
+  int sig;
+{
+  stop_req = 1;
+}
+
+/*
+ * show_syntax
+ */
+static void show_syntax(program)
+  char *program;                /* Program name */
+{
+  fprintf(stderr, "Syntax: %s [-m -u -s -c -o -r -a -g -v] <file> [<file> ...]\n", program);
+  fprintf(stderr, "  -m  module id of mtrplay, given to MTR with -u (default 0x%02x)\n", MTRPLAY_DEF_MOD_ID);
+  fprintf(stderr, "  -u  module id of MTR (default 0x%02x)\n", MTRPLAY_DEF_MTR_ID);
+  fprintf(stderr, "  -s  speed, e.g. -sx10 for ten times the recorded rate, 0 for as fast as possible (default 1)\n");
+  fprintf(stderr, "  -c  copies of the recording played (default 1)\n");
+  fprintf(stderr, "  -o  milliseconds between the starts of the copies (default 0)\n");
+  fprintf(stderr, "  -r  dialogue id range, e.g. -r0x8000-0x87ff (default 0x%04x-0x%04x)\n",
+          MTRPLAY_DEF_FIRST_ID, MTRPLAY_DEF_LAST_ID);
+  fprintf(stderr, "  -a  number of MAP instances used, 0 to n-1 (default 1)\n");
+  fprintf(stderr, "  -g  seconds to wait for MTR before aborting a dialogue (default %u)\n",
+          MTRPLAY_DEF_TIMEOUT_S);
+  fprintf(stderr, "  -v  divergences printed (default %u)\n", MTRPLAY_DEF_VERBOSE);
+  fprintf(stderr, "  Files are MTR text traces, with times from mtrdec -t, or s7_play scripts; - for stdin\n");
+}
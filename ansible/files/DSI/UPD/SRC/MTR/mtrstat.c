@@ -0,0 +1,485 @@
+/*
+ Name:          mtrstat.c
+
+ Description:   Viewer for the MTR statistics segment.
+
+                Maps the statistics segment of a running MTR read-only
+                and either shows its rates and counters on the console,
+                refreshed like top, or writes them to a file in the
+                OpenMetrics text format. Viewing never slows MTR down:
+                MTR itself only ever writes the segment.
+
+                Syntax: mtrstat [-m<mod id>] [-i<seconds>] [-n<count>] [-o<file>]
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "system.h"
+#include "msg.h"
+#include "mtr.h"
+#include "mtr_wrk.h"
+#include "mtr_lat.h"
+#include "mtr_flt.h"
+#include "mtr_sub.h"
+#include "mtr_dlg.h"
+#include "mtr_stat.h"
+
+/*
+ * Default module id of the MTR viewed
+ */
+#define MTRSTAT_DEF_MOD_ID      (0x2d)
+
+/*
+ * Longest average shown, in seconds
+ */
+#define MTRSTAT_LONG_AVG        (300)
+
+static MTR_STAT_SEG *attach(u8 mod_id);
+static int sum_threads(MTR_STAT_SEG *seg, MTR_STAT_THR *sum);
+static int sum_seconds(MTR_STAT_SEG *seg, u32 num, MTR_STAT_SEC *sum);
+static int show(MTR_STAT_SEG *seg, u8 mod_id);
+static int write_metrics(MTR_STAT_SEG *seg, char *file);
+static int read_number(char *str, unsigned long max, unsigned long *value);
+static void show_syntax(char *program);
+
+static char *class_name[MTR_LAT_NUM_CLASSES] = MTR_LAT_CLASS_NAMES;
+static char *state_name[MTR_STAT_MAX_STATES];
+static char *fault_name[MTR_FLT_NUM_OUTCOMES] = MTR_FLT_OUTCOME_NAMES;
+
+/*
+ * main
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  MTR_STAT_SEG *seg;            /* Segment viewed */
+  unsigned long value;          /* Numeric value of an option */
+  unsigned long interval;       /* Seconds between refreshes */
+  unsigned long count;          /* Refreshes left, 0 for no limit */
+  u8 interval_set;              /* Set if -i was given */
+  u8 mod_id;                    /* Module id of the MTR */
+  char *file;                   /* OpenMetrics file, 0 for the console */
+  int i;                        /* Argument index */
+
+  mod_id = MTRSTAT_DEF_MOD_ID;
+  interval = 1;
+  interval_set = 0;
+  count = 0;
+  file = 0;
+
+  for (i = 1; i < argc; i++)
+  {
+    if ((argv[i][0] != '-') || (argv[i][1] == '\0'))
+    {
+      show_syntax(argv[0]);
+      return(1);
+    }
+    switch (argv[i][1])
+    {
+      case 'm':
+        if (read_number(&argv[i][2], 0xff, &value) != 0)
+        {
+          show_syntax(argv[0]);
+          return(1);
+        }
+        mod_id = (u8)value;
+        break;
+
+      case 'i':
+        if ((read_number(&argv[i][2], 3600, &value) != 0) || (value == 0))
+        {
+          show_syntax(argv[0]);
+          return(1);
+        }
+        interval = value;
+        interval_set = 1;
+        break;
+
+      case 'n':
+        if (read_number(&argv[i][2], 0xffffffff, &value) != 0)
+        {
+          show_syntax(argv[0]);
+          return(1);
+        }
+        count = value;
+        break;
+
+      case 'o':
+        if (argv[i][2] == '\0')
+        {
+          show_syntax(argv[0]);
+          return(1);
+        }
+        file = &argv[i][2];
+        break;
+
+      default:
+        show_syntax(argv[0]);
+        return(1);
+    }
+  }
+
+  /*
+   * A file is written once unless asked to refresh it.
+   */
+  if ((file != 0) && (!interval_set) && (count == 0))
+    count = 1;
+
+  state_name[MTR_S_NULL] = "idle";
+  state_name[MTR_S_WAIT_FOR_SRV_PRIM] = "wait_service";
+  state_name[MTR_S_WAIT_DELIMITER] = "wait_delimiter";
+  state_name[MTR_S_REFUSED] = "refused";
+
+  if ((seg = attach(mod_id)) == 0)
+    return(1);
+
+  while (1)
+  {
+    if ((seg->magic != MTR_STAT_MAGIC) || (seg->version != MTR_STAT_VERSION))
+    {
+      fprintf(stderr, "%s: MTR 0x%02x statistics not available\n", argv[0], mod_id);
+      return(1);
+    }
+
+    if (file != 0)
+    {
+      if (write_metrics(seg, file) != 0)
+      {
+        fprintf(stderr, "%s: cannot write %s\n", argv[0], file);
+        return(1);
+      }
+    }
+    else
+      show(seg, mod_id);
+
+    if ((count != 0) && (--count == 0))
+      break;
+    sleep((unsigned int)interval);
+  }
+  return(0);
+}
+
+/*
+ * attach
+ *
+ * Maps the statistics segment of an MTR read-only.
+ *
+ * Returns the segment or 0 on error.
+ */
+static MTR_STAT_SEG *attach(mod_id)
+  u8 mod_id;                    /* Module id of the MTR */
+{
+  char name[MTR_STAT_MAX_NAME]; /* Segment name */
+  void *seg;                    /* Segment mapping */
+  int fd;                       /* Segment file */
+
+  sprintf(name, MTR_STAT_NAME, mod_id);
+  if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+  {
+    fprintf(stderr, "mtrstat: no statistics segment %s, is MTR 0x%02x running?\n", name, mod_id);
+    return(0);
+  }
+  seg = mmap(NULL, sizeof(MTR_STAT_SEG), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED)
+  {
+    fprintf(stderr, "mtrstat: cannot map statistics segment %s\n", name);
+    return(0);
+  }
+  return((MTR_STAT_SEG *)seg);
+}
+
+/*
+ * sum_threads
+ *
+ * Sums the counters of all MTR threads.
+ *
+ * Always returns zero.
+ */
+static int sum_threads(seg, sum)
+  MTR_STAT_SEG *seg;            /* Segment */
+  MTR_STAT_THR *sum;            /* Returns the totals */
+{
+  MTR_STAT_THR *thr;            /* Counters of one thread */
+  u32 t;                        /* Block index */
+  int c;                        /* Class */
+
+  memset(sum, 0, sizeof(MTR_STAT_THR));
+  for (t = 0; (t < seg->num_threads) && (t < MTR_STAT_MAX_THREADS); t++)
+  {
+    thr = &seg->thr[t];
+    sum->rx += thr->rx;
+    sum->tx += thr->tx;
+    sum->opened += thr->opened;
+    sum->refused += thr->refused;
+    sum->send_fail += thr->send_fail;
+    sum->getm_fail += thr->getm_fail;
+    sum->exhausted += thr->exhausted;
+    sum->deferred += thr->deferred;
+    sum->dropped += thr->dropped;
+    for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    {
+      sum->service[c] += thr->service[c];
+      sum->closed[c] += thr->closed[c];
+      sum->aborted[c] += thr->aborted[c];
+    }
+    for (c = 0; c < MTR_FLT_NUM_OUTCOMES; c++)
+      sum->fault[c] += thr->fault[c];
+  }
+  return(0);
+}
+
+/*
+ * sum_seconds
+ *
+ * Sums the totals of the last seconds kept.
+ *
+ * Returns the number of seconds summed.
+ */
+static int sum_seconds(seg, num, sum)
+  MTR_STAT_SEG *seg;            /* Segment */
+  u32 num;                      /* Seconds wanted */
+  MTR_STAT_SEC *sum;            /* Returns the totals */
+{
+  MTR_STAT_SEC *sec;            /* Totals of one second */
+  unsigned long long last;      /* Seconds written */
+  u32 i;                        /* Seconds summed */
+
+  memset(sum, 0, sizeof(MTR_STAT_SEC));
+  last = seg->seconds;
+  __sync_synchronize();
+  for (i = 0; (i < num) && (i < last) && (i < MTR_STAT_HISTORY); i++)
+  {
+    sec = &seg->sec[(last - 1 - i) % MTR_STAT_HISTORY];
+    sum->rx += sec->rx;
+    sum->tx += sec->tx;
+    sum->opened += sec->opened;
+    sum->refused += sec->refused;
+    sum->closed += sec->closed;
+    sum->aborted += sec->aborted;
+    sum->send_fail += sec->send_fail;
+    sum->getm_fail += sec->getm_fail;
+    if (i == 0)
+      sum->active = sec->active;
+  }
+  return((int)i);
+}
+
+/*
+ * show
+ *
+ * Clears the console and shows rates, totals and dialogue states.
+ *
+ * Always returns zero.
+ */
+static int show(seg, mod_id)
+  MTR_STAT_SEG *seg;            /* Segment */
+  u8 mod_id;                    /* Module id of the MTR */
+{
+  MTR_STAT_THR total;           /* Totals since MTR started */
+  MTR_STAT_SEC last;            /* Totals for the last second */
+  MTR_STAT_SEC min1;            /* Totals for the last minute */
+  MTR_STAT_SEC min5;            /* Totals for the last five minutes */
+  unsigned long long closed;    /* Dialogues ended normally */
+  unsigned long long aborted;   /* Dialogues ended by an abort */
+  unsigned long long injected;  /* Faults injected */
+  unsigned long up;             /* Seconds since MTR started */
+  int n1;                       /* Seconds in min1 */
+  int n5;                       /* Seconds in min5 */
+  u32 s;                        /* State */
+  int c;                        /* Class */
+
+  sum_threads(seg, &total);
+  sum_seconds(seg, 1, &last);
+  n1 = sum_seconds(seg, 60, &min1);
+  n5 = sum_seconds(seg, MTRSTAT_LONG_AVG, &min5);
+  n1 = n1 ? n1 : 1;
+  n5 = n5 ? n5 : 1;
+  for (c = 0, closed = 0, aborted = 0; c < MTR_LAT_NUM_CLASSES; c++)
+  {
+    closed += total.closed[c];
+    aborted += total.aborted[c];
+  }
+  up = (unsigned long)(time(NULL) - (time_t)seg->start);
+
+  printf("\033[H\033[2J");
+  printf("MTR 0x%02x  pid %u  up %lud %02lu:%02lu:%02lu  threads %u\n\n",
+         mod_id, seg->pid, up / 86400, (up / 3600) % 24, (up / 60) % 60, up % 60,
+         seg->num_threads);
+
+  printf("%-14s %12s %12s %12s %16s\n", "per second", "last", "1 min", "5 min", "total");
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "received", last.rx,
+         (double)min1.rx / n1, (double)min5.rx / n5, total.rx);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "sent", last.tx,
+         (double)min1.tx / n1, (double)min5.tx / n5, total.tx);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "opened", last.opened,
+         (double)min1.opened / n1, (double)min5.opened / n5, total.opened);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "refused", last.refused,
+         (double)min1.refused / n1, (double)min5.refused / n5, total.refused);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "closed", last.closed,
+         (double)min1.closed / n1, (double)min5.closed / n5, closed);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "aborted", last.aborted,
+         (double)min1.aborted / n1, (double)min5.aborted / n5, aborted);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "send failures", last.send_fail,
+         (double)min1.send_fail / n1, (double)min5.send_fail / n5, total.send_fail);
+  printf("%-14s %12u %12.1f %12.1f %16llu\n", "getm failures", last.getm_fail,
+         (double)min1.getm_fail / n1, (double)min5.getm_fail / n5, total.getm_fail);
+
+  if (total.exhausted != 0)
+  {
+    printf("\n%-14s %12s %12s %12s\n", "back-pressure", "exhausted", "deferred", "dropped");
+    printf("%-14s %12llu %12llu %12llu\n", "total", total.exhausted, total.deferred, total.dropped);
+  }
+
+  printf("\nDialogues in progress: %u\n", last.active);
+  for (s = 0; (s < seg->num_states) && (s < MTR_STAT_MAX_STATES); s++)
+    if (state_name[s] != 0)
+      printf("  %-14s %12llu\n", state_name[s], seg->state[s]);
+
+  printf("\n%-14s %12s %12s %12s\n", "service", "primitives", "closed", "aborted");
+  for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    if ((total.service[c] != 0) || (total.closed[c] != 0) || (total.aborted[c] != 0))
+      printf("%-14s %12llu %12llu %12llu\n", class_name[c],
+             total.service[c], total.closed[c], total.aborted[c]);
+
+  for (c = MTR_FLT_NONE + 1, injected = 0; c < MTR_FLT_NUM_OUTCOMES; c++)
+    injected += total.fault[c];
+  if (injected != 0)
+  {
+    printf("\n%-14s %12s\n", "fault", "injected");
+    for (c = MTR_FLT_NONE + 1; c < MTR_FLT_NUM_OUTCOMES; c++)
+      printf("%-14s %12llu\n", fault_name[c], total.fault[c]);
+  }
+  fflush(stdout);
+  return(0);
+}
+
+/*
+ * write_metrics
+ *
+ * Writes the counters to a file in the OpenMetrics text format. The
+ * file is replaced in one step so readers never see it half written.
+ *
+ * Returns zero or -1 on error.
+ */
+static int write_metrics(seg, file)
+  MTR_STAT_SEG *seg;            /* Segment */
+  char *file;                   /* File to write */
+{
+  MTR_STAT_THR total;           /* Totals since MTR started */
+  MTR_STAT_SEC last;            /* Totals for the last second */
+  char *tmp;                    /* File written before renaming */
+  FILE *f;                      /* Open file */
+  u32 s;                        /* State */
+  int c;                        /* Class */
+
+  if ((tmp = malloc(strlen(file) + 5)) == 0)
+    return(-1);
+  sprintf(tmp, "%s.tmp", file);
+  if ((f = fopen(tmp, "w")) == 0)
+  {
+    free(tmp);
+    return(-1);
+  }
+
+  sum_threads(seg, &total);
+  sum_seconds(seg, 1, &last);
+
+  fprintf(f, "# TYPE mtr_start_time_seconds gauge\n");
+  fprintf(f, "mtr_start_time_seconds %llu\n", seg->start);
+  fprintf(f, "# TYPE mtr_messages_received counter\n");
+  fprintf(f, "mtr_messages_received_total %llu\n", total.rx);
+  fprintf(f, "# TYPE mtr_messages_sent counter\n");
+  fprintf(f, "mtr_messages_sent_total %llu\n", total.tx);
+  fprintf(f, "# TYPE mtr_send_failures counter\n");
+  fprintf(f, "mtr_send_failures_total %llu\n", total.send_fail);
+  fprintf(f, "# TYPE mtr_getm_failures counter\n");
+  fprintf(f, "mtr_getm_failures_total %llu\n", total.getm_fail);
+  fprintf(f, "# TYPE mtr_exhaustions counter\n");
+  fprintf(f, "mtr_exhaustions_total %llu\n", total.exhausted);
+  fprintf(f, "# TYPE mtr_messages_deferred counter\n");
+  fprintf(f, "mtr_messages_deferred_total %llu\n", total.deferred);
+  fprintf(f, "# TYPE mtr_messages_dropped counter\n");
+  fprintf(f, "mtr_messages_dropped_total %llu\n", total.dropped);
+  fprintf(f, "# TYPE mtr_dialogues_opened counter\n");
+  fprintf(f, "mtr_dialogues_opened_total %llu\n", total.opened);
+  fprintf(f, "# TYPE mtr_dialogues_refused counter\n");
+  fprintf(f, "mtr_dialogues_refused_total %llu\n", total.refused);
+
+  fprintf(f, "# TYPE mtr_service_primitives counter\n");
+  for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    fprintf(f, "mtr_service_primitives_total{service=\"%s\"} %llu\n", class_name[c], total.service[c]);
+  fprintf(f, "# TYPE mtr_dialogues_closed counter\n");
+  for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    fprintf(f, "mtr_dialogues_closed_total{service=\"%s\"} %llu\n", class_name[c], total.closed[c]);
+  fprintf(f, "# TYPE mtr_dialogues_aborted counter\n");
+  for (c = 0; c < MTR_LAT_NUM_CLASSES; c++)
+    fprintf(f, "mtr_dialogues_aborted_total{service=\"%s\"} %llu\n", class_name[c], total.aborted[c]);
+  fprintf(f, "# TYPE mtr_faults_injected counter\n");
+  for (c = MTR_FLT_NONE + 1; c < MTR_FLT_NUM_OUTCOMES; c++)
+    fprintf(f, "mtr_faults_injected_total{outcome=\"%s\"} %llu\n", fault_name[c], total.fault[c]);
+
+  fprintf(f, "# TYPE mtr_dialogues gauge\n");
+  for (s = 0; (s < seg->num_states) && (s < MTR_STAT_MAX_STATES); s++)
+    if (state_name[s] != 0)
+      fprintf(f, "mtr_dialogues{state=\"%s\"} %llu\n", state_name[s], seg->state[s]);
+
+  fprintf(f, "# TYPE mtr_messages_received_per_second gauge\n");
+  fprintf(f, "mtr_messages_received_per_second %u\n", last.rx);
+  fprintf(f, "# TYPE mtr_messages_sent_per_second gauge\n");
+  fprintf(f, "mtr_messages_sent_per_second %u\n", last.tx);
+  fprintf(f, "# EOF\n");
+
+  if ((fclose(f) != 0) || (rename(tmp, file) != 0))
+  {
+    unlink(tmp);
+    free(tmp);
+    return(-1);
+  }
+  free(tmp);
+  return(0);
+}
+
+/*
+ * read_number
+ *
+ * Reads a decimal or 0x prefixed hexadecimal number.
+ *
+ * Returns zero or -1 if not a number or above max.
+ */
+static int read_number(str, max, value)
+  char *str;                    /* String to read */
+  unsigned long max;            /* Largest value allowed */
+  unsigned long *value;         /* Returns the value */
+{
+  char *end;                    /* First character not read */
+
+  if (*str == '\0')
+    return(-1);
+  *value = strtoul(str, &end, 0);
+  if ((*end != '\0') || (*value > max))
+    return(-1);
+  return(0);
+}
+
+/*
+ * show_syntax
+ */
+static void show_syntax(program)
+  char *program;                /* Program name */
+{
+  fprintf(stderr, "Syntax: %s [-m -i -n -o]\n", program);
+  fprintf(stderr, "  -m  MTR module id (default 0x%02x)\n", MTRSTAT_DEF_MOD_ID);
+  fprintf(stderr, "  -i  seconds between refreshes (default 1)\n");
+  fprintf(stderr, "  -n  number of refreshes (default 0, no limit)\n");
+  fprintf(stderr, "  -o  write OpenMetrics text to a file, once unless -i or -n is given\n");
+}
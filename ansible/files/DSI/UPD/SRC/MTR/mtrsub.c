@@ -0,0 +1,627 @@
+/*
+ Name:          mtrsub.c
+
+ Description:   Subscriber database compiler for MTR.
+
+                Reads a CSV file of subscribers and writes the database
+                image described in mtr_sub.h, for MTR to map with its
+                -k option. Each line of the file is:
+
+                  <msisdn>,<imsi>[,<msc>[,<sgsn>[,<geog>]]]
+
+                where msisdn and msc are digits with an optional leading
+                '+', sgsn is an IPv4 or IPv6 address and geog is the 8
+                octets of ATI geographical information in hex. Empty
+                fields are left out of the record, so MTR answers with
+                its usual value. Blank lines and lines starting with
+                '#' are skipped.
+
+                The image is written to a temporary file and renamed, so
+                an MTR still using the old image is not disturbed.
+
+                Syntax: mtrsub -i<csv file> -o<image file>
+
+ Functions:     main
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "system.h"
+#include "mtr_sub.h"
+
+/*
+ * Longest line of the CSV file
+ */
+#define MTRSUB_MAX_LINE         (256)
+
+/*
+ * Largest bucket of a hash index, far above any seen in practice
+ */
+#define MTRSUB_MAX_BUCKET       (64)
+
+/*
+ * Subscribers the record table is first sized for
+ */
+#define MTRSUB_INIT_SUBS        (65536)
+
+/*
+ * A key and the line it came from, to find duplicates
+ */
+typedef struct
+{
+  unsigned long long key;       /* Packed number */
+  u32 line;                     /* Line of the CSV file */
+} MTRSUB_KEY;
+
+static int read_csv(char *file);
+static int parse_line(char *line, MTR_SUB_REC *rec);
+static int parse_digits(char *str, u8 max, u8 *digits);
+static u8  put_tbcd(u8 *dst, u8 *digits, u8 num_digits);
+static int check_unique(u8 imsi);
+static int cmp_key(const void *a, const void *b);
+static int build_index(u8 imsi, int *disp, u32 *slot);
+static int write_image(char *file);
+static void show_syntax(char *program);
+
+/*
+ * Static data:
+ */
+static MTR_SUB_REC *recs;       /* Records, in CSV order */
+static u32 *lines;              /* Line of each record */
+static u32 num_recs;            /* Records read */
+
+/*
+ * main
+ */
+int main(argc, argv)
+  int argc;
+  char *argv[];
+{
+  char *in;                     /* CSV file */
+  char *out;                    /* Image file */
+  int i;                        /* Argument index */
+
+  in = 0;
+  out = 0;
+  for (i = 1; i < argc; i++)
+  {
+    if ((argv[i][0] != '-') || (argv[i][1] == '\0') || (argv[i][2] == '\0'))
+    {
+      show_syntax(argv[0]);
+      return(1);
+    }
+    switch (argv[i][1])
+    {
+      case 'i':
+        in = &argv[i][2];
+        break;
+
+      case 'o':
+        out = &argv[i][2];
+        break;
+
+      default:
+        show_syntax(argv[0]);
+        return(1);
+    }
+  }
+  if ((in == 0) || (out == 0))
+  {
+    show_syntax(argv[0]);
+    return(1);
+  }
+
+  if ((read_csv(in) != 0) || (check_unique(0) != 0) || (check_unique(1) != 0))
+    return(1);
+
+  if (write_image(out) != 0)
+  {
+    fprintf(stderr, "%s: cannot write %s\n", argv[0], out);
+    return(1);
+  }
+  printf("%s: %u subscribers written to %s\n", argv[0], num_recs, out);
+  return(0);
+}
+
+/*
+ * read_csv
+ *
+ * Reads every subscriber in the CSV file.
+ *
+ * Returns zero or -1 on error.
+ */
+static int read_csv(file)
+  char *file;                   /* CSV file */
+{
+  FILE *fp;                     /* CSV file */
+  char line[MTRSUB_MAX_LINE];   /* Line read */
+  char *p;                      /* First character of the line */
+  u32 max_recs;                 /* Records allocated */
+  u32 line_num;                 /* Line number */
+  void *new_recs;               /* Grown record table */
+  void *new_lines;              /* Grown line table */
+
+  if ((fp = fopen(file, "r")) == NULL)
+  {
+    fprintf(stderr, "mtrsub: cannot open %s\n", file);
+    return(-1);
+  }
+
+  max_recs = 0;
+  line_num = 0;
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    line_num++;
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if ((*p == '\0') || (*p == '#'))
+      continue;
+
+    if (num_recs == max_recs)
+    {
+      max_recs = max_recs ? max_recs * 2 : MTRSUB_INIT_SUBS;
+      new_recs = realloc(recs, max_recs * sizeof(MTR_SUB_REC));
+      new_lines = realloc(lines, max_recs * sizeof(u32));
+      if (new_recs != NULL)
+        recs = new_recs;
+      if (new_lines != NULL)
+        lines = new_lines;
+      if ((new_recs == NULL) || (new_lines == NULL) || (max_recs > 0x7fffffff))
+      {
+        fprintf(stderr, "mtrsub: out of memory at line %u\n", line_num);
+        fclose(fp);
+        return(-1);
+      }
+    }
+
+    if (parse_line(p, &recs[num_recs]) != 0)
+    {
+      fprintf(stderr, "mtrsub: %s line %u: bad subscriber\n", file, line_num);
+      fclose(fp);
+      return(-1);
+    }
+    lines[num_recs++] = line_num;
+  }
+  fclose(fp);
+
+  if (num_recs == 0)
+  {
+    fprintf(stderr, "mtrsub: no subscribers in %s\n", file);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * parse_line
+ *
+ * Reads one subscriber.
+ *
+ * Returns zero or -1 if the line is not valid.
+ */
+static int parse_line(line, rec)
+  char *line;                   /* Line, without leading spaces */
+  MTR_SUB_REC *rec;             /* Returns the record */
+{
+  char *field[5];               /* Fields of the line */
+  u8 digits[MTR_SUB_MSC_DIGITS]; /* Digits of a number */
+  u8 addr[16];                  /* IP address */
+  int num;                      /* Number of digits, or fields */
+  int i;                        /* Octet index */
+  unsigned int octet;           /* Octet of geog */
+
+  line[strcspn(line, "\r\n")] = '\0';
+  for (num = 0, field[0] = line; num < 5; )
+  {
+    field[num++] = line;
+    if ((line = strchr(line, ',')) == NULL)
+      break;
+    *line++ = '\0';
+  }
+  if ((line != NULL) || (num < 2))
+    return(-1);
+  while (num < 5)
+    field[num++] = "";
+
+  memset(rec, 0, sizeof(MTR_SUB_REC));
+
+  if ((num = parse_digits(field[0], MTR_SUB_KEY_DIGITS, digits)) <= 0)
+    return(-1);
+  rec->msisdn = MTR_sub_key(digits, (u8)num);
+
+  if ((field[1][0] == '+') || ((num = parse_digits(field[1], MTR_SUB_KEY_DIGITS, digits)) <= 0))
+    return(-1);
+  rec->imsi = MTR_sub_key(digits, (u8)num);
+  rec->imsi_len = put_tbcd(rec->imsi_tbcd, digits, (u8)num);
+
+  if (field[2][0] != '\0')
+  {
+    if ((num = parse_digits(field[2], MTR_SUB_MSC_DIGITS, digits)) <= 0)
+      return(-1);
+    rec->msc[0] = 0x91;
+    rec->msc_len = (u8)(1 + put_tbcd(&rec->msc[1], digits, (u8)num));
+    rec->flags |= MTR_SUB_F_MSC;
+  }
+
+  if (field[3][0] != '\0')
+  {
+    if (inet_pton(AF_INET, field[3], addr) == 1)
+    {
+      rec->sgsn[0] = 4;
+      memcpy(&rec->sgsn[1], addr, 4);
+      rec->sgsn_len = 5;
+    }
+    else if (inet_pton(AF_INET6, field[3], addr) == 1)
+    {
+      rec->sgsn[0] = 0x40 | 16;
+      memcpy(&rec->sgsn[1], addr, 16);
+      rec->sgsn_len = 17;
+    }
+    else
+      return(-1);
+    rec->flags |= MTR_SUB_F_SGSN;
+  }
+
+  if (field[4][0] != '\0')
+  {
+    if (strlen(field[4]) != 2 * MTR_SUB_GEOG_LEN)
+      return(-1);
+    for (i = 0; i < MTR_SUB_GEOG_LEN; i++)
+    {
+      if ((!isxdigit((unsigned char)field[4][2 * i])) ||
+          (!isxdigit((unsigned char)field[4][2 * i + 1])) ||
+          (sscanf(&field[4][2 * i], "%2x", &octet) != 1))
+        return(-1);
+      rec->geog[i] = (u8)octet;
+    }
+    rec->flags |= MTR_SUB_F_GEOG;
+  }
+  return(0);
+}
+
+/*
+ * parse_digits
+ *
+ * Reads a number, with an optional leading '+'.
+ *
+ * Returns the number of digits, -1 if not a number of 1 to max digits.
+ */
+static int parse_digits(str, max, digits)
+  char *str;                    /* Number */
+  u8 max;                       /* Most digits */
+  u8 *digits;                   /* Returns the digits, one per octet */
+{
+  int num;                      /* Digits read */
+
+  if (*str == '+')
+    str++;
+  for (num = 0; str[num] != '\0'; num++)
+  {
+    if ((num >= max) || (!isdigit((unsigned char)str[num])))
+      return(-1);
+    digits[num] = (u8)(str[num] - '0');
+  }
+  return(num ? num : -1);
+}
+
+/*
+ * put_tbcd
+ *
+ * Packs digits two to an octet, low nibble first, padding an odd
+ * number of digits with a filler.
+ *
+ * Returns the number of octets written.
+ */
+static u8 put_tbcd(dst, digits, num_digits)
+  u8 *dst;                      /* Destination */
+  u8 *digits;                   /* Digits, one per octet */
+  u8 num_digits;                /* Number of digits */
+{
+  u8 i;                         /* Digit index */
+
+  for (i = 0; i < num_digits; i += 2)
+    dst[i / 2] = (u8)(digits[i] | (((i + 1 < num_digits) ? digits[i + 1] : 0x0f) << 4));
+  return((u8)((num_digits + 1) / 2));
+}
+
+/*
+ * check_unique
+ *
+ * Checks that no MSISDN, or IMSI, is given twice, as a perfect hash
+ * cannot be built over duplicate keys.
+ *
+ * Returns zero or -1 if there are duplicates.
+ */
+static int check_unique(imsi)
+  u8 imsi;                      /* Set to check the IMSIs */
+{
+  MTRSUB_KEY *keys;             /* Keys in order */
+  u32 i;                        /* Record index */
+  int err;                      /* Set if a duplicate was found */
+
+  if ((keys = malloc(num_recs * sizeof(MTRSUB_KEY))) == NULL)
+  {
+    fprintf(stderr, "mtrsub: out of memory\n");
+    return(-1);
+  }
+  for (i = 0; i < num_recs; i++)
+  {
+    keys[i].key = imsi ? recs[i].imsi : recs[i].msisdn;
+    keys[i].line = lines[i];
+  }
+  qsort(keys, num_recs, sizeof(MTRSUB_KEY), cmp_key);
+
+  for (i = 1, err = 0; i < num_recs; i++)
+  {
+    if (keys[i].key == keys[i - 1].key)
+    {
+      fprintf(stderr, "mtrsub: line %u: %s already on line %u\n",
+              keys[i].line, imsi ? "IMSI" : "MSISDN", keys[i - 1].line);
+      err = -1;
+    }
+  }
+  free(keys);
+  return(err);
+}
+
+/*
+ * cmp_key
+ *
+ * Orders keys by value, then by line.
+ */
+static int cmp_key(a, b)
+  const void *a;
+  const void *b;
+{
+  const MTRSUB_KEY *ka = a;     /* First key */
+  const MTRSUB_KEY *kb = b;     /* Second key */
+
+  if (ka->key != kb->key)
+    return((ka->key < kb->key) ? -1 : 1);
+  return((ka->line < kb->line) ? -1 : (ka->line > kb->line));
+}
+
+/*
+ * build_index
+ *
+ * Builds the minimal perfect hash of the MSISDNs, or IMSIs, of all
+ * records. Keys are hashed to as many buckets as there are keys. The
+ * largest buckets are placed first, each by trying seeds until all its
+ * keys hash to free slots; buckets of one key then take the slots left.
+ *
+ * Returns zero or -1 on error.
+ */
+static int build_index(imsi, disp, slot)
+  u8 imsi;                      /* Set to index the IMSIs */
+  int *disp;                    /* Returns the displacement of each bucket */
+  u32 *slot;                    /* Returns the slot of each record */
+{
+  u32 *bucket;                  /* Bucket of each record */
+  u32 *first;                   /* First member of each bucket */
+  u32 *member;                  /* Records, by bucket */
+  u32 *order;                   /* Buckets, largest first */
+  u32 num_size[MTRSUB_MAX_BUCKET]; /* Buckets of each size */
+  u8  *taken;                   /* Set for each slot in use */
+  unsigned long long key;       /* Key of a record */
+  u32 n;                        /* Number of records */
+  u32 num_used;                 /* Buckets not empty */
+  u32 b;                        /* Bucket */
+  u32 i;                        /* Index */
+  u32 j;                        /* Member index */
+  u32 size;                     /* Members of a bucket */
+  u32 s;                        /* Slot */
+  u32 free_slot;                /* Next slot to look at for a free one */
+  u32 d;                        /* Seed tried */
+  int err;                      /* Set on error */
+
+  n = num_recs;
+  bucket = malloc(n * sizeof(u32));
+  first = calloc(n + 1, sizeof(u32));
+  member = malloc(n * sizeof(u32));
+  order = malloc(n * sizeof(u32));
+  taken = calloc(n, 1);
+  err = -1;
+  if ((bucket == NULL) || (first == NULL) || (member == NULL) ||
+      (order == NULL) || (taken == NULL))
+    goto done;
+
+  /*
+   * Group the records by bucket.
+   */
+  for (i = 0; i < n; i++)
+  {
+    bucket[i] = MTR_sub_hash(imsi ? recs[i].imsi : recs[i].msisdn, 0, n);
+    first[bucket[i] + 1]++;
+  }
+  memset(num_size, 0, sizeof(num_size));
+  for (b = 0; b < n; b++)
+  {
+    size = first[b + 1];
+    if (size >= MTRSUB_MAX_BUCKET)
+      goto done;
+    num_size[size]++;
+    first[b + 1] += first[b];
+  }
+  for (i = 0; i < n; i++)
+    member[first[bucket[i]]++] = i;
+  for (b = n; b > 0; b--)
+    first[b] = first[b - 1];
+  first[0] = 0;
+
+  /*
+   * Order the buckets by size, largest first.
+   */
+  for (size = MTRSUB_MAX_BUCKET - 1, j = 0; size > 0; size--)
+  {
+    s = num_size[size];
+    num_size[size] = j;
+    j += s;
+  }
+  num_used = j;
+  for (b = 0; b < n; b++)
+  {
+    size = first[b + 1] - first[b];
+    disp[b] = 0;
+    if (size != 0)
+      order[num_size[size]++] = b;
+  }
+
+  free_slot = 0;
+  for (i = 0; i < num_used; i++)
+  {
+    b = order[i];
+    size = first[b + 1] - first[b];
+    if (size == 1)
+    {
+      /*
+       * A bucket of one key takes the next free slot.
+       */
+      while (taken[free_slot])
+        free_slot++;
+      taken[free_slot] = 1;
+      slot[member[first[b]]] = free_slot;
+      disp[b] = -(int)free_slot - 1;
+      continue;
+    }
+
+    for (d = 1; d < 0x7fffffff; d++)
+    {
+      for (j = 0; j < size; j++)
+      {
+        key = imsi ? recs[member[first[b] + j]].imsi : recs[member[first[b] + j]].msisdn;
+        s = MTR_sub_hash(key, d, n);
+        if (taken[s])
+          break;
+        taken[s] = 1;
+        slot[member[first[b] + j]] = s;
+      }
+      if (j == size)
+        break;
+      while (j > 0)
+        taken[slot[member[first[b] + --j]]] = 0;
+    }
+    if (d == 0x7fffffff)
+      goto done;
+    disp[b] = (int)d;
+  }
+  err = 0;
+
+done:
+  free(bucket);
+  free(first);
+  free(member);
+  free(order);
+  free(taken);
+  return(err);
+}
+
+/*
+ * write_image
+ *
+ * Builds both indexes and writes the image.
+ *
+ * Returns zero or -1 on error.
+ */
+static int write_image(file)
+  char *file;                   /* Image file */
+{
+  MTR_SUB_HDR hdr;              /* Image header */
+  char *tmp;                    /* Temporary file name */
+  FILE *fp;                     /* Image file */
+  int *msisdn_disp;             /* MSISDN index displacements */
+  int *imsi_disp;               /* IMSI index displacements */
+  u32 *msisdn_slot;             /* MSISDN index slot of each record */
+  u32 *imsi_slot;               /* IMSI index slot of each record */
+  u32 *imsi_recs;               /* Record of each IMSI index slot */
+  u32 *rec_of;                  /* Record in each MSISDN index slot */
+  u32 n;                        /* Number of records */
+  u32 i;                        /* Index */
+  int err;                      /* Set on error */
+
+  n = num_recs;
+  msisdn_disp = malloc(n * sizeof(int));
+  imsi_disp = malloc(n * sizeof(int));
+  msisdn_slot = malloc(n * sizeof(u32));
+  imsi_slot = malloc(n * sizeof(u32));
+  imsi_recs = malloc(n * sizeof(u32));
+  rec_of = malloc(n * sizeof(u32));
+  tmp = malloc(strlen(file) + 5);
+  fp = NULL;
+  err = -1;
+  if ((msisdn_disp == NULL) || (imsi_disp == NULL) || (msisdn_slot == NULL) ||
+      (imsi_slot == NULL) || (imsi_recs == NULL) || (rec_of == NULL) || (tmp == NULL))
+    goto done;
+
+  if ((build_index(0, msisdn_disp, msisdn_slot) != 0) ||
+      (build_index(1, imsi_disp, imsi_slot) != 0))
+    goto done;
+
+  /*
+   * Records are stored in MSISDN slot order, the IMSI index maps its
+   * slots to them.
+   */
+  for (i = 0; i < n; i++)
+  {
+    rec_of[msisdn_slot[i]] = i;
+    imsi_recs[imsi_slot[i]] = msisdn_slot[i];
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MTR_SUB_MAGIC;
+  hdr.version = MTR_SUB_VERSION;
+  hdr.num_subs = n;
+  hdr.rec_size = sizeof(MTR_SUB_REC);
+  hdr.msisdn_disp = sizeof(MTR_SUB_HDR);
+  hdr.imsi_disp = hdr.msisdn_disp + (unsigned long long)n * sizeof(int);
+  hdr.imsi_recs = hdr.imsi_disp + (unsigned long long)n * sizeof(int);
+  hdr.recs = (hdr.imsi_recs + (unsigned long long)n * sizeof(u32) + 63) & ~63ULL;
+  hdr.size = hdr.recs + (unsigned long long)n * sizeof(MTR_SUB_REC);
+
+  sprintf(tmp, "%s.tmp", file);
+  if ((fp = fopen(tmp, "wb")) == NULL)
+    goto done;
+  if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+      (fwrite(msisdn_disp, sizeof(int), n, fp) != n) ||
+      (fwrite(imsi_disp, sizeof(int), n, fp) != n) ||
+      (fwrite(imsi_recs, sizeof(u32), n, fp) != n) ||
+      (fseek(fp, (long)hdr.recs, SEEK_SET) != 0))
+    goto done;
+  for (i = 0; i < n; i++)
+  {
+    if (fwrite(&recs[rec_of[i]], sizeof(MTR_SUB_REC), 1, fp) != 1)
+      goto done;
+  }
+  err = fclose(fp);
+  fp = NULL;
+  if ((err != 0) || (rename(tmp, file) != 0))
+    err = -1;
+
+done:
+  if (fp != NULL)
+    fclose(fp);
+  if ((err != 0) && (tmp != NULL))
+    remove(tmp);
+  free(msisdn_disp);
+  free(imsi_disp);
+  free(msisdn_slot);
+  free(imsi_slot);
+  free(imsi_recs);
+  free(rec_of);
+  free(tmp);
+  return(err);
+}
+
+/*
+ * show_syntax
+ */
+static void show_syntax(program)
+  char *program;                /* Program name */
+{
+  fprintf(stderr, "Syntax: %s -i<csv file> -o<image file>\n", program);
+  fprintf(stderr, "  -i  subscribers, one <msisdn>,<imsi>[,<msc>[,<sgsn>[,<geog>]]] per line\n");
+  fprintf(stderr, "  -o  database image for MTR -k\n");
+}